@@ -0,0 +1,13 @@
+open_project CNN_Dense_HLS
+set_top Dense
+add_files HLS/dense.cpp
+add_files HLS/dense.h
+add_files HLS/dense_kernel.h
+add_files HLS/datapath.h
+add_files HLS/conv.h
+add_files -tb HLS/dense_main.cpp
+open_solution "solution1" -flow_target vivado
+set_part {xc7z020clg400-1}
+create_clock -period 10 -name default
+config_export -display_name Dense -format ip_catalog -output ./IP-catalog/HLS_Dense.zip -rtl vhdl -vendor EPFL -vivado_clock 10
+quit
@@ -2,6 +2,8 @@ open_project CNN_HLS
 set_top Conv
 add_files HLS/conv.cpp
 add_files HLS/conv.h
+add_files HLS/conv_kernel.h
+add_files HLS/datapath.h
 add_files -tb HLS/main.cpp
 open_solution "solution1" -flow_target vivado
 set_part {xc7z020clg400-1}
@@ -2,19 +2,110 @@
 
 #include <stdint.h>
 #include "ap_fixed.h"
+#include "ap_int.h"
 
+// Configuration of the bitstream: the parameters of the ConvKernel instantiated by Conv() (conv_kernel.h). They can
+// be set from the command line (e.g. -DNUM_PARALLEL_CHANNELS=4 in the cflags of HLS.tcl). The host reads them
+// from the capability registers.
+
+#ifndef MAX_CHANNELS
 #define MAX_CHANNELS 256
+#endif
 
 //Number of FXP_t that can fit in the row buffer. This row buffer needs to fit num_channels * inputWidth FXP_t elements.
+#ifndef MAX_ROW_BUFFER_SIZE
 #define MAX_ROW_BUFFER_SIZE 4192
+#endif
 
-#define CONV_FILTER_HEIGHT 3
-#define CONV_FILTER_WIDTH 3
+// Bits of the values: 32 (FXP_t, with FXP_NUM_DECIMALS decimals) or 16 (integers with the decimals of each layer,
+// two per 32-bit word). A 16-bit MAC takes one DSP48 instead of four, so the 16-bit datapath defaults to four times
+// the MACs for the same DSPs, and moves half the bytes.
+#ifndef VALUE_BITS
+#define VALUE_BITS 32
+#endif
 
-const uint32_t FXP_NUM_DECIMALS = 20;
+// Channels added per cycle, each into its own accumulator.
+// NOTE: *Must* be a power of 2
+#ifndef NUM_PARALLEL_CHANNELS
+#if VALUE_BITS == 16
+#define NUM_PARALLEL_CHANNELS 4
+#else
+#define NUM_PARALLEL_CHANNELS 2
+#endif
+#endif
+
+// Filters computed in each pass over the input (K): the input rows are read once per NUM_PARALLEL_FILTERS filters,
+// and every input value read from the row buffers feeds NUM_PARALLEL_FILTERS MACs. It multiplies the DSPs of the
+// MACs (and the BRAM of the filter cache and of the MaxPool rows) by NUM_PARALLEL_FILTERS. Any value >= 1 works.
+#ifndef NUM_PARALLEL_FILTERS
+#if VALUE_BITS == 16
+#define NUM_PARALLEL_FILTERS 4
+#else
+#define NUM_PARALLEL_FILTERS 2
+#endif
+#endif
+
+#ifndef FXP_NUM_DECIMALS
+#define FXP_NUM_DECIMALS 20
+#endif
 
 // Based on Xilinx documentation, the integer bit includes the signed bit.
 using FXP_t = ap_fixed<32, 32-FXP_NUM_DECIMALS>;
-using FXP_MULT_t = ap_fixed<64, 64-2*FXP_NUM_DECIMALS>;
 
-void Conv(FXP_t* input, FXP_t* output, FXP_t* filters, FXP_t* biases, uint32_t numFilters,  uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool& resultOk);
+// Values of the input, the output and the filters, and biases, of Conv().
+#if VALUE_BITS == 16
+using Value_t = ap_int<16>;
+using Bias_t = ap_int<32>;
+#else
+using Value_t = FXP_t;
+using Bias_t = FXP_t;
+#endif
+
+#define CONV_FILTER_HEIGHT 3
+#define CONV_FILTER_WIDTH 3
+
+// Latency of the m_axi bundles, in cycles (latency=30 in the INTERFACE pragmas). Only used by the schedule of the
+// counters in C-sim.
+#define AXI_LATENCY 30
+
+// The input is read in beats of AXI_BEAT_WORDS 32-bit words, the width of the HP ports of the Zynq (64 bits).
+// NOTE: *Must* be a power of 2
+#define AXI_BEAT_WORDS 2
+using Beat_t = ap_uint<32 * AXI_BEAT_WORDS>;
+
+// The kernel is a dataflow of three stages, one pass (NUM_PARALLEL_FILTERS filters) at a time:
+//  - Read: bursts every input row on the gmem_in bundle and streams it, realigned to the start of the row.
+//  - Compute: keeps the last rows in a ring of row buffers, and loads the next row into the free one while it
+//    computes the output row of the others.
+//  - Write: bursts every output row on the gmem_out bundle.
+// The filters and biases of a pass are read on the gmem_coef bundle before it starts.
+//  The input pointer is the address of the beat that holds the first input value, and inputSkip (< values in a beat)
+// the position of that value in the beat, so that the input can start at any value.
+
+// Counters returned with every convolution, so that a slow layer can be told compute- from memory-bound.
+// In RTL they are measured (see CountCycles() in datapath.h): every pass counts its cycles, and the compute stage
+// the cycles in which it waits for an input row that has not arrived. The load of the coefficients is all waiting.
+// The writes are buffered a whole row, so they only show in the total. C-sim cannot measure them and counts the
+// cycles of the schedule instead: every burst costs AXI_LATENCY plus one cycle per beat, every output pixel one
+// cycle per NUM_PARALLEL_CHANNELS channels, and past the first CONV_FILTER_HEIGHT rows a pass takes as long as the
+// slower of the reads and the compute. The byte counts are exact in both.
+//  - cycles: total.
+//  - memCycles: waiting on the bundles.
+//  - bytesRead, bytesWritten: transferred on the bundles.
+// With performMaxPool, the output goes through a 2x2 MaxPool on-chip (as MaxPool() in SW_Accel/cnn.cpp, cropping the
+// last row and column of odd sizes) and only the pooled map is written: output[numFilters][outputHeight/2][outputWidth/2].
+// The capability registers describe the configuration, so that the host can check that it matches its format and
+// size the layers to the buffers. They are written by every call, even one that fails or has no filters:
+//  - capabilities: bits 7-0 NUM_PARALLEL_CHANNELS, 15-8 NUM_PARALLEL_FILTERS, 23-16 VALUE_BITS, 31-24 FXP_NUM_DECIMALS
+//    (0 with 16-bit values: the decimals are given with every layer).
+//  - maxChannels: MAX_CHANNELS.
+//  - maxRowBufferSize: MAX_ROW_BUFFER_SIZE.
+// With 16-bit values, the layer gives the decimals of the input, of the filters and of the output. The biases are
+// 32-bit integers with inputDecimals + weightDecimals decimals, those of the products, and the output is rounded
+// to outputDecimals and saturated. It fails if outputDecimals > inputDecimals + weightDecimals. The 32-bit datapath
+// ignores them.
+// The new registers go last to keep the offsets of the others.
+void Conv(Beat_t* input, Value_t* output, Value_t* filters, Bias_t* biases, uint32_t numFilters,  uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool, bool& resultOk,
+		uint32_t& cycles, uint32_t& memCycles, uint32_t& bytesRead, uint32_t& bytesWritten, uint32_t inputSkip,
+		uint32_t& capabilities, uint32_t& maxChannels, uint32_t& maxRowBufferSize,
+		uint32_t inputDecimals, uint32_t weightDecimals, uint32_t outputDecimals);
@@ -0,0 +1,478 @@
+#pragma once
+
+#include <stdint.h>
+#include "conv.h"
+#include "datapath.h"
+#include "hls_stream.h"
+
+// The Conv kernel, as a template on its precision, parallelism and buffer sizes. The top function Conv() (conv.cpp)
+// instantiates it with the configuration of conv.h, and the testbench checks other instantiations too.
+
+// Define some loop tripcounts to get performance estimates inside Vitis HLS.
+#define LOOP_TRIPCOUNT_INPUT_WIDTH 256
+#define LOOP_TRIPCOUNT_INPUT_HEIGHT 256
+#define LOOP_TRIPCOUNT_OUTPUT_WIDTH 254
+#define LOOP_TRIPCOUNT_OUTPUT_HEIGHT 254
+#define LOOP_TRIPCOUNT_CHANNELS 32
+#define LOOP_TRIPCOUNT_FILTERS 32
+
+// input[iChannel][y][x]
+#define IN_IDX(iChannel, y, x) ((x) + (y) * inputWidth + (iChannel) * inputWidth * inputHeight)
+
+// filters[iFilter][iChannel][cy][cx]
+#define FILT_IDX(iFilter, iChannel, cy, cx) ((cx) + (cy) * CONV_FILTER_WIDTH + (iChannel) * CONV_FILTER_WIDTH * CONV_FILTER_HEIGHT + (iFilter) * numChannels * CONV_FILTER_WIDTH * CONV_FILTER_HEIGHT)
+
+// output[iFilter][y][x]
+#define OUT_IDX(iFilter, y, x) ((x) + (y) * outputWidth + (iFilter) * outputHeight * outputWidth)
+
+// Ring of input rows in the compute stage: CONV_FILTER_HEIGHT of them are read while the next one is loaded into the
+// last. A power of two, so that the ring index is a mask.
+#define ROW_BUFFER_SLOTS 4
+#define ROW_SLOT_MASK (ROW_BUFFER_SLOTS - 1)
+
+//  - Fxp: type of the values, ap_fixed (FXP_t) or ap_int (per-layer decimals), of 32 or 16 bits. They are packed
+//    in the beats of the bus.
+//  - ParChannels: channels added per cycle into separate accumulators (NUM_PARALLEL_CHANNELS).
+//  - ParFilters: filters computed per pass over the input (NUM_PARALLEL_FILTERS).
+//  - RowBufferSize: values in a row buffer, numChannels * inputWidth at most (MAX_ROW_BUFFER_SIZE).
+//  - MaxChannels: channels of the filter cache (MAX_CHANNELS).
+template<typename Fxp, uint32_t ParChannels, uint32_t ParFilters, uint32_t RowBufferSize, uint32_t MaxChannels>
+struct ConvKernel {
+	using Acc = typename Datapath<Fxp>::Acc;
+	using Bias = typename Datapath<Fxp>::Bias;
+	static const uint32_t BITS = Datapath<Fxp>::BITS;
+
+	static_assert(BITS == 32 || BITS == 16, "The values travel as 32-bit words or pairs of 16-bit values");
+	static_assert(IsPowerOf2(ParChannels), "ParChannels must be a power of 2: the channel of a row buffer is a mask");
+	static_assert(ParFilters >= 1, "At least one filter per pass");
+	static_assert(RowBufferSize % ParChannels == 0, "The row buffer is split evenly among the parallel channels");
+	static_assert(MaxChannels >= ParChannels, "MaxChannels must hold the parallel channels");
+	static_assert(RowBufferSize >= MaxChannels * CONV_FILTER_WIDTH, "The row buffer must hold a filter width of every channel");
+	static_assert(ParChannels <= 0xff && ParFilters <= 0xff, "Do not fit in the capability register");
+
+	static const uint32_t PAR_CHANNELS_SHIFT = Log2(ParChannels);
+	static const uint32_t PAR_CHANNELS_MASK = ParChannels - 1;
+	// Multiply-accumulates per cycle, which take most of the DSPs.
+	static const uint32_t MACS = ParChannels * ParFilters * CONV_FILTER_HEIGHT * CONV_FILTER_WIDTH;
+	// Values in a beat of the input, and in an element of a row stream.
+	static const uint32_t VALUES_PER_BEAT = 32 * AXI_BEAT_WORDS / BITS;
+
+	// Value of the capability register (see conv.h).
+	static uint32_t Capabilities() {
+		return ParChannels | (ParFilters << 8) | (BITS << 16) | (Datapath<Fxp>::DECIMALS << 24);
+	}
+
+	// Elements of the stream of a row: VALUES_PER_BEAT values each, the last one padded.
+	static uint32_t RowElements(uint32_t width) {
+		return (width + VALUES_PER_BEAT - 1) / VALUES_PER_BEAT;
+	}
+
+	static Fxp Max(Fxp a, Fxp b) {
+		return a > b ? a : b;
+	}
+
+	static Fxp ReLu(Fxp x) {
+		if (x < 0) {
+			return 0;
+		} else {
+			return x;
+		}
+	}
+
+	// Value i of a beat (or of an element of a row stream).
+	static Fxp BeatValue(const Beat_t& beat, uint32_t i) {
+		Fxp value;
+		value.range(BITS - 1, 0) = beat.range(BITS * i + BITS - 1, BITS * i);
+		return value;
+	}
+
+	// Read stage: streams the input rows of a pass, row y of every channel before row y+1. Element j of a row holds
+	// its values [j*VALUES_PER_BEAT, (j+1)*VALUES_PER_BEAT), taken from the two beats it straddles.
+	// The read cycles (see conv.h) of the first CONV_FILTER_HEIGHT rows go to primeCycles, the others to streamCycles.
+	static void ReadInput(Beat_t* input, uint32_t inputSkip, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight,
+			hls::stream<Beat_t>& rows, uint32_t& primeCycles, uint32_t& streamCycles, uint32_t& beatsRead)
+	{
+		uint32_t prime = 0, steady = 0, beats = 0;
+
+		read_y_loop: for (uint32_t y = 0; y < inputHeight; ++y) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_INPUT_HEIGHT max=LOOP_TRIPCOUNT_INPUT_HEIGHT
+			read_channel_loop: for (uint32_t iChannel = 0; iChannel < numChannels; ++iChannel) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_CHANNELS max=LOOP_TRIPCOUNT_CHANNELS
+				const uint32_t first = inputSkip + IN_IDX(iChannel, y, 0);
+				const uint32_t firstBeat = first / VALUES_PER_BEAT;
+				const uint32_t lastBeat = (first + inputWidth - 1) / VALUES_PER_BEAT;
+				const uint32_t shift = BITS * (first & (VALUES_PER_BEAT - 1));
+
+				Beat_t current = input[firstBeat];
+				read_x_loop: for (uint32_t j = 0; j < RowElements(inputWidth); ++j) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_INPUT_WIDTH/VALUES_PER_BEAT max=LOOP_TRIPCOUNT_INPUT_WIDTH/VALUES_PER_BEAT
+#pragma HLS PIPELINE II=1
+					Beat_t next = 0;
+					if (firstBeat + j < lastBeat) {
+						next = input[firstBeat + j + 1];
+					}
+					ap_uint<64 * AXI_BEAT_WORDS> pair = (ap_uint<64 * AXI_BEAT_WORDS>(next) << (32 * AXI_BEAT_WORDS)) | ap_uint<64 * AXI_BEAT_WORDS>(current);
+					rows.write(Beat_t(pair >> shift));
+					current = next;
+				}
+
+				const uint32_t rowBeats = lastBeat - firstBeat + 1;
+				beats += rowBeats;
+				if (y < CONV_FILTER_HEIGHT) {
+					prime += AXI_LATENCY + rowBeats;
+				} else {
+					steady += AXI_LATENCY + rowBeats;
+				}
+			}
+		}
+		primeCycles = prime;
+		streamCycles = steady;
+		beatsRead = beats;
+	}
+
+	// Stores element j of the row of channel iChannel in a row buffer.
+	static void StoreRowElement(Fxp row_buffer[ParChannels][RowBufferSize / ParChannels], uint32_t iChannel, uint32_t j, const Beat_t& element, uint32_t inputWidth)
+	{
+#pragma HLS INLINE
+		for (uint32_t i = 0; i < VALUES_PER_BEAT; ++i) {
+#pragma HLS UNROLL
+			const uint32_t x = j * VALUES_PER_BEAT + i;
+			if (x < inputWidth) {
+				row_buffer[iChannel & PAR_CHANNELS_MASK][(iChannel >> PAR_CHANNELS_SHIFT) * inputWidth + x] = BeatValue(element, i);
+			}
+		}
+	}
+
+	// Compute stage: the output rows of the filters of a pass, one stream per filter (only the pooled rows with performMaxPool).
+	// The loads that must finish before the next output row poll the row stream: stalls counts the cycles in which
+	// it was empty, waiting on the bus.
+	static void ComputeRows(hls::stream<Beat_t>& rows, hls::stream<Fxp> outRows[ParFilters],
+			Fxp filter_coeffs[ParFilters][MaxChannels][CONV_FILTER_WIDTH][CONV_FILTER_HEIGHT], Bias bias[ParFilters],
+			uint32_t passFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool, uint32_t shift,
+			uint32_t& stalls)
+	{
+		const uint32_t outputHeight = inputHeight - CONV_FILTER_HEIGHT + 1;
+		const uint32_t outputWidth = inputWidth - CONV_FILTER_WIDTH + 1;
+		const uint32_t channelSteps = (numChannels + PAR_CHANNELS_MASK) >> PAR_CHANNELS_SHIFT;
+		const uint32_t rowElements = RowElements(inputWidth);
+
+		Fxp row_buffers[ROW_BUFFER_SLOTS][ParChannels][RowBufferSize / ParChannels];
+
+		// Power of two cyclic factor (4 instead of 3) to avoid expensive modulo 3 to choose the correct array,
+		//	and adds a noticeable iteration latency to the ichannel_loop (which has a relatively small number of
+		//	iterations, so the effect is quite noticeable). It also takes the VALUES_PER_BEAT values (up to 4) of an element at once.
+		#pragma HLS ARRAY_PARTITION variable=row_buffers type=cyclic factor=4 dim=3
+		#pragma HLS ARRAY_PARTITION variable=row_buffers type=complete dim=2
+		#pragma HLS ARRAY_PARTITION variable=row_buffers type=complete dim=1
+		// The row being loaded is never one of the rows being read.
+#pragma HLS DEPENDENCE variable=row_buffers type=inter false
+#pragma HLS DEPENDENCE variable=row_buffers type=intra false
+
+		// MaxPool: the maximum of each horizontal pair of an even output row waits here for the odd row below it.
+		Fxp pool_row[ParFilters][RowBufferSize / 2];
+#pragma HLS ARRAY_PARTITION variable=pool_row type=complete dim=1
+		Fxp pool_pair[ParFilters];
+#pragma HLS ARRAY_PARTITION variable=pool_pair type=complete dim=1
+
+		uint32_t stallCycles = 0;
+
+		// Load the first rows to kick-off the caching
+		uint32_t primeRow = 0, primeChannel = 0, primeElement = 0;
+		prime_loop: while (primeRow < CONV_FILTER_HEIGHT) {
+#pragma HLS LOOP_TRIPCOUNT min=CONV_FILTER_HEIGHT*LOOP_TRIPCOUNT_CHANNELS*LOOP_TRIPCOUNT_INPUT_WIDTH/VALUES_PER_BEAT max=CONV_FILTER_HEIGHT*LOOP_TRIPCOUNT_CHANNELS*LOOP_TRIPCOUNT_INPUT_WIDTH/VALUES_PER_BEAT
+#pragma HLS PIPELINE II=1
+			Beat_t element;
+			if (rows.read_nb(element)) {
+				StoreRowElement(row_buffers[primeRow], primeChannel, primeElement, element, inputWidth);
+				if (++primeElement == rowElements) {
+					primeElement = 0;
+					if (++primeChannel == numChannels) {
+						primeChannel = 0;
+						++primeRow;
+					}
+				}
+			} else {
+				++stallCycles;
+			}
+		}
+
+		uint8_t firstRowBufferIndex = 0;
+
+		// For the filters of the pass, compute the output[x][y] of each one
+		output_y_loop: for (uint32_t y = 0; y < outputHeight; ++y) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_OUTPUT_HEIGHT max=LOOP_TRIPCOUNT_OUTPUT_HEIGHT
+
+			// Row y+CONV_FILTER_HEIGHT goes to the free buffer, one element per channel step as it arrives.
+			const uint8_t nextRowBufferToFill = (firstRowBufferIndex + CONV_FILTER_HEIGHT) & ROW_SLOT_MASK;
+			bool filling = y + CONV_FILTER_HEIGHT < inputHeight;
+			uint32_t fillChannel = 0, fillElement = 0;
+
+			output_x_loop: for (uint32_t x = 0; x < outputWidth; ++x) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_OUTPUT_WIDTH max=LOOP_TRIPCOUNT_OUTPUT_WIDTH
+
+				// Generate the pixel output[y][x] of every filter of the pass
+
+				Acc accs[ParFilters][ParChannels];
+#pragma HLS ARRAY_PARTITION variable=accs type=complete dim=0
+				for(uint8_t k = 0; k < ParFilters; ++k) {
+#pragma HLS UNROLL
+					for(uint8_t iParChannel = 0; iParChannel < ParChannels; ++iParChannel) {
+#pragma HLS UNROLL
+						accs[k][iParChannel] = 0;
+					}
+				}
+
+				ichannel_loop: for (uint32_t iStep = 0; iStep < channelSteps; ++iStep) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_CHANNELS/ParChannels max=LOOP_TRIPCOUNT_CHANNELS/ParChannels
+#pragma HLS PIPELINE II=1
+
+					Beat_t element;
+					if (filling && rows.read_nb(element)) {
+						StoreRowElement(row_buffers[nextRowBufferToFill], fillChannel, fillElement, element, inputWidth);
+						if (++fillElement == rowElements) {
+							fillElement = 0;
+							if (++fillChannel == numChannels) {
+								filling = false;
+							}
+						}
+					}
+
+					par_channel_loop: for (uint32_t iParChannel = 0; iParChannel < ParChannels; ++iParChannel) {
+#pragma HLS UNROLL
+						const uint32_t iChannel = (iStep << PAR_CHANNELS_SHIFT) + iParChannel;
+						if (iChannel < numChannels) {
+							cy_loop: for (uint8_t cy = 0; cy < CONV_FILTER_HEIGHT; ++ cy) {
+#pragma HLS UNROLL
+								const uint8_t rowBufferIndex = (firstRowBufferIndex + cy) & ROW_SLOT_MASK;
+								cx_loop: for (uint8_t cx = 0; cx < CONV_FILTER_WIDTH; ++cx) {
+#pragma HLS UNROLL
+									// acc[k] += filters[iFirstFilter+k][iChannel][cy][cx] * input[iChannel][y+cy][x+cx]
+									Fxp inVal = row_buffers[rowBufferIndex][iParChannel][iStep * inputWidth + (x+cx)];
+
+									k_loop: for (uint8_t k = 0; k < ParFilters; ++k) {
+#pragma HLS UNROLL
+										Datapath<Fxp>::Mac(accs[k][iParChannel], inVal, filter_coeffs[k][iChannel][cy][cx]);
+									}
+								}
+							}
+						}
+					}
+				}
+
+				out_k_loop: for (uint8_t k = 0; k < ParFilters; ++k) {
+#pragma HLS UNROLL
+					// The last pass may have fewer filters.
+					if (k < passFilters) {
+						Acc acc = 0;
+						for(uint8_t iParChannel = 0; iParChannel < ParChannels; ++iParChannel) {
+#pragma HLS UNROLL
+							acc += accs[k][iParChannel];
+						}
+
+						Fxp out = Datapath<Fxp>::Output(acc, bias[k], shift);
+
+						if(performReLu) {
+							out = ReLu(out);
+						}
+
+						if (performMaxPool) {
+							// The last column and row of odd sizes are never paired, so they are dropped.
+							if ((x & 1) == 0) {
+								pool_pair[k] = out;
+							} else if ((y & 1) == 0) {
+								pool_row[k][x >> 1] = Max(pool_pair[k], out);
+							} else {
+								// output[iFirstFilter+k][y/2][x/2] = max of the 2x2 window
+								outRows[k].write(Max(pool_row[k][x >> 1], Max(pool_pair[k], out)));
+							}
+						} else {
+							// output[iFirstFilter+k][y][x] = out
+							outRows[k].write(out);
+						}
+					}
+				}
+			}
+
+			// The rest of the next row: the loads take one element per channel step, a bit less than a row.
+			fill_rest_loop: while (filling) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_CHANNELS max=LOOP_TRIPCOUNT_CHANNELS
+#pragma HLS PIPELINE II=1
+				Beat_t element;
+				if (rows.read_nb(element)) {
+					StoreRowElement(row_buffers[nextRowBufferToFill], fillChannel, fillElement, element, inputWidth);
+					if (++fillElement == rowElements) {
+						fillElement = 0;
+						if (++fillChannel == numChannels) {
+							filling = false;
+						}
+					}
+				} else {
+					++stallCycles;
+				}
+			}
+
+			firstRowBufferIndex = (firstRowBufferIndex + 1) & ROW_SLOT_MASK;
+		}
+		stalls = stallCycles;
+	}
+
+	// Write stage: bursts the output rows of the filters of a pass, outputHeight rows of outputWidth values each
+	// (the pooled sizes with performMaxPool). Signals the end of the pass on done.
+	static void WriteOutput(hls::stream<Fxp> outRows[ParFilters], Fxp* output, uint32_t iFirstFilter, uint32_t passFilters, uint32_t outputWidth, uint32_t outputHeight,
+			hls::stream<bool>& done)
+	{
+		write_y_loop: for (uint32_t y = 0; y < outputHeight; ++y) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_OUTPUT_HEIGHT max=LOOP_TRIPCOUNT_OUTPUT_HEIGHT
+			write_k_loop: for (uint32_t k = 0; k < passFilters; ++k) {
+#pragma HLS LOOP_TRIPCOUNT min=ParFilters max=ParFilters
+				write_x_loop: for (uint32_t x = 0; x < outputWidth; ++x) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_OUTPUT_WIDTH max=LOOP_TRIPCOUNT_OUTPUT_WIDTH
+#pragma HLS PIPELINE II=1
+					output[OUT_IDX(iFirstFilter + k, y, x)] = outRows[k].read();
+				}
+			}
+		}
+		done.write(true);
+	}
+
+	// One pass: the three stages run concurrently, connected by streams. The row stream holds a whole row of every
+	// channel, so that the reads of the next row overlap the compute of the current one, and every output stream a
+	// whole output row, while the write stage drains the rows of the other filters. A fourth stage counts the cycles
+	// of the pass (passCycles), and the compute stage those it waited for the input (passStalls).
+	static void ConvPass(Beat_t* input, Fxp* output, Fxp filter_coeffs[ParFilters][MaxChannels][CONV_FILTER_WIDTH][CONV_FILTER_HEIGHT], Bias bias[ParFilters],
+			uint32_t iFirstFilter, uint32_t passFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool, uint32_t shift, uint32_t inputSkip,
+			uint32_t& primeCycles, uint32_t& streamCycles, uint32_t& beatsRead, uint32_t& passCycles, uint32_t& passStalls)
+	{
+#pragma HLS DATAFLOW
+		hls::stream<Beat_t> rows("rows");
+#pragma HLS STREAM variable=rows depth=RowBufferSize/VALUES_PER_BEAT
+		hls::stream<Fxp> outRows[ParFilters];
+#pragma HLS STREAM variable=outRows depth=RowBufferSize
+		hls::stream<bool> done("done");
+
+		const uint32_t outputHeight = inputHeight - CONV_FILTER_HEIGHT + 1;
+		const uint32_t outputWidth = inputWidth - CONV_FILTER_WIDTH + 1;
+
+		ReadInput(input, inputSkip, numChannels, inputWidth, inputHeight, rows, primeCycles, streamCycles, beatsRead);
+		ComputeRows(rows, outRows, filter_coeffs, bias, passFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool, shift, passStalls);
+		WriteOutput(outRows, output, iFirstFilter, passFilters, performMaxPool ? outputWidth / 2 : outputWidth, performMaxPool ? outputHeight / 2 : outputHeight, done);
+		CountCycles(done, passCycles);
+	}
+
+	// Caches the coefficients of the filters of a pass. Signals the end on done.
+	static void LoadCoefficients(Fxp* filters, Bias* biases, Fxp filter_coeffs[ParFilters][MaxChannels][CONV_FILTER_WIDTH][CONV_FILTER_HEIGHT], Bias bias[ParFilters],
+			uint32_t iFirstFilter, uint32_t passFilters, uint32_t numChannels, hls::stream<bool>& done)
+	{
+		filt_cache_iFilter_loop: for (uint32_t k = 0; k < passFilters; ++k) {
+			filt_cache_iChannel_loop: for(uint32_t iChannel = 0; iChannel < numChannels; ++iChannel) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_CHANNELS max=LOOP_TRIPCOUNT_CHANNELS
+				filt_cache_cy_loop: for (uint32_t cy = 0; cy < CONV_FILTER_HEIGHT; ++ cy) {
+					filt_cache_cx_loop: for (uint32_t cx = 0; cx < CONV_FILTER_WIDTH; ++cx) {
+						filter_coeffs[k][iChannel][cy][cx] = filters[FILT_IDX(iFirstFilter + k, iChannel, cy, cx)];
+					}
+				}
+			}
+			bias[k] = biases[iFirstFilter + k];
+		}
+		done.write(true);
+	}
+
+	// The load of the coefficients, with the count of its cycles (coefCycles). The compute waits for all of them.
+	static void CoefficientPass(Fxp* filters, Bias* biases, Fxp filter_coeffs[ParFilters][MaxChannels][CONV_FILTER_WIDTH][CONV_FILTER_HEIGHT], Bias bias[ParFilters],
+			uint32_t iFirstFilter, uint32_t passFilters, uint32_t numChannels, uint32_t& coefCycles)
+	{
+#pragma HLS DATAFLOW
+		hls::stream<bool> done("done");
+
+		LoadCoefficients(filters, biases, filter_coeffs, bias, iFirstFilter, passFilters, numChannels, done);
+		CountCycles(done, coefCycles);
+	}
+
+	// Conv() without the interface and the capability registers (see conv.h).
+	static void Run(Beat_t* input, Fxp* output, Fxp* filters, Bias* biases, uint32_t numFilters,  uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool, bool& resultOk,
+			uint32_t& cycles, uint32_t& memCycles, uint32_t& bytesRead, uint32_t& bytesWritten, uint32_t inputSkip,
+			uint32_t inputDecimals, uint32_t weightDecimals, uint32_t outputDecimals)
+	{
+		cycles = 0;
+		memCycles = 0;
+		bytesRead = 0;
+		bytesWritten = 0;
+
+		if (numChannels > MaxChannels) {
+			resultOk = false;
+			return;
+		}
+
+		if (numChannels * inputWidth > RowBufferSize) {
+			// This parameter combination won't fit on our row buffer.
+			resultOk = false;
+			return;
+		}
+
+		if (inputSkip >= VALUES_PER_BEAT) {
+			resultOk = false;
+			return;
+		}
+
+		// The output cannot have more decimals than the products, nor be shifted out of the accumulator.
+		if (Datapath<Fxp>::LAYER_DECIMALS && (inputDecimals + weightDecimals < outputDecimals || inputDecimals + weightDecimals - outputDecimals >= 32)) {
+			resultOk = false;
+			return;
+		}
+		const uint32_t shift = inputDecimals + weightDecimals - outputDecimals;
+
+		const uint32_t outputHeight = inputHeight - CONV_FILTER_HEIGHT + 1;
+		const uint32_t outputWidth = inputWidth - CONV_FILTER_WIDTH + 1;
+
+		// Counters of the schedule (see conv.h), accumulated once per pass, and the ones measured in RTL.
+		uint32_t waitCycles = 0, computeCycles = 0, coefsRead = 0, beatsRead = 0, valuesWritten = 0;
+		uint32_t measuredCycles = 0, measuredMemCycles = 0;
+		const uint32_t channelSteps = (numChannels + PAR_CHANNELS_MASK) >> PAR_CHANNELS_SHIFT;
+
+		filter_loop: for (uint32_t iFirstFilter = 0; iFirstFilter < numFilters; iFirstFilter += ParFilters) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_FILTERS/ParFilters max=LOOP_TRIPCOUNT_FILTERS/ParFilters
+
+			// Filters of this pass. The last pass may have fewer.
+			const uint32_t passFilters = numFilters - iFirstFilter < ParFilters ? numFilters - iFirstFilter : ParFilters;
+
+			// Cache the filter coefficients here. Only read the coefficients once and use them in all the output pixel computation.
+			Fxp filter_coeffs[ParFilters][MaxChannels][CONV_FILTER_WIDTH][CONV_FILTER_HEIGHT];
+#pragma HLS ARRAY_PARTITION variable=filter_coeffs type=complete dim=4
+#pragma HLS ARRAY_PARTITION variable=filter_coeffs type=complete dim=3
+#pragma HLS ARRAY_PARTITION variable=filter_coeffs type=complete dim=1
+#pragma HLS ARRAY_PARTITION variable=filter_coeffs type=cyclic factor=ParChannels dim=2
+			Bias bias[ParFilters];
+#pragma HLS ARRAY_PARTITION variable=bias type=complete dim=1
+
+			uint32_t coefCycles;
+			CoefficientPass(filters, biases, filter_coeffs, bias, iFirstFilter, passFilters, numChannels, coefCycles);
+			// The coefficients of the filters of a pass are contiguous: one burst for them and one for the biases.
+			waitCycles += (AXI_LATENCY + passFilters * numChannels * CONV_FILTER_HEIGHT * CONV_FILTER_WIDTH) + (AXI_LATENCY + passFilters);
+			coefsRead += passFilters * numChannels * CONV_FILTER_HEIGHT * CONV_FILTER_WIDTH;
+
+			uint32_t primeCycles, streamCycles, passBeats, passCycles, passStalls;
+			ConvPass(input, output, filter_coeffs, bias, iFirstFilter, passFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool, shift, inputSkip,
+				primeCycles, streamCycles, passBeats, passCycles, passStalls);
+			measuredCycles += coefCycles + passCycles;
+			measuredMemCycles += coefCycles + passStalls;
+
+			const uint32_t passCompute = outputHeight * outputWidth * channelSteps;
+			waitCycles += primeCycles + (streamCycles > passCompute ? streamCycles - passCompute : 0);
+			computeCycles += passCompute;
+			beatsRead += passBeats;
+			valuesWritten += passFilters * (performMaxPool ? (outputHeight / 2) * (outputWidth / 2) : outputHeight * outputWidth);
+		}
+#if COUNTERS_FROM_SCHEDULE
+		cycles = waitCycles + computeCycles;
+		memCycles = waitCycles;
+#else
+		cycles = measuredCycles;
+		memCycles = measuredMemCycles;
+#endif
+		// The biases take 32 bits on the bus, and the other values BITS.
+		bytesRead = coefsRead * (BITS / 8) + numFilters * sizeof(uint32_t) + beatsRead * AXI_BEAT_WORDS * sizeof(uint32_t);
+		bytesWritten = valuesWritten * (BITS / 8);
+		resultOk = true;
+		return;
+	}
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdint.h>
+#include "ap_fixed.h"
+#include "ap_int.h"
+#include "hls_stream.h"
+
+// Helpers shared by the kernels (conv_kernel.h, dense_kernel.h).
+
+constexpr bool IsPowerOf2(uint32_t x) { return x != 0 && (x & (x - 1)) == 0; }
+constexpr uint32_t Log2(uint32_t x) { return x <= 1 ? 0 : 1 + Log2(x >> 1); }
+
+// Arithmetic of the kernels, for each type of values: the accumulators, the biases, and how an output is made of
+// the sum of the products and the bias.
+template<typename Fxp> struct Datapath;
+
+// ap_fixed<W, I>: the format of every layer is the one of the type, so the decimals of the layer are not used.
+// Every product is truncated to Fxp before it is accumulated, as FXP_Mult() in SW_Accel/model.h.
+template<int W, int I> struct Datapath<ap_fixed<W, I>> {
+	using Acc = ap_fixed<W, I>;
+	using Bias = ap_fixed<W, I>;
+	static const uint32_t BITS = W;
+	static const uint32_t DECIMALS = W - I;
+	static const bool LAYER_DECIMALS = false;
+
+	static void Mac(Acc& acc, ap_fixed<W, I> in, ap_fixed<W, I> filt) {
+#pragma HLS INLINE
+		acc += ap_fixed<W, I>(ap_fixed<2 * W, 2 * I>(in) * ap_fixed<2 * W, 2 * I>(filt));
+	}
+
+	static ap_fixed<W, I> Output(Acc acc, Bias bias, uint32_t shift) {
+#pragma HLS INLINE
+		return acc + bias;
+	}
+};
+
+// ap_int<W>: integers with the decimals of each layer (see conv.h). The products are exact and accumulate in the
+// 48 bits of a DSP48, the bias has the decimals of the products, and the sum is shifted to the decimals of the
+// output, rounding to nearest, and saturated.
+template<int W> struct Datapath<ap_int<W>> {
+	using Acc = ap_int<48>;
+	using Bias = ap_int<32>;
+	static const uint32_t BITS = W;
+	static const uint32_t DECIMALS = 0;
+	static const bool LAYER_DECIMALS = true;
+
+	static void Mac(Acc& acc, ap_int<W> in, ap_int<W> filt) {
+#pragma HLS INLINE
+		acc += in * filt;
+	}
+
+	static ap_int<W> Output(Acc acc, Bias bias, uint32_t shift) {
+#pragma HLS INLINE
+		const Acc maxValue = (Acc(1) << (W - 1)) - 1;
+		const Acc minValue = -maxValue - 1;
+		Acc sum = acc + bias;
+		if (shift > 0) {
+			sum = (sum + (Acc(1) << (shift - 1))) >> shift;
+		}
+		if (sum > maxValue) {
+			return maxValue;
+		} else if (sum < minValue) {
+			return minValue;
+		} else {
+			return sum;
+		}
+	}
+};
+
+// The counters of the kernels are measured in RTL: HLS cannot read a clock, so a stage of a dataflow region counts
+// the cycles of the region. CountCycles() takes one cycle per iteration (II=1) until the last stage tells it that
+// it has finished. The stages of a region run one after the other in C-sim, where it counts nothing, so C-sim
+// reports the cycles of the schedule of the kernel instead (COUNTERS_FROM_SCHEDULE).
+#ifndef __SYNTHESIS__
+#define COUNTERS_FROM_SCHEDULE 1
+#else
+#define COUNTERS_FROM_SCHEDULE 0
+#endif
+
+inline void CountCycles(hls::stream<bool>& done, uint32_t& cycles)
+{
+	uint32_t count = 0;
+	bool last;
+	count_loop: while (!done.read_nb(last)) {
+#pragma HLS PIPELINE II=1
+		++count;
+	}
+	cycles = count;
+}
@@ -0,0 +1,35 @@
+#include "dense.h"
+#include <stdint.h>
+#include "dense_kernel.h"
+
+using Kernel = DenseKernel<DENSE_PARALLEL_IMAGES, DENSE_MAX_INPUT_SIZE>;
+
+void Dense(Beat_t* input, FXP_t* output, Beat_t* weights, FXP_t* biases, uint32_t inputSize, uint32_t outputSize, uint32_t batchSize, bool performReLu, bool& resultOk,
+		uint32_t& cycles, uint32_t& memCycles, uint32_t& bytesRead, uint32_t& bytesWritten,
+		uint32_t& capabilities, uint32_t& maxInputSize)
+{
+#pragma HLS INTERFACE s_axilite port=inputSize
+#pragma HLS INTERFACE s_axilite port=outputSize
+#pragma HLS INTERFACE s_axilite port=batchSize
+#pragma HLS INTERFACE s_axilite port=performReLu
+#pragma HLS INTERFACE s_axilite port=resultOk
+#pragma HLS INTERFACE s_axilite port=cycles
+#pragma HLS INTERFACE s_axilite port=memCycles
+#pragma HLS INTERFACE s_axilite port=bytesRead
+#pragma HLS INTERFACE s_axilite port=bytesWritten
+#pragma HLS INTERFACE s_axilite port=capabilities
+#pragma HLS INTERFACE s_axilite port=maxInputSize
+#pragma HLS INTERFACE s_axilite port=return
+
+	// The weights have a bundle of their own, as they are streamed while the inputs are cached before each pass.
+#pragma HLS INTERFACE m_axi depth=1024 port=input offset=slave latency=30 bundle=gmem_in max_read_burst_length=256
+#pragma HLS INTERFACE m_axi depth=1024 port=biases offset=slave latency=30 bundle=gmem_in
+#pragma HLS INTERFACE m_axi depth=1024 port=weights offset=slave latency=30 bundle=gmem_coef max_read_burst_length=256
+#pragma HLS INTERFACE m_axi depth=1024 port=output offset=slave latency=30 bundle=gmem_out
+
+	capabilities = Kernel::Capabilities();
+	maxInputSize = DENSE_MAX_INPUT_SIZE;
+
+	Kernel::Run(input, output, weights, biases, inputSize, outputSize, batchSize, performReLu, resultOk,
+		cycles, memCycles, bytesRead, bytesWritten);
+}
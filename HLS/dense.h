@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include "conv.h"
+
+// Configuration of the Dense bitstream: the parameters of the DenseKernel instantiated by Dense() (dense_kernel.h).
+// It shares the formats and the bus of conv.h, and it is synthesized as a second IP, next to Conv (DenseHLS.tcl).
+// The host reads them from the capability registers.
+
+// Values of an input vector cached on-chip (one per parallel image). It limits the inputs of a layer.
+#ifndef DENSE_MAX_INPUT_SIZE
+#define DENSE_MAX_INPUT_SIZE 4096
+#endif
+
+// Images of the batch computed in each pass over the weights: every beat of weights read feeds
+// DENSE_PARALLEL_IMAGES x (values in a beat) MACs, and the weights are read once per DENSE_PARALLEL_IMAGES images.
+// It multiplies the DSPs of the MACs and the BRAM of the input cache. Any value >= 1 works.
+#ifndef DENSE_PARALLEL_IMAGES
+#define DENSE_PARALLEL_IMAGES 4
+#endif
+
+// output[b][o] = sum of input[b][i] * weights[o][i] + biases[o], for b < batchSize, o < outputSize, i < inputSize,
+// with the ReLU with performReLu. The products are truncated to FXP_t as in Conv() (and Dense() in SW_Accel/cnn.cpp).
+// The kernel is a dataflow of three stages, one pass (DENSE_PARALLEL_IMAGES images) at a time:
+//  - Read: bursts the rows of weights on the gmem_coef bundle and streams them, with the bias of each row.
+//  - Compute: multiplies every beat of weights with the cached inputs of the images of the pass, one beat per cycle.
+//  - Write: writes the outputs of each row on the gmem_out bundle.
+// The inputs of a pass are read on the gmem_in bundle before it starts. With a single image the kernel goes as fast
+// as the weights arrive (one beat per cycle), so the parallel images only pay off with batches.
+//  The input and the weights are read in beats, so they have to be aligned to a beat and inputSize has to be a
+// multiple of the values in a beat. Fails otherwise, or if inputSize > DENSE_MAX_INPUT_SIZE.
+// The counters are those of Conv() (see conv.h). In RTL, memCycles adds the load of the inputs and the cycles in
+// which the compute waits for the weights. In C-sim they come from the schedule of the kernel: every burst costs
+// AXI_LATENCY plus one cycle per beat, and the compute one cycle per beat of weights.
+// The capability registers are written by every call, even one that fails or has no outputs:
+//  - capabilities: bits 7-0 DENSE_PARALLEL_IMAGES, 15-8 values in a beat, 23-16 bits of the values, 31-24 FXP_NUM_DECIMALS.
+//  - maxInputSize: DENSE_MAX_INPUT_SIZE.
+void Dense(Beat_t* input, FXP_t* output, Beat_t* weights, FXP_t* biases, uint32_t inputSize, uint32_t outputSize, uint32_t batchSize, bool performReLu, bool& resultOk,
+		uint32_t& cycles, uint32_t& memCycles, uint32_t& bytesRead, uint32_t& bytesWritten,
+		uint32_t& capabilities, uint32_t& maxInputSize);
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <stdint.h>
+#include "dense.h"
+#include "datapath.h"
+#include "hls_stream.h"
+
+// The Dense kernel, as a template on its parallelism and input cache. The top function Dense() (dense.cpp)
+// instantiates it with the configuration of dense.h, and the testbench checks other instantiations too.
+
+// Define some loop tripcounts to get performance estimates inside Vitis HLS (the first dense layer of the cats
+// and dogs network).
+#define LOOP_TRIPCOUNT_DENSE_INPUT 2304
+#define LOOP_TRIPCOUNT_DENSE_OUTPUT 512
+#define LOOP_TRIPCOUNT_DENSE_BATCH 16
+
+//  - ParImages: images of the batch computed per pass over the weights (DENSE_PARALLEL_IMAGES).
+//  - MaxInputSize: values of the input cache of each image (DENSE_MAX_INPUT_SIZE).
+template<uint32_t ParImages, uint32_t MaxInputSize>
+struct DenseKernel {
+	using Fxp = FXP_t;
+	using Acc = typename Datapath<Fxp>::Acc;
+	static const uint32_t BITS = Datapath<Fxp>::BITS;
+	// Values in a beat of the input and of the weights.
+	static const uint32_t VALUES_PER_BEAT = 32 * AXI_BEAT_WORDS / BITS;
+	// Multiply-accumulates per cycle: every value of a beat of weights with every image of the pass.
+	static const uint32_t MACS = ParImages * VALUES_PER_BEAT;
+
+	static_assert(ParImages >= 1 && ParImages <= 0xff, "From 1 image per pass to those that fit in the capability register");
+	static_assert(MaxInputSize % VALUES_PER_BEAT == 0, "The input cache holds whole beats");
+
+	// Value of the capability register (see dense.h).
+	static uint32_t Capabilities() {
+		return ParImages | (VALUES_PER_BEAT << 8) | (BITS << 16) | (Datapath<Fxp>::DECIMALS << 24);
+	}
+
+	static Fxp ReLu(Fxp x) {
+		if (x < 0) {
+			return 0;
+		} else {
+			return x;
+		}
+	}
+
+	// Value i of a beat.
+	static Fxp BeatValue(const Beat_t& beat, uint32_t i) {
+		Fxp value;
+		value.range(BITS - 1, 0) = beat.range(BITS * i + BITS - 1, BITS * i);
+		return value;
+	}
+
+	// Caches the inputs of the images of a pass, one burst each. Signals the end on done.
+	static void LoadInputs(Beat_t* input, Fxp input_cache[ParImages][MaxInputSize], uint32_t iFirstImage, uint32_t passImages, uint32_t rowBeats,
+			hls::stream<bool>& done)
+	{
+		load_image_loop: for (uint32_t p = 0; p < passImages; ++p) {
+#pragma HLS LOOP_TRIPCOUNT min=ParImages max=ParImages
+			load_beat_loop: for (uint32_t j = 0; j < rowBeats; ++j) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_DENSE_INPUT/VALUES_PER_BEAT max=LOOP_TRIPCOUNT_DENSE_INPUT/VALUES_PER_BEAT
+#pragma HLS PIPELINE II=1
+				const Beat_t beat = input[(iFirstImage + p) * rowBeats + j];
+				for (uint32_t i = 0; i < VALUES_PER_BEAT; ++i) {
+#pragma HLS UNROLL
+					input_cache[p][j * VALUES_PER_BEAT + i] = BeatValue(beat, i);
+				}
+			}
+		}
+		done.write(true);
+	}
+
+	// The load of the inputs, with the count of its cycles (loadCycles). The compute waits for all of them.
+	static void InputPass(Beat_t* input, Fxp input_cache[ParImages][MaxInputSize], uint32_t iFirstImage, uint32_t passImages, uint32_t rowBeats,
+			uint32_t& loadCycles)
+	{
+#pragma HLS DATAFLOW
+		hls::stream<bool> done("done");
+
+		LoadInputs(input, input_cache, iFirstImage, passImages, rowBeats, done);
+		CountCycles(done, loadCycles);
+	}
+
+	// Read stage: streams the rows of weights, one burst each, and the bias of every row before its beats.
+	static void ReadWeights(Beat_t* weights, Fxp* biases, uint32_t outputSize, uint32_t rowBeats,
+			hls::stream<Beat_t>& rows, hls::stream<Fxp>& rowBiases)
+	{
+		read_row_loop: for (uint32_t o = 0; o < outputSize; ++o) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_DENSE_OUTPUT max=LOOP_TRIPCOUNT_DENSE_OUTPUT
+			rowBiases.write(biases[o]);
+			read_beat_loop: for (uint32_t j = 0; j < rowBeats; ++j) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_DENSE_INPUT/VALUES_PER_BEAT max=LOOP_TRIPCOUNT_DENSE_INPUT/VALUES_PER_BEAT
+#pragma HLS PIPELINE II=1
+				rows.write(weights[o * rowBeats + j]);
+			}
+		}
+	}
+
+	// Compute stage: one beat of weights per cycle, multiplied with the cached values of every image of the pass
+	// into one accumulator per image. At the end of a row, streams the output of every image. It polls the row stream:
+	// stalls counts the cycles in which it was empty, waiting on the bus.
+	static void ComputeRows(hls::stream<Beat_t>& rows, hls::stream<Fxp>& rowBiases, hls::stream<Fxp>& outValues,
+			Fxp input_cache[ParImages][MaxInputSize], uint32_t passImages, uint32_t outputSize, uint32_t rowBeats, bool performReLu,
+			uint32_t& stalls)
+	{
+		uint32_t stallCycles = 0;
+
+		compute_row_loop: for (uint32_t o = 0; o < outputSize; ++o) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_DENSE_OUTPUT max=LOOP_TRIPCOUNT_DENSE_OUTPUT
+			Acc accs[ParImages];
+#pragma HLS ARRAY_PARTITION variable=accs type=complete dim=1
+			for (uint32_t p = 0; p < ParImages; ++p) {
+#pragma HLS UNROLL
+				accs[p] = 0;
+			}
+
+			uint32_t j = 0;
+			compute_beat_loop: while (j < rowBeats) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_DENSE_INPUT/VALUES_PER_BEAT max=LOOP_TRIPCOUNT_DENSE_INPUT/VALUES_PER_BEAT
+#pragma HLS PIPELINE II=1
+				Beat_t beat;
+				if (rows.read_nb(beat)) {
+					for (uint32_t p = 0; p < ParImages; ++p) {
+#pragma HLS UNROLL
+						for (uint32_t i = 0; i < VALUES_PER_BEAT; ++i) {
+#pragma HLS UNROLL
+							Datapath<Fxp>::Mac(accs[p], input_cache[p][j * VALUES_PER_BEAT + i], BeatValue(beat, i));
+						}
+					}
+					++j;
+				} else {
+					++stallCycles;
+				}
+			}
+
+			const Fxp bias = rowBiases.read();
+			compute_out_loop: for (uint32_t p = 0; p < passImages; ++p) {
+#pragma HLS LOOP_TRIPCOUNT min=ParImages max=ParImages
+#pragma HLS PIPELINE II=1
+				Fxp out = Datapath<Fxp>::Output(accs[p], bias, 0);
+				if (performReLu) {
+					out = ReLu(out);
+				}
+				outValues.write(out);
+			}
+		}
+		stalls = stallCycles;
+	}
+
+	// Write stage: writes the outputs of every row, output[iImage][o]. Signals the end of the pass on done.
+	static void WriteOutput(hls::stream<Fxp>& outValues, Fxp* output, uint32_t iFirstImage, uint32_t passImages, uint32_t outputSize,
+			hls::stream<bool>& done)
+	{
+		write_row_loop: for (uint32_t o = 0; o < outputSize; ++o) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_DENSE_OUTPUT max=LOOP_TRIPCOUNT_DENSE_OUTPUT
+			write_image_loop: for (uint32_t p = 0; p < passImages; ++p) {
+#pragma HLS LOOP_TRIPCOUNT min=ParImages max=ParImages
+#pragma HLS PIPELINE II=1
+				output[(iFirstImage + p) * outputSize + o] = outValues.read();
+			}
+		}
+		done.write(true);
+	}
+
+	// One pass: the three stages run concurrently, connected by streams. The row stream holds a whole row of
+	// weights, so that the burst of the next row overlaps the compute of the current one. A fourth stage counts the
+	// cycles of the pass (passCycles), and the compute stage those it waited for the weights (passStalls).
+	static void DensePass(Beat_t* weights, Fxp* biases, Fxp* output, Fxp input_cache[ParImages][MaxInputSize],
+			uint32_t iFirstImage, uint32_t passImages, uint32_t outputSize, uint32_t rowBeats, bool performReLu,
+			uint32_t& passCycles, uint32_t& passStalls)
+	{
+#pragma HLS DATAFLOW
+		hls::stream<Beat_t> rows("rows");
+#pragma HLS STREAM variable=rows depth=MaxInputSize/VALUES_PER_BEAT
+		hls::stream<Fxp> rowBiases("rowBiases");
+#pragma HLS STREAM variable=rowBiases depth=4
+		hls::stream<Fxp> outValues("outValues");
+#pragma HLS STREAM variable=outValues depth=4*ParImages
+		hls::stream<bool> done("done");
+
+		ReadWeights(weights, biases, outputSize, rowBeats, rows, rowBiases);
+		ComputeRows(rows, rowBiases, outValues, input_cache, passImages, outputSize, rowBeats, performReLu, passStalls);
+		WriteOutput(outValues, output, iFirstImage, passImages, outputSize, done);
+		CountCycles(done, passCycles);
+	}
+
+	// Dense() without the interface and the capability registers (see dense.h).
+	static void Run(Beat_t* input, Fxp* output, Beat_t* weights, Fxp* biases, uint32_t inputSize, uint32_t outputSize, uint32_t batchSize, bool performReLu, bool& resultOk,
+			uint32_t& cycles, uint32_t& memCycles, uint32_t& bytesRead, uint32_t& bytesWritten)
+	{
+		cycles = 0;
+		memCycles = 0;
+		bytesRead = 0;
+		bytesWritten = 0;
+
+		if (inputSize == 0 || inputSize > MaxInputSize || inputSize % VALUES_PER_BEAT != 0) {
+			resultOk = false;
+			return;
+		}
+		const uint32_t rowBeats = inputSize / VALUES_PER_BEAT;
+
+		Fxp input_cache[ParImages][MaxInputSize];
+#pragma HLS ARRAY_PARTITION variable=input_cache type=complete dim=1
+#pragma HLS ARRAY_PARTITION variable=input_cache type=cyclic factor=VALUES_PER_BEAT dim=2
+
+		// Counters of the schedule (see dense.h), accumulated once per pass, and the ones measured in RTL.
+		uint32_t waitCycles = 0, computeCycles = 0, beatsRead = 0, biasesRead = 0, valuesWritten = 0;
+		uint32_t measuredCycles = 0, measuredMemCycles = 0;
+
+		image_loop: for (uint32_t iFirstImage = 0; iFirstImage < batchSize; iFirstImage += ParImages) {
+#pragma HLS LOOP_TRIPCOUNT min=LOOP_TRIPCOUNT_DENSE_BATCH/ParImages max=LOOP_TRIPCOUNT_DENSE_BATCH/ParImages
+
+			// Images of this pass. The last pass may have fewer.
+			const uint32_t passImages = batchSize - iFirstImage < ParImages ? batchSize - iFirstImage : ParImages;
+
+			uint32_t loadCycles, passCycles, passStalls;
+			InputPass(input, input_cache, iFirstImage, passImages, rowBeats, loadCycles);
+			waitCycles += passImages * (AXI_LATENCY + rowBeats);
+
+			DensePass(weights, biases, output, input_cache, iFirstImage, passImages, outputSize, rowBeats, performReLu, passCycles, passStalls);
+			measuredCycles += loadCycles + passCycles;
+			measuredMemCycles += loadCycles + passStalls;
+
+			// The compute takes a cycle per beat of weights, and waits for the latency of every row it gets.
+			const uint32_t passCompute = outputSize * rowBeats;
+			const uint32_t streamCycles = outputSize * (AXI_LATENCY + rowBeats);
+			waitCycles += streamCycles > passCompute ? streamCycles - passCompute : 0;
+			computeCycles += passCompute;
+			beatsRead += (passImages + outputSize) * rowBeats;
+			biasesRead += outputSize;
+			valuesWritten += passImages * outputSize;
+		}
+#if COUNTERS_FROM_SCHEDULE
+		cycles = waitCycles + computeCycles;
+		memCycles = waitCycles;
+#else
+		cycles = measuredCycles;
+		memCycles = measuredMemCycles;
+#endif
+		bytesRead = beatsRead * AXI_BEAT_WORDS * sizeof(uint32_t) + biasesRead * (BITS / 8);
+		bytesWritten = valuesWritten * (BITS / 8);
+		resultOk = true;
+		return;
+	}
+};
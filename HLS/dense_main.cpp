@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+#include "dense.h"
+#include "dense_kernel.h"
+
+#define MAX_INPUT_SIZE DENSE_MAX_INPUT_SIZE
+#define MAX_OUTPUT_SIZE 512
+#define MAX_BATCH 16
+
+using SW_FXP_t = int32_t;
+using SW_FXP_MULT_t = int64_t;
+
+SW_FXP_t input[MAX_BATCH * MAX_INPUT_SIZE] __attribute__((aligned(AXI_BEAT_WORDS * sizeof(SW_FXP_t))));
+SW_FXP_t weights[MAX_OUTPUT_SIZE * MAX_INPUT_SIZE] __attribute__((aligned(AXI_BEAT_WORDS * sizeof(SW_FXP_t))));
+SW_FXP_t biases[MAX_OUTPUT_SIZE];
+
+SW_FXP_t outputSW[MAX_BATCH * MAX_OUTPUT_SIZE];
+SW_FXP_t outputHW[MAX_BATCH * MAX_OUTPUT_SIZE];
+
+///////////////////////////////////////////////////////////////////////////////
+
+inline SW_FXP_t FXP_Mult(SW_FXP_t a, SW_FXP_t b, uint32_t decimals = FXP_NUM_DECIMALS)
+{
+  SW_FXP_MULT_t res = (SW_FXP_MULT_t)a * (SW_FXP_MULT_t)b;
+  res = res >> decimals;
+  return res;
+}
+
+// Same as Dense() and ReLU() in SW_Accel/cnn.cpp, for a batch. The sums wrap around as those of FXP_t.
+void Dense_SW(SW_FXP_t * input, SW_FXP_t * output, SW_FXP_t * weights, SW_FXP_t * biases,
+      uint32_t inputSize, uint32_t outputSize, uint32_t batchSize, bool performReLu)
+{
+  for (uint32_t b = 0; b < batchSize; ++ b) {
+    for (uint32_t o = 0; o < outputSize; ++ o) {
+      uint32_t acc = 0;
+      for (uint32_t i = 0; i < inputSize; ++ i)
+        acc += (uint32_t)FXP_Mult(input[b * inputSize + i], weights[o * inputSize + i]);
+      SW_FXP_t out = (SW_FXP_t)(acc + (uint32_t)biases[o]);
+      if (performReLu && out < 0)
+        out = 0;
+      output[b * outputSize + o] = out;
+    }
+  }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void InitVectors()
+{
+  for (uint32_t ii = 0; ii < MAX_BATCH * MAX_INPUT_SIZE; ++ ii)
+    input[ii] = rand();
+  for (uint32_t ii = 0; ii < MAX_OUTPUT_SIZE * MAX_INPUT_SIZE; ++ ii)
+    weights[ii] = rand();
+  for (uint32_t ii = 0; ii < MAX_OUTPUT_SIZE; ++ ii)
+	biases[ii] = rand();
+}
+
+bool CompareVectors(SW_FXP_t * input1, SW_FXP_t * input2, uint32_t size)
+{
+  bool res = true;
+
+  for (uint32_t ii = 0; res && ii < size; ++ ii)
+    res = (input1[ii] == input2[ii]);
+
+  return res;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Same interface as Dense(), for every instantiation of the kernel.
+using TDenseFunction = void (*)(Beat_t* input, SW_FXP_t* output, Beat_t* weights, SW_FXP_t* biases, uint32_t inputSize, uint32_t outputSize, uint32_t batchSize, bool performReLu, bool& resultOk,
+		uint32_t& cycles, uint32_t& memCycles, uint32_t& bytesRead, uint32_t& bytesWritten);
+
+void RunDense(Beat_t* input, SW_FXP_t* output, Beat_t* weights, SW_FXP_t* biases, uint32_t inputSize, uint32_t outputSize, uint32_t batchSize, bool performReLu, bool& resultOk,
+		uint32_t& cycles, uint32_t& memCycles, uint32_t& bytesRead, uint32_t& bytesWritten)
+{
+	uint32_t capabilities, maxInputSize;
+	Dense(input, reinterpret_cast<FXP_t*>(output), weights, reinterpret_cast<FXP_t*>(biases), inputSize, outputSize, batchSize, performReLu, resultOk,
+		cycles, memCycles, bytesRead, bytesWritten, capabilities, maxInputSize);
+}
+
+template<typename Kernel>
+void RunKernel(Beat_t* input, SW_FXP_t* output, Beat_t* weights, SW_FXP_t* biases, uint32_t inputSize, uint32_t outputSize, uint32_t batchSize, bool performReLu, bool& resultOk,
+		uint32_t& cycles, uint32_t& memCycles, uint32_t& bytesRead, uint32_t& bytesWritten)
+{
+	Kernel::Run(input, reinterpret_cast<FXP_t*>(output), weights, reinterpret_cast<FXP_t*>(biases), inputSize, outputSize, batchSize, performReLu, resultOk,
+		cycles, memCycles, bytesRead, bytesWritten);
+}
+
+// Other instantiations of the kernel: one image per pass, and more images with a smaller cache.
+using KernelSerial = DenseKernel<1, DENSE_MAX_INPUT_SIZE>;
+using KernelWide = DenseKernel<8, 2304>;
+
+// Budget of the xc7z020 of the Pynq-Z2, and DSP48E1 taken by a MAC of two 32-bit values (see main.cpp).
+#define ZYNQ_DSPS 220
+#define DSPS_PER_MAC_32 4
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks a kernel against the reference on every combination of ReLu, batch and sizes. Adds its cycles to
+// totalCycles. Returns false at the first mismatch.
+bool TestKernel(const char * name, TDenseFunction dense, uint32_t parallelImages,
+		uint32_t batches[], uint32_t numBatches, uint32_t sizes[][2], uint32_t numSizes, uint64_t & totalCycles)
+{
+  totalCycles = 0;
+  printf("Kernel %s\n", name);
+  for (uint32_t iRelu = 0; iRelu <= 1; ++iRelu) {
+	bool useRelu = iRelu;
+	for (uint32_t iBatch = 0; iBatch < numBatches; ++ iBatch) {
+	 uint32_t batchSize = batches[iBatch];
+	 for (uint32_t iTest = 0; iTest < numSizes; ++ iTest) {
+		uint32_t inputSize = sizes[iTest][0], outputSize = sizes[iTest][1];
+		uint32_t currentOutputSize = batchSize * outputSize;
+		printf("Evaluating execution for %" PRIu32 " --> %" PRIu32 ", batch of %" PRIu32 ", ReLu: %d\n", inputSize, outputSize, batchSize, useRelu);
+		memset(outputSW, 0, currentOutputSize * sizeof(SW_FXP_t));
+		memset(outputHW, 0, currentOutputSize * sizeof(SW_FXP_t));
+
+		Dense_SW(input, outputSW, weights, biases, inputSize, outputSize, batchSize, useRelu);
+
+		bool resOK = false;
+		uint32_t cycles, memCycles, bytesRead, bytesWritten;
+		dense(reinterpret_cast<Beat_t*>(input), outputHW, reinterpret_cast<Beat_t*>(weights), biases, inputSize, outputSize, batchSize, useRelu, resOK,
+			cycles, memCycles, bytesRead, bytesWritten);
+		if (!resOK) {
+			  printf("\n\n====== ERROR: DENSE FUNCTION RETURNED NOT OK (resOK=false) ======\n\n");
+			  return false;
+		}
+		totalCycles += cycles;
+
+		// Every pass reads the inputs of its images, and every row of weights and its bias. Every output is
+		// written once.
+		uint32_t numPasses = (batchSize + parallelImages - 1) / parallelImages;
+		uint32_t expectedRead = (batchSize * inputSize + numPasses * outputSize * (inputSize + 1)) * sizeof(SW_FXP_t);
+		uint32_t expectedWritten = currentOutputSize * sizeof(SW_FXP_t);
+		printf("  Counters: %" PRIu32 " cycles, %" PRIu32 " waiting on memory (%0.1f %%), %" PRIu32 " B read, %" PRIu32 " B written\n",
+			cycles, memCycles, 100.0f * memCycles / cycles, bytesRead, bytesWritten);
+		if (bytesRead != expectedRead || bytesWritten != expectedWritten || memCycles == 0 || memCycles >= cycles) {
+			  printf("\n\n====== ERROR: WRONG COUNTERS (expected %" PRIu32 " B read, %" PRIu32 " B written) ======\n\n", expectedRead, expectedWritten);
+			  return false;
+		}
+
+		if (!CompareVectors(outputSW, outputHW, currentOutputSize)) {
+			  printf("\n\n====== ERROR COMPARING RESULTS WITH REFERENCE!!! ======\n\n");
+			  return false;
+		} else {
+			  printf("  --> OK!\n");
+		}
+	 }
+	}
+  }
+  return true;
+}
+
+// Checks that a kernel rejects a layer it cannot run.
+bool TestLimit(const char * name, TDenseFunction dense, uint32_t inputSize)
+{
+	bool resOK = true;
+	uint32_t cycles, memCycles, bytesRead, bytesWritten;
+	dense(reinterpret_cast<Beat_t*>(input), outputHW, reinterpret_cast<Beat_t*>(weights), biases, inputSize, 1, 1, false, resOK,
+		cycles, memCycles, bytesRead, bytesWritten);
+	printf("Kernel %s, %" PRIu32 " inputs: %s\n", name, inputSize, resOK ? "accepted" : "rejected");
+	if (resOK)
+		printf("\n\n====== ERROR: A LAYER BEYOND THE LIMITS WAS ACCEPTED ======\n\n");
+	return !resOK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+void PrintBudget(const char * name, uint32_t macs, uint32_t dspsPerMac, uint64_t cycles)
+{
+	uint32_t dsps = macs * dspsPerMac;
+	printf("%-13s %5" PRIu32 " %5" PRIu32 "%-9s %" PRIu64 "\n", name, macs, dsps, dsps > ZYNQ_DSPS ? " (over)" : "", cycles);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char ** argv)
+{
+  // The dense layers of the cats and dogs network, and an odd number of outputs.
+  uint32_t sizes[][2] = { {2304, 512}, {512, 1}, {64, 7} };
+  uint32_t numSizes = sizeof(sizes) / (sizeof(uint32_t) * 2);
+  // A single image, and batches that leave a last pass with fewer images than DENSE_PARALLEL_IMAGES.
+  uint32_t batches[] = { 1, 3, 5 };
+  uint32_t numBatches = sizeof(batches) / sizeof(uint32_t);
+  // Smaller, for the other instantiations.
+  uint32_t smallSizes[][2] = { {2304, 64}, {64, 7} };
+  uint32_t numSmallSizes = sizeof(smallSizes) / (sizeof(uint32_t) * 2);
+  uint32_t smallBatches[] = { 1, 11 };
+  uint32_t numSmallBatches = sizeof(smallBatches) / sizeof(uint32_t);
+
+  srand(time(NULL));
+  InitVectors();
+
+  // The capability registers of the top function.
+  bool resOK;
+  uint32_t cycles, memCycles, bytesRead, bytesWritten, capabilities, maxInputSize;
+  Dense(reinterpret_cast<Beat_t*>(input), reinterpret_cast<FXP_t*>(outputHW), reinterpret_cast<Beat_t*>(weights), reinterpret_cast<FXP_t*>(biases), AXI_BEAT_WORDS, 0, 0, false, resOK,
+	cycles, memCycles, bytesRead, bytesWritten, capabilities, maxInputSize);
+  printf("Capabilities: 0x%08" PRIX32 ", %" PRIu32 " values per input\n", capabilities, maxInputSize);
+  if ((capabilities & 0xff) != DENSE_PARALLEL_IMAGES || ((capabilities >> 8) & 0xff) != AXI_BEAT_WORDS ||
+      ((capabilities >> 16) & 0xff) != 32 || (capabilities >> 24) != FXP_NUM_DECIMALS || maxInputSize != DENSE_MAX_INPUT_SIZE) {
+	printf("\n\n====== ERROR: WRONG CAPABILITIES ======\n\n");
+	return 1;
+  }
+
+  uint64_t denseCycles, smallDenseCycles, serialCycles, wideCycles;
+  if (!TestKernel("Dense", RunDense, DENSE_PARALLEL_IMAGES, batches, numBatches, sizes, numSizes, denseCycles) ||
+      !TestKernel("Dense", RunDense, DENSE_PARALLEL_IMAGES, smallBatches, numSmallBatches, smallSizes, numSmallSizes, smallDenseCycles) ||
+      !TestKernel("Serial", RunKernel<KernelSerial>, 1, smallBatches, numSmallBatches, smallSizes, numSmallSizes, serialCycles) ||
+      !TestKernel("Wide", RunKernel<KernelWide>, 8, smallBatches, numSmallBatches, smallSizes, numSmallSizes, wideCycles))
+	return 1;
+
+  if (!TestLimit("Dense", RunDense, DENSE_MAX_INPUT_SIZE + AXI_BEAT_WORDS) || !TestLimit("Dense", RunDense, 63) ||
+      !TestLimit("Wide", RunKernel<KernelWide>, 2306) || !TestLimit("Serial", RunKernel<KernelSerial>, 0))
+	return 1;
+
+  // The configurations against the DSPs of the Zynq (on top of those of Conv), with the cycles of the same tests.
+  printf("\nConfiguration  MACs  DSPs (of %u)  Cycles of the smaller tests\n", ZYNQ_DSPS);
+  PrintBudget("Serial", KernelSerial::MACS, DSPS_PER_MAC_32, serialCycles);
+  PrintBudget("Dense", DenseKernel<DENSE_PARALLEL_IMAGES, DENSE_MAX_INPUT_SIZE>::MACS, DSPS_PER_MAC_32, smallDenseCycles);
+  PrintBudget("Wide", KernelWide::MACS, DSPS_PER_MAC_32, wideCycles);
+  printf("\n");
+
+  return 0;
+}
@@ -6,6 +6,7 @@
 #include <inttypes.h>
 
 #include "conv.h"
+#include "conv_kernel.h"
 
 #define MAX_WIDTH 128
 #define MAX_HEIGHT 128
@@ -14,20 +15,43 @@
 using SW_FXP_t = int32_t;
 using SW_FXP_MULT_t = int64_t;
 
-SW_FXP_t input[MAX_WIDTH * MAX_HEIGHT * MAX_CHANNELS];
+// One more value, to start the input at any position of a beat.
+SW_FXP_t input[MAX_WIDTH * MAX_HEIGHT * MAX_CHANNELS + AXI_BEAT_WORDS] __attribute__((aligned(AXI_BEAT_WORDS * sizeof(SW_FXP_t))));
 SW_FXP_t coeffs[MAX_CHANNELS * MAX_FILTERS * 9];
 SW_FXP_t biases[MAX_FILTERS];
 
+SW_FXP_t unpooledSW[MAX_WIDTH * MAX_HEIGHT * MAX_FILTERS];
 SW_FXP_t outputSW[MAX_WIDTH * MAX_HEIGHT * MAX_FILTERS];
 SW_FXP_t outputHW[MAX_WIDTH * MAX_HEIGHT * MAX_FILTERS];
 
+// Same for the 16-bit datapath, whose biases are 32-bit integers.
+using SW_FXP16_t = int16_t;
+const uint32_t FXP16_VALUES_PER_BEAT = AXI_BEAT_WORDS * 2;
+
+SW_FXP16_t input16[MAX_WIDTH * MAX_HEIGHT * MAX_CHANNELS + FXP16_VALUES_PER_BEAT] __attribute__((aligned(AXI_BEAT_WORDS * sizeof(SW_FXP_t))));
+SW_FXP16_t coeffs16[MAX_CHANNELS * MAX_FILTERS * 9];
+int32_t biases16[MAX_FILTERS];
+
+SW_FXP16_t unpooledSW16[MAX_WIDTH * MAX_HEIGHT * MAX_FILTERS];
+SW_FXP16_t outputSW16[MAX_WIDTH * MAX_HEIGHT * MAX_FILTERS];
+SW_FXP16_t outputHW16[MAX_WIDTH * MAX_HEIGHT * MAX_FILTERS];
+
+// Those of the top function, with the VALUE_BITS of conv.h.
+#if VALUE_BITS == 16
+using SW_Value_t = SW_FXP16_t;
+using SW_Bias_t = int32_t;
+#else
+using SW_Value_t = SW_FXP_t;
+using SW_Bias_t = SW_FXP_t;
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 
-inline SW_FXP_t FXP_Mult(SW_FXP_t a, SW_FXP_t b)
+inline SW_FXP_t FXP_Mult(SW_FXP_t a, SW_FXP_t b, uint32_t decimals = FXP_NUM_DECIMALS)
 {
   //return a*b;
   SW_FXP_MULT_t res = (SW_FXP_MULT_t)a * (SW_FXP_MULT_t)b;
-  res = res >> FXP_NUM_DECIMALS;
+  res = res >> decimals;
   return res;
 }
 
@@ -60,7 +84,7 @@ void AddBiases_SW(SW_FXP_t * input, SW_FXP_t * biases, uint32_t channels, uint32
 
 void Conv2D_SW(SW_FXP_t *input, SW_FXP_t * output, SW_FXP_t * filters,
       uint32_t numFilters, uint32_t numChannels,
-      uint32_t inputWidth, uint32_t inputHeight)
+      uint32_t inputWidth, uint32_t inputHeight, uint32_t decimals)
 {
   for (uint32_t iFilter = 0; iFilter < numFilters; ++ iFilter) {
     for (uint32_t y = 0; y < (inputHeight-2); ++y) {
@@ -74,7 +98,7 @@ void Conv2D_SW(SW_FXP_t *input, SW_FXP_t * output, SW_FXP_t * filters,
               SW_FXP_t v, f;
               f = *(filters + iFilter*numChannels*CONV_FILTER_HEIGHT*CONV_FILTER_WIDTH + iChannel*CONV_FILTER_HEIGHT*CONV_FILTER_WIDTH + cy*CONV_FILTER_WIDTH + cx);
               v = *(input + iChannel*inputWidth*inputHeight + (y+cy)*inputWidth + (x+cx));
-              acc += FXP_Mult(f, v);
+              acc += FXP_Mult(f, v, decimals);
             }
           }
         }
@@ -85,18 +109,92 @@ void Conv2D_SW(SW_FXP_t *input, SW_FXP_t * output, SW_FXP_t * filters,
   }
 }
 
+// Same as MaxPool() in SW_Accel/cnn.cpp: 2x2, dropping the last row and column of odd sizes.
+template<typename SW_Value>
+void MaxPool_SW(SW_Value * input, SW_Value * output, uint32_t channels, uint32_t width, uint32_t height)
+{
+  uint32_t outWidth, outHeight;
+  outWidth = ( (width % 2) == 0) ? width : width - 1;
+  outHeight = ( (height % 2) == 0) ? height : height - 1;
+
+  for (uint32_t iChannel = 0; iChannel < channels; ++ iChannel) {
+    SW_Value * p = input + iChannel*width*height;
+    for (uint32_t iRow = 0; iRow < outHeight; iRow += 2) {
+      for (uint32_t iCol = 0; iCol < outWidth; iCol += 2) {
+        SW_Value val;
+        val = * p;
+        if (*(p+1) > val) val = *(p+1);
+        if (*(p+width) > val) val = *(p+width);
+        if (*(p+width+1) > val) val = *(p+width+1);
+        *output = val;
+        ++ output;
+        p += 2;
+      }
+      p += width; // Skip one row that has already been processed
+      if (width != outWidth)
+        ++p; // Skip also the last column of the previous one
+    }
+  }
+}
+
 void Conv_SW(SW_FXP_t* input, SW_FXP_t* output, SW_FXP_t* filters, SW_FXP_t* biases,
       uint32_t numFilters, uint32_t numChannels,
-      uint32_t inputWidth, uint32_t inputHeight, bool useReLu)
+      uint32_t inputWidth, uint32_t inputHeight, bool useReLu, bool useMaxPool, uint32_t decimals)
 {
 	const int outputHeight = inputHeight - CONV_FILTER_HEIGHT + 1;
 	const int outputWidth = inputWidth - CONV_FILTER_WIDTH + 1;
+	SW_FXP_t * convOutput = useMaxPool ? unpooledSW : output;
 
-	Conv2D_SW(input, output, filters, numFilters, numChannels, inputWidth, inputHeight);
-	AddBiases_SW(output, biases, numFilters, outputWidth, outputHeight);
+	Conv2D_SW(input, convOutput, filters, numFilters, numChannels, inputWidth, inputHeight, decimals);
+	AddBiases_SW(convOutput, biases, numFilters, outputWidth, outputHeight);
 
 	if(useReLu) {
-		ReLU_SW(output, numFilters, outputWidth, outputHeight);
+		ReLU_SW(convOutput, numFilters, outputWidth, outputHeight);
+	}
+
+	if(useMaxPool) {
+		MaxPool_SW(convOutput, output, numFilters, outputWidth, outputHeight);
+	}
+}
+
+// The 16-bit datapath (Datapath<ap_int<W>> in conv_kernel.h): exact products, the bias with the decimals of the
+// products, and the sum shifted right by inputDecimals + weightDecimals - outputDecimals, rounded and saturated.
+void Conv_SW16(SW_FXP16_t* input, SW_FXP16_t* output, SW_FXP16_t* filters, int32_t* biases,
+      uint32_t numFilters, uint32_t numChannels,
+      uint32_t inputWidth, uint32_t inputHeight, bool useReLu, bool useMaxPool, uint32_t shift)
+{
+	const uint32_t outputHeight = inputHeight - CONV_FILTER_HEIGHT + 1;
+	const uint32_t outputWidth = inputWidth - CONV_FILTER_WIDTH + 1;
+	SW_FXP16_t * convOutput = useMaxPool ? unpooledSW16 : output;
+
+	for (uint32_t iFilter = 0; iFilter < numFilters; ++ iFilter) {
+		for (uint32_t y = 0; y < outputHeight; ++y) {
+			for (uint32_t x = 0; x < outputWidth; ++ x) {
+				int64_t acc = biases[iFilter];
+				for (uint32_t iChannel = 0; iChannel < numChannels; ++ iChannel) {
+					for (uint32_t cy = 0; cy < CONV_FILTER_HEIGHT; ++ cy) {
+						for (uint32_t cx = 0; cx < CONV_FILTER_WIDTH; ++cx) {
+							int32_t f = filters[((iFilter * numChannels + iChannel) * CONV_FILTER_HEIGHT + cy) * CONV_FILTER_WIDTH + cx];
+							int32_t v = input[(iChannel * inputHeight + y + cy) * inputWidth + x + cx];
+							acc += f * v;
+						}
+					}
+				}
+				if (shift > 0)
+					acc = (acc + ((int64_t)1 << (shift - 1))) >> shift;
+				if (acc > INT16_MAX)
+					acc = INT16_MAX;
+				if (acc < INT16_MIN)
+					acc = INT16_MIN;
+				if (useReLu && acc < 0)
+					acc = 0;
+				convOutput[(iFilter * outputHeight + y) * outputWidth + x] = acc;
+			}
+		}
+	}
+
+	if(useMaxPool) {
+		MaxPool_SW(convOutput, output, numFilters, outputWidth, outputHeight);
 	}
 }
 
@@ -111,8 +209,20 @@ void InitVectors(SW_FXP_t * input, uint32_t sizeInput, SW_FXP_t * coeffs, uint32
 	biases[ii] = rand();
 }
 
+// Values within 1/8 of the range, so that the tests saturate some outputs but not most of them.
+void InitVectors16()
+{
+  for (uint32_t ii = 0; ii < sizeof(input16) / sizeof(input16[0]); ++ ii)
+    input16[ii] = rand() % 8192 - 4096;
+  for (uint32_t ii = 0; ii < sizeof(coeffs16) / sizeof(coeffs16[0]); ++ ii)
+    coeffs16[ii] = rand() % 8192 - 4096;
+  for (uint32_t ii = 0; ii < MAX_FILTERS; ++ ii)
+	biases16[ii] = rand() % (1 << 28) - (1 << 27);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
-bool CompareVectors(SW_FXP_t * input1, SW_FXP_t * input2, uint32_t size)
+template<typename SW_Value>
+bool CompareVectors(SW_Value * input1, SW_Value * input2, uint32_t size)
 {
   bool res = true;
 
@@ -141,38 +251,109 @@ void PrintVector(uint16_t* v, uint32_t size) {
 }
 
 ///////////////////////////////////////////////////////////////////////////////
-int main(int argc, char ** argv)
+// Same interface as Conv(), for every instantiation of the kernel.
+// The decimals of the layer are only used by the 16-bit datapath.
+template<typename SW_Value, typename SW_Bias>
+using TConvFunction = void (*)(Beat_t* input, SW_Value* output, SW_Value* filters, SW_Bias* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool, bool& resultOk,
+		uint32_t& cycles, uint32_t& memCycles, uint32_t& bytesRead, uint32_t& bytesWritten, uint32_t inputSkip,
+		uint32_t inputDecimals, uint32_t weightDecimals, uint32_t outputDecimals);
+
+template<typename SW_Value, typename SW_Bias>
+void RunConv(Beat_t* input, SW_Value* output, SW_Value* filters, SW_Bias* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool, bool& resultOk,
+		uint32_t& cycles, uint32_t& memCycles, uint32_t& bytesRead, uint32_t& bytesWritten, uint32_t inputSkip,
+		uint32_t inputDecimals, uint32_t weightDecimals, uint32_t outputDecimals)
+{
+	uint32_t capabilities, maxChannels, maxRowBufferSize;
+	Conv(input, reinterpret_cast<Value_t*>(output), reinterpret_cast<Value_t*>(filters), reinterpret_cast<Bias_t*>(biases), numFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool, resultOk,
+		cycles, memCycles, bytesRead, bytesWritten, inputSkip, capabilities, maxChannels, maxRowBufferSize, inputDecimals, weightDecimals, outputDecimals);
+}
+
+template<typename Kernel, typename Fxp, typename SW_Value = SW_FXP_t, typename SW_Bias = SW_FXP_t>
+void RunKernel(Beat_t* input, SW_Value* output, SW_Value* filters, SW_Bias* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool, bool& resultOk,
+		uint32_t& cycles, uint32_t& memCycles, uint32_t& bytesRead, uint32_t& bytesWritten, uint32_t inputSkip,
+		uint32_t inputDecimals, uint32_t weightDecimals, uint32_t outputDecimals)
 {
-  uint32_t width = MAX_WIDTH, height = MAX_HEIGHT;
-//  uint32_t width = 4, height = 4;
+	Kernel::Run(input, reinterpret_cast<Fxp*>(output), reinterpret_cast<Fxp*>(filters), reinterpret_cast<typename Kernel::Bias*>(biases), numFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool, resultOk,
+		cycles, memCycles, bytesRead, bytesWritten, inputSkip, inputDecimals, weightDecimals, outputDecimals);
+}
+
+// Other instantiations of the kernel: no parallelism, more parallelism with smaller buffers, another precision, and
+// the 16-bit datapath with four times the MACs of the default 32-bit one.
+using KernelSerial = ConvKernel<FXP_t, 1, 1, MAX_ROW_BUFFER_SIZE, MAX_CHANNELS>;
+using KernelWide = ConvKernel<FXP_t, 4, 3, 2048, 64>;
+using FXP_Q16_t = ap_fixed<32, 16>;
+using KernelQ16 = ConvKernel<FXP_Q16_t, 2, 2, MAX_ROW_BUFFER_SIZE, MAX_CHANNELS>;
+using KernelFxp16 = ConvKernel<ap_int<16>, 4, 4, MAX_ROW_BUFFER_SIZE, MAX_CHANNELS>;
+
+// Budget of the xc7z020 of the Pynq-Z2, and DSP48E1 taken by a MAC of two 32-bit values (a 64-bit product) and of
+// two 16-bit values (a 32-bit product).
+#define ZYNQ_DSPS 220
+#define DSPS_PER_MAC_32 4
+#define DSPS_PER_MAC_16 1
+
+// Beats read for every pass over the input: those of every row, which starts inputSkip values into a beat.
+uint32_t InputBeats(uint32_t channels, uint32_t width, uint32_t height, uint32_t inputSkip, uint32_t valuesPerBeat)
+{
+	uint32_t inputBeats = 0;
+	for (uint32_t iRow = 0; iRow < channels * height; ++iRow) {
+		uint32_t first = inputSkip + iRow * width;
+		inputBeats += (first + width - 1) / valuesPerBeat - first / valuesPerBeat + 1;
+	}
+	return inputBeats;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Checks a kernel against the reference on every combination of ReLu, MaxPool, dims and sizes. Adds its cycles to
+// totalCycles. Returns false at the first mismatch.
+bool TestKernel(const char * name, TConvFunction<SW_FXP_t, SW_FXP_t> conv, uint32_t parallelFilters, uint32_t decimals,
+		uint32_t dims[][2], uint32_t numDims, uint32_t sizes[][2], uint32_t numSizes, uint64_t & totalCycles)
+{
+  uint32_t width, height;
   uint32_t channels, filters;
   uint32_t currentOutputSize;
-//  uint32_t sizes[][2] = { {3, 32}, {16, 16}, {32, 32}, {64, 64}, {128, 128}, {256, 256} };
-  uint32_t sizes[][2] = { {3, 32}, {16, 16}, {32, 32}};
-//  uint32_t sizes[][2] = { {2, 1} };
-
-  uint32_t numSizes = sizeof(sizes) / (sizeof(uint32_t) * 2);
 
-  srand(time(NULL));
-  InitVectors(input, MAX_WIDTH * MAX_HEIGHT * MAX_CHANNELS, coeffs, MAX_CHANNELS * MAX_FILTERS * 9, biases, MAX_FILTERS);
-  for (uint32_t iRelu = 0; iRelu <= 1; ++iRelu) {
+  totalCycles = 0;
+  printf("Kernel %s\n", name);
+  for (uint32_t iPool = 0; iPool <= 1; ++iPool) {
+   bool useMaxPool = iPool;
+   for (uint32_t iRelu = 0; iRelu <= 1; ++iRelu) {
 	  bool useRelu = iRelu;
-	  for (uint32_t iTest = 0; iTest < numSizes; ++ iTest) {
+	  for (uint32_t iDim = 0; iDim < numDims; ++ iDim) {
+	   width = dims[iDim][0]; height = dims[iDim][1];
+	   for (uint32_t iTest = 0; iTest < numSizes; ++ iTest) {
 		channels = sizes[iTest][0]; filters = sizes[iTest][1];
-		currentOutputSize = (width-2) * (height-2) * filters;
-		printf("Evaluating execution for %" PRIu32 " --> %" PRIu32 ", ReLu: %d\n", channels, filters, useRelu);
-		memset(outputSW, 0, currentOutputSize * sizeof(FXP_t));
-		memset(outputHW, 0, currentOutputSize * sizeof(FXP_t));
+		currentOutputSize = useMaxPool ? ((width-2) / 2) * ((height-2) / 2) * filters : (width-2) * (height-2) * filters;
+		printf("Evaluating execution for %" PRIu32 " --> %" PRIu32 ", %" PRIu32 "x%" PRIu32 ", ReLu: %d, MaxPool: %d\n", channels, filters, width, height, useRelu, useMaxPool);
+		memset(outputSW, 0, currentOutputSize * sizeof(SW_FXP_t));
+		memset(outputHW, 0, currentOutputSize * sizeof(SW_FXP_t));
 		printf("  SW\n");
 
-		Conv_SW(input, outputSW, coeffs, biases, filters, channels, width, height, useRelu);
+		// Every size starts the input at another position of a beat, as the driver does with any address.
+		uint32_t inputSkip = iTest % AXI_BEAT_WORDS;
+		Conv_SW(input + inputSkip, outputSW, coeffs, biases, filters, channels, width, height, useRelu, useMaxPool, decimals);
 
 		printf("  HW\n");
 		bool resOK = false;
-		Conv(reinterpret_cast<FXP_t*>(input), reinterpret_cast<FXP_t*>(outputHW), reinterpret_cast<FXP_t*>(coeffs), reinterpret_cast<FXP_t*>(biases), filters, channels, width, height, useRelu, resOK);
+		uint32_t cycles, memCycles, bytesRead, bytesWritten;
+		conv(reinterpret_cast<Beat_t*>(input), outputHW, coeffs, biases, filters, channels, width, height, useRelu, useMaxPool, resOK,
+			cycles, memCycles, bytesRead, bytesWritten, inputSkip, 0, 0, 0);
 		if (!resOK) {
 			  printf("\n\n====== ERROR: CONV FUNCTION RETURNED NOT OK (resOK=false) ======\n\n");
-			  return 1;
+			  return false;
+		}
+		totalCycles += cycles;
+
+		// Every pass reads the beats of every input row once, and every filter its coefficients and its bias. Every
+		// output is written once.
+		uint32_t numPasses = (filters + parallelFilters - 1) / parallelFilters;
+		uint32_t inputBeats = InputBeats(channels, width, height, inputSkip, AXI_BEAT_WORDS);
+		uint32_t expectedRead = numPasses * inputBeats * AXI_BEAT_WORDS * sizeof(SW_FXP_t) + filters * (channels * CONV_FILTER_HEIGHT * CONV_FILTER_WIDTH + 1) * sizeof(SW_FXP_t);
+		uint32_t expectedWritten = currentOutputSize * sizeof(SW_FXP_t);
+		printf("  Counters: %" PRIu32 " cycles, %" PRIu32 " waiting on memory (%0.1f %%), %" PRIu32 " B read, %" PRIu32 " B written\n",
+			cycles, memCycles, 100.0f * memCycles / cycles, bytesRead, bytesWritten);
+		if (bytesRead != expectedRead || bytesWritten != expectedWritten || memCycles == 0 || memCycles >= cycles) {
+			  printf("\n\n====== ERROR: WRONG COUNTERS (expected %" PRIu32 " B read, %" PRIu32 " B written) ======\n\n", expectedRead, expectedWritten);
+			  return false;
 		}
 
 		printf("SW output: ");
@@ -182,15 +363,182 @@ int main(int argc, char ** argv)
 
 		if (!CompareVectors(outputSW, outputHW, currentOutputSize)) {
 			  printf("\n\n====== ERROR COMPARING RESULTS WITH REFERENCE!!! ======\n\n");
-			  return 1;
+			  return false;
 		} else {
 			  printf("  --> OK!\n");
 		}
+	   }
 	  }
+   }
   }
-  printf("\n");
+  return true;
+}
 
-  return 0;
+///////////////////////////////////////////////////////////////////////////////
+// Same for the 16-bit datapath. Every size has other decimals, and so another shift of the sums.
+bool TestKernelFxp16(const char * name, TConvFunction<SW_FXP16_t, int32_t> conv, uint32_t parallelFilters,
+		uint32_t dims[][2], uint32_t numDims, uint32_t sizes[][2], uint32_t numSizes, uint64_t & totalCycles)
+{
+  const uint32_t inputDecimals = 12, weightDecimals = 14;
+
+  totalCycles = 0;
+  printf("Kernel %s\n", name);
+  for (uint32_t iPool = 0; iPool <= 1; ++iPool) {
+   bool useMaxPool = iPool;
+   for (uint32_t iRelu = 0; iRelu <= 1; ++iRelu) {
+	  bool useRelu = iRelu;
+	  for (uint32_t iDim = 0; iDim < numDims; ++ iDim) {
+	   uint32_t width = dims[iDim][0], height = dims[iDim][1];
+	   for (uint32_t iTest = 0; iTest < numSizes; ++ iTest) {
+		uint32_t channels = sizes[iTest][0], filters = sizes[iTest][1];
+		uint32_t outputDecimals = 14 - iTest;
+		uint32_t currentOutputSize = useMaxPool ? ((width-2) / 2) * ((height-2) / 2) * filters : (width-2) * (height-2) * filters;
+		printf("Evaluating execution for %" PRIu32 " --> %" PRIu32 ", %" PRIu32 "x%" PRIu32 ", ReLu: %d, MaxPool: %d, decimals %" PRIu32 "/%" PRIu32 "/%" PRIu32 "\n",
+			channels, filters, width, height, useRelu, useMaxPool, inputDecimals, weightDecimals, outputDecimals);
+		memset(outputSW16, 0, currentOutputSize * sizeof(SW_FXP16_t));
+		memset(outputHW16, 0, currentOutputSize * sizeof(SW_FXP16_t));
+
+		uint32_t inputSkip = iTest % FXP16_VALUES_PER_BEAT;
+		Conv_SW16(input16 + inputSkip, outputSW16, coeffs16, biases16, filters, channels, width, height, useRelu, useMaxPool,
+			inputDecimals + weightDecimals - outputDecimals);
+
+		bool resOK = false;
+		uint32_t cycles, memCycles, bytesRead, bytesWritten;
+		conv(reinterpret_cast<Beat_t*>(input16), outputHW16, coeffs16, biases16, filters, channels, width, height, useRelu, useMaxPool, resOK,
+			cycles, memCycles, bytesRead, bytesWritten, inputSkip, inputDecimals, weightDecimals, outputDecimals);
+		if (!resOK) {
+			  printf("\n\n====== ERROR: CONV FUNCTION RETURNED NOT OK (resOK=false) ======\n\n");
+			  return false;
+		}
+		totalCycles += cycles;
+
+		// Half the bytes of the 32-bit datapath, but for the biases.
+		uint32_t numPasses = (filters + parallelFilters - 1) / parallelFilters;
+		uint32_t inputBeats = InputBeats(channels, width, height, inputSkip, FXP16_VALUES_PER_BEAT);
+		uint32_t expectedRead = numPasses * inputBeats * AXI_BEAT_WORDS * sizeof(uint32_t) + filters * (channels * CONV_FILTER_HEIGHT * CONV_FILTER_WIDTH * sizeof(SW_FXP16_t) + sizeof(int32_t));
+		uint32_t expectedWritten = currentOutputSize * sizeof(SW_FXP16_t);
+		printf("  Counters: %" PRIu32 " cycles, %" PRIu32 " waiting on memory (%0.1f %%), %" PRIu32 " B read, %" PRIu32 " B written\n",
+			cycles, memCycles, 100.0f * memCycles / cycles, bytesRead, bytesWritten);
+		if (bytesRead != expectedRead || bytesWritten != expectedWritten || memCycles == 0 || memCycles >= cycles) {
+			  printf("\n\n====== ERROR: WRONG COUNTERS (expected %" PRIu32 " B read, %" PRIu32 " B written) ======\n\n", expectedRead, expectedWritten);
+			  return false;
+		}
+
+		if (!CompareVectors(outputSW16, outputHW16, currentOutputSize)) {
+			  printf("\n\n====== ERROR COMPARING RESULTS WITH REFERENCE!!! ======\n\n");
+			  return false;
+		} else {
+			  printf("  --> OK!\n");
+		}
+	   }
+	  }
+   }
+  }
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Buffers of the tests of each datapath.
+void TestBuffers(SW_FXP_t *& in, SW_FXP_t *& out, SW_FXP_t *& filters, SW_FXP_t *& bias)
+{
+	in = input; out = outputHW; filters = coeffs; bias = biases;
+}
+
+void TestBuffers(SW_FXP16_t *& in, SW_FXP16_t *& out, SW_FXP16_t *& filters, int32_t *& bias)
+{
+	in = input16; out = outputHW16; filters = coeffs16; bias = biases16;
+}
+
+// Checks that a kernel rejects a layer beyond its limits, or decimals it cannot shift to.
+template<typename SW_Value, typename SW_Bias>
+bool TestLimit(const char * name, TConvFunction<SW_Value, SW_Bias> conv, uint32_t channels, uint32_t width, uint32_t height,
+		uint32_t inputDecimals = 0, uint32_t weightDecimals = 0, uint32_t outputDecimals = 0)
+{
+	SW_Value * in, * out, * filters;
+	SW_Bias * bias;
+	TestBuffers(in, out, filters, bias);
+
+	bool resOK = true;
+	uint32_t cycles, memCycles, bytesRead, bytesWritten;
+	conv(reinterpret_cast<Beat_t*>(in), out, filters, bias, 1, channels, width, height, false, false, resOK,
+		cycles, memCycles, bytesRead, bytesWritten, 0, inputDecimals, weightDecimals, outputDecimals);
+	printf("Kernel %s, %" PRIu32 " channels of %" PRIu32 "x%" PRIu32 ", decimals %" PRIu32 "/%" PRIu32 "/%" PRIu32 ": %s\n",
+		name, channels, width, height, inputDecimals, weightDecimals, outputDecimals, resOK ? "accepted" : "rejected");
+	if (resOK)
+		printf("\n\n====== ERROR: A LAYER BEYOND THE LIMITS WAS ACCEPTED ======\n\n");
+	return !resOK;
 }
 
+///////////////////////////////////////////////////////////////////////////////
+void PrintBudget(const char * name, uint32_t macs, uint32_t dspsPerMac, uint64_t cycles)
+{
+	uint32_t dsps = macs * dspsPerMac;
+	printf("%-13s %5" PRIu32 " %5" PRIu32 "%-9s %" PRIu64 "\n", name, macs, dsps, dsps > ZYNQ_DSPS ? " (over)" : "", cycles);
+}
 
+///////////////////////////////////////////////////////////////////////////////
+int main(int argc, char ** argv)
+{
+  // Even and odd output sizes, for the cropping of the MaxPool.
+  uint32_t dims[][2] = { {MAX_WIDTH, MAX_HEIGHT}, {MAX_WIDTH - 1, MAX_HEIGHT - 3} };
+  uint32_t numDims = sizeof(dims) / (sizeof(uint32_t) * 2);
+  // Smaller, for the other instantiations (within the 2048-value row buffer of KernelWide).
+  uint32_t smallDims[][2] = { {60, 57} };
+  uint32_t numSmallDims = sizeof(smallDims) / (sizeof(uint32_t) * 2);
+//  uint32_t sizes[][2] = { {3, 32}, {16, 16}, {32, 32}, {64, 64}, {128, 128}, {256, 256} };
+  // 7 filters leave a last pass with fewer filters than NUM_PARALLEL_FILTERS.
+  uint32_t sizes[][2] = { {3, 32}, {16, 16}, {32, 32}, {8, 7}};
+//  uint32_t sizes[][2] = { {2, 1} };
+  uint32_t numSizes = sizeof(sizes) / (sizeof(uint32_t) * 2);
+
+  srand(time(NULL));
+  InitVectors(input, MAX_WIDTH * MAX_HEIGHT * MAX_CHANNELS, coeffs, MAX_CHANNELS * MAX_FILTERS * 9, biases, MAX_FILTERS);
+  InitVectors16();
+
+  // The capability registers of the top function.
+  SW_Value_t * in, * out, * filters;
+  SW_Bias_t * bias;
+  TestBuffers(in, out, filters, bias);
+  bool resOK;
+  uint32_t cycles, memCycles, bytesRead, bytesWritten, capabilities, maxChannels, maxRowBufferSize;
+  Conv(reinterpret_cast<Beat_t*>(in), reinterpret_cast<Value_t*>(out), reinterpret_cast<Value_t*>(filters), reinterpret_cast<Bias_t*>(bias), 0, 1, 3, 3, false, false, resOK,
+	cycles, memCycles, bytesRead, bytesWritten, 0, capabilities, maxChannels, maxRowBufferSize, 0, 0, 0);
+  printf("Capabilities: 0x%08" PRIX32 ", %" PRIu32 " channels, %" PRIu32 " values per row\n", capabilities, maxChannels, maxRowBufferSize);
+  if ((capabilities & 0xff) != NUM_PARALLEL_CHANNELS || ((capabilities >> 8) & 0xff) != NUM_PARALLEL_FILTERS ||
+      ((capabilities >> 16) & 0xff) != VALUE_BITS || (capabilities >> 24) != (VALUE_BITS == 16 ? 0 : FXP_NUM_DECIMALS) ||
+      maxChannels != MAX_CHANNELS || maxRowBufferSize != MAX_ROW_BUFFER_SIZE) {
+	printf("\n\n====== ERROR: WRONG CAPABILITIES ======\n\n");
+	return 1;
+  }
+
+  uint64_t convCycles, serialCycles, wideCycles, q16Cycles, fxp16Cycles;
+#if VALUE_BITS == 16
+  if (!TestKernelFxp16("Conv", RunConv<SW_FXP16_t, int32_t>, NUM_PARALLEL_FILTERS, dims, numDims, sizes, numSizes, convCycles))
+	return 1;
+#else
+  if (!TestKernel("Conv", RunConv<SW_FXP_t, SW_FXP_t>, NUM_PARALLEL_FILTERS, FXP_NUM_DECIMALS, dims, numDims, sizes, numSizes, convCycles))
+	return 1;
+#endif
+  if (!TestKernel("Serial", RunKernel<KernelSerial, FXP_t>, 1, FXP_NUM_DECIMALS, smallDims, numSmallDims, sizes, numSizes, serialCycles) ||
+      !TestKernel("Wide", RunKernel<KernelWide, FXP_t>, 3, FXP_NUM_DECIMALS, smallDims, numSmallDims, sizes, numSizes, wideCycles) ||
+      !TestKernel("Q16", RunKernel<KernelQ16, FXP_Q16_t>, 2, 16, smallDims, numSmallDims, sizes, numSizes, q16Cycles) ||
+      !TestKernelFxp16("Fxp16", RunKernel<KernelFxp16, ap_int<16>, SW_FXP16_t, int32_t>, 4, smallDims, numSmallDims, sizes, numSizes, fxp16Cycles))
+	return 1;
+
+  if (!TestLimit("Wide", RunKernel<KernelWide, FXP_t>, 65, 8, 8) || !TestLimit("Wide", RunKernel<KernelWide, FXP_t>, 32, 65, 8) ||
+      !TestLimit("Conv", RunConv<SW_Value_t, SW_Bias_t>, MAX_CHANNELS + 1, 8, 8) ||
+      !TestLimit("Conv", RunConv<SW_Value_t, SW_Bias_t>, 32, MAX_ROW_BUFFER_SIZE / 32 + 1, 8) ||
+      !TestLimit("Fxp16", RunKernel<KernelFxp16, ap_int<16>, SW_FXP16_t, int32_t>, 8, 8, 8, 4, 4, 9))
+	return 1;
+
+  // The configurations against the DSPs of the Zynq, with the cycles of the same tests (the decimals do not change
+  // the schedule, so Q16 stands for the default 32-bit configuration of Conv, and Fxp16 is the 16-bit one).
+  printf("\nConfiguration  MACs  DSPs (of %u)  Cycles of the %" PRIu32 "x%" PRIu32 " tests\n", ZYNQ_DSPS, smallDims[0][0], smallDims[0][1]);
+  PrintBudget("Serial", KernelSerial::MACS, DSPS_PER_MAC_32, serialCycles);
+  PrintBudget("Conv 32-bit", KernelQ16::MACS, DSPS_PER_MAC_32, q16Cycles);
+  PrintBudget("Wide", KernelWide::MACS, DSPS_PER_MAC_32, wideCycles);
+  PrintBudget("Conv 16-bit", KernelFxp16::MACS, DSPS_PER_MAC_16, fxp16Cycles);
+  printf("\n");
+
+  return 0;
+}
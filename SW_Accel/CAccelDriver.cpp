@@ -2,12 +2,16 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <map>
+#include <iterator>
 #include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
 #include "CAccelDriver.hpp"
+#ifdef HAVE_LIBCMA
 extern "C" {
 #include <libxlnk_cma.h>  // Required for memory-mapping functions from Xilinx
 }
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 //////////////////////////// CAccelDriver() ///////////////////////////////////
@@ -16,6 +20,12 @@ extern "C" {
 CAccelDriver::CAccelDriver(bool Logging)
   : driver(0), logging(Logging)
 {
+#ifdef HAVE_LIBCMA
+  hostMemory = false;
+#else
+  hostMemory = true;
+#endif
+
   if (logging)
     printf("CAccelDriver::CAccelDriver()\n");
 }
@@ -59,27 +69,79 @@ uint32_t CAccelDriver::Open(const char * driver_name, volatile void ** AccelRegs
   driver = open(driver_name, O_RDWR);
   if (driver == -1) {
     printf("ERR: cannot open driver %s\n", driver_name);
-    return false;
+    driver = 0;
+    return DEVICE_CALL_ERROR;
   }
 
   return OK;
 }
 
 
+///////////////////////////////////////////////////////////////////////////////
+/////////////////////////////// SetHostMemory() ///////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+void CAccelDriver::SetHostMemory(bool HostMemory)
+{
+  if (logging)
+    printf("CAccelDriver::SetHostMemory(HostMemory = %d)\n", HostMemory);
+
+#ifdef HAVE_LIBCMA
+  hostMemory = HostMemory;
+#else
+  if (!HostMemory)
+    printf("Warning: built without libcma, DMA-compatible memory is always allocated in host memory.\n");
+#endif
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////
 //////////////////////// AllocDMACompatible() /////////////////////////////////
 ///////////////////////////////////////////////////////////////////////////////
 
 void * CAccelDriver::AllocDMACompatible(uint32_t Size, uint32_t Cacheable)
 {
-  void * virtualAddr = NULL;
-  uint32_t physicalAddr = 0;
-
   if (logging)
     printf("CAccelDriver::AllocDMACompatible(Size = %u, Cacheable = %u)\n", Size, Cacheable);
 
+  if (arenaBase != NULL && Cacheable == 0 && arenaHostMemory == hostMemory) {
+    void * virtualAddr = ArenaAlloc(Size);
+    if (virtualAddr != NULL)
+      return virtualAddr;
+    if (logging)
+      printf("The DMA arena has no room for %u bytes, allocating them separately.\n", Size);
+  }
+
+  return InternalAlloc(Size, Cacheable);
+}
+
+// One block of memory, with a call to cma_alloc() or aligned_alloc().
+void * CAccelDriver::InternalAlloc(uint32_t Size, uint32_t Cacheable)
+{
+  void * virtualAddr = NULL;
+
+  if (hostMemory) {
+    // Round up to the alignment, as required by aligned_alloc().
+    uint32_t alignedSize = (Size + HOST_MEMORY_ALIGNMENT - 1) & ~(HOST_MEMORY_ALIGNMENT - 1);
+    virtualAddr = aligned_alloc(HOST_MEMORY_ALIGNMENT, alignedSize);
+    if (virtualAddr == NULL) {
+      if (logging)
+        printf("Error allocating host memory for %u bytes.\n", Size);
+      return NULL;
+    }
+    hostAllocations[(uintptr_t)virtualAddr] = Size;
+
+    if (logging)
+      printf("Host memory allocated - Virtual addr: %p\n", virtualAddr);
+
+    return virtualAddr;
+  }
+
+#ifdef HAVE_LIBCMA
+  uint32_t physicalAddr = 0;
+
   virtualAddr = cma_alloc(Size, Cacheable);
-  if ( (int32_t)virtualAddr == -1) {
+  if ( (intptr_t)virtualAddr == -1) {
     if (logging)
       printf("Error allocating DMA memory for %u bytes.\n", Size);
     return NULL;
@@ -88,16 +150,17 @@ void * CAccelDriver::AllocDMACompatible(uint32_t Size, uint32_t Cacheable)
   physicalAddr = cma_get_phy_addr(virtualAddr);
   if (physicalAddr == 0) {
     if (logging)
-      printf("Error obtaining physical addr for virtual address 0x%08X (%u).\n", (uint32_t)virtualAddr, (uint32_t)virtualAddr);
+      printf("Error obtaining physical addr for virtual address %p.\n", virtualAddr);
     cma_free(virtualAddr);
     return NULL;
   }
 
-  dmaMappings[(uint32_t)virtualAddr] = physicalAddr;
+  dmaMappings[(uintptr_t)virtualAddr] = {physicalAddr, Size};
 
   if (logging)
-    printf("DMA memory allocated - Virtual addr: 0x%08X (%u) // Physical addr: 0x%08X (%u)\n",
-            (uint32_t)virtualAddr, (uint32_t)virtualAddr, physicalAddr, physicalAddr);
+    printf("DMA memory allocated - Virtual addr: %p // Physical addr: 0x%08X (%u)\n",
+            virtualAddr, physicalAddr, physicalAddr);
+#endif
 
   return virtualAddr;
 }
@@ -110,16 +173,146 @@ void * CAccelDriver::AllocDMACompatible(uint32_t Size, uint32_t Cacheable)
 bool CAccelDriver::FreeDMACompatible(void * VirtAddr)
 {
   if (logging)
-    printf("CAccelDriver::FreeDMACompatible(Addr = 0x%08X)\n", (uint32_t)VirtAddr);
+    printf("CAccelDriver::FreeDMACompatible(Addr = %p)\n", VirtAddr);
 
-  if (logging) {
-    if (dmaMappings.count((uint32_t)VirtAddr) == 0)
-      printf("No virtual address 0x%08X present in the dictionary of mappings.\n", (uint32_t)VirtAddr);
+  // The region of the arena is also in the maps, but only its blocks can be freed by the application.
+  if ((uintptr_t)VirtAddr - (uintptr_t)arenaBase < arenaSize) {
+    if (ArenaFree(VirtAddr))
+      return true;
+    if (logging)
+      printf("No block at %p in the DMA arena.\n", VirtAddr);
+    return false;
   }
 
-  dmaMappings.erase((uint32_t)VirtAddr);
+  if (hostAllocations.count((uintptr_t)VirtAddr) == 0 && dmaMappings.count((uintptr_t)VirtAddr) == 0) {
+    if (logging)
+      printf("No virtual address %p present in the dictionary of mappings.\n", VirtAddr);
+    return false;
+  }
+
+  InternalFree(VirtAddr);
+  return true;
+}
+
+void CAccelDriver::InternalFree(void * VirtAddr)
+{
+  if (hostAllocations.count((uintptr_t)VirtAddr) != 0) {
+    hostAllocations.erase((uintptr_t)VirtAddr);
+    free(VirtAddr);
+    return;
+  }
+
+  dmaMappings.erase((uintptr_t)VirtAddr);
+#ifdef HAVE_LIBCMA
   cma_free(VirtAddr);
+#endif
+}
+
 
+///////////////////////////////////////////////////////////////////////////////
+/////////////////////////////// DMA arena /////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+
+bool CAccelDriver::CreateDMAArena(uint32_t Size)
+{
+  if (logging)
+    printf("CAccelDriver::CreateDMAArena(Size = %u)\n", Size);
+
+  if (arenaBase != NULL && !DestroyDMAArena())
+    return false;
+
+  Size &= ~(DMA_ARENA_ALIGNMENT - 1);
+  if (Size == 0)
+    return false;
+  arenaBase = (uint8_t *)InternalAlloc(Size, 0);
+  if (arenaBase == NULL) {
+    printf("Error reserving a DMA arena of %u bytes.\n", Size);
+    return false;
+  }
+
+  arenaSize = Size;
+  arenaHostMemory = hostMemory;
+  arenaPhysicalAddr = hostMemory ? 0 : dmaMappings[(uintptr_t)arenaBase].physicalAddr;
+  arenaFree.clear();
+  arenaBlocks.clear();
+  arenaFree[0] = Size;
+  arenaUsed = arenaPeak = 0;
+  return true;
+}
+
+bool CAccelDriver::DestroyDMAArena()
+{
+  if (logging)
+    printf("CAccelDriver::DestroyDMAArena()\n");
+
+  if (arenaBase == NULL)
+    return true;
+  if (!arenaBlocks.empty()) {
+    printf("The DMA arena still has %u blocks allocated.\n", (uint32_t)arenaBlocks.size());
+    return false;
+  }
+
+  InternalFree(arenaBase);
+  arenaBase = NULL;
+  arenaSize = 0;
+  arenaFree.clear();
+  return true;
+}
+
+void * CAccelDriver::ArenaAlloc(uint32_t Size)
+{
+  // Empty blocks also take some room, so that every block has its own address.
+  uint32_t alignedSize = (Size + DMA_ARENA_ALIGNMENT - 1) & ~(DMA_ARENA_ALIGNMENT - 1);
+  if (alignedSize == 0)
+    alignedSize = DMA_ARENA_ALIGNMENT;
+
+  // First fit. The free ranges are sorted by offset, and all the offsets and sizes are aligned.
+  for (auto it = arenaFree.begin(); it != arenaFree.end(); ++ it) {
+    if (it->second < alignedSize)
+      continue;
+
+    uint32_t offset = it->first;
+    uint32_t remaining = it->second - alignedSize;
+    arenaFree.erase(it);
+    if (remaining > 0)
+      arenaFree[offset + alignedSize] = remaining;
+    arenaBlocks[offset] = alignedSize;
+
+    arenaUsed += alignedSize;
+    if (arenaUsed > arenaPeak)
+      arenaPeak = arenaUsed;
+    if (logging)
+      printf("DMA arena block allocated - Virtual addr: %p // Offset: %u\n", arenaBase + offset, offset);
+    return arenaBase + offset;
+  }
+  return NULL;
+}
+
+bool CAccelDriver::ArenaFree(void * VirtAddr)
+{
+  uint32_t offset = (uint8_t *)VirtAddr - arenaBase;
+  auto block = arenaBlocks.find(offset);
+  if (block == arenaBlocks.end())
+    return false;
+
+  uint32_t size = block->second;
+  arenaBlocks.erase(block);
+  arenaUsed -= size;
+
+  // Merged with the free ranges around it, so that large blocks can be allocated again.
+  auto next = arenaFree.lower_bound(offset);
+  if (next != arenaFree.end() && next->first == offset + size) {
+    size += next->second;
+    next = arenaFree.erase(next);
+  }
+  if (next != arenaFree.begin()) {
+    auto prev = std::prev(next);
+    if (prev->first + prev->second == offset) {
+      prev->second += size;
+      return true;
+    }
+  }
+  arenaFree[offset] = size;
   return true;
 }
 
@@ -131,15 +324,23 @@ bool CAccelDriver::FreeDMACompatible(void * VirtAddr)
 uint32_t CAccelDriver::GetDMAPhysicalAddr(void * VirtAddr)
 {
   if (logging)
-    printf("CAccelDriver::GetDMAPhysicalAddr(Addr = 0x%08X)\n", (uint32_t)VirtAddr);
-
-  if (dmaMappings.count((uint32_t)VirtAddr) == 0) {
-    if (logging)
-      printf("No virtual address 0x%08X present in the dictionary of mappings.\n", (uint32_t)VirtAddr);
-    return 0;
+    printf("CAccelDriver::GetDMAPhysicalAddr(Addr = %p)\n", VirtAddr);
+
+  uintptr_t addr = (uintptr_t)VirtAddr;
+  if (addr - (uintptr_t)arenaBase < arenaSize)
+    return arenaHostMemory ? 0 : arenaPhysicalAddr + (uint32_t)(addr - (uintptr_t)arenaBase);
+
+  // The block that starts at or before the address, if the address is inside it.
+  auto it = dmaMappings.upper_bound(addr);
+  if (it != dmaMappings.begin()) {
+    -- it;
+    if (addr - it->first < it->second.size)
+      return it->second.physicalAddr + (uint32_t)(addr - it->first);
   }
-  
-  return dmaMappings[(uint32_t)VirtAddr];
+
+  if (logging)
+    printf("No virtual address %p present in the dictionary of mappings.\n", VirtAddr);
+  return 0;
 }
 
 
@@ -150,7 +351,8 @@ uint32_t CAccelDriver::GetDMAPhysicalAddr(void * VirtAddr)
 // Called by the destructor to free any dangling DMA allocations.
 void CAccelDriver::InternalEmptyDMAAllocs()
 {
-  uint32_t numMappings = dmaMappings.size();
+  // The region of the arena does not count, only the blocks allocated in it.
+  uint32_t numMappings = dmaMappings.size() + hostAllocations.size() + arenaBlocks.size() - (arenaBase != NULL ? 1 : 0);
 
   if (logging)
     printf("CAccelDriver::InternalEmptyDMAAllocs(DMA dict size = %u)\n", numMappings);
@@ -159,13 +361,23 @@ void CAccelDriver::InternalEmptyDMAAllocs()
     printf("DMA MEMORY WAS NOT CORRECTLY FREED. PERFORMING EMERGENCY RELEASE OF KERNEL DMA MEMORY IN DESTRUCTOR. PLEASE, FIX THIS ISSUE.\n");
 
   for (auto it = dmaMappings.begin(); it != dmaMappings.end(); ++ it) {
-    uint32_t virtAddr = it->first;
+    uintptr_t virtAddr = it->first;
     if (logging)
-      printf("Releasing DMA (virtual) pointer 0x%08X\n", virtAddr);
+      printf("Releasing DMA (virtual) pointer %p\n", (void*)virtAddr);
+#ifdef HAVE_LIBCMA
     cma_free((void*)virtAddr);
+#endif
   }
 
+  for (auto it = hostAllocations.begin(); it != hostAllocations.end(); ++ it)
+    free((void*)it->first);
+
   dmaMappings.clear();
+  hostAllocations.clear();
+  arenaBase = NULL;
+  arenaSize = 0;
+  arenaFree.clear();
+  arenaBlocks.clear();
 }
 
 
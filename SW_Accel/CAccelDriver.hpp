@@ -9,14 +9,42 @@
 //  This class takes care of the low-level configuration of addresses.
 // The class stores internally the address of the device registers in the application virtual space,
 // and a map of DMA-compatible memory allocations that relates virtual with physical addresses.
+//  When the application runs without the accelerator (CPU backends, or builds without libcma), the
+// DMA-compatible allocations are served from aligned host memory instead, so the same code path works.
+//  Optionally, one large region can be reserved with CreateDMAArena(). The allocations are then carved from it
+// instead of calling cma_alloc() every time, so they are cheap and do not fragment the CMA pool, and the physical
+// address of any pointer inside the region is found with an offset.
 
 class CAccelDriver {
   protected:
     int driver = 0;
     bool logging;
 
-    // Map of virtual addresses to physical addresses
-    std::map<uint32_t, uint32_t> dmaMappings;
+    // Serve AllocDMACompatible() from aligned host memory instead of the CMA pool.
+    bool hostMemory;
+
+    struct TDMABlock {
+      uint32_t physicalAddr;
+      uint32_t size;
+    };
+    // Map of virtual addresses to physical addresses (and sizes, to translate pointers inside the blocks)
+    std::map<uintptr_t, TDMABlock> dmaMappings;
+    // Map of virtual addresses to sizes of the blocks allocated in host memory (no physical address).
+    std::map<uintptr_t, uint32_t> hostAllocations;
+
+    // DMA arena. The free ranges and the allocated blocks are indexed by their offset in the region.
+    uint8_t * arenaBase = NULL;
+    uint32_t arenaSize = 0;
+    uint32_t arenaPhysicalAddr = 0;   // 0 in host memory
+    bool arenaHostMemory = false;
+    std::map<uint32_t, uint32_t> arenaFree;
+    std::map<uint32_t, uint32_t> arenaBlocks;
+    uint32_t arenaUsed = 0, arenaPeak = 0;
+    void * ArenaAlloc(uint32_t Size);
+    bool ArenaFree(void * VirtAddr);
+
+    void * InternalAlloc(uint32_t Size, uint32_t Cacheable);
+    void InternalFree(void * VirtAddr);
 
     // Called by the destructor to free any dangling DMA allocations.
     void InternalEmptyDMAAllocs();
@@ -25,19 +53,41 @@ class CAccelDriver {
     typedef enum {OK = 0, DEVICE_ALREADY_INITIALIZED = 1, DEVICE_NOT_INITIALIZED = 2, ERROR_MAPPING_BASE_ADDR = 3,
                 VIRT_ADDR_NOT_FOUND = 4, DEVICE_CALL_ERROR=5} TErrors;
 
+    // Alignment of the blocks allocated in host memory (a cache line, and enough for any SIMD load).
+    static const uint32_t HOST_MEMORY_ALIGNMENT = 64;
+    // Alignment of the blocks carved from the DMA arena.
+    static const uint32_t DMA_ARENA_ALIGNMENT = 64;
+
   public:
     CAccelDriver(bool Logging = false);
     virtual ~CAccelDriver();
 
     // Maps the address of the peripheral registers in the physical address space into the application virtual address space.
     uint32_t Open(const char * driver_name, volatile void ** AccelRegsPointer = NULL);
+    bool IsOpen() const { return driver != 0; }
+
+    // Selects where the following AllocDMACompatible() calls take their memory from. Blocks already allocated
+    // are not affected, and FreeDMACompatible() releases both kinds. Without libcma, host memory is always used.
+    void SetHostMemory(bool HostMemory);
+    bool UsesHostMemory() const { return hostMemory; }
+
+    // Reserves a region of Size bytes (in CMA or host memory, as selected with SetHostMemory()). The following
+    // non-cacheable AllocDMACompatible() calls are served from it while they fit, and from separate blocks otherwise.
+    bool CreateDMAArena(uint32_t Size);
+    // Releases the region. Fails if some of its blocks have not been freed.
+    bool DestroyDMAArena();
+    uint32_t DMAArenaSize() const { return arenaSize; }
+    uint32_t DMAArenaUsed() const { return arenaUsed; }
+    uint32_t DMAArenaPeak() const { return arenaPeak; }
 
     // Allocates a block of DMA-compatible memory and returns the corresponding address in this application virtual address space.
-    // The class keeps an internal map of virtual to physical addresses, so that derived classes can translate the virtual 
+    // The class keeps an internal map of virtual to physical addresses, so that derived classes can translate the virtual
     // addresses supplied by the applications.
     void * AllocDMACompatible(uint32_t Size, uint32_t Cacheable = 0);
-    bool FreeDMACompatible(void * VirtAddr);
+    virtual bool FreeDMACompatible(void * VirtAddr);
     // The application should never use the physical address. This is just for debugging purposes.
+    // Accepts any address inside a block, so that a slice of a buffer can be handed to the accelerator: O(1) in the
+    // DMA arena, a map lookup for the separate blocks. Returns 0 for blocks allocated in host memory.
     uint32_t GetDMAPhysicalAddr(void * VirtAddr);
 };
 
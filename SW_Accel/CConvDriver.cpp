@@ -7,49 +7,511 @@
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <errno.h>
 #include "CConvDriver.hpp"
+#include "model.h"
+#include "cnn.h"
+#include "gemm.h"
+#include "winograd.h"
 
-uint32_t CConvDriver::Conv(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu)
+static const char * BackendNames[CConvDriver::NUM_BACKENDS] = {"accel", "cpu-ref", "cpu-opt", "cpu-gemm", "cpu-winograd", "cpu-fxp16"};
+
+CConvDriver::CConvDriver(bool Logging, TBackend Backend)
+  : CAccelDriver(Logging)
+{
+  // The configuration of HLS/conv.h, until Open() reads the one of the bitstream.
+  accelCaps = {ACCEL_PARALLEL_CHANNELS, ACCEL_PARALLEL_FILTERS, 8 * sizeof(TFXP), DECIMALS, ACCEL_MAX_CHANNELS, ACCEL_MAX_ROW_BUFFER_SIZE};
+  SetBackend(Backend);
+}
+
+CConvDriver::~CConvDriver()
+{
+  FreeAllScratch();
+  while (!fxp16Layers.empty())
+    FreeFxp16Layer(fxp16Layers.begin()->first);
+}
+
+uint32_t CConvDriver::Open(const char * driver_name)
 {
-  uint32_t phyInput, phyOutput, phyFilters, phyBiases;
+  uint32_t result = CAccelDriver::Open(driver_name);
+  if (result != OK)
+    return result;
+
+  struct conv_caps caps = {0, 0, 0};
+  if (ioctl(driver, CONV_IOC_GET_CAPS, &caps) != 0 || caps.capabilities == 0) {
+    printf("Warning: the accelerator does not report its capabilities, assuming %u channels and %u values per row.\n",
+      accelCaps.maxChannels, accelCaps.maxRowBufferSize);
+    return OK;
+  }
+  accelCaps.parallelChannels = caps.capabilities & 0xff;
+  accelCaps.parallelFilters = (caps.capabilities >> 8) & 0xff;
+  accelCaps.valueBits = (caps.capabilities >> 16) & 0xff;
+  accelCaps.decimals = caps.capabilities >> 24;
+  accelCaps.maxChannels = caps.maxChannels;
+  accelCaps.maxRowBufferSize = caps.maxRowBufferSize;
+  if (logging)
+    printf("CConvDriver::Open(): %u channels x %u filters per cycle, %u-bit values with %u decimals, up to %u channels and %u values per row\n",
+      accelCaps.parallelChannels, accelCaps.parallelFilters, accelCaps.valueBits, accelCaps.decimals,
+      accelCaps.maxChannels, accelCaps.maxRowBufferSize);
+
+  // The 16-bit datapath takes the decimals of every layer (decimals = 0).
+  bool fxp32 = accelCaps.valueBits == 8 * sizeof(TFXP) && accelCaps.decimals == DECIMALS;
+  bool fxp16 = accelCaps.valueBits == 8 * sizeof(TFXP16) && accelCaps.decimals == 0;
+  if (!fxp32 && !fxp16) {
+    printf("Error: the accelerator computes with %u-bit values with %u decimals, and the model with %u-bit values with %u decimals"
+      " (or 16-bit values with per-layer decimals).\n", accelCaps.valueBits, accelCaps.decimals, (uint32_t)(8 * sizeof(TFXP)), DECIMALS);
+    close(driver);
+    driver = 0;
+    return DEVICE_CALL_ERROR;
+  }
+  // ConvAccelTiled() needs a row buffer that holds the width of a filter.
+  if (accelCaps.maxChannels == 0 || accelCaps.maxRowBufferSize < CONV_FILTER_WIDTH) {
+    printf("Error: the accelerator reports %u channels and %u values per row, too few for a %ux%u filter.\n",
+      accelCaps.maxChannels, accelCaps.maxRowBufferSize, CONV_FILTER_WIDTH, CONV_FILTER_HEIGHT);
+    close(driver);
+    driver = 0;
+    return DEVICE_CALL_ERROR;
+  }
+  return OK;
+}
+
+void CConvDriver::SetBackend(TBackend Backend)
+{
+  if (logging)
+    printf("CConvDriver::SetBackend(Backend = %s)\n", BackendName(Backend));
+
+  // The scratch buffers may come from the wrong kind of memory for the new backend.
+  FreeAllScratch();
+  backend = Backend;
+  SetHostMemory(backend != BACKEND_ACCEL);
+}
+
+void * CConvDriver::GetScratch(TScratch & Scratch, uint32_t Size)
+{
+  if (Scratch.size < Size) {
+    FreeScratch(Scratch);
+    Scratch.ptr = AllocDMACompatible(Size);
+    if (Scratch.ptr != NULL)
+      Scratch.size = Size;
+  }
+  return Scratch.ptr;
+}
+
+void CConvDriver::FreeScratch(TScratch & Scratch)
+{
+  if (Scratch.ptr != NULL)
+    CAccelDriver::FreeDMACompatible(Scratch.ptr);
+  Scratch.ptr = NULL;
+  Scratch.size = 0;
+}
+
+void CConvDriver::FreeAllScratch()
+{
+  FreeScratch(poolScratch);
+  FreeScratch(tileInput);
+  FreeScratch(tileOutput);
+  FreeScratch(zeroBiases);
+  FreeScratch(fxp16Input);
+  FreeScratch(fxp16Output);
+  while (!groupedFilters.empty())
+    FreeGroupedFilters(groupedFilters.begin()->first);
+}
+
+const char * CConvDriver::BackendName(TBackend Backend)
+{
+  return Backend < NUM_BACKENDS ? BackendNames[Backend] : "unknown";
+}
+
+bool CConvDriver::ParseBackend(const char * Name, TBackend & Backend)
+{
+  for (uint32_t ii = 0; ii < NUM_BACKENDS; ++ ii) {
+    if (strcmp(Name, BackendNames[ii]) == 0) {
+      Backend = (TBackend)ii;
+      return true;
+    }
+  }
+  return false;
+}
+
+void CConvDriver::PrepareFilters(void* filters, uint32_t numFilters, uint32_t numChannels)
+{
+  if (logging)
+    printf("CConvDriver::PrepareFilters(Filters=%p, NumFilters=%u, NumChannels=%u)\n", filters, numFilters, numChannels);
+
+  if (backend == BACKEND_CPU_WINOGRAD)
+    PrepareWinogradFilters(filters, numFilters, numChannels);
+}
+
+void CConvDriver::PrepareWinogradFilters(void* filters, uint32_t numFilters, uint32_t numChannels)
+{
+  std::vector<int32_t> & transformed = preparedFilters[(uintptr_t)filters];
+  transformed.resize(WinogradFiltersSize(numFilters, numChannels));
+  if (!WinogradTransformFilters((TFXP*)filters, numFilters, numChannels, transformed.data())) {
+    printf("Warning: filters at %p are too large for Winograd, using %s.\n", filters, BackendName(BACKEND_CPU_OPT));
+    transformed.clear();
+  }
+}
 
+bool CConvDriver::FreeDMACompatible(void * VirtAddr)
+{
+  preparedFilters.erase((uintptr_t)VirtAddr);
+  FreeGroupedFilters((uintptr_t)VirtAddr);
+  FreeFxp16Layer((uintptr_t)VirtAddr);
+  return CAccelDriver::FreeDMACompatible(VirtAddr);
+}
+
+bool CConvDriver::SetFxp16Quant(void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, const TFxp16Quant & quant)
+{
+  if (logging)
+    printf("CConvDriver::SetFxp16Quant(Filters=%p, NumFilters=%u, NumChannels=%u, Decimals=%u/%u/%u)\n", filters, numFilters,
+      numChannels, quant.inputDecimals, quant.weightDecimals, quant.outputDecimals);
+
+  if (quant.inputDecimals + quant.weightDecimals < quant.outputDecimals || quant.inputDecimals + quant.weightDecimals - quant.outputDecimals >= 32) {
+    printf("Error: a conv layer cannot go from %u + %u decimals to %u.\n", quant.inputDecimals, quant.weightDecimals, quant.outputDecimals);
+    return false;
+  }
+
+  FreeFxp16Layer((uintptr_t)filters);
+  TFxp16Layer layer;
+  layer.quant = quant;
+  layer.filters = (int16_t *)AllocDMACompatible(numFilters * numChannels * CONV_FILTER_HEIGHT * CONV_FILTER_WIDTH * sizeof(int16_t));
+  layer.biases = (int32_t *)AllocDMACompatible(numFilters * sizeof(int32_t));
+  if (layer.filters == NULL || layer.biases == NULL) {
+    printf("Error allocating the 16-bit filters of a conv layer.\n");
+    if (layer.filters != NULL)
+      CAccelDriver::FreeDMACompatible(layer.filters);
+    if (layer.biases != NULL)
+      CAccelDriver::FreeDMACompatible(layer.biases);
+    return false;
+  }
+  QuantizeConvFxp16((TFXP*)filters, (TFXP*)biases, numFilters, numChannels, quant, layer.filters, layer.biases);
+  fxp16Layers[(uintptr_t)filters] = layer;
+  return true;
+}
+
+void CConvDriver::FreeFxp16Layer(uintptr_t filters)
+{
+  auto it = fxp16Layers.find(filters);
+  if (it == fxp16Layers.end())
+    return;
+  CAccelDriver::FreeDMACompatible(it->second.filters);
+  CAccelDriver::FreeDMACompatible(it->second.biases);
+  fxp16Layers.erase(it);
+}
+
+uint32_t CConvDriver::Conv(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool)
+{
+  return ConvOn(backend, input, output, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool);
+}
+
+uint32_t CConvDriver::ConvOn(TBackend Backend, void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool, void* PoolScratch)
+{
   if (logging) {
-    printf("CConvDriver::Add(Input=0x%08X, Output=0x%08X, Filters=0x%08X, NumFilters=%u, NumChannels=%u, InputWidth=%u, InputHeight=%u)\n", 
-          (uint32_t)input, (uint32_t)output, (uint32_t)filters, numFilters, numChannels, inputWidth, inputHeight);
+    printf("CConvDriver::Conv(Backend=%s, Input=%p, Output=%p, Filters=%p, NumFilters=%u, NumChannels=%u, InputWidth=%u, InputHeight=%u, MaxPool=%d)\n",
+          BackendName(Backend), input, output, filters, numFilters, numChannels, inputWidth, inputHeight, performMaxPool);
   }
 
-  if (driver == 0) {
+  lastStats.clear();
+  if (UsesFxp16(Backend))
+    return ConvFxp16(Backend, input, output, filters, numFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool);
+
+  switch (Backend) {
+    case BACKEND_CPU_OPT:
+      return ConvCPUOpt(input, output, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool);
+    case BACKEND_CPU_WINOGRAD:
+      return ConvCPUWinograd(input, output, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool);
+    case BACKEND_ACCEL:
+      // The accelerator pools the layers that fit in it. The tiled ones are pooled below.
+      if (performMaxPool && FitsAccel(numChannels, inputWidth))
+        return RunAccel(input, output, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu, true);
+      break;
+    default:
+      break;
+  }
+
+  // The other backends write the un-pooled output to a scratch buffer and pool it from there.
+  void * convOutput = output;
+  uint32_t outputWidth = inputWidth - CONV_FILTER_WIDTH + 1;
+  uint32_t outputHeight = inputHeight - CONV_FILTER_HEIGHT + 1;
+
+  if (performMaxPool) {
+    convOutput = PoolScratch != NULL ? PoolScratch : GetScratch(poolScratch, numFilters * outputWidth * outputHeight * sizeof(TFXP));
+    if (convOutput == NULL) {
+      printf("Error allocating the MaxPool scratch buffer.\n");
+      return DEVICE_CALL_ERROR;
+    }
+  }
+
+  uint32_t result;
+  switch (Backend) {
+    case BACKEND_CPU_REF:
+      result = ConvCPURef(input, convOutput, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu);
+      break;
+    case BACKEND_CPU_GEMM:
+      result = ConvCPUGemm(input, convOutput, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu);
+      break;
+    default:
+      result = ConvAccel(input, convOutput, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu);
+      break;
+  }
+
+  if (performMaxPool && result == OK)
+    MaxPool((TFXP*)convOutput, (TFXP*)output, numFilters, outputWidth, outputHeight);
+
+  return result;
+}
+
+uint32_t CConvDriver::ConvCPURef(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu)
+{
+  uint32_t outputWidth = inputWidth - CONV_FILTER_WIDTH + 1;
+  uint32_t outputHeight = inputHeight - CONV_FILTER_HEIGHT + 1;
+
+  Conv2D((TFXP*)input, (TFXP*)output, (TFXP*)filters, numFilters, numChannels, inputWidth, inputHeight, CONV_FILTER_WIDTH, CONV_FILTER_HEIGHT);
+  AddBiases((TFXP*)output, (TFXP*)biases, numFilters, outputWidth, outputHeight);
+  if (performReLu)
+    ReLU((TFXP*)output, numFilters, outputWidth, outputHeight);
+
+  return OK;
+}
+
+uint32_t CConvDriver::ConvCPUOpt(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool)
+{
+  if (performMaxPool)
+    Conv2DBiasReLUMaxPool((TFXP*)input, (TFXP*)output, (TFXP*)filters, (TFXP*)biases, numFilters, numChannels, inputWidth, inputHeight, performReLu);
+  else
+    Conv2DBiasReLU((TFXP*)input, (TFXP*)output, (TFXP*)filters, (TFXP*)biases, numFilters, numChannels, inputWidth, inputHeight, performReLu);
+  return OK;
+}
+
+uint32_t CConvDriver::ConvCPUGemm(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu)
+{
+  Conv2DGemm((TFXP*)input, (TFXP*)output, (TFXP*)filters, (TFXP*)biases, numFilters, numChannels, inputWidth, inputHeight, performReLu);
+  return OK;
+}
+
+uint32_t CConvDriver::ConvCPUWinograd(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool)
+{
+  auto it = preparedFilters.find((uintptr_t)filters);
+  if (it == preparedFilters.end() || (!it->second.empty() && it->second.size() != WinogradFiltersSize(numFilters, numChannels))) {
+    PrepareWinogradFilters(filters, numFilters, numChannels);
+    it = preparedFilters.find((uintptr_t)filters);
+  }
+
+  if (it->second.empty())
+    return ConvCPUOpt(input, output, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool);
+
+  Conv2DWinograd((TFXP*)input, (TFXP*)output, it->second.data(), (TFXP*)biases, numFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool);
+  return OK;
+}
+
+// The layer is converted to 16 bits, run on the accelerator (or on the CPU reference if it does not fit in it) and
+// converted back.
+uint32_t CConvDriver::ConvFxp16(TBackend Backend, void* input, void* output, void* filters, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool)
+{
+  auto it = fxp16Layers.find((uintptr_t)filters);
+  if (it == fxp16Layers.end()) {
+    printf("Error: the filters at %p have not been quantized to 16 bits (SetFxp16Quant()).\n", filters);
+    return DEVICE_CALL_ERROR;
+  }
+  const TFxp16Layer & layer = it->second;
+
+  uint32_t outputWidth = inputWidth - CONV_FILTER_WIDTH + 1;
+  uint32_t outputHeight = inputHeight - CONV_FILTER_HEIGHT + 1;
+  if (performMaxPool) {
+    outputWidth /= 2;
+    outputHeight /= 2;
+  }
+  const uint32_t inputSize = numChannels * inputWidth * inputHeight;
+  const uint32_t outputSize = numFilters * outputWidth * outputHeight;
+  TFXP16 * in = (TFXP16 *)GetScratch(fxp16Input, inputSize * sizeof(TFXP16));
+  TFXP16 * out = (TFXP16 *)GetScratch(fxp16Output, outputSize * sizeof(TFXP16));
+  if (in == NULL || out == NULL) {
+    printf("Error allocating the 16-bit buffers of a conv layer.\n");
+    return DEVICE_CALL_ERROR;
+  }
+
+  ConvertFxpToFxp16((TFXP *)input, in, inputSize, layer.quant.inputDecimals);
+  if (Backend == BACKEND_ACCEL && FitsAccel(numChannels, inputWidth)) {
+    TConvDesc desc = {in, out, layer.filters, layer.biases, numFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool,
+      layer.quant.inputDecimals, layer.quant.weightDecimals, layer.quant.outputDecimals};
+    uint32_t result = SubmitAccelChain(&desc, 1);
+    if (result == OK)
+      result = WaitAccel();
+    if (result != OK)
+      return result;
+  } else {
+    Conv2DFxp16(in, out, layer.filters, layer.biases, numFilters, numChannels, inputWidth, inputHeight, layer.quant, performReLu, performMaxPool);
+  }
+  ConvertFxp16ToFxp(out, (TFXP *)output, outputSize, layer.quant.outputDecimals);
+  return OK;
+}
+
+uint32_t CConvDriver::ConvAccel(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu)
+{
+  if (FitsAccel(numChannels, inputWidth))
+    return RunAccel(input, output, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu);
+  return ConvAccelTiled(input, output, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu);
+}
+
+void * CConvDriver::GetGroupedFilters(void* filters, uint32_t numFilters, uint32_t numChannels, uint32_t groupSize)
+{
+  auto it = groupedFilters.find((uintptr_t)filters);
+  if (it != groupedFilters.end() && it->second.groupSize == groupSize)
+    return it->second.ptr;
+  FreeGroupedFilters((uintptr_t)filters);
+
+  const uint32_t filterSize = CONV_FILTER_HEIGHT * CONV_FILTER_WIDTH;
+  TFXP * grouped = (TFXP *)AllocDMACompatible(numFilters * numChannels * filterSize * sizeof(TFXP));
+  if (grouped == NULL)
+    return NULL;
+
+  TFXP * p = grouped;
+  for (uint32_t firstChannel = 0; firstChannel < numChannels; firstChannel += groupSize) {
+    uint32_t groupChannels = numChannels - firstChannel < groupSize ? numChannels - firstChannel : groupSize;
+    for (uint32_t iFilter = 0; iFilter < numFilters; ++ iFilter) {
+      memcpy(p, (TFXP *)filters + (iFilter * numChannels + firstChannel) * filterSize, groupChannels * filterSize * sizeof(TFXP));
+      p += groupChannels * filterSize;
+    }
+  }
+  groupedFilters[(uintptr_t)filters] = {grouped, groupSize};
+  return grouped;
+}
+
+void CConvDriver::FreeGroupedFilters(uintptr_t filters)
+{
+  auto it = groupedFilters.find(filters);
+  if (it == groupedFilters.end())
+    return;
+  CAccelDriver::FreeDMACompatible(it->second.ptr);
+  groupedFilters.erase(it);
+}
+
+// Splits a layer that does not fit in the accelerator:
+//  - In groups of up to accelCaps.maxChannels channels, of similar size. Each group is convolved with zero biases and
+//    without ReLU, and the partial sums are added on the CPU. The accumulators wrap around like the ones of the
+//    accelerator, so the result does not depend on the order of the additions.
+//  - In strips as wide as the row buffer allows for a group, overlapping by the 2 columns the 3x3 filters need.
+// The strips are packed in tileInput, because the accelerator computes the strides from the sizes it receives.
+// Every tile has its own place in tileInput and tileOutput, so that all of them run in a single chain.
+uint32_t CConvDriver::ConvAccelTiled(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu)
+{
+  const uint32_t halo = CONV_FILTER_WIDTH - 1;
+  const uint32_t outputWidth = inputWidth - CONV_FILTER_WIDTH + 1;
+  const uint32_t outputHeight = inputHeight - CONV_FILTER_HEIGHT + 1;
+
+  // A strip needs at least one output column, halo + 1 input columns of every channel of its group: the groups are
+  // smaller when the row buffer cannot hold them for maxChannels channels.
+  uint32_t maxGroupSize = accelCaps.maxRowBufferSize / (halo + 1);
+  if (maxGroupSize > accelCaps.maxChannels)
+    maxGroupSize = accelCaps.maxChannels;
+  uint32_t numGroups = (numChannels + maxGroupSize - 1) / maxGroupSize;
+  uint32_t groupSize = (numChannels + numGroups - 1) / numGroups;
+  uint32_t maxStripWidth = accelCaps.maxRowBufferSize / groupSize - halo;  // In output columns
+  uint32_t numStrips = (outputWidth + maxStripWidth - 1) / maxStripWidth;
+  uint32_t stripWidth = (outputWidth + numStrips - 1) / numStrips;
+  uint32_t numTiles = numStrips * numGroups;
+
+  if (logging)
+    printf("CConvDriver::ConvAccelTiled(%u channel groups of %u, %u strips of %u columns)\n", numGroups, groupSize, numStrips, stripWidth);
+  // A layer that needs more tiles than a chain runs on the CPU reference, with the same result.
+  if (numTiles > ACCEL_MAX_CHAIN) {
     if (logging)
-      printf("Error: Calling Conv() on a non-initialized accelerator.\n");
-    return DEVICE_NOT_INITIALIZED;
+      printf("CConvDriver::ConvAccelTiled(): %u tiles, more than a chain, on the CPU\n", numTiles);
+    return ConvCPURef(input, output, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu);
   }
 
-  // We need to obtain the physical addresses corresponding to each of the virtual addresses passed by the application.
-  // The accelerator uses only the physical addresses (and only contiguous memory).
-  phyInput = GetDMAPhysicalAddr(input);
-  if (phyInput == 0) {
-    printf("Error: No physical address found for virtual address 0x%08X\n", (uint32_t)input);
-    return VIRT_ADDR_NOT_FOUND;
+  // With a single strip, the channels of a group are contiguous in the input, and the output of the first group
+  // can go straight to the output.
+  const uint32_t tileInputSize = groupSize * inputHeight * (stripWidth + halo);
+  const uint32_t tileOutputSize = numFilters * outputHeight * stripWidth;
+  TFXP * groupFilters = numGroups > 1 ? (TFXP *)GetGroupedFilters(filters, numFilters, numChannels, groupSize) : (TFXP *)filters;
+  TFXP * stripInputs = numStrips > 1 ? (TFXP *)GetScratch(tileInput, numTiles * tileInputSize * sizeof(TFXP)) : NULL;
+  TFXP * stripOutputs = (TFXP *)GetScratch(tileOutput, numTiles * tileOutputSize * sizeof(TFXP));
+  TFXP * groupBiases = numGroups > 1 ? (TFXP *)GetScratch(zeroBiases, numFilters * sizeof(TFXP)) : (TFXP *)biases;
+  if (groupFilters == NULL || (numStrips > 1 && stripInputs == NULL) || stripOutputs == NULL || groupBiases == NULL) {
+    printf("Error allocating the tiles of a conv layer for the accelerator.\n");
+    return DEVICE_CALL_ERROR;
   }
-  phyOutput = GetDMAPhysicalAddr(output);
-  if (phyOutput == 0) {
-    printf("Error: No physical address found for virtual address 0x%08X\n", (uint32_t)output);
-    return VIRT_ADDR_NOT_FOUND;
+  if (numGroups > 1)
+    memset(groupBiases, 0, numFilters * sizeof(TFXP));
+
+  // Pack the strips and describe the tiles, strip by strip.
+  TFXP * in = (TFXP *)input;
+  TFXP * out = (TFXP *)output;
+  std::vector<TConvDesc> tiles;
+  for (uint32_t x0 = 0; x0 < outputWidth; x0 += stripWidth) {
+    uint32_t width = outputWidth - x0 < stripWidth ? outputWidth - x0 : stripWidth;
+
+    for (uint32_t firstChannel = 0; firstChannel < numChannels; firstChannel += groupSize) {
+      uint32_t groupChannels = numChannels - firstChannel < groupSize ? numChannels - firstChannel : groupSize;
+
+      TFXP * tileIn = in + firstChannel * inputWidth * inputHeight;
+      if (numStrips > 1) {
+        tileIn = stripInputs + tiles.size() * tileInputSize;
+        for (uint32_t iChannel = 0; iChannel < groupChannels; ++ iChannel) {
+          for (uint32_t y = 0; y < inputHeight; ++ y)
+            memcpy(tileIn + (iChannel * inputHeight + y) * (width + halo),
+              in + ((firstChannel + iChannel) * inputHeight + y) * inputWidth + x0, (width + halo) * sizeof(TFXP));
+        }
+      }
+
+      TFXP * tileOut = (numStrips == 1 && firstChannel == 0) ? out : stripOutputs + tiles.size() * tileOutputSize;
+      tiles.push_back({tileIn, tileOut, groupFilters + numFilters * firstChannel * CONV_FILTER_HEIGHT * CONV_FILTER_WIDTH,
+        groupBiases, numFilters, groupChannels, width + halo, inputHeight, performReLu && numGroups == 1, false});
+    }
   }
 
-  phyFilters = GetDMAPhysicalAddr(filters);
-  if (phyFilters == 0) {
-    printf("Error: No physical address found for virtual address 0x%08X\n", (uint32_t)phyFilters);
-    return VIRT_ADDR_NOT_FOUND;
+  uint32_t result = SubmitConvChain(tiles.data(), tiles.size());
+  if (result == OK)
+    result = WaitConv();
+  if (result != OK)
+    return result;
+
+  // The first group of a strip is copied to its place, and the others are added to it.
+  for (uint32_t iTile = 0; iTile < numTiles; ++ iTile) {
+    const TConvDesc & tile = tiles[iTile];
+    uint32_t x0 = (iTile / numGroups) * stripWidth;
+    uint32_t width = tile.inputWidth - halo;
+    if (tile.output == out)
+      continue;
+
+    for (uint32_t iFilter = 0; iFilter < numFilters; ++ iFilter) {
+      for (uint32_t y = 0; y < outputHeight; ++ y) {
+        TFXP * src = (TFXP *)tile.output + (iFilter * outputHeight + y) * width;
+        TFXP * dst = out + (iFilter * outputHeight + y) * outputWidth + x0;
+        if (iTile % numGroups == 0)
+          memcpy(dst, src, width * sizeof(TFXP));
+        else {
+          for (uint32_t x = 0; x < width; ++ x)
+            dst[x] = (uint32_t)dst[x] + (uint32_t)src[x];
+        }
+      }
+    }
   }
 
-  phyBiases = GetDMAPhysicalAddr(biases);
-  if (phyFilters == 0) {
-    printf("Error: No physical address found for virtual address 0x%08X\n", (uint32_t)phyFilters);
-    return VIRT_ADDR_NOT_FOUND;
+  // The partial sums are complete: add the biases and apply the ReLU, as the accelerator does.
+  if (numGroups > 1) {
+    for (uint32_t iFilter = 0; iFilter < numFilters; ++ iFilter) {
+      TFXP bias = ((TFXP *)biases)[iFilter];
+      TFXP * p = out + iFilter * outputHeight * outputWidth;
+      for (uint32_t ii = 0; ii < outputHeight * outputWidth; ++ ii) {
+        TFXP value = (uint32_t)p[ii] + (uint32_t)bias;
+        p[ii] = (performReLu && value < 0) ? 0 : value;
+      }
+    }
   }
+  return OK;
+}
 
-  uint32_t resultOK;
+uint32_t CConvDriver::SubmitAccelChain(const TConvDesc * chain, uint32_t chainLength)
+{
+  if (driver == 0) {
+    if (logging)
+      printf("Error: Calling Conv() on a non-initialized accelerator.\n");
+    return DEVICE_NOT_INITIALIZED;
+  }
 
   // struct user_message {  
   //   uint32_t input;
@@ -61,32 +523,117 @@ uint32_t CConvDriver::Conv(void* input, void* output, void* filters, void* biase
   //   uint32_t inputWidth;
   //   uint32_t inputHeight;
   //   uint32_t performReLu;
+  //   uint32_t performMaxPool;
   //   uint32_t resultOkPtr;
+  //   uint32_t inputDecimals;
+  //   uint32_t weightDecimals;
+  //   uint32_t outputDecimals;
   // };
-  struct user_message message = {
-    (uint32_t)phyInput, 
-    (uint32_t)phyOutput,
-    (uint32_t)phyFilters,
-    (uint32_t)phyBiases,
-    numFilters,
-    numChannels,
-    inputWidth,
-    inputHeight,
-    performReLu,
-    (uint32_t)(&resultOK)
-    };
+  // The driver returns the result of each convolution in the status array of the chain, so resultOkPtr is not used.
+  std::vector<struct user_message> messages(chainLength);
+  for (uint32_t ii = 0; ii < chainLength; ++ ii) {
+    const TConvDesc & desc = chain[ii];
+    void * addresses[4] = {desc.input, desc.output, desc.filters, desc.biases};
+    uint32_t physical[4];
+
+    // We need to obtain the physical addresses corresponding to each of the virtual addresses passed by the application.
+    // The accelerator uses only the physical addresses (and only contiguous memory).
+    for (uint32_t k = 0; k < 4; ++ k) {
+      physical[k] = GetDMAPhysicalAddr(addresses[k]);
+      if (physical[k] == 0) {
+        printf("Error: No physical address found for virtual address %p\n", addresses[k]);
+        return VIRT_ADDR_NOT_FOUND;
+      }
+    }
+    messages[ii] = {physical[0], physical[1], physical[2], physical[3], desc.numFilters, desc.numChannels,
+      desc.inputWidth, desc.inputHeight, desc.performReLu, desc.performMaxPool, 0, desc.inputDecimals, desc.weightDecimals,
+      desc.outputDecimals};
+  }
 
   if (logging)
-    printf("\nStarting accel...\n");
+    printf("\nStarting accel (%u convolutions)...\n", chainLength);
+
+  chainStatus.assign(chainLength, 0);
+  chainStats.assign(chainLength, {0, 0, 0, 0});
+  struct conv_chain request = {(uint32_t)(uintptr_t)messages.data(), chainLength, (uint32_t)(uintptr_t)chainStatus.data(),
+    (uint32_t)(uintptr_t)chainStats.data()};
+  if (ioctl(driver, CONV_IOC_SUBMIT_CHAIN, &request) != 0) {
+    printf("ERROR: Could not start the accelerator (%s)\n", strerror(errno));
+    return DEVICE_CALL_ERROR;
+  }
+  accelPending = true;
+  return OK;
+}
+
+uint32_t CConvDriver::WaitAccel()
+{
+  uint32_t resultOK = 0;
+
+  int32_t readBytes;
+  do {
+    readBytes = read(driver, (void *)&resultOK, sizeof(resultOK));
+  } while (readBytes < 0 && errno == EINTR);
+  accelPending = false;
+  if (readBytes != sizeof(resultOK)) {
+    printf("ERROR: Could not read the result of the accelerator (%d)\n", readBytes);
+    return DEVICE_CALL_ERROR;
+  }
 
-  int32_t readBytes = read(driver, (void *)&message, sizeof(message));
-  if (readBytes != 0)
-    printf("Warning! Read %d bytes instead than %d\n", readBytes, 0);
+  lastStats.resize(chainStats.size());
+  for (uint32_t ii = 0; ii < chainStats.size(); ++ ii)
+    lastStats[ii] = {chainStats[ii].cycles, chainStats[ii].memCycles, chainStats[ii].bytesRead, chainStats[ii].bytesWritten};
 
   if(!resultOK) {
-    printf("ERROR: Accelerator returned resultOK=false!\n");
+    uint32_t failed = 0;
+    while (failed + 1 < chainStatus.size() && chainStatus[failed])
+      ++ failed;
+    printf("ERROR: Accelerator returned resultOK=false (convolution %u of %u)!\n", failed, (uint32_t)chainStatus.size());
     return DEVICE_CALL_ERROR;
   }
 
   return OK;
-}
\ No newline at end of file
+}
+
+bool CConvDriver::AccelDone()
+{
+  struct pollfd request = {driver, POLLIN, 0};
+  return poll(&request, 1, 0) > 0 && (request.revents & POLLIN) != 0;
+}
+
+uint32_t CConvDriver::RunAccel(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool)
+{
+  TConvDesc desc = {input, output, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool};
+  uint32_t result = SubmitAccelChain(&desc, 1);
+  return result == OK ? WaitAccel() : result;
+}
+
+uint32_t CConvDriver::SubmitConv(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool)
+{
+  TConvDesc desc = {input, output, filters, biases, numFilters, numChannels, inputWidth, inputHeight, performReLu, performMaxPool};
+  return SubmitConvChain(&desc, 1);
+}
+
+uint32_t CConvDriver::SubmitConvChain(const TConvDesc * chain, uint32_t chainLength)
+{
+  if (logging)
+    printf("CConvDriver::SubmitConvChain(chainLength = %u)\n", chainLength);
+
+  bool fits = chainLength > 0 && chainLength <= ACCEL_MAX_CHAIN;
+  for (uint32_t ii = 0; ii < chainLength; ++ ii)
+    fits = fits && FitsAccel(chain[ii].numChannels, chain[ii].inputWidth);
+  if (accelPending || !fits || !SupportsConvChain()) {
+    printf("Error: SubmitConvChain() needs an idle 32-bit accelerator and layers that fit in it.\n");
+    return DEVICE_CALL_ERROR;
+  }
+  return SubmitAccelChain(chain, chainLength);
+}
+
+bool CConvDriver::ConvDone()
+{
+  return !accelPending || AccelDone();
+}
+
+uint32_t CConvDriver::WaitConv()
+{
+  return accelPending ? WaitAccel() : OK;
+}
@@ -2,10 +2,24 @@
 #define CVECTORADDER_HPP
 
 #include "CAccelDriver.hpp"
+#include <vector>
 
 #define CONV_FILTER_HEIGHT 3
 #define CONV_FILTER_WIDTH 3
 
+// Limits of the Conv accelerator (MAX_CHANNELS and MAX_ROW_BUFFER_SIZE in HLS/conv.h). Larger layers are tiled.
+// Open() reads the ones of the bitstream from its capability registers: these are the defaults, for a bitstream
+// without them.
+#define ACCEL_MAX_CHANNELS 256
+#define ACCEL_MAX_ROW_BUFFER_SIZE 4192
+#define ACCEL_PARALLEL_CHANNELS 2
+#define ACCEL_PARALLEL_FILTERS 2
+// Longest chain of convolutions accepted by the driver (CONV_MAX_CHAIN in driver/conv.c).
+#define ACCEL_MAX_CHAIN 1024
+#define CONV_IOC_MAGIC 'C'
+#define CONV_IOC_SUBMIT_CHAIN _IOW(CONV_IOC_MAGIC, 1, struct conv_chain)
+#define CONV_IOC_GET_CAPS _IOR(CONV_IOC_MAGIC, 3, struct conv_caps)
+
 class CConvDriver : public CAccelDriver {
   protected:
     // Structure used to pass commands between user-space and kernel-space.
@@ -19,21 +33,214 @@ class CConvDriver : public CAccelDriver {
       uint32_t inputWidth;
       uint32_t inputHeight;
       uint32_t performReLu;
+      uint32_t performMaxPool;
       uint32_t resultOkPtr;
+      uint32_t inputDecimals;
+      uint32_t weightDecimals;
+      uint32_t outputDecimals;
+    };
+    // Chain of user_message for ioctl(CONV_IOC_SUBMIT_CHAIN), started one after the other by the driver.
+    struct conv_chain {
+      uint32_t descriptors;
+      uint32_t numDescriptors;
+      uint32_t status;
+      uint32_t stats;
+    };
+    // Counters of the accelerator for one convolution of a chain.
+    struct conv_stats {
+      uint32_t cycles;
+      uint32_t memCycles;
+      uint32_t bytesRead;
+      uint32_t bytesWritten;
+    };
+    // Capability registers of the bitstream (HLS/conv.h), for ioctl(CONV_IOC_GET_CAPS). All zeros if it has none.
+    struct conv_caps {
+      uint32_t capabilities;
+      uint32_t maxChannels;
+      uint32_t maxRowBufferSize;
     };
 
   public:
-    CConvDriver(bool Logging = false)
-      : CAccelDriver(Logging) {}
+    // Where the convolutions are executed:
+    //  - BACKEND_ACCEL: the FPGA accelerator, through the /dev/conv driver. Requires Open() and CMA memory.
+    //  - BACKEND_CPU_REF: Conv2D() + AddBiases() + ReLU() from cnn.cpp, the reference implementation.
+    //  - BACKEND_CPU_OPT: optimized CPU kernels, bit-exact with the reference.
+    //  - BACKEND_CPU_GEMM: convolution lowered to a cache-blocked GEMM, bit-exact with the reference.
+    //  - BACKEND_CPU_WINOGRAD: Winograd F(2x2, 3x3), differs from the reference in the last bits of the FxP format.
+    //  - BACKEND_CPU_FXP16: Conv2DFxp16() from model.cpp, the reference of the 16-bit accelerator. Needs the
+    //    quantization of SetFxp16Quant().
+    typedef enum {BACKEND_ACCEL = 0, BACKEND_CPU_REF = 1, BACKEND_CPU_OPT = 2, BACKEND_CPU_GEMM = 3, BACKEND_CPU_WINOGRAD = 4,
+                BACKEND_CPU_FXP16 = 5, NUM_BACKENDS} TBackend;
+
+    // Decimals of a conv layer in the 16-bit format: of its input, of its filters and of its output. The biases have
+    // inputDecimals + weightDecimals, in 32 bits.
+    struct TFxp16Quant {
+      uint32_t inputDecimals, weightDecimals, outputDecimals;
+    };
+
+  protected:
+    TBackend backend;
+
+  public:
+    // One convolution of a chain (SubmitConvChain()), with the parameters of Conv().
+    struct TConvDesc {
+      void * input, * output, * filters, * biases;
+      uint32_t numFilters, numChannels, inputWidth, inputHeight;
+      bool performReLu, performMaxPool;
+      uint32_t inputDecimals, weightDecimals, outputDecimals;   // Only for the 16-bit accelerator
+    };
 
-    ~CConvDriver() {}
+    // Counters of the accelerator (HLS/conv.h): cycles, cycles waiting on the memory bus, and bytes transferred.
+    struct TAccelStats {
+      uint64_t cycles, memCycles, bytesRead, bytesWritten;
+    };
+
+    // Configuration of the bitstream (HLS/conv.h): channels and filters per cycle, format of the values, and limits
+    // of the layers it runs without tiling.
+    struct TAccelCaps {
+      uint32_t parallelChannels, parallelFilters;
+      uint32_t valueBits, decimals;
+      uint32_t maxChannels, maxRowBufferSize;
+    };
+
+  protected:
+    TAccelCaps accelCaps;
+
+    // Filters transformed by PrepareFilters(), indexed by the virtual address of the original filters.
+    // Empty if the layer cannot use the backend, which then falls back to BACKEND_CPU_OPT.
+    std::map<uintptr_t, std::vector<int32_t>> preparedFilters;
+
+    // Internal DMA-compatible buffers, grown on demand.
+    struct TScratch {
+      void * ptr = NULL;
+      uint32_t size = 0;
+    };
+    void * GetScratch(TScratch & Scratch, uint32_t Size);
+    void FreeScratch(TScratch & Scratch);
+    void FreeAllScratch();
+
+    // Un-pooled conv output, for the backends that cannot fuse the MaxPool.
+    TScratch poolScratch;
+    // Tiles of the layers that exceed the limits of the accelerator: input strip, output strip and zero biases.
+    TScratch tileInput, tileOutput, zeroBiases;
+    // Filters split in channel groups for the accelerator, indexed by the virtual address of the original filters:
+    // group g is [numFilters][groupChannels][3][3], at numFilters * firstChannel * 3*3. DMA-compatible.
+    struct TGroupedFilters {
+      void * ptr;
+      uint32_t groupSize;
+    };
+    std::map<uintptr_t, TGroupedFilters> groupedFilters;
+    void * GetGroupedFilters(void* filters, uint32_t numFilters, uint32_t numChannels, uint32_t groupSize);
+    void FreeGroupedFilters(uintptr_t filters);
 
+    void PrepareWinogradFilters(void* filters, uint32_t numFilters, uint32_t numChannels);
+
+    // 16-bit copies of the conv layers, indexed by the virtual address of the original filters. DMA-compatible.
+    // The layers convert their input and output around them, in the scratch buffers.
+    struct TFxp16Layer {
+      TFxp16Quant quant;
+      int16_t * filters;
+      int32_t * biases;
+    };
+    std::map<uintptr_t, TFxp16Layer> fxp16Layers;
+    TScratch fxp16Input, fxp16Output;
+    void FreeFxp16Layer(uintptr_t filters);
+
+    // One call to the accelerator, with a chain of convolutions: SubmitAccelChain() starts it and WaitAccel() collects
+    // its result. AccelDone() tells, without blocking, whether it has finished. Virtual so that a simulation of the
+    // device can stand in for them.
+    bool accelPending = false;
+    std::vector<uint32_t> chainStatus;   // resultOk of each convolution of the chain in flight
+    std::vector<struct conv_stats> chainStats;
+    std::vector<TAccelStats> lastStats;
+    virtual uint32_t SubmitAccelChain(const TConvDesc * chain, uint32_t chainLength);
+    virtual uint32_t WaitAccel();
+    virtual bool AccelDone();
+    uint32_t RunAccel(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool = false);
+    uint32_t ConvAccel(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu);
+    uint32_t ConvAccelTiled(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu);
+    uint32_t ConvCPURef(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu);
+    uint32_t ConvCPUOpt(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool);
+    uint32_t ConvCPUGemm(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu);
+    uint32_t ConvCPUWinograd(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool);
+    uint32_t ConvFxp16(TBackend Backend, void* input, void* output, void* filters, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool);
+
+  public:
+    CConvDriver(bool Logging = false, TBackend Backend = BACKEND_ACCEL);
+
+    ~CConvDriver();
+
+    // Opens the driver and reads the configuration of the bitstream. Fails if its values are neither in the TFXP
+    // format of model.h nor 16-bit with per-layer decimals.
+    uint32_t Open(const char * driver_name);
+    const TAccelCaps & AccelCaps() const { return accelCaps; }
+
+    // Must be called before allocating the buffers: the CPU backends use host memory for AllocDMACompatible().
+    void SetBackend(TBackend Backend);
+    TBackend GetBackend() const { return backend; }
+    // Only the accelerator backend needs the device driver to be open.
+    bool NeedsDevice() const { return backend == BACKEND_ACCEL; }
+    // Whether Conv(performMaxPool = true) is computed without writing the un-pooled output to memory.
+    // Otherwise the driver keeps an internal buffer for it.
+    bool SupportsFusedMaxPool() const { return FusesMaxPool(backend); }
+    static bool FusesMaxPool(TBackend Backend) { return Backend == BACKEND_CPU_OPT || Backend == BACKEND_CPU_WINOGRAD || Backend == BACKEND_CPU_FXP16; }
+    // Same for one layer: the accelerator pools the layers that it runs without tiling. On a 16-bit bitstream, the
+    // others run on BACKEND_CPU_FXP16.
+    bool FusesMaxPool(TBackend Backend, uint32_t numChannels, uint32_t inputWidth) const
+      { return Backend == BACKEND_ACCEL ? FitsAccel(numChannels, inputWidth) || accelCaps.valueBits == 16 : FusesMaxPool(Backend); }
+
+    // Whether the backend computes with the 16-bit values of SetFxp16Quant(): BACKEND_CPU_FXP16, and the accelerator
+    // with a 16-bit bitstream. Their input and output stay in TFXP, converted by the driver.
+    bool UsesFxp16(TBackend Backend) const { return Backend == BACKEND_CPU_FXP16 || (Backend == BACKEND_ACCEL && accelCaps.valueBits == 16); }
+    // The chains of SubmitConvChain() pass TFXP values to the accelerator, so they need a 32-bit bitstream.
+    bool SupportsConvChain() const { return !UsesFxp16(BACKEND_ACCEL); }
+    // Quantizes a conv layer to 16 bits (QuantizeConvFxp16() in model.h) for the backends that UsesFxp16(). Called
+    // once per layer when the model is loaded, usually through QuantizeModelFxp16(). Conv() then uses the copy of
+    // the filters and biases, until the filters are released with FreeDMACompatible().
+    bool SetFxp16Quant(void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, const TFxp16Quant & quant);
+
+    // Called once per conv layer when the model is loaded, so the backends that work on a transformed copy of the
+    // filters (Winograd) build it only once. Conv() prepares unknown filters on the fly. The copy is dropped when
+    // the filters are released with FreeDMACompatible().
+    void PrepareFilters(void* filters, uint32_t numFilters, uint32_t numChannels);
+    bool FreeDMACompatible(void * VirtAddr);
+
+    static const char * BackendName(TBackend Backend);
+    // Accepts the names returned by BackendName(). Returns false for unknown names.
+    static bool ParseBackend(const char * Name, TBackend & Backend);
 
     // The data must be organized as follows:
     // uint16_t input[NUM_CHANNELS][INPUT_HEIGHT][INPUT_WIDTH]
     // uint16_t output[NUM_FILTERS][OUTPUT_HEIGHT][OUTPUT_WIDTH]
     // uint16_t filters[NUM_FILTERS][NUM_CHANNELS][CONV_HEIGHT][CONV_WIDTH]
-    uint32_t Conv(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu);
+    // With performMaxPool, the output is followed by a 2x2 MaxPool (as MaxPool() in cnn.cpp, cropping odd sizes), and
+    // OUTPUT_HEIGHT and OUTPUT_WIDTH are halved.
+    uint32_t Conv(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool = false);
+    // Same, on another backend than the one selected with SetBackend(), e.g. to run some layers on the CPU.
+    // BACKEND_ACCEL needs the device and buffers allocated with the accelerator backend selected.
+    // PoolScratch receives the un-pooled output when the backend cannot fuse the MaxPool. NULL uses an internal buffer.
+    //  On the accelerator, the layers with more than AccelCaps().maxChannels channels or more than maxRowBufferSize
+    // values in a row of all the channels are split into width strips and channel groups, with the same result. The
+    // ones that would need more than ACCEL_MAX_CHAIN tiles run on the CPU reference.
+    uint32_t ConvOn(TBackend Backend, void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool = false, void* PoolScratch = NULL);
+
+    // Asynchronous convolutions on the accelerator, so that the CPU can work while it runs. Only for the layers that
+    // fit in it without tiling (FitsAccel()) on a bitstream that SupportsConvChain(), and one at a time: SubmitConv() starts it and returns,
+    // ConvDone() polls it and WaitConv() waits for it and returns its result. Conv() cannot be called in between.
+    // CompletionFd() can also be given to poll()/select(): POLLIN means that WaitConv() will not block.
+    bool FitsAccel(uint32_t numChannels, uint32_t inputWidth) const { return numChannels <= accelCaps.maxChannels && numChannels * inputWidth <= accelCaps.maxRowBufferSize; }
+    uint32_t SubmitConv(void* input, void* output, void* filters, void* biases, uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool = false);
+    // Same with up to ACCEL_MAX_CHAIN convolutions, which the driver starts one after the other without returning to
+    // user space (e.g. consecutive layers, whose input is the output of the previous one). The chain stops at the
+    // first one that fails, and WaitConv() reports it.
+    uint32_t SubmitConvChain(const TConvDesc * chain, uint32_t chainLength);
+    bool ConvPending() const { return accelPending; }
+    bool ConvDone();
+    uint32_t WaitConv();
+    int CompletionFd() const { return driver; }
+    // Counters of each convolution of the last chain collected by WaitConv(), or run by Conv()/ConvOn() on the
+    // accelerator (one per tile for the layers that are tiled). Empty after the CPU backends.
+    const std::vector<TAccelStats> & LastAccelStats() const { return lastStats; }
 };
 
 // ==============================================================
@@ -97,12 +304,63 @@ class CConvDriver : public CAccelDriver {
 //        bit 0  - performReLu[0] (Read/Write)
 //        others - reserved
 // 0x64 : reserved
-// 0x68 : Data signal of resultOk
+// 0x68 : Data signal of performMaxPool
+//        bit 0  - performMaxPool[0] (Read/Write)
+//        others - reserved
+// 0x6c : reserved
+// 0x70 : Data signal of resultOk
 //        bit 0  - resultOk[0] (Read)
 //        others - reserved
-// 0x6c : Control signal of resultOk
+// 0x74 : Control signal of resultOk
 //        bit 0  - resultOk_ap_vld (Read/COR)
 //        others - reserved
+// 0x78 : Data signal of cycles
+//        bit 31~0 - cycles[31:0] (Read)
+// 0x7c : Control signal of cycles
+//        bit 0  - cycles_ap_vld (Read/COR)
+//        others - reserved
+// 0x80 : Data signal of memCycles
+//        bit 31~0 - memCycles[31:0] (Read)
+// 0x84 : Control signal of memCycles
+//        bit 0  - memCycles_ap_vld (Read/COR)
+//        others - reserved
+// 0x88 : Data signal of bytesRead
+//        bit 31~0 - bytesRead[31:0] (Read)
+// 0x8c : Control signal of bytesRead
+//        bit 0  - bytesRead_ap_vld (Read/COR)
+//        others - reserved
+// 0x90 : Data signal of bytesWritten
+//        bit 31~0 - bytesWritten[31:0] (Read)
+// 0x94 : Control signal of bytesWritten
+//        bit 0  - bytesWritten_ap_vld (Read/COR)
+//        others - reserved
+// 0x98 : Data signal of inputSkip
+//        bit 31~0 - inputSkip[31:0] (Read/Write)
+// 0x9c : reserved
+// 0xa0 : Data signal of capabilities
+//        bit 31~0 - capabilities[31:0] (Read)
+// 0xa4 : Control signal of capabilities
+//        bit 0  - capabilities_ap_vld (Read/COR)
+//        others - reserved
+// 0xa8 : Data signal of maxChannels
+//        bit 31~0 - maxChannels[31:0] (Read)
+// 0xac : Control signal of maxChannels
+//        bit 0  - maxChannels_ap_vld (Read/COR)
+//        others - reserved
+// 0xb0 : Data signal of maxRowBufferSize
+//        bit 31~0 - maxRowBufferSize[31:0] (Read)
+// 0xb4 : Control signal of maxRowBufferSize
+//        bit 0  - maxRowBufferSize_ap_vld (Read/COR)
+//        others - reserved
+// 0xb8 : Data signal of inputDecimals
+//        bit 31~0 - inputDecimals[31:0] (Read/Write)
+// 0xbc : reserved
+// 0xc0 : Data signal of weightDecimals
+//        bit 31~0 - weightDecimals[31:0] (Read/Write)
+// 0xc4 : reserved
+// 0xc8 : Data signal of outputDecimals
+//        bit 31~0 - outputDecimals[31:0] (Read/Write)
+// 0xcc : reserved
 // (SC = Self Clear, COR = Clear on Read, TOW = Toggle on Write, COH = Clear on Handshake)
 
 
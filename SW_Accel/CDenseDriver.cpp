@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include "CDenseDriver.hpp"
+#include "cnn.h"
+
+CDenseDriver::CDenseDriver(CAccelDriver & Memory, bool Logging)
+  : CAccelDriver(Logging), memory(Memory)
+{
+  // The configuration of HLS/dense.h, until Open() reads the one of the bitstream.
+  accelCaps = {DENSE_ACCEL_PARALLEL_IMAGES, DENSE_ACCEL_VALUES_PER_BEAT, 8 * sizeof(TFXP), DECIMALS, DENSE_ACCEL_MAX_INPUT_SIZE};
+}
+
+uint32_t CDenseDriver::Open(const char * driver_name)
+{
+  uint32_t result = CAccelDriver::Open(driver_name);
+  if (result != OK)
+    return result;
+
+  struct dense_caps caps = {0, 0};
+  if (ioctl(driver, DENSE_IOC_GET_CAPS, &caps) != 0 || caps.capabilities == 0) {
+    printf("Warning: the dense accelerator does not report its capabilities, assuming %u inputs.\n", accelCaps.maxInputSize);
+    return OK;
+  }
+  accelCaps.parallelImages = caps.capabilities & 0xff;
+  accelCaps.valuesPerBeat = (caps.capabilities >> 8) & 0xff;
+  accelCaps.valueBits = (caps.capabilities >> 16) & 0xff;
+  accelCaps.decimals = caps.capabilities >> 24;
+  accelCaps.maxInputSize = caps.maxInputSize;
+  if (logging)
+    printf("CDenseDriver::Open(): %u images x %u values per cycle, %u-bit values with %u decimals, up to %u inputs\n",
+      accelCaps.parallelImages, accelCaps.valuesPerBeat, accelCaps.valueBits, accelCaps.decimals, accelCaps.maxInputSize);
+
+  if (accelCaps.valueBits != 8 * sizeof(TFXP) || accelCaps.decimals != DECIMALS || accelCaps.valuesPerBeat == 0 || accelCaps.maxInputSize == 0) {
+    printf("Error: the dense accelerator computes with %u-bit values with %u decimals, and the model with %u-bit values with %u decimals.\n",
+      accelCaps.valueBits, accelCaps.decimals, (uint32_t)(8 * sizeof(TFXP)), DECIMALS);
+    close(driver);
+    driver = 0;
+    return DEVICE_CALL_ERROR;
+  }
+  return OK;
+}
+
+uint32_t CDenseDriver::Dense(TFXP * input, TFXP * output, TFXP * weights, TFXP * biases, uint32_t inputSize, uint32_t outputSize, uint32_t batchSize, bool performReLu)
+{
+  lastStats.clear();
+
+  // The accelerator reads the input and the weights in beats, so they have to start at one. A buffer outside the
+  // CMA memory has no physical address. A layer that the accelerator fails runs again on the CPU.
+  const uint32_t beatBytes = accelCaps.valuesPerBeat * sizeof(TFXP);
+  if (driver != 0 && FitsAccel(inputSize)) {
+    uint32_t physical[4] = {memory.GetDMAPhysicalAddr(input), memory.GetDMAPhysicalAddr(output),
+      memory.GetDMAPhysicalAddr(weights), memory.GetDMAPhysicalAddr(biases)};
+    if (physical[0] != 0 && physical[1] != 0 && physical[2] != 0 && physical[3] != 0 &&
+        physical[0] % beatBytes == 0 && physical[2] % beatBytes == 0 &&
+        DenseAccel(physical[0], physical[1], physical[2], physical[3], inputSize, outputSize, batchSize, performReLu) == OK)
+      return OK;
+  }
+
+  if (logging)
+    printf("CDenseDriver::Dense(): %u --> %u on the CPU\n", inputSize, outputSize);
+  DenseBatch(input, output, batchSize, inputSize, outputSize, weights, biases);
+  if (performReLu)
+    ReLU(output, batchSize * outputSize, 1, 1);
+  return OK;
+}
+
+uint32_t CDenseDriver::DenseAccel(uint32_t input, uint32_t output, uint32_t weights, uint32_t biases, uint32_t inputSize, uint32_t outputSize, uint32_t batchSize, bool performReLu)
+{
+  struct dense_message message = {input, output, weights, biases, inputSize, outputSize, batchSize, performReLu, 0, 0, 0, 0, 0};
+
+  if (logging)
+    printf("\nStarting dense accel (%u --> %u, batch of %u)...\n", inputSize, outputSize, batchSize);
+
+  int result;
+  do {
+    result = ioctl(driver, DENSE_IOC_RUN, &message);
+  } while (result != 0 && errno == EINTR);
+  // The driver fails with EIO when the accelerator rejects the layer.
+  if (result != 0 && errno != EIO) {
+    printf("Warning: the dense accelerator could not be called (%s), running the layer on the CPU\n", strerror(errno));
+    return DEVICE_CALL_ERROR;
+  }
+  if (result != 0 || !message.resultOk) {
+    printf("Warning: the dense accelerator rejected the layer (%u --> %u), running it on the CPU\n", inputSize, outputSize);
+    return DEVICE_CALL_ERROR;
+  }
+
+  lastStats.push_back({message.cycles, message.memCycles, message.bytesRead, message.bytesWritten});
+  return OK;
+}
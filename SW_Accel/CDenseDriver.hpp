@@ -0,0 +1,85 @@
+#ifndef CDENSEDRIVER_HPP
+#define CDENSEDRIVER_HPP
+
+#include <stdint.h>
+#include <vector>
+#include "CAccelDriver.hpp"
+#include "CConvDriver.hpp"
+#include "model.h"
+
+// Limits of the Dense accelerator (HLS/dense.h). Open() reads the ones of the bitstream from its capability
+// registers: these are the defaults, for a bitstream without them.
+#define DENSE_ACCEL_MAX_INPUT_SIZE 4096
+#define DENSE_ACCEL_PARALLEL_IMAGES 4
+#define DENSE_ACCEL_VALUES_PER_BEAT 2
+#define DENSE_IOC_MAGIC 'D'
+#define DENSE_IOC_RUN _IOWR(DENSE_IOC_MAGIC, 1, struct dense_message)
+#define DENSE_IOC_GET_CAPS _IOR(DENSE_IOC_MAGIC, 2, struct dense_caps)
+
+//  Runs the dense layers on the Dense accelerator, through the /dev/dense driver (driver/dense.c). The buffers are
+// not allocated by this driver but by another one (the convolver, which owns the CMA memory), whose mappings
+// translate their addresses.
+//  The layers that the accelerator cannot take (see FitsAccel()) or fails, the buffers outside CMA memory, and
+// every layer while the device is not open, run on the CPU with DenseBatch(), with the same result.
+
+class CDenseDriver : public CAccelDriver {
+  protected:
+    // Structures of the ioctl() calls (see driver/dense.c).
+    struct dense_message {
+      uint32_t input;
+      uint32_t output;
+      uint32_t weights;
+      uint32_t biases;
+      uint32_t inputSize;
+      uint32_t outputSize;
+      uint32_t batchSize;
+      uint32_t performReLu;
+      uint32_t resultOk;
+      uint32_t cycles;
+      uint32_t memCycles;
+      uint32_t bytesRead;
+      uint32_t bytesWritten;
+    };
+    struct dense_caps {
+      uint32_t capabilities;
+      uint32_t maxInputSize;
+    };
+
+  public:
+    // Configuration of the bitstream (HLS/dense.h): images per pass over the weights, values per beat, format of the
+    // values and largest input.
+    struct TAccelCaps {
+      uint32_t parallelImages, valuesPerBeat;
+      uint32_t valueBits, decimals;
+      uint32_t maxInputSize;
+    };
+
+  protected:
+    CAccelDriver & memory;
+    TAccelCaps accelCaps;
+    std::vector<CConvDriver::TAccelStats> lastStats;
+
+    // One layer on the accelerator, at physical addresses. Virtual so that a simulation of the device can stand in.
+    virtual uint32_t DenseAccel(uint32_t input, uint32_t output, uint32_t weights, uint32_t biases, uint32_t inputSize, uint32_t outputSize, uint32_t batchSize, bool performReLu);
+
+  public:
+    // Memory is the driver that allocates the buffers given to Dense().
+    CDenseDriver(CAccelDriver & Memory, bool Logging = false);
+
+    // Opens the driver and reads the configuration of the bitstream. Fails if its values are not in the TFXP format
+    // of model.h.
+    uint32_t Open(const char * driver_name);
+    const TAccelCaps & AccelCaps() const { return accelCaps; }
+
+    // Whether the accelerator takes a layer with inputSize inputs: whole beats, within its input cache.
+    bool FitsAccel(uint32_t inputSize) const
+      { return inputSize > 0 && inputSize <= accelCaps.maxInputSize && inputSize % accelCaps.valuesPerBeat == 0; }
+
+    // DenseBatch() of cnn.h, followed by ReLU() with performReLu:
+    // input[batchSize][inputSize], weights[outputSize][inputSize], biases[outputSize] --> output[batchSize][outputSize].
+    uint32_t Dense(TFXP * input, TFXP * output, TFXP * weights, TFXP * biases, uint32_t inputSize, uint32_t outputSize, uint32_t batchSize, bool performReLu);
+    // Counters of the last Dense() that ran on the accelerator. Empty if it ran on the CPU.
+    const std::vector<CConvDriver::TAccelStats> & LastAccelStats() const { return lastStats; }
+};
+
+#endif  // CDENSEDRIVER_HPP
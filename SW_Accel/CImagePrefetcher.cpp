@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "CImagePrefetcher.hpp"
+
+CImagePrefetcher::CImagePrefetcher(const std::vector<std::string> & Images, const std::vector<TFXP *> & Buffers, uint32_t ImageSize)
+  : images(Images), imageSize(ImageSize), rgb(ImageSize), freeBuffers(Buffers), numReturned(0), stopping(false)
+{
+  producer = std::thread(&CImagePrefetcher::ProducerLoop, this);
+}
+
+CImagePrefetcher::~CImagePrefetcher()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  bufferFree.notify_all();
+  producer.join();
+}
+
+void CImagePrefetcher::ProducerLoop()
+{
+  for (uint32_t ii = 0; ii < images.size(); ++ ii) {
+    TFXP * buffer;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      bufferFree.wait(guard, [this] { return stopping || !freeBuffers.empty(); });
+      if (stopping)
+        return;
+      buffer = freeBuffers.back();
+      freeBuffers.pop_back();
+    }
+
+    // The loading and conversion run without the lock, while the consumer works on the previous image.
+    bool ok = LoadImageInFxp(images[ii].c_str(), buffer, rgb.data(), imageSize);
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      readyImages.push_back({ii, buffer, ok});
+    }
+    imageReady.notify_one();
+  }
+}
+
+bool CImagePrefetcher::Next(TImage & image)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  if (numReturned == images.size())
+    return false;
+
+  imageReady.wait(guard, [this] { return !readyImages.empty(); });
+  image = readyImages.front();
+  readyImages.pop_front();
+  ++ numReturned;
+  return true;
+}
+
+void CImagePrefetcher::Release(const TImage & image)
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    freeBuffers.push_back(image.fxp);
+  }
+  bufferFree.notify_one();
+}
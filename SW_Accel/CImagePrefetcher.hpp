@@ -0,0 +1,56 @@
+#ifndef CIMAGEPREFETCHER_HPP
+#define CIMAGEPREFETCHER_HPP
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "model.h"
+
+//  Loads and converts the images of a batch on a separate thread, so that reading and converting image N+1
+// overlaps with the inference of image N.
+// The images are loaded into a fixed set of FxP buffers supplied by the application (DMA-compatible, so that
+// the accelerator can read them). The buffers form a bounded queue: the producer waits while all of them are
+// loaded and not yet released, so with two buffers this is plain double buffering.
+
+class CImagePrefetcher {
+  public:
+    struct TImage {
+      uint32_t index;   // Position in the list of images
+      TFXP * fxp;       // Converted image. Only valid until Release().
+      bool ok;          // false if the file could not be read
+    };
+
+  protected:
+    std::vector<std::string> images;
+    uint32_t imageSize;
+    std::vector<uint8_t> rgb;       // Raw pixels of the image being loaded
+
+    std::mutex lock;
+    std::condition_variable bufferFree;
+    std::condition_variable imageReady;
+    std::vector<TFXP *> freeBuffers;
+    std::deque<TImage> readyImages;
+    uint32_t numReturned;
+    bool stopping;
+
+    std::thread producer;
+    void ProducerLoop();
+
+  public:
+    // Starts loading the images right away, in order.
+    CImagePrefetcher(const std::vector<std::string> & Images, const std::vector<TFXP *> & Buffers, uint32_t ImageSize);
+    // Stops the producer, even if not all the images were consumed.
+    ~CImagePrefetcher();
+
+    // Waits for the next image, in the order of the list. Returns false when all the images were returned.
+    bool Next(TImage & image);
+    // Gives the buffer of an image back to the producer.
+    void Release(const TImage & image);
+};
+
+#endif  // CIMAGEPREFETCHER_HPP
@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "CNetExecutor.hpp"
+#include "memoryPlanner.h"
+#include "cnn.h"
+
+// Of every activation in the arena, in bytes: a cache line.
+const uint32_t ARENA_ALIGNMENT = 64;
+
+bool CNetExecutor::Init(const TNetwork & Network, const std::vector<TFXP*> & Weights, const std::vector<TFXP*> & Biases)
+{
+  std::vector<TNetShape> shapes;
+
+  FreeBuffers();
+  if (!DeriveShapes(Network, shapes))
+    return false;
+  if (Weights.size() != Network.layers.size() || Biases.size() != Network.layers.size()) {
+    printf("The network has %u layers, but there are parameters for %u\n", (uint32_t)Network.layers.size(), (uint32_t)Weights.size());
+    return false;
+  }
+
+  network = Network;
+  weights = Weights;
+  biases = Biases;
+  convBackends.assign(network.layers.size(), convolver.GetBackend());
+
+  // The classifier starts after the last FLATTEN. Without it, at the first DENSE (on a 1x1 input).
+  uint32_t split = 0;
+  for (uint32_t iOp = 0; iOp < network.ops.size(); ++ iOp) {
+    if (network.ops[iOp].type == OP_FLATTEN)
+      split = iOp + 1;
+  }
+  if (split == 0) {
+    split = network.ops.size();
+    for (uint32_t iOp = 0; iOp < network.ops.size() && split == network.ops.size(); ++ iOp) {
+      if (network.ops[iOp].type == OP_DENSE)
+        split = iOp;
+    }
+  }
+
+  featuresShape = split > 0 ? shapes[split - 1] : network.input;
+  outputSize = shapes.back().Size();
+  BuildSteps(0, split, shapes, featureSteps);
+  BuildSteps(split, network.ops.size(), shapes, classifierSteps);
+  PlanActivations(featureSteps, featuresPlan);
+  PlanActivations(classifierSteps, classifierPlan);
+  return true;
+}
+
+void CNetExecutor::BuildSteps(uint32_t first, uint32_t last, const std::vector<TNetShape> & shapes, std::vector<TStep> & steps)
+{
+  uint32_t lastLayer = 0;
+
+  steps.clear();
+  for (uint32_t iOp = first; iOp < last; ++ iOp) {
+    const TNetOp & op = network.ops[iOp];
+    TStep step = {op.type, op.layer, false, false, iOp > 0 ? shapes[iOp - 1] : network.input, shapes[iOp], IN_PLACE, 0, false, 0, lastLayer};
+
+    if (op.type == OP_CONV || op.type == OP_DENSE) {
+      step.timeLayer = lastLayer = op.layer;
+      if (iOp + 1 < last && network.ops[iOp + 1].type == OP_RELU) {
+        step.relu = true;
+        ++ iOp;
+      }
+      if (op.type == OP_CONV && iOp + 1 < last && network.ops[iOp + 1].type == OP_MAXPOOL) {
+        step.maxPool = true;
+        ++ iOp;
+      }
+      step.out = shapes[iOp];
+    }
+    steps.push_back(step);
+  }
+}
+
+void CNetExecutor::PlanActivations(std::vector<TStep> & steps, TPlan & plan)
+{
+  // The last out-of-place step writes the result. Every other one writes a tensor that lives until the next
+  // out-of-place step reads it (the in-place steps in between work on it).
+  int32_t lastOutOfPlace = -1;
+  for (uint32_t ii = 0; ii < steps.size(); ++ ii) {
+    if (IsOutOfPlace(steps[ii].type))
+      lastOutOfPlace = ii;
+  }
+  if (lastOutOfPlace >= 0)
+    steps[lastOutOfPlace].output = TO_RESULT;
+
+  // Tensors, and the step that uses each one (negative for a pool scratch).
+  std::vector<TTensorLifetime> tensors;
+  std::vector<int32_t> tensorSteps;
+  plan.unshared = 0;
+  for (int32_t ii = 0; ii < (int32_t)steps.size(); ++ ii) {
+    TStep & step = steps[ii];
+    step.useScratch = step.type == OP_CONV && step.maxPool &&
+      !convolver.FusesMaxPool(convBackends[step.layer], network.layers[step.layer].inputSize, step.in.width);
+    if (step.useScratch) {
+      uint32_t size = network.layers[step.layer].outputSize * (step.in.height - 2) * (step.in.width - 2);
+      tensors.push_back({(uint32_t)(size * sizeof(TFXP)), (uint32_t)ii, (uint32_t)ii, 0});
+      tensorSteps.push_back(-ii - 1);
+      plan.unshared += size;
+    }
+
+    if (ii >= lastOutOfPlace || !IsOutOfPlace(step.type))
+      continue;
+    uint32_t reader = ii + 1;
+    while (!IsOutOfPlace(steps[reader].type))
+      ++ reader;
+    tensors.push_back({(uint32_t)(step.out.Size() * sizeof(TFXP)), (uint32_t)ii, reader, 0});
+    tensorSteps.push_back(ii);
+    plan.unshared += step.out.Size();
+  }
+
+  plan.arena = PlanArena(tensors, ARENA_ALIGNMENT) / sizeof(TFXP);
+  plan.peak = PeakLiveSize(tensors) / sizeof(TFXP);
+  for (uint32_t ii = 0; ii < tensors.size(); ++ ii) {
+    if (tensorSteps[ii] < 0) {
+      steps[-tensorSteps[ii] - 1].scratchOffset = tensors[ii].offset / sizeof(TFXP);
+    } else {
+      steps[tensorSteps[ii]].output = TO_ARENA;
+      steps[tensorSteps[ii]].offset = tensors[ii].offset / sizeof(TFXP);
+    }
+  }
+}
+
+uint32_t CNetExecutor::FeaturesArenaStride() const
+{
+  const uint32_t alignment = ARENA_ALIGNMENT / sizeof(TFXP);
+  return (featuresPlan.arena + alignment - 1) / alignment * alignment;
+}
+
+uint32_t CNetExecutor::ArenaBytes(uint32_t MaxBatch, uint32_t PipelineDepth) const
+{
+  // With a single image, both parts run one after the other, so they use the same memory. Scaling the plan of
+  // the classifier by the batch keeps its tensors apart.
+  uint32_t size;
+  if (PipelineDepth <= 1)
+    size = featuresPlan.arena > MaxBatch * classifierPlan.arena ? featuresPlan.arena : MaxBatch * classifierPlan.arena;
+  else
+    size = PipelineDepth * FeaturesArenaStride() + MaxBatch * classifierPlan.arena;
+  return size * sizeof(TFXP);
+}
+
+bool CNetExecutor::AllocBuffers(uint32_t MaxBatch, uint32_t PipelineDepth)
+{
+  FreeBuffers();
+  maxBatch = MaxBatch;
+  pipelineDepth = PipelineDepth > 1 ? PipelineDepth : 1;
+  if (ArenaBytes(maxBatch, pipelineDepth) > 0 && (arena = (TFXP *)convolver.AllocDMACompatible(ArenaBytes(maxBatch, pipelineDepth))) == NULL)
+    return false;
+  classifierArena = pipelineDepth > 1 ? arena + pipelineDepth * FeaturesArenaStride() : arena;
+  contexts.assign(pipelineDepth, TContext());
+  for (uint32_t ii = 0; ii < pipelineDepth; ++ ii) {
+    contexts[ii].busy = false;
+    contexts[ii].arena = arena != NULL ? arena + ii * FeaturesArenaStride() : NULL;
+  }
+  runFeatures = (TFXP *)convolver.AllocDMACompatible(FeaturesSize() * sizeof(TFXP));
+  streamFeatures = (TFXP *)convolver.AllocDMACompatible(2 * maxBatch * FeaturesSize() * sizeof(TFXP));
+  return runFeatures != NULL && streamFeatures != NULL;
+}
+
+void CNetExecutor::FreeBuffers()
+{
+  TFXP ** all[3] = {&arena, &runFeatures, &streamFeatures};
+  for (TFXP ** p : all) {
+    if (*p != NULL) {
+      convolver.FreeDMACompatible(*p);
+      *p = NULL;
+    }
+  }
+  classifierArena = NULL;
+  contexts.clear();
+  maxBatch = 0;
+  pipelineDepth = 1;
+}
+
+bool CNetExecutor::SetConvBackend(uint32_t iLayer, CConvDriver::TBackend Backend)
+{
+  if (iLayer >= network.layers.size() || network.layers[iLayer].type != CONV) {
+    printf("Layer %u is not a conv layer\n", iLayer);
+    return false;
+  }
+  if (arena != NULL || runFeatures != NULL || streamFeatures != NULL) {
+    printf("The backends have to be selected before allocating the buffers\n");
+    return false;
+  }
+  if (Backend == CConvDriver::BACKEND_ACCEL && convolver.GetBackend() != CConvDriver::BACKEND_ACCEL) {
+    printf("Layer %u can only use the accelerator if it is also the main backend\n", iLayer);
+    return false;
+  }
+  convBackends[iLayer] = Backend;
+  // Whether the layer needs a pool scratch may have changed.
+  PlanActivations(featureSteps, featuresPlan);
+  return true;
+}
+
+TFXP * CNetExecutor::StepOutput(const TStep & step, TFXP * stepArena, TFXP * current, TFXP * result, uint32_t batchSize)
+{
+  return step.output == TO_RESULT ? result : step.output == IN_PLACE ? current : stepArena + step.offset * batchSize;
+}
+
+void CNetExecutor::RunStep(const TStep & step, TFXP * stepArena, TFXP * current, TFXP * output, uint32_t batchSize, TTimes & times)
+{
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+  switch (step.type) {
+    case OP_CONV:
+      convolver.ConvOn(convBackends[step.layer], current, output, weights[step.layer], biases[step.layer],
+        network.layers[step.layer].outputSize, network.layers[step.layer].inputSize, step.in.width, step.in.height,
+        step.relu, step.maxPool, step.useScratch ? stepArena + step.scratchOffset : NULL);
+      // One entry per tile when it is tiled.
+      for (const CConvDriver::TAccelStats & stats : convolver.LastAccelStats())
+        AddAccelStats(step, stats, times);
+      break;
+    case OP_MAXPOOL:
+      MaxPool(current, output, step.in.channels, step.in.width, step.in.height);
+      break;
+    case OP_FLATTEN:
+      Flatten(current, output, step.in.channels, step.in.width, step.in.height);
+      break;
+    case OP_DENSE:
+      if (denseDriver != NULL) {
+        denseDriver->Dense(current, output, weights[step.layer], biases[step.layer], step.in.Size(), step.out.Size(), batchSize, step.relu);
+        for (const CConvDriver::TAccelStats & stats : denseDriver->LastAccelStats())
+          AddAccelStats(step, stats, times);
+        break;
+      }
+      DenseBatch(current, output, batchSize, step.in.Size(), step.out.Size(), weights[step.layer], biases[step.layer]);
+      if (step.relu)
+        ReLU(output, batchSize * step.out.Size(), 1, 1);
+      break;
+    case OP_RELU:
+      ReLU(output, batchSize * step.out.Size(), 1, 1);
+      break;
+    case OP_SIGMOID:
+      Sigmoid(output, batchSize * step.out.Size());
+      break;
+  }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+  AddStepTime(step, step.type, CalcTimeDiff(end, start), times);
+}
+
+// type is the one of the step, or OP_MAXPOOL for the MaxPool of a conv step run on its own.
+void CNetExecutor::AddStepTime(const TStep & step, uint32_t type, uint64_t elapsed, TTimes & times)
+{
+  switch (type) {
+    case OP_CONV:     times.timeConv[step.timeLayer] += elapsed; break;
+    case OP_MAXPOOL:  times.timeMaxPool[step.timeLayer] += elapsed; break;
+    case OP_FLATTEN:  times.timeFlatten += elapsed; break;
+    case OP_DENSE:    times.timeDense[step.timeLayer] += elapsed; break;
+    case OP_SIGMOID:  times.timeSigmoid += elapsed; break;
+    case OP_RELU:
+      if (step.timeLayer < network.layers.size() && network.layers[step.timeLayer].type == DENSE)
+        times.timeDense[step.timeLayer] += elapsed;
+      else
+        times.timeConv[step.timeLayer] += elapsed;
+      break;
+  }
+}
+
+void CNetExecutor::AddAccelStats(const TStep & step, const CConvDriver::TAccelStats & stats, TTimes & times)
+{
+  times.accelCycles[step.timeLayer] += stats.cycles;
+  times.accelMemCycles[step.timeLayer] += stats.memCycles;
+  times.accelBytes[step.timeLayer] += stats.bytesRead + stats.bytesWritten;
+}
+
+void CNetExecutor::RunSteps(const std::vector<TStep> & steps, TFXP * stepArena, TFXP * input, TFXP * result, uint32_t batchSize, TTimes & times)
+{
+  TFXP * current = input;
+  bool resultWritten = false;
+
+  for (const TStep & step : steps) {
+    TFXP * output = StepOutput(step, stepArena, current, result, batchSize);
+    RunStep(step, stepArena, current, output, batchSize, times);
+    current = output;
+    resultWritten = resultWritten || output == result;
+  }
+
+  // Only activations: they were applied to the input.
+  if (!resultWritten)
+    memcpy(result, current, batchSize * steps.back().out.Size() * sizeof(TFXP));
+}
+
+void CNetExecutor::RunFeatures(TFXP * input, TFXP * features, TTimes & times)
+{
+  if (featureSteps.empty())
+    memcpy(features, input, FeaturesSize() * sizeof(TFXP));
+  else
+    RunSteps(featureSteps, arena, input, features, 1, times);
+}
+
+void CNetExecutor::RunClassifier(TFXP * features, uint32_t batchSize, TFXP * outputs, TTimes & times)
+{
+  if (classifierSteps.empty())
+    memcpy(outputs, features, batchSize * FeaturesSize() * sizeof(TFXP));
+  else
+    RunSteps(classifierSteps, classifierArena, features, outputs, batchSize, times);
+}
+
+void CNetExecutor::Run(TFXP * input, TFXP * outputs, TTimes & times)
+{
+  RunFeatures(input, runFeatures, times);
+  RunClassifier(runFeatures, 1, outputs, times);
+}
+
+bool CNetExecutor::RunsOnAccel(const TStep & step) const
+{
+  return step.type == OP_CONV && convBackends[step.layer] == CConvDriver::BACKEND_ACCEL && convolver.SupportsConvChain() &&
+    convolver.FitsAccel(network.layers[step.layer].inputSize, step.in.width);
+}
+
+// The oldest image in flight whose next step waits for the accelerator (forAccel), or can run on the CPU.
+CNetExecutor::TContext * CNetExecutor::Oldest(bool forAccel)
+{
+  TContext * oldest = NULL;
+  for (TContext & context : contexts) {
+    if (!context.busy || context.inAccel || (oldest != NULL && oldest->order < context.order))
+      continue;
+    bool accelStep = !context.poolPending && !context.synchronous && RunsOnAccel(featureSteps[context.step]);
+    if (accelStep == forAccel)
+      oldest = &context;
+  }
+  return oldest;
+}
+
+// Starts the next convs that wait for the accelerator, if it is free. Consecutive conv layers with nothing to do
+// on the CPU in between go in the same chain. Returns false if nothing was started.
+bool CNetExecutor::SubmitNextConv(TTimes & times)
+{
+  if (convolver.ConvPending())
+    return false;
+  TContext * context = Oldest(true);
+  if (context == NULL)
+    return false;
+
+  std::vector<CConvDriver::TConvDesc> chain;
+  TFXP * current = context->current;
+  for (uint32_t iStep = context->step; iStep < featureSteps.size() && chain.size() < ACCEL_MAX_CHAIN; ++ iStep) {
+    const TStep & step = featureSteps[iStep];
+    if (!RunsOnAccel(step))
+      break;
+    TFXP * output = step.useScratch ? context->arena + step.scratchOffset : StepOutput(step, context->arena, current, context->features, 1);
+    chain.push_back({current, output, weights[step.layer], biases[step.layer], network.layers[step.layer].outputSize,
+      network.layers[step.layer].inputSize, step.in.width, step.in.height, step.relu, step.maxPool && !step.useScratch});
+    // Its MaxPool has to run on the CPU before the next layer.
+    if (step.useScratch)
+      break;
+    current = output;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC_RAW, &context->convStart);
+  if (convolver.SubmitConvChain(chain.data(), chain.size()) != CConvDriver::OK) {
+    // Run it synchronously instead, as a CPU step (as Run() would).
+    context->synchronous = true;
+    return false;
+  }
+  context->inAccel = true;
+  context->chainSteps = chain.size();
+  accelOwner = context;
+  return true;
+}
+
+// Waits for the convs on the accelerator. Returns their image if they were its last steps.
+// A chain is timed as a whole, under its first layer.
+CNetExecutor::TContext * CNetExecutor::CollectConv(TTimes & times)
+{
+  struct timespec end;
+
+  convolver.WaitConv();
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+  TContext & context = *accelOwner;
+  accelOwner = NULL;
+
+  AddStepTime(featureSteps[context.step], OP_CONV, CalcTimeDiff(end, context.convStart), times);
+  // The counters are per convolution, so they go to each layer of the chain.
+  const std::vector<CConvDriver::TAccelStats> & stats = convolver.LastAccelStats();
+  for (uint32_t ii = 0; ii < stats.size() && ii < context.chainSteps; ++ ii)
+    AddAccelStats(featureSteps[context.step + ii], stats[ii], times);
+  context.inAccel = false;
+  for (uint32_t ii = 0; ii + 1 < context.chainSteps; ++ ii)
+    FinishStep(context);
+  if (featureSteps[context.step].useScratch) {
+    // The MaxPool runs on the CPU, once the accelerator has been given more work.
+    context.poolPending = true;
+    return NULL;
+  }
+  return FinishStep(context);
+}
+
+// Moves an image to its next step. Returns it if it has finished.
+CNetExecutor::TContext * CNetExecutor::FinishStep(TContext & context)
+{
+  const TStep & step = featureSteps[context.step];
+  TFXP * output = StepOutput(step, context.arena, context.current, context.features, 1);
+  context.current = output;
+  context.resultWritten = context.resultWritten || output == context.features;
+  context.synchronous = false;
+  if (++ context.step < featureSteps.size())
+    return NULL;
+
+  if (!context.resultWritten)
+    memcpy(context.features, context.current, FeaturesSize() * sizeof(TFXP));
+  context.busy = false;
+  return &context;
+}
+
+// Does one piece of work for the images in flight, in this order of preference:
+//  1. Collect the conv on the accelerator if it has finished, and give it the next one.
+//  2. Run the next CPU step of the oldest image that has one.
+//  3. Wait for the accelerator.
+// Returns the image that has finished, if any.
+CNetExecutor::TContext * CNetExecutor::Advance(TTimes & times)
+{
+  TContext * finished = NULL;
+
+  if (accelOwner != NULL && convolver.ConvDone())
+    finished = CollectConv(times);
+  if (SubmitNextConv(times) || finished != NULL)
+    return finished;
+
+  TContext * context = Oldest(false);
+  if (context != NULL) {
+    const TStep & step = featureSteps[context->step];
+    // The layers that are tiled (or could not be submitted) also use the accelerator, synchronously.
+    if (accelOwner != NULL && !context->poolPending && step.type == OP_CONV && convBackends[step.layer] == CConvDriver::BACKEND_ACCEL)
+      return CollectConv(times);
+    TFXP * output = StepOutput(step, context->arena, context->current, context->features, 1);
+    if (context->poolPending) {
+      struct timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+      MaxPool(context->arena + step.scratchOffset, output, step.out.channels, step.in.width - CONV_FILTER_WIDTH + 1,
+        step.in.height - CONV_FILTER_HEIGHT + 1);
+      clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+      AddStepTime(step, OP_MAXPOOL, CalcTimeDiff(end, start), times);
+      context->poolPending = false;
+    } else
+      RunStep(step, context->arena, context->current, output, 1, times);
+    return FinishStep(*context);
+  }
+
+  if (accelOwner != NULL)
+    return CollectConv(times);
+  return NULL;
+}
+
+void CNetExecutor::RunStream(const std::function<bool(TFXP *& input, uint32_t & tag)> & Next,
+      const std::function<void(uint32_t tag)> & InputDone,
+      const std::function<void(uint32_t tag, const TFXP * outputs)> & Output, TTimes & times)
+{
+  // The features of a batch are written to one half of streamFeatures while the classifier reads the other.
+  std::vector<uint32_t> batchTags[2];
+  uint32_t batchDone[2] = {0, 0};
+  std::vector<TFXP> outputs(maxBatch * OutputSize());
+  uint32_t half = 0;
+  uint32_t inFlight = 0;
+  bool more = true;
+
+  // A half is classified once all its images have their features, and no more images will go to it.
+  auto classifyReady = [&]() {
+    for (uint32_t h : {half ^ 1, half}) {
+      if (batchTags[h].empty() || batchDone[h] < batchTags[h].size() || (h == half && batchTags[h].size() < maxBatch && more))
+        continue;
+      // Keep the accelerator busy with the images in flight meanwhile.
+      SubmitNextConv(times);
+      RunClassifier(streamFeatures + h * maxBatch * FeaturesSize(), batchTags[h].size(), outputs.data(), times);
+      for (uint32_t ii = 0; ii < batchTags[h].size(); ++ ii)
+        Output(batchTags[h][ii], &outputs[ii * OutputSize()]);
+      batchTags[h].clear();
+      batchDone[h] = 0;
+    }
+  };
+
+  while (true) {
+    // Start new images while there is room for them.
+    while (more && inFlight < pipelineDepth) {
+      if (batchTags[half].size() == maxBatch) {
+        if (!batchTags[half ^ 1].empty())
+          break;
+        half ^= 1;
+      }
+
+      TFXP * input;
+      uint32_t tag;
+      if (!Next(input, tag)) {
+        more = false;
+        break;
+      }
+
+      TFXP * features = streamFeatures + (half * maxBatch + batchTags[half].size()) * FeaturesSize();
+      batchTags[half].push_back(tag);
+      if (featureSteps.empty()) {
+        memcpy(features, input, FeaturesSize() * sizeof(TFXP));
+        InputDone(tag);
+        ++ batchDone[half];
+        continue;
+      }
+
+      TContext * context = NULL;
+      for (TContext & candidate : contexts) {
+        if (!candidate.busy && context == NULL)
+          context = &candidate;
+      }
+      context->busy = true;
+      context->tag = tag;
+      context->half = half;
+      context->order = numStarted ++;
+      context->features = features;
+      context->current = input;
+      context->step = 0;
+      context->inAccel = context->poolPending = context->synchronous = context->resultWritten = false;
+      ++ inFlight;
+    }
+
+    if (inFlight == 0) {
+      classifyReady();
+      if (!more && batchTags[0].empty() && batchTags[1].empty())
+        break;
+      continue;
+    }
+
+    TContext * finished = Advance(times);
+    if (finished != NULL) {
+      -- inFlight;
+      InputDone(finished->tag);
+      ++ batchDone[finished->half];
+      classifyReady();
+    }
+  }
+}
+
+void CNetExecutor::Print()
+{
+  printf("Network: input %ux%ux%u, %u layers, %u operations\n", network.input.channels, network.input.height, network.input.width,
+    (uint32_t)network.layers.size(), (uint32_t)network.ops.size());
+
+  for (uint32_t part = 0; part < 2; ++ part) {
+    for (const TStep & step : part == 0 ? featureSteps : classifierSteps) {
+      char name[64];
+      if (step.type == OP_CONV || step.type == OP_DENSE)
+        snprintf(name, sizeof(name), "%s %u%s%s", OpName(step.type), step.layer, step.relu ? "+ReLU" : "", step.maxPool ? "+MaxPool" : "");
+      else
+        snprintf(name, sizeof(name), "%s", OpName(step.type));
+
+      printf("  %-22s %ux%ux%u --> %ux%ux%u", name, step.in.channels, step.in.height, step.in.width,
+        step.out.channels, step.out.height, step.out.width);
+      if (step.type == OP_CONV)
+        printf(" [%s]", CConvDriver::BackendName(convBackends[step.layer]));
+      if (step.type == OP_DENSE && denseDriver != NULL && denseDriver->IsOpen() && denseDriver->FitsAccel(step.in.Size()))
+        printf(" [accel]");
+      printf(part == 0 ? "\n" : " (batched)\n");
+    }
+  }
+
+  const TPlan * plans[2] = {&featuresPlan, &classifierPlan};
+  const char * partNames[2] = {"Features", "Classifier (per image)"};
+  for (uint32_t part = 0; part < 2; ++ part) {
+    printf("  %-22s activations %0.1lf KB, peak alive %0.1lf KB, %0.1lf KB without sharing\n", partNames[part],
+      plans[part]->arena * sizeof(TFXP) / 1024.0, plans[part]->peak * sizeof(TFXP) / 1024.0, plans[part]->unshared * sizeof(TFXP) / 1024.0);
+  }
+  uint32_t batch = maxBatch > 0 ? maxBatch : 1;
+  printf("  Activation arena: %0.1lf KB for batches of %u images, %u in flight\n", ArenaBytes(batch, pipelineDepth) / 1024.0,
+    batch, pipelineDepth);
+}
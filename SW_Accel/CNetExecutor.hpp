@@ -0,0 +1,160 @@
+#ifndef CNETEXECUTOR_HPP
+#define CNETEXECUTOR_HPP
+
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#include <functional>
+
+#include "model.h"
+#include "network.h"
+#include "CConvDriver.hpp"
+#include "CDenseDriver.hpp"
+
+//  Runs a network described by a TNetwork (network.h), deriving all the activation sizes from it.
+// The operations are grouped into steps: a CONV absorbs the RELU and MAXPOOL that follow it (CConvDriver fuses them
+// when the backend can), and a DENSE absorbs its RELU. Every conv layer can run on its own backend.
+//  The network is split in two parts:
+//  - The features: every operation up to the last FLATTEN (or the first DENSE), run one image at a time.
+//  - The classifier: the DENSE, RELU and SIGMOID after it, run on a batch of images so that the dense weights
+//    are read once per batch.
+// The intermediate activations of both parts share one DMA-compatible arena, planned by memoryPlanner.h from
+// their lifetimes, together with the un-pooled conv outputs of the backends that cannot fuse the MaxPool.
+// The activation steps (ReLU, Sigmoid) run in place. MaxPool does not: it is split by channel among the threads,
+// and the output of a channel overlaps the input of the previous ones.
+//  RunStream() pipelines a sequence of images: several of them are in flight, each with its own copy of the
+// features arena, and the conv layers on the accelerator are submitted asynchronously (CConvDriver::SubmitConvChain()),
+// so that the accelerator convolves (and pools) one image while the CPU flattens and classifies the others.
+// Consecutive conv layers with no CPU work in between are submitted in one chain. A 16-bit bitstream does not take
+// chains (CConvDriver::SupportsConvChain()), and its layers run synchronously.
+//  The DENSE steps run on the CPU, or on the Dense accelerator with SetDenseDriver().
+
+class CNetExecutor {
+  protected:
+    enum {TO_ARENA, TO_RESULT, IN_PLACE};
+
+    struct TStep {
+      uint32_t type;        // TOpType
+      uint32_t layer;       // OP_CONV, OP_DENSE
+      bool relu;            // OP_CONV, OP_DENSE: followed by a ReLU
+      bool maxPool;         // OP_CONV: followed by a MaxPool
+      TNetShape in, out;
+      uint32_t output;      // TO_ARENA, TO_RESULT (features or outputs) or IN_PLACE
+      uint32_t offset;      // TO_ARENA: position in the arena, in TFXP values per image of the batch
+      bool useScratch;      // OP_CONV: the un-pooled output goes to the arena, at scratchOffset
+      uint32_t scratchOffset;
+      uint32_t timeLayer;   // Entry of TTimes for the step
+    };
+
+    CConvDriver & convolver;
+    TNetwork network;
+    std::vector<TFXP*> weights, biases;
+    std::vector<CConvDriver::TBackend> convBackends;  // Indexed by layer
+    CDenseDriver * denseDriver = NULL;
+
+    std::vector<TStep> featureSteps, classifierSteps;
+    TNetShape featuresShape;
+    uint32_t outputSize;
+
+    // Sizes of the plan of each part, in TFXP values (per image of the batch for the classifier).
+    struct TPlan {
+      uint32_t arena;       // Planned
+      uint32_t peak;        // Lower bound: largest set of activations alive at once
+      uint32_t unshared;    // Every activation in its own buffer
+    } featuresPlan, classifierPlan;
+
+    // The features arena of image k of the pipeline is at arena + k * FeaturesArenaStride(). With a single image,
+    // the classifier shares it; otherwise it goes after them, so that it can run while the features progress.
+    TFXP * arena = NULL;
+    TFXP * classifierArena = NULL;
+    TFXP * runFeatures = NULL;   // Features of Run()
+    TFXP * streamFeatures = NULL;  // Features of RunStream(): two halves of maxBatch images
+    uint32_t maxBatch = 0;
+    uint32_t pipelineDepth = 1;
+
+    // An image in flight in RunStream().
+    struct TContext {
+      bool busy;
+      uint32_t tag;
+      uint32_t half;          // Of streamFeatures
+      uint64_t order;         // The oldest image goes first
+      TFXP * features, * current, * arena;
+      uint32_t step;          // Next feature step
+      bool inAccel;           // The conv of step is running on the accelerator
+      bool poolPending;       // The conv of step has finished, its MaxPool has not
+      bool synchronous;       // The conv of step could not be submitted, it runs with ConvOn()
+      uint32_t chainSteps;    // Steps in the chain running on the accelerator, from step
+      bool resultWritten;
+      struct timespec convStart;
+    };
+    std::vector<TContext> contexts;
+    TContext * accelOwner = NULL;
+    uint64_t numStarted = 0;
+
+    static bool IsOutOfPlace(uint32_t type) { return type != OP_RELU && type != OP_SIGMOID; }
+    void BuildSteps(uint32_t first, uint32_t last, const std::vector<TNetShape> & shapes, std::vector<TStep> & steps);
+    void PlanActivations(std::vector<TStep> & steps, TPlan & plan);
+    uint32_t FeaturesArenaStride() const;
+    TFXP * StepOutput(const TStep & step, TFXP * stepArena, TFXP * current, TFXP * result, uint32_t batchSize);
+    void RunStep(const TStep & step, TFXP * stepArena, TFXP * current, TFXP * output, uint32_t batchSize, TTimes & times);
+    void AddStepTime(const TStep & step, uint32_t type, uint64_t elapsed, TTimes & times);
+    void AddAccelStats(const TStep & step, const CConvDriver::TAccelStats & stats, TTimes & times);
+    void RunSteps(const std::vector<TStep> & steps, TFXP * stepArena, TFXP * input, TFXP * result, uint32_t batchSize, TTimes & times);
+
+    // Scheduling of RunStream().
+    bool RunsOnAccel(const TStep & step) const;
+    TContext * Oldest(bool forAccel);
+    bool SubmitNextConv(TTimes & times);
+    TContext * CollectConv(TTimes & times);
+    TContext * FinishStep(TContext & context);
+    TContext * Advance(TTimes & times);
+
+  public:
+    CNetExecutor(CConvDriver & Convolver) : convolver(Convolver) {}
+    ~CNetExecutor() { FreeBuffers(); }
+
+    // Checks the network and plans the steps. The parameters (one array per layer) stay owned by the caller.
+    // The conv layers run on the backend of the convolver.
+    bool Init(const TNetwork & Network, const std::vector<TFXP*> & Weights, const std::vector<TFXP*> & Biases);
+    // Allocates the DMA-compatible activation arena, for classifier batches of up to MaxBatch images and up to
+    // PipelineDepth images in flight in RunStream().
+    bool AllocBuffers(uint32_t MaxBatch, uint32_t PipelineDepth = 1);
+    void FreeBuffers();
+    // Size of the arena for classifier batches of MaxBatch images and PipelineDepth images in flight.
+    uint32_t ArenaBytes(uint32_t MaxBatch, uint32_t PipelineDepth = 1) const;
+
+    // Runs conv layer iLayer on another backend. The accelerator can only be used if it is the backend of the
+    // convolver, which then has the device open and allocates the buffers in CMA memory.
+    // It changes the memory plan, so it has to be called before AllocBuffers().
+    bool SetConvBackend(uint32_t iLayer, CConvDriver::TBackend Backend);
+    CConvDriver::TBackend ConvBackend(uint32_t iLayer) const { return convBackends[iLayer]; }
+    // Runs the dense layers with the Dense driver, which falls back to the CPU for the layers it cannot take. The
+    // parameters and the activations have to be allocated by the convolver, in CMA memory. NULL runs them on the CPU.
+    void SetDenseDriver(CDenseDriver * DenseDriver) { denseDriver = DenseDriver; }
+
+    const TNetwork & Network() const { return network; }
+    uint32_t InputSize() const { return network.input.Size(); }
+    uint32_t FeaturesSize() const { return featuresShape.Size(); }
+    uint32_t OutputSize() const { return outputSize; }
+
+    // Feature part of one image: input[InputSize()] --> features[FeaturesSize()]. Both DMA-compatible.
+    // An activation before any other operation of a part is applied in place, to its input.
+    void RunFeatures(TFXP * input, TFXP * features, TTimes & times);
+    // Classifier part of a batch: features[batchSize][FeaturesSize()] --> outputs[batchSize][OutputSize()].
+    void RunClassifier(TFXP * features, uint32_t batchSize, TFXP * outputs, TTimes & times);
+    // The whole network for one image.
+    void Run(TFXP * input, TFXP * outputs, TTimes & times);
+    // The whole network for a sequence of images, pipelined. Next() gives the next image (DMA-compatible) and a
+    // tag for it, or false at the end. InputDone() is called when the input of an image is no longer needed, and
+    // Output() with its outputs[OutputSize()], in the order of Next(). The classifier runs on batches of up to
+    // MaxBatch images. The conv times include the time waiting for the accelerator, so with several images in
+    // flight they overlap with the other steps.
+    void RunStream(const std::function<bool(TFXP *& input, uint32_t & tag)> & Next,
+      const std::function<void(uint32_t tag)> & InputDone,
+      const std::function<void(uint32_t tag, const TFXP * outputs)> & Output, TTimes & times);
+
+    // Prints the steps, their backends and the memory plan.
+    void Print();
+};
+
+#endif  // CNETEXECUTOR_HPP
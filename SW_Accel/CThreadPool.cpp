@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "CThreadPool.hpp"
+
+// Number of chunks per thread in a job. More chunks balance better, but cost more atomic operations.
+static const uint32_t CHUNKS_PER_THREAD = 4;
+
+CThreadPool::CThreadPool(uint32_t NumThreads)
+  : job(nullptr), jobCount(0), jobGrain(1), nextItem(0), generation(0), busyWorkers(0), stopping(false)
+{
+  StartWorkers(NumThreads);
+}
+
+CThreadPool::~CThreadPool()
+{
+  StopWorkers();
+}
+
+void CThreadPool::SetNumThreads(uint32_t NumThreads)
+{
+  std::lock_guard<std::mutex> submitGuard(submitLock);
+
+  StopWorkers();
+  StartWorkers(NumThreads);
+}
+
+void CThreadPool::StartWorkers(uint32_t NumThreads)
+{
+  if (NumThreads == 0)
+    NumThreads = std::thread::hardware_concurrency();
+  if (NumThreads == 0)
+    NumThreads = 1;
+
+  stopping = false;
+  for (uint32_t ii = 1; ii < NumThreads; ++ ii)
+    workers.emplace_back(&CThreadPool::WorkerLoop, this, generation);
+}
+
+void CThreadPool::StopWorkers()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wakeWorkers.notify_all();
+
+  for (auto & worker : workers)
+    worker.join();
+  workers.clear();
+}
+
+void CThreadPool::ParallelFor(uint32_t count, const TRangeFn & fn)
+{
+  if (count == 0)
+    return;
+
+  // Nothing to share: avoid waking up the workers.
+  if (workers.empty() || count == 1) {
+    fn(0, count);
+    return;
+  }
+
+  std::lock_guard<std::mutex> submitGuard(submitLock);
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    job = &fn;
+    jobCount = count;
+    jobGrain = count / (GetNumThreads() * CHUNKS_PER_THREAD);
+    if (jobGrain == 0)
+      jobGrain = 1;
+    nextItem = 0;
+    busyWorkers = workers.size();
+    ++ generation;
+  }
+  wakeWorkers.notify_all();
+
+  RunChunks();
+
+  std::unique_lock<std::mutex> guard(lock);
+  jobDone.wait(guard, [this] { return busyWorkers == 0; });
+  job = nullptr;
+}
+
+// Grabs chunks of the current job until there are no items left.
+void CThreadPool::RunChunks()
+{
+  for (;;) {
+    uint32_t begin = nextItem.fetch_add(jobGrain);
+    if (begin >= jobCount)
+      return;
+    uint32_t end = begin + jobGrain < jobCount ? begin + jobGrain : jobCount;
+    (*job)(begin, end);
+  }
+}
+
+// lastGeneration is the job generation when the worker was created, so that it only runs newer jobs.
+void CThreadPool::WorkerLoop(uint32_t lastGeneration)
+{
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wakeWorkers.wait(guard, [&] { return stopping || generation != lastGeneration; });
+      if (stopping)
+        return;
+      lastGeneration = generation;
+    }
+
+    RunChunks();
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (-- busyWorkers == 0)
+        jobDone.notify_one();
+    }
+  }
+}
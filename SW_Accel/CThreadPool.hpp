@@ -0,0 +1,55 @@
+#ifndef CTHREADPOOL_HPP
+#define CTHREADPOOL_HPP
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//  Persistent pool of worker threads for the CPU layers.
+// The threads are created once and sleep between jobs, so splitting a layer costs a wake-up instead of a
+// thread creation. ParallelFor() hands out the items of a job in small chunks to whichever thread is free
+// (the calling thread works too), which balances the load when some threads are slower or preempted.
+
+class CThreadPool {
+  public:
+    // Body of a parallel loop: processes the items [begin, end).
+    typedef std::function<void(uint32_t begin, uint32_t end)> TRangeFn;
+
+  protected:
+    std::vector<std::thread> workers;
+
+    std::mutex submitLock;          // Only one job at a time.
+    std::mutex lock;                // Protects the job description below.
+    std::condition_variable wakeWorkers;
+    std::condition_variable jobDone;
+
+    const TRangeFn * job;
+    uint32_t jobCount;
+    uint32_t jobGrain;
+    std::atomic<uint32_t> nextItem;
+    uint32_t generation;            // Incremented for every job, so the workers know there is new work.
+    uint32_t busyWorkers;
+    bool stopping;
+
+    void WorkerLoop(uint32_t lastGeneration);
+    void RunChunks();
+    void StartWorkers(uint32_t NumThreads);
+    void StopWorkers();
+
+  public:
+    // NumThreads counts the calling thread. 0 uses one thread per core.
+    CThreadPool(uint32_t NumThreads = 0);
+    ~CThreadPool();
+
+    void SetNumThreads(uint32_t NumThreads);
+    uint32_t GetNumThreads() const { return workers.size() + 1; }
+
+    // Runs fn over the items [0, count) split among the threads, and returns when all of them are done.
+    void ParallelFor(uint32_t count, const TRangeFn & fn);
+};
+
+#endif  // CTHREADPOOL_HPP
@@ -1,9 +1,43 @@
 #include <stdio.h>
 #include <math.h>
 #include <stdint.h>
+#include <vector>
 #include "model.h"
 #include "cnn.h"
+#include "CThreadPool.hpp"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CNN_HAVE_AVX2 1
+#else
+#define CNN_HAVE_AVX2 0
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define CNN_HAVE_NEON 1
+#else
+#define CNN_HAVE_NEON 0
+#endif
+
+// The CPU layers share one pool of threads, created the first time it is needed.
+CThreadPool & ThreadPool()
+{
+  static CThreadPool pool;
+  return pool;
+}
+
+void SetNumThreads(uint32_t numThreads)
+{
+  ThreadPool().SetNumThreads(numThreads);
+}
+
+uint32_t GetNumThreads()
+{
+  return ThreadPool().GetNumThreads();
+}
+
+// The channels are independent, so they are split among the threads.
 void MaxPool(TFXP * input, TFXP * output, uint32_t channels, uint32_t width, uint32_t height)
 {
   // The input width is the argument received. The output width can be one less if the dimensions are not even numbers.
@@ -11,26 +45,27 @@ void MaxPool(TFXP * input, TFXP * output, uint32_t channels, uint32_t width, uin
   outWidth = ( (width % 2) == 0) ? width : width - 1;
   outHeight = ( (height % 2) == 0) ? height : height - 1;
 
-  TFXP * p = input;
-  for (uint32_t iChannel = 0; iChannel < channels; ++ iChannel) {
-    for (uint32_t iRow = 0; iRow < outHeight; iRow += 2) {
-      for (uint32_t iCol = 0; iCol < outWidth; iCol += 2) {
-        TFXP val;
-        val = * p;
-        if (*(p+1) > val) val = *(p+1);
-        if (*(p+width) > val) val = *(p+width);
-        if (*(p+width+1) > val) val = *(p+width+1);
-        *output = val;
-        ++ output;
-        p += 2;
+  ThreadPool().ParallelFor(channels, [=](uint32_t firstChannel, uint32_t lastChannel) {
+    for (uint32_t iChannel = firstChannel; iChannel < lastChannel; ++ iChannel) {
+      TFXP * p = input + iChannel*width*height;
+      TFXP * out = output + iChannel*(outWidth/2)*(outHeight/2);
+      for (uint32_t iRow = 0; iRow < outHeight; iRow += 2) {
+        for (uint32_t iCol = 0; iCol < outWidth; iCol += 2) {
+          TFXP val;
+          val = * p;
+          if (*(p+1) > val) val = *(p+1);
+          if (*(p+width) > val) val = *(p+width);
+          if (*(p+width+1) > val) val = *(p+width+1);
+          *out = val;
+          ++ out;
+          p += 2;
+        }
+        p += width; // Skip one row that has already been processed
+        if (width != outWidth)
+          ++p; // Skip also the last column of the previous one
       }
-      p += width; // Skip one row that has already been processed
-      if (width != outWidth)
-        ++p; // Skip also the last column of the previous one
     }
-    if (width != outWidth)
-      p += width; // When crossing channels, also skip the last row if odd number.
-  }
+  });
 }
 
 void ReLU(TFXP * input, uint32_t channels, uint32_t width, uint32_t height)
@@ -52,13 +87,16 @@ void AddBiases(TFXP * input, TFXP * biases, uint32_t channels, uint32_t width, u
   }
 }
 
+// The output rows of all the filters are split among the threads.
 void Conv2D(TFXP *input, TFXP * output, TFXP * filters,
       uint32_t numFilters, uint32_t numChannels,
       uint32_t inputWidth, uint32_t inputHeight,
       uint32_t convWidth, uint32_t convHeight)
 {
-  for (uint32_t iFilter = 0; iFilter < numFilters; ++ iFilter) {
-    for (uint32_t y = 0; y < (inputHeight-2); ++y) {
+  ThreadPool().ParallelFor(numFilters * (inputHeight-2), [=](uint32_t firstRow, uint32_t lastRow) {
+    for (uint32_t iRow = firstRow; iRow < lastRow; ++ iRow) {
+      uint32_t iFilter = iRow / (inputHeight-2);
+      uint32_t y = iRow % (inputHeight-2);
       for (uint32_t x = 0; x < (inputWidth-2); ++ x) {
         TFXP acc;
         acc = 0;
@@ -77,23 +115,360 @@ void Conv2D(TFXP *input, TFXP * output, TFXP * filters,
         *(output + iFilter * (inputHeight-2)*(inputWidth-2) + y*(inputWidth-2) + x) = acc;
       }
     }
+  });
+}
+
+// Computes one output pixel of one filter (bias not included), accumulating all the input channels.
+// in points to input[0][y][x], channelStride is the distance between input channels.
+static inline TFXP Conv3x3Pixel(const TFXP * in, uint32_t inputWidth, uint32_t channelStride, uint32_t numChannels, const TFXP * filter)
+{
+  TFXP acc = 0;
+  for (uint32_t iChannel = 0; iChannel < numChannels; ++ iChannel) {
+    for (uint32_t cy = 0; cy < 3; ++ cy) {
+      for (uint32_t cx = 0; cx < 3; ++ cx)
+        acc += FXP_Mult(filter[cy*3 + cx], in[cy*inputWidth + cx]);
+    }
+    in += channelStride;
+    filter += 9;
+  }
+  return acc;
+}
+
+// Row kernels: compute one output row of one filter, accumulating all the input channels, and add the bias.
+// in points to input[0][y][0], filter to filters[iFilter][0][0][0].
+// The additions wrap modulo 2^32, so the order in which the products are accumulated does not change the
+// result: all the kernels are bit-exact with Conv2D() + AddBiases().
+typedef void (*TConvRowKernel)(const TFXP * in, uint32_t inputWidth, uint32_t channelStride, uint32_t numChannels,
+      const TFXP * filter, TFXP bias, TFXP * outRow, uint32_t outWidth);
+
+// Generic version: sweeps the whole row once per channel, so the row of accumulators stays in cache.
+static void Conv3x3RowGeneric(const TFXP * in, uint32_t inputWidth, uint32_t channelStride, uint32_t numChannels,
+      const TFXP * filter, TFXP bias, TFXP * outRow, uint32_t outWidth)
+{
+  for (uint32_t x = 0; x < outWidth; ++ x)
+    outRow[x] = bias;
+
+  for (uint32_t iChannel = 0; iChannel < numChannels; ++ iChannel) {
+    const TFXP * in0 = in + iChannel*channelStride;
+    const TFXP * in1 = in0 + inputWidth;
+    const TFXP * in2 = in0 + 2*inputWidth;
+    const TFXP * f = filter + iChannel*9;
+
+    for (uint32_t x = 0; x < outWidth; ++ x) {
+      TFXP acc = outRow[x];
+      acc += FXP_Mult(f[0], in0[x]);
+      acc += FXP_Mult(f[1], in0[x+1]);
+      acc += FXP_Mult(f[2], in0[x+2]);
+      acc += FXP_Mult(f[3], in1[x]);
+      acc += FXP_Mult(f[4], in1[x+1]);
+      acc += FXP_Mult(f[5], in1[x+2]);
+      acc += FXP_Mult(f[6], in2[x]);
+      acc += FXP_Mult(f[7], in2[x+1]);
+      acc += FXP_Mult(f[8], in2[x+2]);
+      outRow[x] = acc;
+    }
   }
 }
 
+#if CNN_HAVE_AVX2
+// AVX2 version: strips of 8 output pixels, kept in registers across all the channels.
+// _mm256_mul_epi32 multiplies the even 32-bit lanes into 64-bit products, so the odd pixels are shifted down
+// and multiplied separately. Only the low 32 bits of (product >> DECIMALS) are kept by FXP_Mult(), and those
+// are the same for a logical or an arithmetic shift, so the 64-bit lanes are accumulated with plain adds and
+// truncated at the end.
+__attribute__((target("avx2")))
+static void Conv3x3RowAVX2(const TFXP * in, uint32_t inputWidth, uint32_t channelStride, uint32_t numChannels,
+      const TFXP * filter, TFXP bias, TFXP * outRow, uint32_t outWidth)
+{
+  uint32_t x = 0;
+
+  for (; x + 8 <= outWidth; x += 8) {
+    __m256i accEven = _mm256_setzero_si256();
+    __m256i accOdd = _mm256_setzero_si256();
+
+    for (uint32_t iChannel = 0; iChannel < numChannels; ++ iChannel) {
+      const TFXP * p = in + iChannel*channelStride + x;
+      const TFXP * f = filter + iChannel*9;
+
+      for (uint32_t cy = 0; cy < 3; ++ cy) {
+        for (uint32_t cx = 0; cx < 3; ++ cx) {
+          __m256i tap = _mm256_set1_epi32(f[cy*3 + cx]);
+          __m256i v = _mm256_loadu_si256((const __m256i *)(p + cy*inputWidth + cx));
+          accEven = _mm256_add_epi64(accEven, _mm256_srli_epi64(_mm256_mul_epi32(v, tap), DECIMALS));
+          accOdd = _mm256_add_epi64(accOdd, _mm256_srli_epi64(_mm256_mul_epi32(_mm256_srli_epi64(v, 32), tap), DECIMALS));
+        }
+      }
+    }
+
+    __m256i acc = _mm256_blend_epi32(accEven, _mm256_slli_epi64(accOdd, 32), 0xAA);
+    acc = _mm256_add_epi32(acc, _mm256_set1_epi32(bias));
+    _mm256_storeu_si256((__m256i *)(outRow + x), acc);
+  }
+
+  for (; x < outWidth; ++ x)
+    outRow[x] = Conv3x3Pixel(in + x, inputWidth, channelStride, numChannels, filter) + bias;
+}
+#endif
+
+#if CNN_HAVE_NEON
+// NEON version: strips of 4 output pixels, kept in a register across all the channels.
+// vmull_n_s32 produces the exact 64-bit products and vshrn_n_s64 keeps the low 32 bits of (product >> DECIMALS),
+// which is what FXP_Mult() returns.
+static void Conv3x3RowNEON(const TFXP * in, uint32_t inputWidth, uint32_t channelStride, uint32_t numChannels,
+      const TFXP * filter, TFXP bias, TFXP * outRow, uint32_t outWidth)
+{
+  uint32_t x = 0;
+
+  for (; x + 4 <= outWidth; x += 4) {
+    int32x4_t acc = vdupq_n_s32(bias);
+
+    for (uint32_t iChannel = 0; iChannel < numChannels; ++ iChannel) {
+      const TFXP * p = in + iChannel*channelStride + x;
+      const TFXP * f = filter + iChannel*9;
+
+      for (uint32_t cy = 0; cy < 3; ++ cy) {
+        for (uint32_t cx = 0; cx < 3; ++ cx) {
+          int32x4_t v = vld1q_s32(p + cy*inputWidth + cx);
+          int32_t tap = f[cy*3 + cx];
+          int32x2_t lo = vshrn_n_s64(vmull_n_s32(vget_low_s32(v), tap), DECIMALS);
+          int32x2_t hi = vshrn_n_s64(vmull_n_s32(vget_high_s32(v), tap), DECIMALS);
+          acc = vaddq_s32(acc, vcombine_s32(lo, hi));
+        }
+      }
+    }
+
+    vst1q_s32(outRow + x, acc);
+  }
+
+  for (; x < outWidth; ++ x)
+    outRow[x] = Conv3x3Pixel(in + x, inputWidth, channelStride, numChannels, filter) + bias;
+}
+#endif
+
+// Picks the row kernel once, based on what the CPU supports.
+static TConvRowKernel SelectConvRowKernel(const char ** name)
+{
+#if CNN_HAVE_AVX2
+  if (__builtin_cpu_supports("avx2")) {
+    *name = "avx2";
+    return Conv3x3RowAVX2;
+  }
+#endif
+#if CNN_HAVE_NEON
+  *name = "neon";
+  return Conv3x3RowNEON;
+#endif
+  *name = "generic";
+  return Conv3x3RowGeneric;
+}
+
+static const char * convRowKernelName = "generic";
+static const TConvRowKernel convRowKernel = SelectConvRowKernel(&convRowKernelName);
+
+const char * Conv2DKernelName()
+{
+  return convRowKernelName;
+}
+
+// Same result as Conv2D() + AddBiases() + ReLU() for 3x3 filters, but computed one output row at a time with the
+// fastest row kernel available. The bias and ReLU are applied before moving to the next row, so the output is
+// written only once. The output rows of all the filters are split among the threads.
+void Conv2DBiasReLU(TFXP *input, TFXP * output, TFXP * filters, TFXP * biases,
+      uint32_t numFilters, uint32_t numChannels,
+      uint32_t inputWidth, uint32_t inputHeight, bool performReLu)
+{
+  const uint32_t outWidth = inputWidth - 2;
+  const uint32_t outHeight = inputHeight - 2;
+
+  ThreadPool().ParallelFor(numFilters * outHeight, [=](uint32_t firstRow, uint32_t lastRow) {
+    for (uint32_t iRow = firstRow; iRow < lastRow; ++ iRow) {
+      uint32_t iFilter = iRow / outHeight;
+      uint32_t y = iRow % outHeight;
+      const TFXP * filter = filters + iFilter*numChannels*9;
+      TFXP * outRow = output + iFilter*outHeight*outWidth + y*outWidth;
+
+      convRowKernel(input + y*inputWidth, inputWidth, inputWidth*inputHeight, numChannels, filter, biases[iFilter], outRow, outWidth);
+
+      if (performReLu) {
+        for (uint32_t x = 0; x < outWidth; ++ x) {
+          if (outRow[x] < 0)
+            outRow[x] = 0;
+        }
+      }
+    }
+  });
+}
+
+// Same result as Conv2DBiasReLU() + MaxPool(). Each work item computes the two conv rows of one pooled row into a
+// small per-thread buffer and reduces them, so the un-pooled output never reaches memory. The last row and column
+// of odd sizes are cropped, like MaxPool() does. ReLU and max commute, so the ReLU is applied to the pooled values.
+void Conv2DBiasReLUMaxPool(TFXP *input, TFXP * output, TFXP * filters, TFXP * biases,
+      uint32_t numFilters, uint32_t numChannels,
+      uint32_t inputWidth, uint32_t inputHeight, bool performReLu)
+{
+  const uint32_t outWidth = inputWidth - 2;
+  const uint32_t outHeight = inputHeight - 2;
+  const uint32_t poolWidth = outWidth / 2;
+  const uint32_t poolHeight = outHeight / 2;
+
+  ThreadPool().ParallelFor(numFilters * poolHeight, [=](uint32_t firstRow, uint32_t lastRow) {
+    std::vector<TFXP> rows(2*outWidth);
+
+    for (uint32_t iRow = firstRow; iRow < lastRow; ++ iRow) {
+      uint32_t iFilter = iRow / poolHeight;
+      uint32_t y = 2*(iRow % poolHeight);
+      const TFXP * filter = filters + iFilter*numChannels*9;
+      TFXP * outRow = output + iFilter*poolHeight*poolWidth + (iRow % poolHeight)*poolWidth;
+
+      convRowKernel(input + y*inputWidth, inputWidth, inputWidth*inputHeight, numChannels, filter, biases[iFilter], &rows[0], outWidth);
+      convRowKernel(input + (y + 1)*inputWidth, inputWidth, inputWidth*inputHeight, numChannels, filter, biases[iFilter], &rows[outWidth], outWidth);
+
+      for (uint32_t x = 0; x < poolWidth; ++ x) {
+        const TFXP * r0 = &rows[2*x];
+        const TFXP * r1 = &rows[outWidth + 2*x];
+        TFXP val = r0[0];
+        if (r0[1] > val) val = r0[1];
+        if (r1[0] > val) val = r1[0];
+        if (r1[1] > val) val = r1[1];
+        if (performReLu && val < 0)
+          val = 0;
+        outRow[x] = val;
+      }
+    }
+  });
+}
+
+
+// Dense row kernels: the dot products of one row of weights with up to DENSE_BATCH_BLOCK inputs, each one equal
+// to the sum of FXP_Mult(input[j], w[j]) in int32. The row is read once for all the inputs.
+static const uint32_t DENSE_BATCH_BLOCK = 4;
+typedef void (*TDenseRowKernel)(const TFXP * w, const TFXP * const * inputs, uint32_t numInputs, uint32_t inputSize, TFXP * results);
+
+static void DenseRowGeneric(const TFXP * w, const TFXP * const * inputs, uint32_t numInputs, uint32_t inputSize, TFXP * results)
+{
+  for (uint32_t b = 0; b < numInputs; ++ b) {
+    const TFXP * in = inputs[b];
+    TFXP tmp = 0;
+    for (uint32_t jj = 0; jj < inputSize; ++ jj)
+      tmp += FXP_Mult(in[jj], w[jj]);
+    results[b] = tmp;
+  }
+}
+
+#if CNN_HAVE_AVX2
+// AVX2 version: the same even/odd lane products as Conv3x3RowAVX2, accumulated in 64-bit lanes. Only the low
+// 32 bits of the sum are kept, which is the int32 sum of the truncated FXP_Mult() results.
+template <uint32_t NUM_INPUTS>
+__attribute__((target("avx2")))
+static void DenseRowAVX2Block(const TFXP * w, const TFXP * const * inputs, uint32_t inputSize, TFXP * results)
+{
+  __m256i acc[NUM_INPUTS];
+  for (uint32_t b = 0; b < NUM_INPUTS; ++ b)
+    acc[b] = _mm256_setzero_si256();
+
+  uint32_t jj = 0;
+  for (; jj + 8 <= inputSize; jj += 8) {
+    __m256i vw = _mm256_loadu_si256((const __m256i *)(w + jj));
+    __m256i vwOdd = _mm256_srli_epi64(vw, 32);
+    for (uint32_t b = 0; b < NUM_INPUTS; ++ b) {
+      __m256i v = _mm256_loadu_si256((const __m256i *)(inputs[b] + jj));
+      acc[b] = _mm256_add_epi64(acc[b], _mm256_srli_epi64(_mm256_mul_epi32(v, vw), DECIMALS));
+      acc[b] = _mm256_add_epi64(acc[b], _mm256_srli_epi64(_mm256_mul_epi32(_mm256_srli_epi64(v, 32), vwOdd), DECIMALS));
+    }
+  }
+
+  for (uint32_t b = 0; b < NUM_INPUTS; ++ b) {
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc[b]), _mm256_extracti128_si256(acc[b], 1));
+    sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+    TFXP tmp = _mm_cvtsi128_si32(sum);
+    for (uint32_t kk = jj; kk < inputSize; ++ kk)
+      tmp += FXP_Mult(inputs[b][kk], w[kk]);
+    results[b] = tmp;
+  }
+}
+
+// The number of inputs is a template parameter so that the accumulators stay in registers.
+__attribute__((target("avx2")))
+static void DenseRowAVX2(const TFXP * w, const TFXP * const * inputs, uint32_t numInputs, uint32_t inputSize, TFXP * results)
+{
+  switch (numInputs) {
+    case 1: DenseRowAVX2Block<1>(w, inputs, inputSize, results); break;
+    case 2: DenseRowAVX2Block<2>(w, inputs, inputSize, results); break;
+    case 3: DenseRowAVX2Block<3>(w, inputs, inputSize, results); break;
+    default: DenseRowAVX2Block<4>(w, inputs, inputSize, results); break;
+  }
+}
+#endif
+
+#if CNN_HAVE_NEON
+// NEON version: vmull_s32 produces the exact 64-bit products and vsraq_n_s64 accumulates (product >> DECIMALS)
+// in 64-bit lanes, truncated to 32 bits at the end like in the AVX2 version.
+static void DenseRowNEON(const TFXP * w, const TFXP * const * inputs, uint32_t numInputs, uint32_t inputSize, TFXP * results)
+{
+  int64x2_t acc[DENSE_BATCH_BLOCK];
+  for (uint32_t b = 0; b < numInputs; ++ b)
+    acc[b] = vdupq_n_s64(0);
+
+  uint32_t jj = 0;
+  for (; jj + 4 <= inputSize; jj += 4) {
+    int32x4_t vw = vld1q_s32(w + jj);
+    for (uint32_t b = 0; b < numInputs; ++ b) {
+      int32x4_t v = vld1q_s32(inputs[b] + jj);
+      acc[b] = vsraq_n_s64(acc[b], vmull_s32(vget_low_s32(v), vget_low_s32(vw)), DECIMALS);
+      acc[b] = vsraq_n_s64(acc[b], vmull_s32(vget_high_s32(v), vget_high_s32(vw)), DECIMALS);
+    }
+  }
+
+  for (uint32_t b = 0; b < numInputs; ++ b) {
+    TFXP tmp = (TFXP)(vgetq_lane_s64(acc[b], 0) + vgetq_lane_s64(acc[b], 1));
+    for (uint32_t kk = jj; kk < inputSize; ++ kk)
+      tmp += FXP_Mult(inputs[b][kk], w[kk]);
+    results[b] = tmp;
+  }
+}
+#endif
+
+static TDenseRowKernel SelectDenseRowKernel()
+{
+#if CNN_HAVE_AVX2
+  if (__builtin_cpu_supports("avx2"))
+    return DenseRowAVX2;
+#endif
+#if CNN_HAVE_NEON
+  return DenseRowNEON;
+#endif
+  return DenseRowGeneric;
+}
+
+static const TDenseRowKernel denseRowKernel = SelectDenseRowKernel();
 
 void Dense(TFXP * input, TFXP * output, uint32_t inputSize, uint32_t outputSize,
       TFXP * weights, TFXP * biases)
 {
-  TFXP tmp;
+  DenseBatch(input, output, 1, inputSize, outputSize, weights, biases);
+}
 
-  for (uint32_t ii = 0; ii < outputSize; ++ ii) {
-    tmp = 0;
-    for (uint32_t jj = 0; jj < inputSize; ++ jj) {
-      tmp += FXP_Mult(input[jj], (*weights));
-      ++ weights;
+// The output neurons are split among the threads. Each row of weights is read from memory once for the
+// whole batch: it stays in cache while the row kernel goes over the inputs in blocks of DENSE_BATCH_BLOCK.
+void DenseBatch(TFXP * input, TFXP * output, uint32_t batchSize, uint32_t inputSize, uint32_t outputSize,
+      TFXP * weights, TFXP * biases)
+{
+  ThreadPool().ParallelFor(outputSize, [=](uint32_t firstOutput, uint32_t lastOutput) {
+    const TFXP * inputs[DENSE_BATCH_BLOCK];
+    TFXP results[DENSE_BATCH_BLOCK];
+
+    for (uint32_t ii = firstOutput; ii < lastOutput; ++ ii) {
+      const TFXP * w = weights + ii*inputSize;
+      for (uint32_t b0 = 0; b0 < batchSize; b0 += DENSE_BATCH_BLOCK) {
+        uint32_t numInputs = batchSize - b0 < DENSE_BATCH_BLOCK ? batchSize - b0 : DENSE_BATCH_BLOCK;
+        for (uint32_t b = 0; b < numInputs; ++ b)
+          inputs[b] = input + (b0 + b)*inputSize;
+        denseRowKernel(w, inputs, numInputs, inputSize, results);
+        for (uint32_t b = 0; b < numInputs; ++ b)
+          output[(b0 + b)*outputSize + ii] = results[b] + biases[ii];
+      }
     }
-    output[ii] = tmp + biases[ii];
-  }
+  });
 }
 
 void Sigmoid(TFXP * input, uint32_t numParams)
@@ -1,6 +1,14 @@
 #ifndef CNN_H
 #define CNN_H
 
+class CThreadPool;
+
+// Pool of threads shared by the CPU layers.
+CThreadPool & ThreadPool();
+// Threads used by the CPU layers (MaxPool, Conv2D, Conv2DBiasReLU[MaxPool], Dense). 0 uses one per core (the default).
+void SetNumThreads(uint32_t numThreads);
+uint32_t GetNumThreads();
+
 void MaxPool(TFXP * input, TFXP * output, uint32_t channels, uint32_t width, uint32_t height);
 void ReLU(TFXP * input, uint32_t channels, uint32_t width, uint32_t height);
 void Sigmoid(TFXP * input, uint32_t numParams);
@@ -9,8 +17,21 @@ void Conv2D(TFXP *input, TFXP * output, TFXP * filters,
       uint32_t numFilters, uint32_t numChannels,
       uint32_t inputWidth, uint32_t inputHeight,
       uint32_t convWidth = 3, uint32_t convHeight = 3);
+void Conv2DBiasReLU(TFXP *input, TFXP * output, TFXP * filters, TFXP * biases,
+      uint32_t numFilters, uint32_t numChannels,
+      uint32_t inputWidth, uint32_t inputHeight, bool performReLu);
+// Conv2DBiasReLU() followed by MaxPool(), without writing the un-pooled output.
+void Conv2DBiasReLUMaxPool(TFXP *input, TFXP * output, TFXP * filters, TFXP * biases,
+      uint32_t numFilters, uint32_t numChannels,
+      uint32_t inputWidth, uint32_t inputHeight, bool performReLu);
+// Name of the SIMD kernels used by the optimized CPU backends on this CPU ("avx2", "neon" or "generic").
+const char * Conv2DKernelName();
 void Dense(TFXP * input, TFXP * output, uint32_t inputSize, uint32_t outputSize,
       TFXP * weights, TFXP * biases);
+// Dense() over a batch of inputs [batchSize][inputSize], producing outputs [batchSize][outputSize].
+// The weights are streamed from memory once per batch instead of once per input.
+void DenseBatch(TFXP * input, TFXP * output, uint32_t batchSize, uint32_t inputSize, uint32_t outputSize,
+      TFXP * weights, TFXP * biases);
 void Flatten(TFXP * input, TFXP * output, uint32_t numFilters, uint32_t width, uint32_t height);
 
 #endif 
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cnnProtocol.h"
+
+// Sends images to a cnnSolver running in server mode (cnnSolver -s socket) and prints the classification,
+// with the same OUTPUT lines as cnnSolver.
+
+uint8_t inputImage[CNN_IMAGE_SIZE];
+
+static double ElapsedMs(const struct timespec & end, const struct timespec & start)
+{
+  return (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+bool LoadImage(const char * fileName, uint8_t * image, uint32_t size)
+{
+  FILE * imageFile = fopen(fileName, "rb");
+  if (imageFile == NULL) {
+    printf("Error opening image [%s]\n", fileName);
+    return false;
+  }
+  bool ok = fread(image, 1, size, imageFile) == size;
+  if (!ok)
+    printf("Error reading %u bytes from [%s]\n", size, fileName);
+  fclose(imageFile);
+  return ok;
+}
+
+int Connect(const char * socketName)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketName) >= sizeof(addr.sun_path)) {
+    printf("Socket name too long [%s]\n", socketName);
+    return -1;
+  }
+  strcpy(addr.sun_path, socketName);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    printf("Error connecting to [%s]. Is cnnSolver -s running?\n", socketName);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void PrintUsage()
+{
+  printf("Usage: cnnClient [-s socket] [-v] image.rgba.planar ...\n");
+  printf("  -s socket   Socket of the cnnSolver server (default: %s)\n", CNN_DEFAULT_SOCKET);
+  printf("  -v          Print the name and the latency of every image\n");
+}
+
+int main(int argc, char ** argv)
+{
+  const char * socketName = CNN_DEFAULT_SOCKET;
+  bool verbose = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:v")) != -1) {
+    switch (opt) {
+      case 's':
+        socketName = optarg;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        PrintUsage();
+        return -1;
+    }
+  }
+
+  if (optind >= argc) {
+    PrintUsage();
+    return -1;
+  }
+
+  int fd = Connect(socketName);
+  if (fd < 0)
+    return -1;
+
+  uint32_t numImages = 0, numFailed = 0;
+  double totalMs = 0, inferenceMs = 0;
+  TInferenceReply reply;
+
+  for (int ii = optind; ii < argc; ++ ii) {
+    if (!LoadImage(argv[ii], inputImage, CNN_IMAGE_SIZE)) {
+      ++ numFailed;
+      continue;
+    }
+
+    struct timespec start, end;
+    TInferenceRequest request = {CNN_PROTOCOL_MAGIC, CNN_IMAGE_SIZE};
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    if (!WriteAll(fd, &request, sizeof(request)) || !WriteAll(fd, inputImage, CNN_IMAGE_SIZE) ||
+        !ReadAll(fd, &reply, sizeof(reply))) {
+      printf("Connection to the server lost\n");
+      close(fd);
+      return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+
+    if (reply.magic != CNN_PROTOCOL_MAGIC || reply.status != REPLY_OK) {
+      printf("The server rejected the request (status %u)\n", reply.status);
+      close(fd);
+      return -1;
+    }
+
+    double ms = ElapsedMs(end, start);
+    totalMs += ms;
+    inferenceMs += reply.timeNs / 1e6;
+    ++ numImages;
+
+    if (verbose)
+      printf("Image: %s (%0.3lf ms, inference %0.3lf ms)\n", argv[ii], ms, reply.timeNs / 1e6);
+    printf("OUTPUT: %0.8lf --> %s\n", reply.score, reply.score < 0.5 ? "CAT" : "DOG");
+  }
+  close(fd);
+
+  if (numImages > 0)
+    printf("Images: %u classified, %u failed, average latency %0.3lf ms (inference %0.3lf ms)\n",
+      numImages, numFailed, totalMs / numImages, inferenceMs / numImages);
+
+  if (numFailed > 0)
+    return -1;
+  // A single image returns its class, like cnnSolver.
+  if (numImages == 1)
+    return reply.score < 0.5 ? 0 : 1;
+  return 0;
+}
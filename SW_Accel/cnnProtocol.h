@@ -0,0 +1,60 @@
+#ifndef CNN_PROTOCOL_H
+#define CNN_PROTOCOL_H
+
+#include <stdint.h>
+#include <unistd.h>
+
+// Protocol between cnnSolver -s (server) and cnnClient over a Unix domain socket.
+// The client sends any number of requests over one connection, each one answered by a reply:
+//   TInferenceRequest + uint8_t image[3][256][256] (planar RGB, the same layout as the *.rgba.planar files)
+//   TInferenceReply
+// Both ends run on the same machine, so the structs are sent in native byte order.
+
+const char * const CNN_DEFAULT_SOCKET = "/tmp/cnnSolver.sock";
+const uint32_t CNN_PROTOCOL_MAGIC = 0x314E4E43; // "CNN1"
+const uint32_t CNN_IMAGE_SIZE = 256*256*3;
+
+typedef enum {REPLY_OK = 0, REPLY_BAD_REQUEST = 1} TReplyStatus;
+
+struct TInferenceRequest {
+  uint32_t magic;
+  uint32_t imageSize; // Must be CNN_IMAGE_SIZE
+};
+
+struct TInferenceReply {
+  uint32_t magic;
+  uint32_t status;    // TReplyStatus. After REPLY_BAD_REQUEST the server closes the connection.
+  int32_t fxpScore;   // Sigmoid output in FxP
+  float score;        // Same, as float. < 0.5 is a cat.
+  uint64_t timeNs;    // Inference time in the server, without the transfers.
+};
+
+// Blocking transfers of a whole buffer. They fail on EOF, on errors and on signals (EINTR), so that the
+// server can be stopped while waiting for a client.
+inline bool ReadAll(int fd, void * buffer, size_t size)
+{
+  uint8_t * p = (uint8_t *)buffer;
+  while (size > 0) {
+    ssize_t n = read(fd, p, size);
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool WriteAll(int fd, const void * buffer, size_t size)
+{
+  const uint8_t * p = (const uint8_t *)buffer;
+  while (size > 0) {
+    ssize_t n = write(fd, p, size);
+    if (n <= 0)
+      return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+#endif
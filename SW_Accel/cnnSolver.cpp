@@ -3,51 +3,114 @@
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
 
 #include "model.h"
+#include "network.h"
 #include "CConvDriver.hpp"
+#include "CDenseDriver.hpp"
+#include "CNetExecutor.hpp"
+#include "cnn.h"
+#include "cnnProtocol.h"
+#include "CImagePrefetcher.hpp"
 
 const uint32_t MAP_SIZE = 64*1024; // Size of address range mapped to the adder registers
 // const uint32_t CONV_ADDR = 0x40000000; // From Vivado's address editor
 
 const char* DRIVER_NAME = "/dev/conv";
+const char* DENSE_DRIVER_NAME = "/dev/dense";
 
-const uint32_t INPUT_SIZE = (256*256*3);
-
-TFXP * weights[NUM_LAYERS] = {nullptr};
-TFXP * biases[NUM_LAYERS] = {nullptr};
+TNetwork network;   // Read from the model file
+std::vector<TFXP*> weights;
+std::vector<TFXP*> biases;
 TTimes times;
 
-uint8_t inputImage[INPUT_SIZE];   // RGB pixel data separated in planes.
+std::vector<uint8_t> inputImage;   // RGB pixel data separated in planes.
 
 TFXP* inputImageFxp = nullptr;  // RGB planar data, converted to [0, 1] in FxP.
-TFXP *buffer0 = nullptr, *buffer1 = nullptr;  // Ping-pong buffer for activations.
+// More input buffers, to load the next images while the previous ones are in the pipeline.
+std::vector<TFXP*> prefetchImagesFxp;
+
+// In batch mode, the dense layers run once for up to CLASSIFIER_BATCH images, so that their weights
+// (4.7 MB in the default model) are read once per group instead of once per image.
+const uint32_t CLASSIFIER_BATCH = 16;
+
+// Images in flight with the accelerator (-p): while it convolves one, the CPU pools and classifies the other.
+// Each one needs its own activations (10 MB in the default model), and the CPU backends gain nothing from it.
+const uint32_t DEFAULT_ACCEL_PIPELINE_DEPTH = 2;
+uint32_t pipelineDepth = 0;   // 0: the default of the backend
+
+// All the DMA-compatible buffers (parameters, activations, images) are carved from one region of this size
+// (-m), instead of one CMA allocation each. The default model takes about 18 MB with the accelerator, and
+// 29 MB with two images in flight.
+const uint32_t DEFAULT_DMA_ARENA_MB = 32;
 
 void InitTimes(TTimes & times);
 void PrintTimes(TTimes & times, uint32_t numLayers);
 
 bool InitDevice(CConvDriver& convolver, bool log = true) {
-  printf("\n\nThis program requires that the bitstream is loaded in the FPGA.\n");
-  printf("This program has to be run with sudo.\n");
-  printf("Press ENTER to confirm that the bitstream is loaded (proceeding without it can crash the board).\n\n");
-  getchar();
-
-  if ( convolver.Open(DRIVER_NAME) != CAccelDriver::OK ) {
-    printf("Error opening the device driver %s", DRIVER_NAME);
-    // printf("Error mapping device at physical address 0x%08X\n", CONV_ADDR);
+  // The CPU backends do not touch the FPGA, so there is no need to open the driver.
+  if (convolver.NeedsDevice()) {
+    printf("\n\nThis program requires that the bitstream is loaded in the FPGA.\n");
+    printf("This program has to be run with sudo.\n");
+    printf("Press ENTER to confirm that the bitstream is loaded (proceeding without it can crash the board).\n\n");
+    getchar();
+
+    if ( convolver.Open(DRIVER_NAME) != CAccelDriver::OK ) {
+      printf("Error opening the device driver %s", DRIVER_NAME);
+      // printf("Error mapping device at physical address 0x%08X\n", CONV_ADDR);
+      return false;
+    }
+    if (log) {
+      const CConvDriver::TAccelCaps & caps = convolver.AccelCaps();
+      printf("Device driver %s succesfully open\n", DRIVER_NAME);
+      printf("Accelerator: %u channels x %u filters per cycle, %u-bit values, up to %u channels and %u values per row\n\n",
+        caps.parallelChannels, caps.parallelFilters, caps.valueBits, caps.maxChannels, caps.maxRowBufferSize);
+    }
+  }
+  return true;
+}
+
+// The Dense accelerator (-d), once the convolver is open: it uses the CMA memory of the convolver.
+bool InitDenseDevice(CDenseDriver& denseDriver) {
+  if ( denseDriver.Open(DENSE_DRIVER_NAME) != CAccelDriver::OK ) {
+    printf("Error opening the device driver %s\n", DENSE_DRIVER_NAME);
     return false;
   }
+  const CDenseDriver::TAccelCaps & caps = denseDriver.AccelCaps();
+  printf("Device driver %s succesfully open\n", DENSE_DRIVER_NAME);
+  printf("Dense accelerator: %u images x %u values per cycle, %u-bit values, up to %u inputs\n\n",
+    caps.parallelImages, caps.valuesPerBeat, caps.valueBits, caps.maxInputSize);
+  return true;
+}
+
+// The sizes of the buffers come from the network, so they are allocated once the model is loaded.
+bool AllocBuffers(CConvDriver& convolver, CNetExecutor& executor, bool log = true) {
   if (log)
-    printf("Device driver %s succesfully open\n\n", DRIVER_NAME);
-  
-  if (log)
-    printf("Allocating DMA memory for buffer0 and buffer1...\n");
+    printf("Allocating DMA memory for the activations...\n");
 
-  buffer0 = (TFXP *)convolver.AllocDMACompatible(4129024 * sizeof(TFXP));
-  buffer1 = (TFXP *)convolver.AllocDMACompatible(1032256 * sizeof(TFXP));
-  inputImageFxp = (TFXP *) convolver.AllocDMACompatible(INPUT_SIZE * sizeof(TFXP));
+  inputImage.resize(executor.InputSize());
+  inputImageFxp = (TFXP *) convolver.AllocDMACompatible(executor.InputSize() * sizeof(TFXP));
+  bool ok = inputImageFxp != nullptr;
+  // One buffer per image in flight, plus the one being loaded.
+  prefetchImagesFxp.assign(pipelineDepth, nullptr);
+  for (auto& ptr: prefetchImagesFxp) {
+    ptr = (TFXP *) convolver.AllocDMACompatible(executor.InputSize() * sizeof(TFXP));
+    ok = ok && ptr != nullptr;
+  }
 
-  if ((buffer0 == nullptr) || (buffer1 == nullptr) || (inputImageFxp == nullptr)) {
+  if (!executor.AllocBuffers(CLASSIFIER_BATCH, pipelineDepth) || !ok) {
     if (log)
       printf("Error allocating DMA memory.\n");
     return false;
@@ -55,7 +118,9 @@ bool InitDevice(CConvDriver& convolver, bool log = true) {
   return true;
 }
 
-void FreeAllBuffers(CConvDriver& convolver) {
+void FreeAllBuffers(CConvDriver& convolver, CNetExecutor& executor) {
+  executor.FreeBuffers();
+
   auto freeBuffer = [&](TFXP*& ptr) {
     if (ptr != nullptr) {
       convolver.FreeDMACompatible(ptr);
@@ -63,9 +128,10 @@ void FreeAllBuffers(CConvDriver& convolver) {
     }
   };
 
-  freeBuffer(buffer0);
-  freeBuffer(buffer1);
   freeBuffer(inputImageFxp);
+  for(auto& ptr: prefetchImagesFxp) {
+    freeBuffer(ptr);
+  }
 
   for(auto& ptr: weights) {
     freeBuffer(ptr);
@@ -76,48 +142,422 @@ void FreeAllBuffers(CConvDriver& convolver) {
   }
 }
 
+// Adds an image argument to the list. A directory adds all its *.planar files, in alphabetical order.
+bool AddImages(const char * path, std::vector<std::string> & images)
+{
+  struct stat info;
+  if (stat(path, &info) != 0) {
+    printf("Error opening [%s]\n", path);
+    return false;
+  }
+
+  if (!S_ISDIR(info.st_mode)) {
+    images.push_back(path);
+    return true;
+  }
+
+  DIR * dir = opendir(path);
+  if (dir == NULL) {
+    printf("Error opening directory [%s]\n", path);
+    return false;
+  }
+
+  std::vector<std::string> dirImages;
+  struct dirent * entry;
+  while ((entry = readdir(dir)) != NULL) {
+    std::string name = entry->d_name;
+    if (name.size() > 7 && name.compare(name.size() - 7, 7, ".planar") == 0)
+      dirImages.push_back(std::string(path) + "/" + name);
+  }
+  closedir(dir);
+
+  std::sort(dirImages.begin(), dirImages.end());
+  images.insert(images.end(), dirImages.begin(), dirImages.end());
+  return true;
+}
+
+// Adds the images listed in a text file, one path (or directory) per line.
+bool AddImageList(const char * listName, std::vector<std::string> & images)
+{
+  FILE * listFile = fopen(listName, "r");
+  if (listFile == NULL) {
+    printf("Error opening image list [%s]\n", listName);
+    return false;
+  }
+
+  char line[4096];
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), listFile) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] != '\0' && line[0] != '#')
+      ok = AddImages(line, images);
+  }
+  fclose(listFile);
+  return ok;
+}
+
+static volatile sig_atomic_t stopServer = 0;
+
+static void StopServer(int)
+{
+  stopServer = 1;
+}
+
+// Answers the requests of one client until it closes the connection. Returns the number of images classified.
+uint32_t ServeClient(CNetExecutor& executor, int clientFd)
+{
+  TInferenceRequest request;
+  uint32_t numRequests = 0;
+
+  while (!stopServer && ReadAll(clientFd, &request, sizeof(request))) {
+    TInferenceReply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.magic = CNN_PROTOCOL_MAGIC;
+
+    if (request.magic != CNN_PROTOCOL_MAGIC || request.imageSize != executor.InputSize()) {
+      printf("Bad request (magic 0x%08X, image size %u)\n", request.magic, request.imageSize);
+      reply.status = REPLY_BAD_REQUEST;
+      WriteAll(clientFd, &reply, sizeof(reply));
+      break;
+    }
+    if (!ReadAll(clientFd, inputImage.data(), executor.InputSize()))
+      break;
+
+    // The reply carries a single score: the first output of the network.
+    std::vector<TFXP> outputs(executor.OutputSize());
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+    ConvertImageToFxp(inputImage.data(), inputImageFxp, executor.InputSize());
+    InitTimes(times);
+    executor.Run(inputImageFxp, outputs.data(), times);
+    TFXP finalPrediction = outputs[0];
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+
+    reply.status = REPLY_OK;
+    reply.fxpScore = finalPrediction;
+    reply.score = Fxp2Float(finalPrediction, DECIMALS);
+    reply.timeNs = CalcTimeDiff(end, start);
+    if (!WriteAll(clientFd, &reply, sizeof(reply)))
+      break;
+    ++ numRequests;
+  }
+  return numRequests;
+}
+
+// Keeps the device, the buffers and the model loaded, and classifies the images sent by cnnClient through a
+// Unix domain socket. The clients are served one at a time. SIGINT/SIGTERM stop the server.
+bool RunServer(CNetExecutor& executor, const char * socketName)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketName) >= sizeof(addr.sun_path)) {
+    printf("Socket name too long [%s]\n", socketName);
+    return false;
+  }
+  strcpy(addr.sun_path, socketName);
+
+  int serverFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (serverFd < 0) {
+    perror("socket");
+    return false;
+  }
+
+  // Remove the socket left by a previous server that did not exit cleanly.
+  unlink(socketName);
+  if (bind(serverFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(serverFd, 8) != 0) {
+    printf("Error listening on [%s]: %s\n", socketName, strerror(errno));
+    close(serverFd);
+    return false;
+  }
+
+  // No SA_RESTART, so that accept() and read() return when the server has to stop.
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = StopServer;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("Listening on %s\n", socketName);
+  fflush(stdout);
+
+  uint32_t numClients = 0, numRequests = 0;
+  while (!stopServer) {
+    int clientFd = accept(serverFd, NULL, NULL);
+    if (clientFd < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("accept");
+      break;
+    }
+    numRequests += ServeClient(executor, clientFd);
+    ++ numClients;
+    close(clientFd);
+  }
+
+  close(serverFd);
+  unlink(socketName);
+  printf("Server stopped: %u clients, %u images\n", numClients, numRequests);
+  return true;
+}
+
+// Applies the -L option: one backend per conv layer, in order.
+bool SetLayerBackends(CNetExecutor& executor, const char * layerBackends)
+{
+  if (layerBackends == NULL)
+    return true;
+
+  const TNetwork & network = executor.Network();
+  std::string list = layerBackends;
+  size_t position = 0;
+  for (uint32_t iLayer = 0; iLayer < network.layers.size() && position <= list.size(); ++ iLayer) {
+    if (network.layers[iLayer].type != CONV)
+      continue;
+
+    size_t comma = list.find(',', position);
+    std::string name = list.substr(position, comma == std::string::npos ? std::string::npos : comma - position);
+    position = comma == std::string::npos ? list.size() + 1 : comma + 1;
+    if (name.empty())
+      continue;
+
+    CConvDriver::TBackend backend;
+    if (!CConvDriver::ParseBackend(name.c_str(), backend)) {
+      printf("Unknown backend [%s]\n", name.c_str());
+      return false;
+    }
+    if (!executor.SetConvBackend(iLayer, backend))
+      return false;
+  }
+  if (position <= list.size()) {
+    printf("There are more backends in [%s] than conv layers\n", layerBackends);
+    return false;
+  }
+  return true;
+}
+
+// The layers on a 16-bit backend need the decimals of the activations, measured on the calibration images (the
+// sample images by default).
+bool QuantizeFxp16Layers(CConvDriver& convolver, CNetExecutor& executor, std::vector<std::string> calibrationImages)
+{
+  const TNetwork & network = executor.Network();
+  bool needed = false;
+  for (uint32_t iLayer = 0; iLayer < network.layers.size(); ++ iLayer)
+    needed = needed || (network.layers[iLayer].type == CONV && convolver.UsesFxp16(executor.ConvBackend(iLayer)));
+  if (!needed)
+    return true;
+
+  if (calibrationImages.empty())
+    calibrationImages.assign(std::begin(FXP16_CALIBRATION_IMAGES), std::end(FXP16_CALIBRATION_IMAGES));
+  return QuantizeModelFxp16(convolver, network, weights, biases, calibrationImages);
+}
+
+void PrintUsage()
+{
+  printf("Usage: cnnSolver [-b backend] [-L backends] [-d] [-t threads] [-m MB] [-p images] [-q image] [-l list] [image.rgba.planar | directory] ...\n");
+  printf("       cnnSolver [-b backend] [-L backends] [-d] [-t threads] [-m MB] [-q image] -s socket\n");
+  printf("  -b backend  Where the convolutions run:");
+  for (uint32_t ii = 0; ii < CConvDriver::NUM_BACKENDS; ++ ii)
+    printf(" %s", CConvDriver::BackendName((CConvDriver::TBackend)ii));
+  printf(" (default: %s)\n", CConvDriver::BackendName(CConvDriver::BACKEND_ACCEL));
+  printf("  -L backends Backend of each conv layer, separated by commas (e.g. cpu-opt,accel,accel). Empty or\n");
+  printf("              missing entries use -b. The accelerator can only be used with -b accel.\n");
+  printf("  -d          Run the dense layers on the Dense accelerator (%s). Needs -b accel\n", DENSE_DRIVER_NAME);
+  printf("  -t threads  Threads for the CPU layers (default: one per core)\n");
+  printf("  -m MB       Size of the DMA arena (default: %u, 0 allocates every buffer separately)\n", DEFAULT_DMA_ARENA_MB);
+  printf("  -p images   Images in flight, so that the accelerator and the CPU work at the same time\n");
+  printf("              (default: %u with -b accel, 1 otherwise)\n", DEFAULT_ACCEL_PIPELINE_DEPTH);
+  printf("  -q image    Calibration image of the 16-bit layers (cpu-fxp16, or a 16-bit accelerator). Can be repeated\n");
+  printf("              (default: %s and %s)\n", FXP16_CALIBRATION_IMAGES[0], FXP16_CALIBRATION_IMAGES[1]);
+  printf("  -l list     Text file with one image (or directory) per line\n");
+  printf("  -s socket   Serve the images sent by cnnClient through this Unix socket (e.g. %s)\n", CNN_DEFAULT_SOCKET);
+  printf("The model is loaded once and all the images are classified in order.\n");
+}
+
 int main(int argc, char ** argv)
 {
-  if (argc != 2) {
-    printf("Usage: cnnSolver image.rgba.planar\n");
+  CConvDriver::TBackend backend = CConvDriver::BACKEND_ACCEL;
+  std::vector<std::string> images, calibrationImages;
+  const char * socketName = NULL;
+  const char * layerBackends = NULL;
+  uint32_t arenaMB = DEFAULT_DMA_ARENA_MB;
+  bool denseAccel = false;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "b:L:dt:m:p:q:l:s:")) != -1) {
+    switch (opt) {
+      case 'b':
+        if (!CConvDriver::ParseBackend(optarg, backend)) {
+          printf("Unknown backend [%s]\n", optarg);
+          PrintUsage();
+          return -1;
+        }
+        break;
+      case 'L':
+        layerBackends = optarg;
+        break;
+      case 'd':
+        denseAccel = true;
+        break;
+      case 't':
+        SetNumThreads(atoi(optarg));
+        break;
+      case 'm':
+        arenaMB = atoi(optarg);
+        break;
+      case 'p':
+        pipelineDepth = atoi(optarg);
+        if (pipelineDepth == 0) {
+          printf("The pipeline needs at least one image\n");
+          return -1;
+        }
+        break;
+      case 'q':
+        calibrationImages.push_back(optarg);
+        break;
+      case 'l':
+        if (!AddImageList(optarg, images))
+          return -1;
+        break;
+      case 's':
+        socketName = optarg;
+        break;
+      default:
+        PrintUsage();
+        return -1;
+    }
+  }
+
+  for (int ii = optind; ii < argc; ++ ii) {
+    if (!AddImages(argv[ii], images))
+      return -1;
+  }
+
+  if (images.empty() == (socketName == NULL)) {
+    PrintUsage();
+    return -1;
+  }
+  // The dense layers read their parameters and activations from the CMA memory of the convolver.
+  if (denseAccel && backend != CConvDriver::BACKEND_ACCEL) {
+    printf("The Dense accelerator (-d) needs -b accel\n");
     return -1;
   }
+  // The server classifies one image at a time.
+  if (pipelineDepth == 0)
+    pipelineDepth = (backend == CConvDriver::BACKEND_ACCEL && socketName == NULL) ? DEFAULT_ACCEL_PIPELINE_DEPTH : 1;
 
-  CConvDriver convolver(false);
-  if (!InitDevice(convolver)) {
-    FreeAllBuffers(convolver);
+  CConvDriver convolver(false, backend);
+  CNetExecutor executor(convolver);
+  CDenseDriver denseDriver(convolver);
+  if (!InitDevice(convolver) || (denseAccel && !InitDenseDevice(denseDriver)) || (arenaMB > 0 && !convolver.CreateDMAArena(arenaMB << 20))) {
+    FreeAllBuffers(convolver, executor);
     return -1;
   }
   
-  if (!LoadModelInFxP(convolver, weights, biases)) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+  if (!LoadModelInFxP(convolver, network, weights, biases)) {
     printf("Error loading the CNN model and converting to FxP!\n");
-    FreeAllBuffers(convolver);
+    FreeAllBuffers(convolver, executor);
     return -1;
   }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+  printf("Model loaded in %0.3lf s\n", CalcTimeDiff(end, start) / 1e9);
 
-  if (!LoadImageInFxp(argv[1], inputImageFxp, inputImage, INPUT_SIZE)) {
-    printf("Error loading the image file.\n");
-    FreeAllBuffers(convolver);
+  if (!executor.Init(network, weights, biases) || !SetLayerBackends(executor, layerBackends) ||
+      !QuantizeFxp16Layers(convolver, executor, calibrationImages) || !AllocBuffers(convolver, executor)) {
+    FreeAllBuffers(convolver, executor);
     return -1;
   }
+  if (denseAccel)
+    executor.SetDenseDriver(&denseDriver);
+  executor.Print();
+  if (convolver.DMAArenaSize() > 0)
+    printf("DMA arena: %0.1lf of %0.1lf MB used\n", convolver.DMAArenaUsed() / 1048576.0, convolver.DMAArenaSize() / 1048576.0);
 
-  InitTimes(times);
-  TFXP finalPrediction = Inference(convolver, inputImageFxp, buffer0, buffer1, weights, biases, times);
-  printf("OUTPUT: %0.8lf --> %s\n", Fxp2Float(finalPrediction, DECIMALS),
-    Fxp2Float(finalPrediction) < 0.5 ? "CAT" : "DOG");
-  PrintTimes(times, NUM_LAYERS);
+  if (socketName != NULL) {
+    bool ok = RunServer(executor, socketName);
+    FreeAllBuffers(convolver, executor);
+    return ok ? 0 : -1;
+  }
 
-  FreeAllBuffers(convolver);
-  return Fxp2Float(finalPrediction) < 0.5 ? 0 : 1;;
-}
+  // With several images, the times printed at the end are the sum over all of them.
+  const bool batch = images.size() > 1;
+  TTimes totalTimes;
+  TFXP finalPrediction = 0;
+  uint32_t numFailed = 0;
+
+  InitTimes(totalTimes);
+  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+  {
+    // The next images are loaded and converted on another thread while the executor works on the previous ones.
+    std::vector<TFXP*> imageBuffers = prefetchImagesFxp;
+    imageBuffers.push_back(inputImageFxp);
+    CImagePrefetcher prefetcher(images, imageBuffers, executor.InputSize());
+    std::map<uint32_t, CImagePrefetcher::TImage> inFlight;   // By index
+
+    auto next = [&](TFXP *& input, uint32_t & tag) {
+      CImagePrefetcher::TImage image;
+      while (prefetcher.Next(image)) {
+        if (image.ok) {
+          inFlight[image.index] = image;
+          input = image.fxp;
+          tag = image.index;
+          return true;
+        }
+        printf("Error loading the image file.\n");
+        ++ numFailed;
+        prefetcher.Release(image);
+      }
+      return false;
+    };
+    auto inputDone = [&](uint32_t tag) {
+      prefetcher.Release(inFlight[tag]);
+      inFlight.erase(tag);
+    };
+    auto output = [&](uint32_t tag, const TFXP * outputs) {
+      finalPrediction = outputs[0];
+      if (batch)
+        printf("Image: %s\n", images[tag].c_str());
+      printf("OUTPUT: %0.8lf --> %s\n", Fxp2Float(finalPrediction, DECIMALS),
+        Fxp2Float(finalPrediction) < 0.5 ? "CAT" : "DOG");
+    };
+    executor.RunStream(next, inputDone, output, totalTimes);
+  }
+  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+
+  uint32_t numDone = images.size() - numFailed;
+  if (numDone > 0) {
+    if (backend != CConvDriver::BACKEND_ACCEL && backend != CConvDriver::BACKEND_CPU_REF && backend != CConvDriver::BACKEND_CPU_FXP16)
+      printf("Backend: %s (%s), %u threads\n", CConvDriver::BackendName(backend), Conv2DKernelName(), GetNumThreads());
+    else
+      printf("Backend: %s, %u threads\n", CConvDriver::BackendName(backend), GetNumThreads());
+    PrintTimes(totalTimes, network.layers.size());
+  }
 
+  // Wall time, including the loading of the images.
+  double elapsed = CalcTimeDiff(end, start) / 1e9;
+  printf("Images: %u classified, %u failed, %0.3lf s (%0.2lf images/s)\n", numDone, numFailed, elapsed,
+    elapsed > 0 ? numDone / elapsed : 0.0);
+
+  FreeAllBuffers(convolver, executor);
+  if (numFailed > 0)
+    return -1;
+  // A single image returns its class, as before.
+  if (!batch)
+    return Fxp2Float(finalPrediction) < 0.5 ? 0 : 1;
+  return 0;
+}
 
 void InitTimes(TTimes & times)
 {
-  for (uint32_t ii = 0; ii < NUM_LAYERS; ++ ii) {
+  for (uint32_t ii = 0; ii < MAX_NET_LAYERS; ++ ii) {
     times.timeConv[ii] = 0;
     times.timeMaxPool[ii] = 0;
     times.timeDense[ii] = 0;
+    times.accelCycles[ii] = 0;
+    times.accelMemCycles[ii] = 0;
+    times.accelBytes[ii] = 0;
   }
   times.timeFlatten = 0;
   times.timeSigmoid = 0;
@@ -135,6 +575,15 @@ void PrintTimes(TTimes & times, uint32_t numLayers)
     }
   }
 
+  // The counters of the accelerators tell whether a layer is bound by the compute or by the memory bus.
+  for (uint32_t ii = 0; ii < numLayers; ++ ii) {
+    if (times.accelCycles[ii] != 0) {
+      double memShare = (double)times.accelMemCycles[ii] / times.accelCycles[ii];
+      printf("%s %u accel --> %" PRIu64 " cycles, %0.1lf %% waiting on memory (%s-bound), %" PRIu64 " bytes\n",
+        network.layers[ii].type == DENSE ? "Dense" : "Conv", ii, times.accelCycles[ii], memShare * 100, memShare > 0.5 ? "memory" : "compute", times.accelBytes[ii]);
+    }
+  }
+
   for (uint32_t ii = 0; ii < numLayers; ++ ii) {
     if (times.timeMaxPool[ii] != 0) {
       printf("MaxPool %u --> %" PRIu64 " ns (%0.3lf s)\n", ii, times.timeMaxPool[ii], times.timeMaxPool[ii]/1e9);
@@ -11,9 +11,14 @@
 #include <asm/uaccess.h>         /* copy_to copy_from _user */
 #include <linux/uaccess.h>
 #include <linux/io.h>
+#include <linux/poll.h>          /* poll_wait, POLLIN... */
+#include <linux/mutex.h>
+#include <linux/delay.h>         /* udelay */
 
 #define DRIVER_NAME "conv_driver"
 #define CONV_IRQ 48  // Hard-coded value of IRQ vector (GIC: 61).
+#define AXI_BEAT_BYTES 8  // AXI_BEAT_WORDS values of the input bundle (HLS/conv.h).
+#define CONV_FILTER_SIZE 3
 
 // Structure that mimics the layout of the peripheral registers.
 // Vitis HLS skips some addresses in the register file. We introduce
@@ -43,8 +48,31 @@ struct TRegs {
       uint32_t padding7; // 0x5c
       uint32_t performReLu; //0x60
       uint32_t padding8; // 0x64
-      uint32_t resultOk; // 0x68
-      uint32_t resultOk_ctrl; // 0x6c
+      uint32_t performMaxPool; // 0x68
+      uint32_t padding9; // 0x6c
+      uint32_t resultOk; // 0x70
+      uint32_t resultOk_ctrl; // 0x74
+      uint32_t cycles; // 0x78 Counters of the last convolution (HLS/conv.h)
+      uint32_t cycles_ctrl; // 0x7c
+      uint32_t memCycles; // 0x80
+      uint32_t memCycles_ctrl; // 0x84
+      uint32_t bytesRead; // 0x88
+      uint32_t bytesRead_ctrl; // 0x8c
+      uint32_t bytesWritten; // 0x90
+      uint32_t bytesWritten_ctrl; // 0x94
+      uint32_t inputSkip; // 0x98 Position of the first input value in its beat (HLS/conv.h)
+      uint32_t padding10; // 0x9c
+      uint32_t capabilities; // 0xa0 Configuration of the bitstream (HLS/conv.h), written by every convolution
+      uint32_t capabilities_ctrl; // 0xa4
+      uint32_t maxChannels; // 0xa8
+      uint32_t maxChannels_ctrl; // 0xac
+      uint32_t maxRowBufferSize; // 0xb0
+      uint32_t maxRowBufferSize_ctrl; // 0xb4
+      uint32_t inputDecimals; // 0xb8 Decimals of the layer, for the 16-bit datapath (HLS/conv.h)
+      uint32_t padding11; // 0xbc
+      uint32_t weightDecimals; // 0xc0
+      uint32_t padding12; // 0xc4
+      uint32_t outputDecimals; // 0xc8
 };
 
 // Structure used to pass commands between user-space and kernel-space.
@@ -58,17 +86,84 @@ struct user_message {
   uint32_t inputWidth;
   uint32_t inputHeight;
   uint32_t performReLu;
+  uint32_t performMaxPool;      // 2x2 MaxPool before writing: output[numFilters][outputHeight/2][outputWidth/2]
   uint32_t resultOkPtr;
+  uint32_t inputDecimals;       // Only used by the 16-bit datapath
+  uint32_t weightDecimals;
+  uint32_t outputDecimals;
 };
 
+// Chain of convolutions for ioctl(CONV_IOC_SUBMIT_CHAIN / CONV_IOC_RUN_CHAIN). The IRQ handler starts each one
+// as soon as the previous one finishes, so the whole chain costs one system call and one wake-up.
+// The resultOkPtr of the descriptors is not used: status receives the resultOk of each descriptor (0 for the
+// ones that did not run, because an earlier one failed).
+// stats receives the counters of the accelerator for each descriptor (zeros for the ones that did not run).
+struct conv_chain {
+  uint32_t descriptors;       // User address of struct user_message[numDescriptors]
+  uint32_t numDescriptors;    // 1..CONV_MAX_CHAIN
+  uint32_t status;            // User address of uint32_t[numDescriptors], or 0
+  uint32_t stats;             // User address of struct conv_stats[numDescriptors], or 0
+};
+
+// Counters of the accelerator for one convolution (see HLS/conv.h).
+struct conv_stats {
+  uint32_t cycles;            // Total
+  uint32_t memCycles;         // Waiting on the memory bus
+  uint32_t bytesRead;
+  uint32_t bytesWritten;
+};
+
+// Configuration of the bitstream, read from the capability registers when the module is loaded (see HLS/conv.h).
+// All zeros if the bitstream does not have them.
+struct conv_caps {
+  uint32_t capabilities;      // Bits 7-0 parallel channels, 15-8 parallel filters, 23-16 value bits, 31-24 decimals
+  uint32_t maxChannels;
+  uint32_t maxRowBufferSize;
+};
+
+#define CONV_MAX_CHAIN 1024
+#define CONV_IOC_MAGIC 'C'
+// Starts the chain and returns at once. read() of a uint32_t waits for it, as after write().
+#define CONV_IOC_SUBMIT_CHAIN _IOW(CONV_IOC_MAGIC, 1, struct conv_chain)
+// Starts the chain and waits for it.
+#define CONV_IOC_RUN_CHAIN _IOW(CONV_IOC_MAGIC, 2, struct conv_chain)
+// Returns the configuration of the bitstream.
+#define CONV_IOC_GET_CAPS _IOR(CONV_IOC_MAGIC, 3, struct conv_caps)
+
 int conv_major = 0;
 int conv_minor = 0;
 module_param(conv_major,int,S_IRUGO);
 module_param(conv_minor,int,S_IRUGO);
 
-// We declare a wait queue that will allow us to wait on a condition.
-wait_queue_head_t wq;
-int flag = 0;
+// Every open file is a client with its own job: a chain of convolutions (write() and read() of a user_message
+// submit a chain of one). Only one job per file can be in flight.
+//  The clients with convolutions left wait in run_queue. Every time the accelerator finishes one, the IRQ handler
+// puts its client back at the end of the queue and starts the next convolution of the first client. So the
+// clients share the accelerator round-robin, one convolution at a time, whatever the length of their chains,
+// and it never waits for a process to wake up. hw_lock serializes the queue and the programming of the registers.
+struct conv_client {
+  struct mutex lock;            // Serializes the submission and collection of the job of the file
+  wait_queue_head_t wq;         // Woken when the job has finished
+  struct list_head node;        // In run_queue while the job waits for the accelerator
+  int busy;                     // A job was submitted and its result has not been read yet
+  int done;                     // The job has finished (all its convolutions, or the first that failed)
+  int cancelled;                // The file was closed: the job stops after the running convolution
+  struct user_message * chain;
+  uint32_t * status;            // resultOk of each convolution (0 for the ones that did not run)
+  struct conv_stats * stats;    // Counters of each convolution
+  uint32_t length;
+  uint32_t next;                // Next convolution to start
+  uint32_t statusPtr;           // User address for the status of each convolution, or 0
+  uint32_t statsPtr;            // User address for the counters of each convolution, or 0
+};
+
+static DEFINE_SPINLOCK(hw_lock);
+static LIST_HEAD(run_queue);
+static struct conv_client * running = NULL;   // Client of the convolution on the accelerator
+static int failed = 0;                        // A convolution never finished: no job starts until its IRQ arrives
+static struct conv_caps caps;
+static DEFINE_MUTEX(probe_lock);
+static int probed = 0;                        // conv_probe() has run
 
 // This structure contains the device information.
 struct conv_info {
@@ -85,6 +180,16 @@ static struct conv_info conv_mem = {CONV_IRQ, 0x40000000, 0x4000FFFF};
 int conv_open(struct inode *inode, struct file *filp);
 int conv_release(struct inode *inode, struct file *filed_mem);
 ssize_t conv_read(struct file *filed_mem, char __user *buf, size_t count, loff_t *f_pos);
+ssize_t conv_write(struct file *filed_mem, const char __user *buf, size_t count, loff_t *f_pos);
+unsigned int conv_poll(struct file *filed_mem, poll_table *wait);
+long conv_ioctl(struct file *filed_mem, unsigned int cmd, unsigned long arg);
+
+static void conv_start(const struct user_message * message);
+static void conv_probe(void);
+static void conv_kick(void);
+static void conv_fail(void);
+static int conv_submit(struct conv_client * client, struct user_message * descriptors, uint32_t numDescriptors, uint32_t statusPtr, uint32_t statsPtr);
+static uint32_t conv_finish(struct conv_client * client);
 
 // IRQ handler function.
 static irq_handler_t  convIRQHandler(unsigned int irq, void *dev_id, struct pt_regs *regs);
@@ -93,26 +198,81 @@ static irq_handler_t  convIRQHandler(unsigned int irq, void *dev_id, struct pt_r
 struct file_operations conv_fops = {
   .owner =    THIS_MODULE,
   .read =     conv_read,
+  .write =    conv_write,
+  .poll =     conv_poll,
+  .unlocked_ioctl = conv_ioctl,
   .open =     conv_open,
   .release =  conv_release,
 };
 
 
 // Function that implements system call open() for our driver.
-// Initialize the device and enable the interrups here.
+// Every open file is a client of the accelerator, with its own job.
 int conv_open(struct inode *inode, struct file *filp)
 {
+  struct conv_client * client;
+
   pr_info("CONV_DRIVER: Performing 'open' operation\n");
+  client = kzalloc(sizeof(struct conv_client), GFP_KERNEL);
+  if (!client)
+    return -ENOMEM;
+
+  // The PL is only touched once the device is used, with the bitstream loaded: the capabilities are read on the
+  // first open, before any convolution can be submitted.
+  mutex_lock(&probe_lock);
+  if (!probed) {
+    conv_probe();
+    probed = 1;
+  }
+  mutex_unlock(&probe_lock);
+
+  mutex_init(&client->lock);
+  init_waitqueue_head(&client->wq);
+  INIT_LIST_HEAD(&client->node);
+  filp->private_data = client;
   return 0;         
 }
 
 // Function that implements system call release() for our driver.
 // Used with close() or when the OS closes the descriptors held by
 // the process when it is closed (e.g., Ctrl-C).
-// Stop the interrupts and disable the device.
+// Drops the convolutions of the file that have not started, and waits for the running one.
 int conv_release(struct inode *inode, struct file *filed_mem)
 {
+  struct conv_client * client = filed_mem->private_data;
+  unsigned long flags;
+
   pr_info("CONV_DRIVER: Performing 'release' operation\n");
+
+  mutex_lock(&client->lock);
+  if (client->busy) {
+    spin_lock_irqsave(&hw_lock, flags);
+    client->cancelled = 1;
+    if (!list_empty(&client->node)) {
+      list_del_init(&client->node);
+      client->done = 1;
+    }
+    spin_unlock_irqrestore(&hw_lock, flags);
+
+    if (!wait_event_timeout(client->wq, client->done, msecs_to_jiffies(1000))) {
+      pr_err("CONV_DRIVER: The running convolution did not finish.\n");
+      spin_lock_irqsave(&hw_lock, flags);
+      if (running == client) {
+        running = NULL;
+        conv_fail();
+      }
+      spin_unlock_irqrestore(&hw_lock, flags);
+    }
+    // The IRQ handler may still be waking us up: let it leave its critical section before freeing the client.
+    spin_lock_irqsave(&hw_lock, flags);
+    spin_unlock_irqrestore(&hw_lock, flags);
+
+    client->statusPtr = 0;
+    client->statsPtr = 0;
+    conv_finish(client);
+  }
+  mutex_unlock(&client->lock);
+  kfree(client);
   return 0;
 }
 
@@ -132,83 +292,388 @@ void conv_cleanup_module(void)
   pr_info("CONV_DRIVER: Cdev deleted, conv device unmapped, chdev unregistered\n");
 }
 
-// Function that implements system call read() for our driver.
-// Returns 1 uint32_t with the number of times the interrupt has been detected.
-ssize_t conv_read(struct file *filed_mem, char __user *buf, size_t count, loff_t *f_pos)
+// Programs the peripheral registers and starts a convolution. Called with hw_lock held.
+static void conv_start(const struct user_message * message)
 {
   volatile struct TRegs * slave_regs = (struct TRegs*)conv_mem.baseAddr;
-  struct user_message message;
   uint32_t status;
-  uint32_t resultOk;
-
-  if (count < sizeof(struct user_message)) {
-    pr_err("CONV_DRIVER: USer buffer too small (> %d bytes).\n", sizeof(struct user_message));
-    return -1;
-  }
 
-  // Copy the information from user-space to the kernel-space buffer.
-  if(raw_copy_from_user(&message, buf, sizeof(struct user_message)))
-  {
-    pr_err("CONV_DRIVER: Raw copy from user buffer failed.\n");
-    return -1;
-  }
+  // The input is read in beats of AXI_BEAT_BYTES, from the beat that holds its first value. The values take 32 bits
+  // unless the bitstream reports another width.
+  uint32_t valueBytes = ((caps.capabilities >> 16) & 0xff) / 8;
+  if (valueBytes == 0)
+    valueBytes = sizeof(uint32_t);
+
+  iowrite32(message->input & ~(AXI_BEAT_BYTES - 1), (volatile void*)(&slave_regs->input));
+  iowrite32((message->input & (AXI_BEAT_BYTES - 1)) / valueBytes, (volatile void*)(&slave_regs->inputSkip));
+  iowrite32(message->output, (volatile void*)(&slave_regs->output));
+  iowrite32(message->filters, (volatile void*)(&slave_regs->filters));
+  iowrite32(message->biases, (volatile void*)(&slave_regs->biases));
+  iowrite32(message->numFilters, (volatile void*)(&slave_regs->numFilters));
+  iowrite32(message->numChannels, (volatile void*)(&slave_regs->numChannels));
+  iowrite32(message->inputWidth, (volatile void*)(&slave_regs->inputWidth));
+  iowrite32(message->inputHeight, (volatile void*)(&slave_regs->inputHeight));
+  iowrite32(message->performReLu, (volatile void*)(&slave_regs->performReLu));
+  iowrite32(message->performMaxPool, (volatile void*)(&slave_regs->performMaxPool));
+  iowrite32(message->inputDecimals, (volatile void*)(&slave_regs->inputDecimals));
+  iowrite32(message->weightDecimals, (volatile void*)(&slave_regs->weightDecimals));
+  iowrite32(message->outputDecimals, (volatile void*)(&slave_regs->outputDecimals));
 
-  // Program the peripheral registers.
-
-  iowrite32(message.input, (volatile void*)(&slave_regs->input));
-  iowrite32(message.output, (volatile void*)(&slave_regs->output));
-  iowrite32(message.filters, (volatile void*)(&slave_regs->filters));
-  iowrite32(message.biases, (volatile void*)(&slave_regs->biases));
-  iowrite32(message.numFilters, (volatile void*)(&slave_regs->numFilters));
-  iowrite32(message.numChannels, (volatile void*)(&slave_regs->numChannels));
-  iowrite32(message.inputWidth, (volatile void*)(&slave_regs->inputWidth));
-  iowrite32(message.inputHeight, (volatile void*)(&slave_regs->inputHeight));
-  iowrite32(message.performReLu, (volatile void*)(&slave_regs->performReLu));
-  
   // Enable interrupts (global and spacific to done).
   iowrite32(1, (volatile void*)(&slave_regs->gier));
   iowrite32(1, (volatile void*)(&slave_regs->ier));
   mb();
-  pr_info("CONV_DRIVER: Starting accel...\n");
-  
+
   // Tell the peripheral to start (start bit = 1)
   status = ioread32((volatile void*)(&slave_regs->control));
-  status |= 1; 
+  status |= 1;
   iowrite32(status, (volatile void*)(&slave_regs->control));
   mb();
+}
+
+// Runs a convolution without filters, which only writes the capability registers, and keeps them in caps.
+// Called on the first open, with the interrupts of the accelerator disabled.
+static void conv_probe(void)
+{
+  volatile struct TRegs * slave_regs = (struct TRegs*)conv_mem.baseAddr;
+  uint32_t ii;
+
+  iowrite32(0, (volatile void*)(&slave_regs->numFilters));
+  iowrite32(1, (volatile void*)(&slave_regs->numChannels));
+  iowrite32(CONV_FILTER_SIZE, (volatile void*)(&slave_regs->inputWidth));
+  iowrite32(CONV_FILTER_SIZE, (volatile void*)(&slave_regs->inputHeight));
+  iowrite32(0, (volatile void*)(&slave_regs->inputSkip));
+  iowrite32(0, (volatile void*)(&slave_regs->gier));
+  iowrite32(0, (volatile void*)(&slave_regs->ier));
+  mb();
+  iowrite32(1, (volatile void*)(&slave_regs->control));
+  mb();
+
+  // ap_done (bit 1) is set a few cycles later.
+  for (ii = 0; ii < 1000 && !(ioread32((volatile void*)(&slave_regs->control)) & 2); ++ii)
+    udelay(1);
+  if (ii == 1000) {
+    pr_warn("CONV_DRIVER: The accelerator did not finish the probe, its capabilities are unknown\n");
+    return;
+  }
+
+  caps.capabilities = ioread32((volatile void*)(&slave_regs->capabilities));
+  caps.maxChannels = ioread32((volatile void*)(&slave_regs->maxChannels));
+  caps.maxRowBufferSize = ioread32((volatile void*)(&slave_regs->maxRowBufferSize));
+  pr_info("CONV_DRIVER: %u channels x %u filters per cycle, %u-bit values with %u decimals, up to %u channels and %u values per row\n",
+    caps.capabilities & 0xff, (caps.capabilities >> 8) & 0xff, (caps.capabilities >> 16) & 0xff, caps.capabilities >> 24,
+    caps.maxChannels, caps.maxRowBufferSize);
+}
+
+// Starts the next convolution of the first client in the queue, if the accelerator is free. When there is
+// nothing left to do, disables the interrupts. Called with hw_lock held.
+static void conv_kick(void)
+{
+  volatile struct TRegs * slave_regs = (struct TRegs*)conv_mem.baseAddr;
+  struct conv_client * client;
+
+  if (running)
+    return;
+  if (list_empty(&run_queue)) {
+    iowrite32(0, (volatile void*)&slave_regs->gier);
+    iowrite32(0, (volatile void*)&slave_regs->ier);
+    mb();
+    return;
+  }
+
+  client = list_first_entry(&run_queue, struct conv_client, node);
+  list_del_init(&client->node);
+  running = client;
+  conv_start(&client->chain[client->next]);
+}
+
+// Marks the accelerator as failed, since it may still be busy with an abandoned convolution, and ends the jobs of
+// every queued client with an error. Called with hw_lock held.
+static void conv_fail(void)
+{
+  struct conv_client * client, * tmp;
+
+  failed = 1;
+  list_for_each_entry_safe(client, tmp, &run_queue, node) {
+    list_del_init(&client->node);
+    client->done = 1;
+    wake_up(&client->wq);
+  }
+}
+
+// Queues a chain of descriptors (kmalloc'ed, owned by the driver from now on) for the client. Called with
+// client->lock held and no job in flight for the client. Fails with -EIO while the accelerator is failed.
+static int conv_submit(struct conv_client * client, struct user_message * descriptors, uint32_t numDescriptors, uint32_t statusPtr, uint32_t statsPtr)
+{
+  unsigned long flags;
+
+  client->status = kcalloc(numDescriptors, sizeof(uint32_t), GFP_KERNEL);
+  client->stats = kcalloc(numDescriptors, sizeof(struct conv_stats), GFP_KERNEL);
+  if (!client->status || !client->stats) {
+    kfree(client->status);
+    kfree(client->stats);
+    client->status = NULL;
+    client->stats = NULL;
+    kfree(descriptors);
+    return -ENOMEM;
+  }
+  client->chain = descriptors;
+  client->length = numDescriptors;
+  client->next = 0;
+  client->statusPtr = statusPtr;
+  client->statsPtr = statsPtr;
+  client->done = 0;
+  client->cancelled = 0;
+
+  spin_lock_irqsave(&hw_lock, flags);
+  if (failed) {
+    spin_unlock_irqrestore(&hw_lock, flags);
+    kfree(client->status);
+    kfree(client->stats);
+    client->status = NULL;
+    client->stats = NULL;
+    client->chain = NULL;
+    kfree(descriptors);
+    return -EIO;
+  }
+  client->busy = 1;
+  list_add_tail(&client->node, &run_queue);
+  conv_kick();
+  spin_unlock_irqrestore(&hw_lock, flags);
+  return 0;
+}
+
+// Ends the job of the client, which has finished: gives the status and the counters of every descriptor to the
+// user and frees the chain. Returns 1 if all the descriptors succeeded. Called with client->lock held.
+static uint32_t conv_finish(struct conv_client * client)
+{
+  uint32_t resultOk, ii;
+  uint64_t cycles = 0, memCycles = 0, bytes = 0;
+
+  resultOk = client->next == client->length && client->status[client->length - 1];
+  if (client->statusPtr != 0 &&
+      raw_copy_to_user((void __user *)(uintptr_t)client->statusPtr, client->status, client->length * sizeof(uint32_t)))
+    pr_err("CONV_DRIVER: Raw copy to user buffer failed.\n");
+  if (client->statsPtr != 0 &&
+      raw_copy_to_user((void __user *)(uintptr_t)client->statsPtr, client->stats, client->length * sizeof(struct conv_stats)))
+    pr_err("CONV_DRIVER: Raw copy to user buffer failed.\n");
+
+  for (ii = 0; ii < client->next; ++ ii) {
+    cycles += client->stats[ii].cycles;
+    memCycles += client->stats[ii].memCycles;
+    bytes += client->stats[ii].bytesRead + client->stats[ii].bytesWritten;
+  }
+  pr_debug("CONV_DRIVER: Job of %u convolutions: %llu cycles, %llu waiting on memory, %llu bytes\n",
+    client->next, cycles, memCycles, bytes);
+
+  kfree(client->chain);
+  kfree(client->status);
+  kfree(client->stats);
+  client->chain = NULL;
+  client->status = NULL;
+  client->stats = NULL;
+  client->length = 0;
+  client->busy = 0;
+  return resultOk;
+}
+
+// Copies one descriptor from user space into a chain of one.
+static struct user_message * conv_copy_message(const char __user *buf)
+{
+  struct user_message * message = kmalloc(sizeof(struct user_message), GFP_KERNEL);
+
+  if (!message)
+    return NULL;
+  // Copy the information from user-space to the kernel-space buffer.
+  if (raw_copy_from_user(message, buf, sizeof(struct user_message))) {
+    pr_err("CONV_DRIVER: Raw copy from user buffer failed.\n");
+    kfree(message);
+    return NULL;
+  }
+  return message;
+}
+
+// Function that implements system call read() for our driver.
+// - With a user_message: starts the convolution, waits for it and writes resultOk to message.resultOkPtr.
+//   Returns 0.
+// - With a single uint32_t: waits for the convolution (or chain) started with write() or ioctl() (unless the
+//   file was opened with O_NONBLOCK, which returns -EAGAIN while it runs) and returns its resultOk: 1 if all
+//   the convolutions succeeded. Returns 4.
+ssize_t conv_read(struct file *filed_mem, char __user *buf, size_t count, loff_t *f_pos)
+{
+  struct conv_client * client = filed_mem->private_data;
+  struct user_message * message;
+  uint32_t resultOk, resultOkPtr;
+  int result;
+
+  if (count == sizeof(uint32_t)) {
+    mutex_lock(&client->lock);
+    if (!client->busy) {
+      mutex_unlock(&client->lock);
+      return -EINVAL;
+    }
+    if (!client->done && (filed_mem->f_flags & O_NONBLOCK)) {
+      mutex_unlock(&client->lock);
+      return -EAGAIN;
+    }
+    // A signal interrupts the wait, but not the convolution: its result can be read again later.
+    if (wait_event_interruptible(client->wq, client->done)) {
+      mutex_unlock(&client->lock);
+      return -ERESTARTSYS;
+    }
+    resultOk = conv_finish(client);
+    mutex_unlock(&client->lock);
+
+    if (raw_copy_to_user(buf, &resultOk, sizeof(uint32_t))) {
+      pr_err("CONV_DRIVER: Raw copy to user buffer failed.\n");
+      return -EFAULT;
+    }
+    return sizeof(uint32_t);
+  }
+
+  if (count < sizeof(struct user_message)) {
+    pr_err("CONV_DRIVER: USer buffer too small (> %d bytes).\n", sizeof(struct user_message));
+    return -1;
+  }
+
+  message = conv_copy_message(buf);
+  if (!message)
+    return -1;
+  resultOkPtr = message->resultOkPtr;
+
+  mutex_lock(&client->lock);
+  if (client->busy) {
+    mutex_unlock(&client->lock);
+    kfree(message);
+    pr_err("CONV_DRIVER: A convolution submitted with write() is still pending.\n");
+    return -EBUSY;
+  }
+  result = conv_submit(client, message, 1, 0, 0);
+  if (result) {
+    mutex_unlock(&client->lock);
+    return result;
+  }
 
   // blocking read (PS user application goes to sleep)
   // Sleep the thread until the peripheral generates an interrupt
-  // wait_event_interruptible may exit when a signal is received, so
-  // we check our flag to ensure that it was our own interrupt handler
-  // waking up us after the interrupt is received, and not an 
-  // spurious signal.
+  // The done flag of the client ensures that it was our own interrupt
+  // handler waking up us after its convolution finished, and not the
+  // convolution of another client. Only a fatal signal stops the wait
+  // (a signal would otherwise wake us up over and over): conv_release()
+  // then reaps the job.
   // When we go to sleep, the processor is free for other tasks.
-  flag = 0;
-  while(wait_event_interruptible(wq, flag !=0)) {
-    printk(KERN_ALERT "CONV_DRIVER: AWOKEN BY ANOTHER SIGNAL\n");
+  if (wait_event_killable(client->wq, client->done)) {
+    mutex_unlock(&client->lock);
+    return -EINTR;
   }
   pr_info("CONV_DRIVER: AWOKEN FROM INTERRUPT\n");
 
-  resultOk = 1 & ioread32((volatile void*)(&slave_regs->resultOk));
-  mb();
+  resultOk = conv_finish(client);
+  mutex_unlock(&client->lock);
 
   // Copy the result to user
-  if(raw_copy_to_user((void*)message.resultOkPtr, &resultOk, sizeof(uint32_t)))
+  if(raw_copy_to_user((void*)resultOkPtr, &resultOk, sizeof(uint32_t)))
   {
     pr_err("CONV_DRIVER: Raw copy to user buffer failed.\n");
     return -1;
   }
 
-  // Disable interrupts.
-  iowrite32(0, (volatile void*)&slave_regs->gier);
-  iowrite32(0, (volatile void*)&slave_regs->ier);
-  mb();
-
   pr_info("CONV_DRIVER: Performed READ operation successfully\n");
   return 0;
 }
 
+// Function that implements system call write() for our driver.
+// Starts the convolution described by a user_message (resultOkPtr is not used) and returns without waiting.
+// Fails with -EBUSY if the result of the previous one has not been read.
+ssize_t conv_write(struct file *filed_mem, const char __user *buf, size_t count, loff_t *f_pos)
+{
+  struct conv_client * client = filed_mem->private_data;
+  struct user_message * message;
+  int result;
+
+  if (count < sizeof(struct user_message))
+    return -EINVAL;
+  message = conv_copy_message(buf);
+  if (!message)
+    return -EFAULT;
+
+  mutex_lock(&client->lock);
+  if (client->busy) {
+    mutex_unlock(&client->lock);
+    kfree(message);
+    return -EBUSY;
+  }
+  result = conv_submit(client, message, 1, 0, 0);
+  mutex_unlock(&client->lock);
+  return result ? result : sizeof(struct user_message);
+}
+
+// Function that implements system call ioctl() for our driver: the chains of convolutions, and the capabilities.
+// CONV_IOC_SUBMIT_CHAIN fails with -EBUSY if the result of the previous submission has not been read.
+// CONV_IOC_RUN_CHAIN returns 0 once the whole chain has finished, or -EIO if one of its convolutions failed.
+long conv_ioctl(struct file *filed_mem, unsigned int cmd, unsigned long arg)
+{
+  struct conv_client * client = filed_mem->private_data;
+  struct conv_chain request;
+  struct user_message * descriptors;
+  uint32_t resultOk;
+  int result;
+
+  if (cmd == CONV_IOC_GET_CAPS)
+    return raw_copy_to_user((void __user *)arg, &caps, sizeof(caps)) ? -EFAULT : 0;
+  if (cmd != CONV_IOC_SUBMIT_CHAIN && cmd != CONV_IOC_RUN_CHAIN)
+    return -ENOTTY;
+  if (raw_copy_from_user(&request, (void __user *)arg, sizeof(request)))
+    return -EFAULT;
+  if (request.numDescriptors == 0 || request.numDescriptors > CONV_MAX_CHAIN)
+    return -EINVAL;
+
+  descriptors = kmalloc_array(request.numDescriptors, sizeof(struct user_message), GFP_KERNEL);
+  if (!descriptors)
+    return -ENOMEM;
+  if (raw_copy_from_user(descriptors, (void __user *)(uintptr_t)request.descriptors,
+        request.numDescriptors * sizeof(struct user_message))) {
+    kfree(descriptors);
+    return -EFAULT;
+  }
+
+  mutex_lock(&client->lock);
+  if (client->busy) {
+    mutex_unlock(&client->lock);
+    kfree(descriptors);
+    return -EBUSY;
+  }
+  result = conv_submit(client, descriptors, request.numDescriptors, request.status, request.stats);
+  if (result || cmd == CONV_IOC_SUBMIT_CHAIN) {
+    mutex_unlock(&client->lock);
+    return result;
+  }
+
+  // The chain is owned by the driver once submitted, so only a fatal signal stops the wait: conv_release() then
+  // drops the rest of the chain and reaps the job.
+  if (wait_event_killable(client->wq, client->done)) {
+    mutex_unlock(&client->lock);
+    return -EINTR;
+  }
+  resultOk = conv_finish(client);
+  mutex_unlock(&client->lock);
+  return resultOk ? 0 : -EIO;
+}
+
+// Function that implements system calls poll() and select() for our driver. Only the job of the file counts.
+unsigned int conv_poll(struct file *filed_mem, poll_table *wait)
+{
+  struct conv_client * client = filed_mem->private_data;
+  unsigned int mask = 0;
+
+  poll_wait(filed_mem, &client->wq, wait);
+  if (client->busy && client->done)
+    mask |= POLLIN | POLLRDNORM;     // The result can be read without blocking
+  if (!client->busy)
+    mask |= POLLOUT | POLLWRNORM;    // A convolution can be submitted
+  return mask;
+}
+
 // Set up the char_dev structure for this device.
 static void conv_setup_cdev(struct conv_info *_conv_mem)
 {
@@ -260,8 +725,6 @@ static int conv_init(void)
     return -1;
   }
 
-  init_waitqueue_head(&wq);
-
   // Request registering our interrupt handler for the IRQ of the peripheral.
   // We configure the interrupt to be detected on the rising edge of the signal.
   result = request_irq(conv_mem.irq, (irq_handler_t)convIRQHandler, IRQF_TRIGGER_RISING, DRIVER_NAME, &conv_mem);
@@ -308,6 +771,8 @@ module_exit(conv_exit);
 static irq_handler_t convIRQHandler(unsigned int irq, void *dev_id, struct pt_regs *regs)
 {
   volatile struct TRegs * slave_regs = (struct TRegs*)conv_mem.baseAddr;
+  struct conv_client * client;
+
   // Clean the interrupt in the peripheral, so that we can detect new rising transition.
   // The ISR is toggle-on-write (TOW), which means that its bits toggle when they are
   // written, whatever it was their previous value. Therefore, we write (1) to the 
@@ -315,10 +780,35 @@ static irq_handler_t convIRQHandler(unsigned int irq, void *dev_id, struct pt_re
   iowrite32(1, (volatile void*)&slave_regs->isr);
   mb();
 
-  // Signal that it is us waking the main thread.
-	flag = 1;
-  // Wake the main thread.
-	wake_up_interruptible(&wq);
+  spin_lock(&hw_lock);
+  client = running;
+  running = NULL;
+  if (client) {
+    uint32_t resultOk = 1 & ioread32((volatile void*)(&slave_regs->resultOk));
+    struct conv_stats * stats = &client->stats[client->next];
+    stats->cycles = ioread32((volatile void*)(&slave_regs->cycles));
+    stats->memCycles = ioread32((volatile void*)(&slave_regs->memCycles));
+    stats->bytesRead = ioread32((volatile void*)(&slave_regs->bytesRead));
+    stats->bytesWritten = ioread32((volatile void*)(&slave_regs->bytesWritten));
+    client->status[client->next ++] = resultOk;
+    // The job ends with its last convolution, the first that fails, or when its file is closed. Otherwise it
+    // goes back to the end of the queue, behind the other clients.
+    if (!resultOk || client->next == client->length || client->cancelled) {
+      client->done = 1;
+      // Wake the thread of the client.
+      wake_up(&client->wq);
+    }
+    else
+      list_add_tail(&client->node, &run_queue);
+  }
+  else if (failed) {
+    // The late IRQ of an abandoned convolution: the accelerator is free again.
+    pr_info("CONV_DRIVER: The abandoned convolution finished, the accelerator is available again.\n");
+    failed = 0;
+  }
+  // Start the next convolution right away.
+  conv_kick();
+  spin_unlock(&hw_lock);
 	return (irq_handler_t) IRQ_HANDLED;      // Announce that the IRQ has been handled correctly
   // In case of error, or if it was not our device which generated the IRQ, return IRQ_NONE.
 }
@@ -0,0 +1,410 @@
+#include <linux/init.h>          /* needed for module_init and exit */
+#include <linux/module.h>
+#include <linux/moduleparam.h>   /* needed for module_param */
+#include <linux/kernel.h>        /* needed for printk */
+#include <linux/types.h>         /* needed for dev_t type */
+#include <linux/kdev_t.h>        /* needed for macros MAJOR, MINOR, MKDEV... */
+#include <linux/fs.h>            /* needed for register_chrdev_region, file_operations */
+#include <linux/interrupt.h>
+#include <linux/cdev.h>          /* cdev definition */
+#include <linux/slab.h>          /* kmalloc(),kfree() */
+#include <asm/uaccess.h>         /* copy_to copy_from _user */
+#include <linux/uaccess.h>
+#include <linux/io.h>
+#include <linux/mutex.h>
+#include <linux/delay.h>         /* udelay */
+
+// Driver of the Dense accelerator (HLS/dense.h), the second IP of the bitstream, next to Conv (conv.c).
+// It runs one layer at a time: the processes share it through a mutex.
+
+#define DRIVER_NAME "dense_driver"
+#define DENSE_IRQ 49  // Hard-coded value of IRQ vector (GIC: 62).
+
+// Structure that mimics the layout of the peripheral registers.
+// Vitis HLS skips some addresses in the register file. We introduce
+// padding fields to create the right mapping to registers with our structure,
+struct TRegs {
+      uint32_t control; // 0x00
+      uint32_t gier, ier, isr; // 0x04, 0x08, 0x0C
+      uint32_t input; // 0x10
+      uint32_t input_h; // 0x14 The project was configured for 64-bit addresses, so we need to set this register to 0
+      uint32_t padding0; // 0x18
+      uint32_t output; // 0x1C
+      uint32_t output_h; // 0x20
+      uint32_t padding1; // 0x24
+      uint32_t weights; // 0x28
+      uint32_t weights_h; // 0x2C
+      uint32_t padding2; // 0x30
+      uint32_t biases; // 0x34
+      uint32_t biases_h; // 0x38
+      uint32_t padding3; // 0x3c
+      uint32_t inputSize; // 0x40
+      uint32_t padding4; // 0x44
+      uint32_t outputSize; // 0x48
+      uint32_t padding5; // 0x4c
+      uint32_t batchSize; // 0x50
+      uint32_t padding6; // 0x54
+      uint32_t performReLu; // 0x58
+      uint32_t padding7; // 0x5c
+      uint32_t resultOk; // 0x60
+      uint32_t resultOk_ctrl; // 0x64
+      uint32_t cycles; // 0x68 Counters of the last layer (HLS/dense.h)
+      uint32_t cycles_ctrl; // 0x6c
+      uint32_t memCycles; // 0x70
+      uint32_t memCycles_ctrl; // 0x74
+      uint32_t bytesRead; // 0x78
+      uint32_t bytesRead_ctrl; // 0x7c
+      uint32_t bytesWritten; // 0x80
+      uint32_t bytesWritten_ctrl; // 0x84
+      uint32_t capabilities; // 0x88 Configuration of the bitstream (HLS/dense.h), written by every layer
+      uint32_t capabilities_ctrl; // 0x8c
+      uint32_t maxInputSize; // 0x90
+};
+
+// A layer for ioctl(DENSE_IOC_RUN): output[batchSize][outputSize] from input[batchSize][inputSize],
+// weights[outputSize][inputSize] and biases[outputSize], at physical addresses. The input and the weights have to
+// be aligned to a beat (8 bytes).
+struct dense_message {
+  uint32_t input;
+  uint32_t output;
+  uint32_t weights;
+  uint32_t biases;
+  uint32_t inputSize;
+  uint32_t outputSize;
+  uint32_t batchSize;
+  uint32_t performReLu;
+  uint32_t resultOk;            // Written by the driver
+  uint32_t cycles;              // Counters of the accelerator (see HLS/dense.h), written by the driver
+  uint32_t memCycles;
+  uint32_t bytesRead;
+  uint32_t bytesWritten;
+};
+
+// Configuration of the bitstream, read from the capability registers when the module is loaded (see HLS/dense.h).
+// All zeros if the accelerator did not answer.
+struct dense_caps {
+  uint32_t capabilities;      // Bits 7-0 parallel images, 15-8 values per beat, 23-16 value bits, 31-24 decimals
+  uint32_t maxInputSize;
+};
+
+#define DENSE_IOC_MAGIC 'D'
+// Runs the layer and waits for it. Returns 0, -EIO if the accelerator rejected it, or -EINTR if the caller was killed.
+#define DENSE_IOC_RUN _IOWR(DENSE_IOC_MAGIC, 1, struct dense_message)
+// Returns the configuration of the bitstream.
+#define DENSE_IOC_GET_CAPS _IOR(DENSE_IOC_MAGIC, 2, struct dense_caps)
+
+int dense_major = 0;
+int dense_minor = 0;
+module_param(dense_major,int,S_IRUGO);
+module_param(dense_minor,int,S_IRUGO);
+
+// A layer on the accelerator. It is freed by its caller, or by the IRQ handler if the caller was killed.
+struct dense_job {
+  wait_queue_head_t wq;         // Woken when the layer has finished
+  int done;                     // The layer has finished
+  int abandoned;                // The caller was killed while the layer ran
+};
+
+static DEFINE_MUTEX(run_lock);                // One caller at a time
+static DEFINE_SPINLOCK(hw_lock);              // Serializes running and the flags of its job with the IRQ handler
+static DECLARE_WAIT_QUEUE_HEAD(idle_wq);      // Woken when the accelerator becomes free
+static struct dense_job * running = NULL;     // Layer on the accelerator
+static struct dense_caps caps;
+static int probed = 0;                        // dense_probe() has run
+
+// This structure contains the device information.
+struct dense_info {
+  int irq;
+  unsigned long memStart;
+  unsigned long memEnd;
+  void __iomem  *baseAddr;
+  struct cdev   cdev;            /* Char device structure               */
+};
+
+static struct dense_info dense_mem = {DENSE_IRQ, 0x40010000, 0x4001FFFF};
+
+int dense_open(struct inode *inode, struct file *filp);
+int dense_release(struct inode *inode, struct file *filed_mem);
+long dense_ioctl(struct file *filed_mem, unsigned int cmd, unsigned long arg);
+
+static void dense_probe(void);
+
+// IRQ handler function.
+static irq_handler_t  denseIRQHandler(unsigned int irq, void *dev_id, struct pt_regs *regs);
+
+// This structure declares the operations that our driver exports for the users.
+struct file_operations dense_fops = {
+  .owner =    THIS_MODULE,
+  .unlocked_ioctl = dense_ioctl,
+  .open =     dense_open,
+  .release =  dense_release,
+};
+
+// The PL is only touched once the device is used: the capabilities are read on the first open, under run_lock so
+// that no layer runs meanwhile.
+int dense_open(struct inode *inode, struct file *filp)
+{
+  if (mutex_lock_interruptible(&run_lock))
+    return -ERESTARTSYS;
+  if (!probed) {
+    dense_probe();
+    probed = 1;
+  }
+  mutex_unlock(&run_lock);
+  return 0;
+}
+
+int dense_release(struct inode *inode, struct file *filed_mem)
+{
+  return 0;
+}
+
+void dense_cleanup_module(void)
+{
+  dev_t devno = MKDEV(dense_major, dense_minor);
+  disable_irq(dense_mem.irq);
+  free_irq(dense_mem.irq,&dense_mem);
+  kfree(running);                            // A layer abandoned by a killed caller
+  iounmap(dense_mem.baseAddr);
+  release_mem_region(dense_mem.memStart, dense_mem.memEnd - dense_mem.memStart + 1);
+  cdev_del(&dense_mem.cdev);
+  unregister_chrdev_region(devno, 1);        /* unregistering device */
+  pr_info("DENSE_DRIVER: Cdev deleted, dense device unmapped, chdev unregistered\n");
+}
+
+// Runs a layer without outputs, which only writes the capability registers, and keeps them in caps.
+// Called on the first open, with the interrupts of the accelerator disabled.
+static void dense_probe(void)
+{
+  volatile struct TRegs * slave_regs = (struct TRegs*)dense_mem.baseAddr;
+  uint32_t ii;
+
+  iowrite32(0, (volatile void*)(&slave_regs->inputSize));
+  iowrite32(0, (volatile void*)(&slave_regs->outputSize));
+  iowrite32(0, (volatile void*)(&slave_regs->batchSize));
+  iowrite32(0, (volatile void*)(&slave_regs->gier));
+  iowrite32(0, (volatile void*)(&slave_regs->ier));
+  mb();
+  iowrite32(1, (volatile void*)(&slave_regs->control));
+  mb();
+
+  // ap_done (bit 1) is set a few cycles later.
+  for (ii = 0; ii < 1000 && !(ioread32((volatile void*)(&slave_regs->control)) & 2); ++ii)
+    udelay(1);
+  if (ii == 1000) {
+    pr_warn("DENSE_DRIVER: The accelerator did not finish the probe, its capabilities are unknown\n");
+    return;
+  }
+
+  caps.capabilities = ioread32((volatile void*)(&slave_regs->capabilities));
+  caps.maxInputSize = ioread32((volatile void*)(&slave_regs->maxInputSize));
+  pr_info("DENSE_DRIVER: %u images x %u values per cycle, %u-bit values with %u decimals, up to %u inputs\n",
+    caps.capabilities & 0xff, (caps.capabilities >> 8) & 0xff, (caps.capabilities >> 16) & 0xff, caps.capabilities >> 24,
+    caps.maxInputSize);
+}
+
+// Whether the accelerator is free: a layer abandoned by a killed caller may still run.
+static int dense_idle(void)
+{
+  unsigned long flags;
+  int idle;
+
+  spin_lock_irqsave(&hw_lock, flags);
+  idle = running == NULL;
+  spin_unlock_irqrestore(&hw_lock, flags);
+  return idle;
+}
+
+// Programs the peripheral registers, starts the layer and waits for its interrupt. Called with run_lock held.
+// The layer always runs to the end: only a fatal signal stops the wait, and then the IRQ handler frees the job.
+static int dense_run(struct dense_message * message)
+{
+  volatile struct TRegs * slave_regs = (struct TRegs*)dense_mem.baseAddr;
+  struct dense_job * job;
+  unsigned long flags;
+  uint32_t status;
+
+  job = kzalloc(sizeof(struct dense_job), GFP_KERNEL);
+  if (!job)
+    return -ENOMEM;
+  init_waitqueue_head(&job->wq);
+  if (wait_event_killable(idle_wq, dense_idle())) {
+    kfree(job);
+    return -EINTR;
+  }
+
+  iowrite32(message->input, (volatile void*)(&slave_regs->input));
+  iowrite32(message->output, (volatile void*)(&slave_regs->output));
+  iowrite32(message->weights, (volatile void*)(&slave_regs->weights));
+  iowrite32(message->biases, (volatile void*)(&slave_regs->biases));
+  iowrite32(message->inputSize, (volatile void*)(&slave_regs->inputSize));
+  iowrite32(message->outputSize, (volatile void*)(&slave_regs->outputSize));
+  iowrite32(message->batchSize, (volatile void*)(&slave_regs->batchSize));
+  iowrite32(message->performReLu, (volatile void*)(&slave_regs->performReLu));
+
+  spin_lock_irqsave(&hw_lock, flags);
+  running = job;
+  spin_unlock_irqrestore(&hw_lock, flags);
+  // Enable interrupts (global and specific to done).
+  iowrite32(1, (volatile void*)(&slave_regs->gier));
+  iowrite32(1, (volatile void*)(&slave_regs->ier));
+  mb();
+
+  // Tell the peripheral to start (start bit = 1)
+  status = ioread32((volatile void*)(&slave_regs->control));
+  status |= 1;
+  iowrite32(status, (volatile void*)(&slave_regs->control));
+  mb();
+
+  if (wait_event_killable(job->wq, job->done)) {
+    spin_lock_irqsave(&hw_lock, flags);
+    if (!job->done) {
+      job->abandoned = 1;
+      spin_unlock_irqrestore(&hw_lock, flags);
+      return -EINTR;
+    }
+    spin_unlock_irqrestore(&hw_lock, flags);
+  }
+  kfree(job);
+
+  message->resultOk = 1 & ioread32((volatile void*)(&slave_regs->resultOk));
+  message->cycles = ioread32((volatile void*)(&slave_regs->cycles));
+  message->memCycles = ioread32((volatile void*)(&slave_regs->memCycles));
+  message->bytesRead = ioread32((volatile void*)(&slave_regs->bytesRead));
+  message->bytesWritten = ioread32((volatile void*)(&slave_regs->bytesWritten));
+  return 0;
+}
+
+// Function that implements system call ioctl() for our driver.
+long dense_ioctl(struct file *filed_mem, unsigned int cmd, unsigned long arg)
+{
+  struct dense_message message;
+  int result;
+
+  if (cmd == DENSE_IOC_GET_CAPS)
+    return raw_copy_to_user((void __user *)arg, &caps, sizeof(caps)) ? -EFAULT : 0;
+  if (cmd != DENSE_IOC_RUN)
+    return -ENOTTY;
+  if (raw_copy_from_user(&message, (void __user *)arg, sizeof(message)))
+    return -EFAULT;
+
+  if (mutex_lock_interruptible(&run_lock))
+    return -ERESTARTSYS;
+  result = dense_run(&message);
+  mutex_unlock(&run_lock);
+  if (result)
+    return result;
+
+  if (raw_copy_to_user((void __user *)arg, &message, sizeof(message)))
+    return -EFAULT;
+  return message.resultOk ? 0 : -EIO;
+}
+
+// Set up the char_dev structure for this device.
+static void dense_setup_cdev(struct dense_info *_dense_mem)
+{
+  int err, devno = MKDEV(dense_major, dense_minor);
+
+  cdev_init(&_dense_mem->cdev, &dense_fops);
+  _dense_mem->cdev.owner = THIS_MODULE;
+  _dense_mem->cdev.ops = &dense_fops;
+  err = cdev_add(&_dense_mem->cdev, devno, 1);
+  /* Fail gracefully if need be */
+  if (err)
+    pr_err("DENSE_DRIVER: Error %d adding dense cdev_add", err);
+
+  pr_info("DENSE_DRIVER: Cdev initialized\n");
+}
+
+// The init function registers the chdev, as the one of conv.c.
+static int dense_init(void)
+{
+  int result = 0;
+  dev_t dev = 0;
+
+  pr_info("DENSE_DRIVER: Allocating a new major number.\n");
+  result = alloc_chrdev_region(&dev, dense_minor, 1, "dense");
+  dense_major = MAJOR(dev);
+  if (result < 0) {
+    pr_err("DENSE_DRIVER: Can't get major %d\n", dense_major);
+    return result;
+  }
+
+  // Request (exclusive) access to the memory address range of the peripheral.
+  if (!request_mem_region(dense_mem.memStart, dense_mem.memEnd - dense_mem.memStart + 1, DRIVER_NAME)) {
+    pr_err("DENSE_DRIVER: Couldn't lock memory region at %p\n", (void *)dense_mem.memStart);
+    unregister_chrdev_region(dev, 1);
+    return -1;
+  }
+
+  // Obtain a "kernel virtual address" for the physical address of the peripheral.
+  dense_mem.baseAddr = ioremap(dense_mem.memStart, dense_mem.memEnd - dense_mem.memStart + 1);
+  if (!dense_mem.baseAddr) {
+    pr_err("DENSE_DRIVER: Could not obtain virtual kernel address for iomem space.\n");
+    release_mem_region(dense_mem.memStart, dense_mem.memEnd - dense_mem.memStart + 1);
+    unregister_chrdev_region(dev, 1);
+    return -1;
+  }
+
+  // Request registering our interrupt handler for the IRQ of the peripheral, on the rising edge of the signal.
+  result = request_irq(dense_mem.irq, (irq_handler_t)denseIRQHandler, IRQF_TRIGGER_RISING, DRIVER_NAME, &dense_mem);
+  if(result) {
+    printk(KERN_ALERT "DENSE_DRIVER: Failed to register interrupt handler (error=%d)\n", result);
+    iounmap(dense_mem.baseAddr);
+    release_mem_region(dense_mem.memStart, dense_mem.memEnd - dense_mem.memStart + 1);
+    unregister_chrdev_region(dev, 1);
+    return result;
+  }
+
+  enable_irq(dense_mem.irq);
+  pr_info("DENSE_DRIVER: Interrupt %d registered\n", dense_mem.irq);
+
+  pr_info("DENSE_DRIVER: driver at 0x%08X mapped to 0x%08X\n",
+    (uint32_t)dense_mem.memStart, (uint32_t)dense_mem.baseAddr);
+  dense_setup_cdev(&dense_mem);
+
+  return 0;
+}
+
+static void dense_exit(void)
+{
+  pr_info("DENSE_DRIVER: calling cleanup function.\n");
+  dense_cleanup_module();
+}
+
+module_init(dense_init);
+module_exit(dense_exit);
+
+// The interrupt handler is called on the (rising edge of the) accelerator interrupt. It disarms it (the ISR is
+// toggle-on-write) and wakes the process that runs the layer, or frees the layer if its process was killed.
+static irq_handler_t denseIRQHandler(unsigned int irq, void *dev_id, struct pt_regs *regs)
+{
+  volatile struct TRegs * slave_regs = (struct TRegs*)dense_mem.baseAddr;
+  struct dense_job * job;
+
+  iowrite32(1, (volatile void*)&slave_regs->isr);
+  iowrite32(0, (volatile void*)&slave_regs->gier);
+  iowrite32(0, (volatile void*)&slave_regs->ier);
+  mb();
+
+  spin_lock(&hw_lock);
+  job = running;
+  running = NULL;
+  if (job) {
+    if (job->abandoned)
+      kfree(job);
+    else {
+      job->done = 1;
+      wake_up(&job->wq);
+    }
+  }
+  spin_unlock(&hw_lock);
+  wake_up(&idle_wq);
+  return (irq_handler_t) IRQ_HANDLED;
+}
+
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Pedro Palacios Almendros");
+MODULE_DESCRIPTION("Device driver for controlling the Dense accelerator of the PYNQ-Z2 CNN");
+MODULE_VERSION("1.0");
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <vector>
+
+#include "model.h"
+#include "network.h"
+#include "fxpModel.h"
+
+static uint32_t AlignUp(uint32_t value)
+{
+  return (value + FXP_MODEL_ALIGNMENT - 1) & ~(FXP_MODEL_ALIGNMENT - 1);
+}
+
+// Standard CRC-32 (as zlib), so that the files can also be checked with other tools. Slicing-by-8: eight tables
+// let the loop consume 8 bytes per iteration, so checking the model costs a few ms instead of dominating the load.
+uint32_t Crc32(uint32_t crc, const void * data, uint32_t size)
+{
+  static uint32_t table[8][256];
+  static bool tableReady = false;
+
+  if (!tableReady) {
+    for (uint32_t ii = 0; ii < 256; ++ ii) {
+      uint32_t c = ii;
+      for (uint32_t k = 0; k < 8; ++ k)
+        c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      table[0][ii] = c;
+    }
+    for (uint32_t ii = 0; ii < 256; ++ ii) {
+      for (uint32_t k = 1; k < 8; ++ k)
+        table[k][ii] = table[0][table[k - 1][ii] & 0xFF] ^ (table[k - 1][ii] >> 8);
+    }
+    tableReady = true;
+  }
+
+  const uint8_t * p = (const uint8_t *)data;
+  crc = ~crc;
+  for (; size >= 8; size -= 8, p += 8) {
+    // Byte by byte, so that it does not depend on the endianness.
+    uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+    crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+          table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+  }
+  for (; size > 0; -- size, ++ p)
+    crc = table[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+bool SaveFxPModel(const char * fileName, const TNetwork & network, TFXP * const * fxpWeights, TFXP * const * fxpBiases)
+{
+  std::vector<TNetShape> shapes;
+  if (!DeriveShapes(network, shapes))
+    return false;
+
+  const uint32_t numLayers = network.layers.size();
+  const uint32_t numOps = network.ops.size();
+  TFxPModelHeader header;
+  std::vector<TFxPModelLayer> layers(numLayers);
+  std::vector<TFxPModelOp> ops(numOps);
+
+  memset(&header, 0, sizeof(header));
+  memset(layers.data(), 0, numLayers * sizeof(TFxPModelLayer));
+  memcpy(header.magic, FXP_MODEL_MAGIC, sizeof(header.magic));
+  header.version = FXP_MODEL_VERSION;
+  header.decimals = DECIMALS;
+  header.numLayers = numLayers;
+  header.numOps = numOps;
+  header.inputChannels = network.input.channels;
+  header.inputHeight = network.input.height;
+  header.inputWidth = network.input.width;
+  header.dataOffset = AlignUp(sizeof(header) + numLayers * sizeof(TFxPModelLayer) + numOps * sizeof(TFxPModelOp));
+
+  uint32_t offset = header.dataOffset;
+  for (uint32_t iLayer = 0; iLayer < numLayers; ++ iLayer) {
+    layers[iLayer].type = network.layers[iLayer].type;
+    layers[iLayer].inputSize = network.layers[iLayer].inputSize;
+    layers[iLayer].outputSize = network.layers[iLayer].outputSize;
+    layers[iLayer].weightsOffset = offset;
+    layers[iLayer].weightsCount = NetLayerWeightsCount(network.layers[iLayer]);
+    offset = AlignUp(offset + layers[iLayer].weightsCount * sizeof(TFXP));
+    layers[iLayer].biasesOffset = offset;
+    layers[iLayer].biasesCount = network.layers[iLayer].outputSize;
+    offset = AlignUp(offset + layers[iLayer].biasesCount * sizeof(TFXP));
+  }
+  header.dataSize = offset - header.dataOffset;
+
+  for (uint32_t iOp = 0; iOp < numOps; ++ iOp)
+    ops[iOp] = {network.ops[iOp].type, network.ops[iOp].layer};
+
+  // The whole file is built in memory (a few MB), so that the CRC is known before writing the header.
+  std::vector<uint8_t> file(offset, 0);
+  memcpy(&file[sizeof(header)], layers.data(), numLayers * sizeof(TFxPModelLayer));
+  memcpy(&file[sizeof(header) + numLayers * sizeof(TFxPModelLayer)], ops.data(), numOps * sizeof(TFxPModelOp));
+  for (uint32_t iLayer = 0; iLayer < numLayers; ++ iLayer) {
+    memcpy(&file[layers[iLayer].weightsOffset], fxpWeights[iLayer], layers[iLayer].weightsCount * sizeof(TFXP));
+    memcpy(&file[layers[iLayer].biasesOffset], fxpBiases[iLayer], layers[iLayer].biasesCount * sizeof(TFXP));
+  }
+  header.crc32 = Crc32(0, &file[sizeof(header)], file.size() - sizeof(header));
+  memcpy(&file[0], &header, sizeof(header));
+
+  // Written to a temporary file and renamed, so that a running cnnSolver never sees a partial model.
+  char tmpName[1024];
+  snprintf(tmpName, sizeof(tmpName), "%s.tmp", fileName);
+  FILE * output = fopen(tmpName, "wb");
+  if (output == NULL) {
+    printf("Error creating file [%s]\n", tmpName);
+    return false;
+  }
+  bool ok = fwrite(&file[0], 1, file.size(), output) == file.size();
+  ok = (fclose(output) == 0) && ok;
+  if (!ok || rename(tmpName, fileName) != 0) {
+    printf("Error writing file [%s]\n", fileName);
+    remove(tmpName);
+    return false;
+  }
+  return true;
+}
+
+// Reads size bytes at offset, which cannot be behind the current position, adding them (and any padding
+// skipped before them) to the CRC.
+static bool ReadSection(FILE * input, uint32_t & position, uint32_t offset, void * data, uint32_t size, uint32_t & crc)
+{
+  uint8_t padding[FXP_MODEL_ALIGNMENT];
+
+  if (offset < position)
+    return false;
+  while (position < offset) {
+    uint32_t chunk = offset - position < sizeof(padding) ? offset - position : sizeof(padding);
+    if (fread(padding, 1, chunk, input) != chunk)
+      return false;
+    crc = Crc32(crc, padding, chunk);
+    position += chunk;
+  }
+
+  if (fread(data, 1, size, input) != size)
+    return false;
+  crc = Crc32(crc, data, size);
+  position += size;
+  return true;
+}
+
+// Reads the header and the tables, and checks that they describe a valid network.
+static bool ReadFxPModelTables(FILE * input, const char * fileName, TFxPModelHeader & header, std::vector<TFxPModelLayer> & layers,
+      TNetwork & network, uint32_t & position, uint32_t & crc)
+{
+  if (fread(&header, sizeof(header), 1, input) != 1 || memcmp(header.magic, FXP_MODEL_MAGIC, sizeof(header.magic)) != 0) {
+    printf("[%s] is not a FxP model\n", fileName);
+    return false;
+  }
+  if (header.version != FXP_MODEL_VERSION) {
+    printf("[%s] has version %u, expected %u (run fxpModelConverter again)\n", fileName, header.version, FXP_MODEL_VERSION);
+    return false;
+  }
+  if (header.decimals != DECIMALS) {
+    printf("[%s] has %u decimals, expected %u\n", fileName, header.decimals, DECIMALS);
+    return false;
+  }
+  if (header.numLayers > MAX_NET_LAYERS || header.numOps > FXP_MODEL_MAX_OPS) {
+    printf("[%s] has %u layers and %u operations, the maximum is %u and %u\n", fileName, header.numLayers, header.numOps,
+      MAX_NET_LAYERS, FXP_MODEL_MAX_OPS);
+    return false;
+  }
+
+  std::vector<TFxPModelOp> ops(header.numOps);
+  layers.resize(header.numLayers);
+  position = sizeof(header);
+  if (!ReadSection(input, position, position, layers.data(), header.numLayers * sizeof(TFxPModelLayer), crc) ||
+      !ReadSection(input, position, position, ops.data(), header.numOps * sizeof(TFxPModelOp), crc)) {
+    printf("Error reading the network of [%s]\n", fileName);
+    return false;
+  }
+
+  network.input = {header.inputChannels, header.inputHeight, header.inputWidth};
+  network.layers.clear();
+  network.ops.clear();
+  for (const TFxPModelLayer & layer : layers) {
+    network.layers.push_back({layer.type, layer.inputSize, layer.outputSize});
+    if (layer.weightsCount != NetLayerWeightsCount(network.layers.back()) || layer.biasesCount != layer.outputSize) {
+      printf("Layer %u of [%s] has the wrong number of parameters\n", (uint32_t)network.layers.size() - 1, fileName);
+      return false;
+    }
+  }
+  for (const TFxPModelOp & op : ops)
+    network.ops.push_back({op.type, op.layer});
+
+  std::vector<TNetShape> shapes;
+  if (!DeriveShapes(network, shapes)) {
+    printf("[%s] describes an invalid network\n", fileName);
+    return false;
+  }
+  return true;
+}
+
+bool LoadFxPModel(CConvDriver& convolver, const char * fileName, TNetwork & network, std::vector<TFXP*> & fxpWeights, std::vector<TFXP*> & fxpBiases)
+{
+  TFxPModelHeader header;
+  std::vector<TFxPModelLayer> layers;
+
+  fxpWeights.clear();
+  fxpBiases.clear();
+
+  FILE * input = fopen(fileName, "rb");
+  if (input == NULL)
+    return false;
+
+  uint32_t position = 0, crc = 0;
+  bool ok = ReadFxPModelTables(input, fileName, header, layers, network, position, crc);
+
+  if (ok) {
+    fxpWeights.resize(layers.size(), NULL);
+    fxpBiases.resize(layers.size(), NULL);
+  }
+
+  for (uint32_t iLayer = 0; ok && iLayer < layers.size(); ++ iLayer) {
+    const TFxPModelLayer & layer = layers[iLayer];
+
+    fxpWeights[iLayer] = (TFXP*)convolver.AllocDMACompatible(layer.weightsCount * sizeof(TFXP));
+    fxpBiases[iLayer] = (TFXP*)convolver.AllocDMACompatible(layer.biasesCount * sizeof(TFXP));
+    if (fxpWeights[iLayer] == NULL || fxpBiases[iLayer] == NULL) {
+      printf("Error allocating the FxP parameters of layer %u\n", iLayer);
+      ok = false;
+      break;
+    }
+
+    if (!ReadSection(input, position, layer.weightsOffset, fxpWeights[iLayer], layer.weightsCount * sizeof(TFXP), crc) ||
+        !ReadSection(input, position, layer.biasesOffset, fxpBiases[iLayer], layer.biasesCount * sizeof(TFXP), crc)) {
+      printf("Error reading the parameters of layer %u from [%s]\n", iLayer, fileName);
+      ok = false;
+    }
+  }
+
+  // The CRC also covers the padding after the last section.
+  if (ok) {
+    uint32_t end = header.dataOffset + header.dataSize;
+    ok = ReadSection(input, position, end, NULL, 0, crc) && fgetc(input) == EOF;
+    if (!ok)
+      printf("[%s] has an unexpected size\n", fileName);
+    else if (crc != header.crc32) {
+      printf("Checksum error in [%s]: 0x%08X, expected 0x%08X\n", fileName, crc, header.crc32);
+      ok = false;
+    }
+  }
+  fclose(input);
+
+  if (!ok) {
+    for (uint32_t ii = 0; ii < fxpWeights.size(); ++ ii) {
+      if (fxpWeights[ii] != NULL)
+        convolver.FreeDMACompatible(fxpWeights[ii]);
+      if (fxpBiases[ii] != NULL)
+        convolver.FreeDMACompatible(fxpBiases[ii]);
+    }
+    fxpWeights.clear();
+    fxpBiases.clear();
+    return false;
+  }
+
+  for (uint32_t iLayer = 0; iLayer < network.layers.size(); ++ iLayer) {
+    if (network.layers[iLayer].type == CONV)
+      convolver.PrepareFilters(fxpWeights[iLayer], network.layers[iLayer].outputSize, network.layers[iLayer].inputSize);
+  }
+  return true;
+}
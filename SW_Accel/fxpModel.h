@@ -0,0 +1,67 @@
+#ifndef FXP_MODEL_H
+#define FXP_MODEL_H
+
+#include <vector>
+#include "model.h"
+#include "network.h"
+
+// Precompiled FxP model container, produced offline by fxpModelConverter from the float model/*.bin files.
+// Loading it is a single sequential read straight into the DMA-compatible buffers, with no conversion.
+// Besides the parameters, it stores the description of the network (network.h), so a retrained or larger
+// variant of the model only needs a new file.
+//
+// Layout (native byte order, every section aligned to FXP_MODEL_ALIGNMENT bytes from the start of the file):
+//   TFxPModelHeader
+//   TFxPModelLayer layers[numLayers]
+//   TFxPModelOp ops[numOps]
+//   padding
+//   for each layer: TFXP weights[weightsCount], padding, TFXP biases[biasesCount], padding
+// The weights keep the layout used by the float files: [filter][channel][3][3] or [output][input].
+// The CRC-32 covers everything after the header.
+
+const char * const FXP_MODEL_FILE = "model/model.fxp";
+const char FXP_MODEL_MAGIC[8] = {'C', 'N', 'N', 'F', 'X', 'P', '\0', '\0'};
+const uint32_t FXP_MODEL_VERSION = 2;   // 2: network description
+const uint32_t FXP_MODEL_ALIGNMENT = 64;
+const uint32_t FXP_MODEL_MAX_OPS = 1024;
+
+struct TFxPModelHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t decimals;        // DECIMALS used in the conversion
+  uint32_t numLayers;       // Parameterized layers
+  uint32_t numOps;
+  uint32_t inputChannels;   // Input of the network
+  uint32_t inputHeight;
+  uint32_t inputWidth;
+  uint32_t dataOffset;      // Offset of the first section
+  uint32_t dataSize;        // Bytes from dataOffset to the end of the file
+  uint32_t crc32;           // CRC-32 of everything after the header
+};
+
+struct TFxPModelLayer {
+  uint32_t type;            // TLayerType
+  uint32_t inputSize;       // CONV: channels, DENSE: inputs
+  uint32_t outputSize;      // CONV: filters, DENSE: outputs
+  uint32_t weightsOffset;
+  uint32_t weightsCount;    // In TFXP values
+  uint32_t biasesOffset;
+  uint32_t biasesCount;
+  uint32_t reserved;
+};
+
+struct TFxPModelOp {
+  uint32_t type;            // TOpType
+  uint32_t layer;
+};
+
+// Writes the network and its FxP weights and biases (one array per layer of the network) to fileName.
+bool SaveFxPModel(const char * fileName, const TNetwork & network, TFXP * const * fxpWeights, TFXP * const * fxpBiases);
+// Loads a container written by SaveFxPModel: the network, and its parameters into DMA-compatible memory.
+// Fails (freeing everything it allocated) if the file is missing, has another version or DECIMALS, describes
+// an invalid network, or the checksum does not match.
+bool LoadFxPModel(CConvDriver& convolver, const char * fileName, TNetwork & network, std::vector<TFXP*> & fxpWeights, std::vector<TFXP*> & fxpBiases);
+
+uint32_t Crc32(uint32_t crc, const void * data, uint32_t size);
+
+#endif
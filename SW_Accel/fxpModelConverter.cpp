@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "model.h"
+#include "network.h"
+#include "fxpModel.h"
+
+// Converts the float model (model/weights_N.bin, model/bias_N.bin) to the FxP container read by cnnSolver.
+// The float files hold the parameters of DefaultNetwork(), which is stored with them.
+// It has to be run again whenever the model or DECIMALS change.
+
+void PrintUsage()
+{
+  printf("Usage: fxpModelConverter [-o output]\n");
+  printf("  -o output   FxP model to write (default: %s)\n", FXP_MODEL_FILE);
+}
+
+int main(int argc, char ** argv)
+{
+  const char * outputName = FXP_MODEL_FILE;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    switch (opt) {
+      case 'o':
+        outputName = optarg;
+        break;
+      default:
+        PrintUsage();
+        return -1;
+    }
+  }
+
+  // Only used to allocate the parameters, in host memory.
+  CConvDriver convolver(false, CConvDriver::BACKEND_CPU_REF);
+  float * floatWeights[NUM_LAYERS] = {NULL};
+  float * floatBiases[NUM_LAYERS] = {NULL};
+  TFXP * fxpWeights[NUM_LAYERS] = {NULL};
+  TFXP * fxpBiases[NUM_LAYERS] = {NULL};
+
+  if (!LoadFloatWeights(NUM_LAYERS, floatWeights) || !LoadFloatBiases(NUM_LAYERS, floatBiases) ||
+      !ConvertWeightsToFxP(convolver, NUM_LAYERS, floatWeights, fxpWeights) ||
+      !ConvertBiasesToFxP(convolver, NUM_LAYERS, floatBiases, fxpBiases)) {
+    printf("Error reading the float model.\n");
+    FreeParams(NUM_LAYERS, (void**)floatWeights);
+    FreeParams(NUM_LAYERS, (void**)floatBiases);
+    return -1;
+  }
+  FreeParams(NUM_LAYERS, (void**)floatWeights);
+  FreeParams(NUM_LAYERS, (void**)floatBiases);
+
+  // Read it back, to check the file and the loader.
+  TNetwork network = DefaultNetwork(), checkNetwork;
+  std::vector<TFXP*> checkWeights, checkBiases;
+  bool ok = SaveFxPModel(outputName, network, fxpWeights, fxpBiases);
+  if (ok && !LoadFxPModel(convolver, outputName, checkNetwork, checkWeights, checkBiases)) {
+    printf("Error reading back [%s]\n", outputName);
+    ok = false;
+  }
+  if (ok && (checkNetwork.layers.size() != NUM_LAYERS || checkNetwork.ops.size() != network.ops.size())) {
+    printf("The network of [%s] does not match\n", outputName);
+    ok = false;
+  }
+  for (uint32_t iLayer = 0; ok && iLayer < NUM_LAYERS; ++ iLayer) {
+    if (memcmp(checkWeights[iLayer], fxpWeights[iLayer], LayerWeightsCount(iLayer) * sizeof(TFXP)) != 0 ||
+        memcmp(checkBiases[iLayer], fxpBiases[iLayer], LayerShapes[iLayer][1] * sizeof(TFXP)) != 0) {
+      printf("Layer %u of [%s] does not match the float model\n", iLayer, outputName);
+      ok = false;
+    }
+  }
+
+  for (uint32_t iLayer = 0; iLayer < NUM_LAYERS; ++ iLayer) {
+    TFXP * params[4] = {fxpWeights[iLayer], fxpBiases[iLayer],
+      iLayer < checkWeights.size() ? checkWeights[iLayer] : NULL, iLayer < checkBiases.size() ? checkBiases[iLayer] : NULL};
+    for (TFXP * p : params) {
+      if (p != NULL)
+        convolver.FreeDMACompatible(p);
+    }
+  }
+  if (!ok)
+    return -1;
+
+  PrintNetwork(network);
+  printf("FxP model with %u layers and %u decimals written to [%s]\n", NUM_LAYERS, DECIMALS, outputName);
+  return 0;
+}
@@ -0,0 +1,236 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "model.h"
+#include "cnn.h"
+#include "gemm.h"
+#include "CThreadPool.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_HAVE_AVX2 1
+#else
+#define GEMM_HAVE_AVX2 0
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GEMM_HAVE_NEON 1
+#else
+#define GEMM_HAVE_NEON 0
+#endif
+
+// Register block of the micro-kernel: MR filters x NR output pixels.
+static const uint32_t MR = 4;
+static const uint32_t NR = 8;
+
+// Cache blocks. A KC x NC block of the im2col matrix (192 KB) stays in L2 while all the filters sweep it, and the
+// MR x KC slice of the filters used by the micro-kernel (4 KB) stays in L1.
+static const uint32_t KC = 256;
+static const uint32_t NC_MAX = 192;
+
+// Micro-kernels: C[i][j] += sum_k FXP_Mult(a[k][i], b[k][j]) for an MR x NR tile.
+// a is a packed filter panel (kc x MR), b a packed im2col panel (kc x NR), C has a row stride of ldc.
+typedef void (*TMicroKernel)(uint32_t kc, const TFXP * a, const TFXP * b, TFXP * c, uint32_t ldc);
+
+static void MicroKernelGeneric(uint32_t kc, const TFXP * a, const TFXP * b, TFXP * c, uint32_t ldc)
+{
+  TFXP acc[MR][NR] = {};
+
+  for (uint32_t k = 0; k < kc; ++ k) {
+    for (uint32_t i = 0; i < MR; ++ i) {
+      for (uint32_t j = 0; j < NR; ++ j)
+        acc[i][j] += FXP_Mult(a[k*MR + i], b[k*NR + j]);
+    }
+  }
+
+  for (uint32_t i = 0; i < MR; ++ i) {
+    for (uint32_t j = 0; j < NR; ++ j)
+      c[i*ldc + j] += acc[i][j];
+  }
+}
+
+#if GEMM_HAVE_AVX2
+// Same even/odd lane scheme as the AVX2 row kernel in cnn.cpp: the 64-bit lanes keep (product >> DECIMALS),
+// whose low 32 bits are the FXP_Mult() result, and are truncated when the tile is stored.
+__attribute__((target("avx2")))
+static void MicroKernelAVX2(uint32_t kc, const TFXP * a, const TFXP * b, TFXP * c, uint32_t ldc)
+{
+  __m256i accEven[MR], accOdd[MR];
+
+  for (uint32_t i = 0; i < MR; ++ i) {
+    accEven[i] = _mm256_setzero_si256();
+    accOdd[i] = _mm256_setzero_si256();
+  }
+
+  for (uint32_t k = 0; k < kc; ++ k) {
+    __m256i even = _mm256_loadu_si256((const __m256i *)(b + k*NR));
+    __m256i odd = _mm256_srli_epi64(even, 32);
+
+    for (uint32_t i = 0; i < MR; ++ i) {
+      __m256i coeff = _mm256_set1_epi32(a[k*MR + i]);
+      accEven[i] = _mm256_add_epi64(accEven[i], _mm256_srli_epi64(_mm256_mul_epi32(even, coeff), DECIMALS));
+      accOdd[i] = _mm256_add_epi64(accOdd[i], _mm256_srli_epi64(_mm256_mul_epi32(odd, coeff), DECIMALS));
+    }
+  }
+
+  for (uint32_t i = 0; i < MR; ++ i) {
+    __m256i acc = _mm256_blend_epi32(accEven[i], _mm256_slli_epi64(accOdd[i], 32), 0xAA);
+    __m256i * dst = (__m256i *)(c + i*ldc);
+    _mm256_storeu_si256(dst, _mm256_add_epi32(_mm256_loadu_si256(dst), acc));
+  }
+}
+#endif
+
+#if GEMM_HAVE_NEON
+// vshrn_n_s64 keeps the low 32 bits of (product >> DECIMALS), which is what FXP_Mult() returns.
+static void MicroKernelNEON(uint32_t kc, const TFXP * a, const TFXP * b, TFXP * c, uint32_t ldc)
+{
+  int32x4_t accLo[MR], accHi[MR];
+
+  for (uint32_t i = 0; i < MR; ++ i) {
+    accLo[i] = vdupq_n_s32(0);
+    accHi[i] = vdupq_n_s32(0);
+  }
+
+  for (uint32_t k = 0; k < kc; ++ k) {
+    int32x4_t lo = vld1q_s32(b + k*NR);
+    int32x4_t hi = vld1q_s32(b + k*NR + 4);
+
+    for (uint32_t i = 0; i < MR; ++ i) {
+      int32_t coeff = a[k*MR + i];
+      accLo[i] = vaddq_s32(accLo[i], vcombine_s32(vshrn_n_s64(vmull_n_s32(vget_low_s32(lo), coeff), DECIMALS),
+                                                  vshrn_n_s64(vmull_n_s32(vget_high_s32(lo), coeff), DECIMALS)));
+      accHi[i] = vaddq_s32(accHi[i], vcombine_s32(vshrn_n_s64(vmull_n_s32(vget_low_s32(hi), coeff), DECIMALS),
+                                                  vshrn_n_s64(vmull_n_s32(vget_high_s32(hi), coeff), DECIMALS)));
+    }
+  }
+
+  for (uint32_t i = 0; i < MR; ++ i) {
+    vst1q_s32(c + i*ldc, vaddq_s32(vld1q_s32(c + i*ldc), accLo[i]));
+    vst1q_s32(c + i*ldc + 4, vaddq_s32(vld1q_s32(c + i*ldc + 4), accHi[i]));
+  }
+}
+#endif
+
+static TMicroKernel SelectMicroKernel()
+{
+#if GEMM_HAVE_AVX2
+  if (__builtin_cpu_supports("avx2"))
+    return MicroKernelAVX2;
+#endif
+#if GEMM_HAVE_NEON
+  return MicroKernelNEON;
+#endif
+  return MicroKernelGeneric;
+}
+
+static const TMicroKernel microKernel = SelectMicroKernel();
+
+// Packs the filters [F][K] into panels of MR rows: packed[iPanel][k][MR]. Missing rows are padded with zeros.
+static void PackFilters(const TFXP * filters, uint32_t numFilters, uint32_t K, TFXP * packed)
+{
+  for (uint32_t i0 = 0; i0 < numFilters; i0 += MR) {
+    for (uint32_t k = 0; k < K; ++ k) {
+      for (uint32_t i = 0; i < MR; ++ i)
+        *(packed++) = (i0 + i < numFilters) ? filters[(i0 + i)*K + k] : 0;
+    }
+  }
+}
+
+// Packs the block [k0, k0+kc) x [p0, p0+nc) of the (virtual) im2col matrix into panels of NR columns:
+// packed[iPanel][kk][NR]. Row k of im2col is input[c][y+cy][x+cx] with k = c*9 + cy*3 + cx, column p is
+// the output pixel (y, x). Pixels past the end are padded with zeros.
+static void PackIm2col(const TFXP * input, uint32_t inputWidth, uint32_t inputHeight, uint32_t outWidth, uint32_t numPixels,
+      uint32_t k0, uint32_t kc, uint32_t p0, uint32_t nc, TFXP * packed)
+{
+  for (uint32_t j0 = 0; j0 < nc; j0 += NR) {
+    // Offset of the top-left input pixel of each column of the panel.
+    int32_t pixelOffset[NR];
+    for (uint32_t j = 0; j < NR; ++ j) {
+      uint32_t p = p0 + j0 + j;
+      pixelOffset[j] = (j0 + j < nc && p < numPixels) ? (p / outWidth)*inputWidth + (p % outWidth) : -1;
+    }
+
+    for (uint32_t kk = 0; kk < kc; ++ kk) {
+      uint32_t k = k0 + kk;
+      uint32_t tap = k % 9;
+      const TFXP * in = input + (k / 9)*inputWidth*inputHeight + (tap / 3)*inputWidth + (tap % 3);
+      for (uint32_t j = 0; j < NR; ++ j)
+        *(packed++) = (pixelOffset[j] >= 0) ? in[pixelOffset[j]] : 0;
+    }
+  }
+}
+
+void Conv2DGemm(TFXP *input, TFXP * output, TFXP * filters, TFXP * biases,
+      uint32_t numFilters, uint32_t numChannels,
+      uint32_t inputWidth, uint32_t inputHeight, bool performReLu)
+{
+  const uint32_t outWidth = inputWidth - 2;
+  const uint32_t outHeight = inputHeight - 2;
+  const uint32_t K = numChannels * 9;
+  const uint32_t P = outWidth * outHeight;
+  const uint32_t numFilterPanels = (numFilters + MR - 1) / MR;
+
+  std::vector<TFXP> packedFilters(numFilterPanels * MR * K);
+  PackFilters(filters, numFilters, K, packedFilters.data());
+
+  // The pixel blocks are split among the threads. Small layers use narrower blocks so all threads get work.
+  uint32_t nc = (P + 2*GetNumThreads() - 1) / (2*GetNumThreads());
+  nc = (nc + NR - 1) / NR * NR;
+  if (nc > NC_MAX)
+    nc = NC_MAX;
+  const uint32_t numPixelBlocks = (P + nc - 1) / nc;
+  const TFXP * packedA = packedFilters.data();
+
+  ThreadPool().ParallelFor(numPixelBlocks, [=](uint32_t firstBlock, uint32_t lastBlock) {
+    std::vector<TFXP> packedB(KC * nc);
+    TFXP tile[MR * NR];
+
+    for (uint32_t iBlock = firstBlock; iBlock < lastBlock; ++ iBlock) {
+      const uint32_t p0 = iBlock * nc;
+      const uint32_t pc = (p0 + nc <= P) ? nc : P - p0;
+
+      for (uint32_t iFilter = 0; iFilter < numFilters; ++ iFilter) {
+        for (uint32_t p = p0; p < p0 + pc; ++ p)
+          output[iFilter*P + p] = biases[iFilter];
+      }
+
+      for (uint32_t k0 = 0; k0 < K; k0 += KC) {
+        const uint32_t kc = (k0 + KC <= K) ? KC : K - k0;
+        PackIm2col(input, inputWidth, inputHeight, outWidth, P, k0, kc, p0, pc, packedB.data());
+
+        for (uint32_t iPanel = 0; iPanel < numFilterPanels; ++ iPanel) {
+          const TFXP * a = packedA + iPanel*MR*K + k0*MR;
+          const uint32_t i0 = iPanel * MR;
+
+          for (uint32_t j0 = 0; j0 < pc; j0 += NR) {
+            const TFXP * b = packedB.data() + j0*kc;
+
+            if (i0 + MR <= numFilters && j0 + NR <= pc) {
+              microKernel(kc, a, b, output + i0*P + p0 + j0, P);
+            } else {
+              // Edge tile: compute the full tile in a scratch buffer and add only the valid part.
+              memset(tile, 0, sizeof(tile));
+              microKernel(kc, a, b, tile, NR);
+              for (uint32_t i = 0; i < MR && i0 + i < numFilters; ++ i) {
+                for (uint32_t j = 0; j < NR && j0 + j < pc; ++ j)
+                  output[(i0 + i)*P + p0 + j0 + j] += tile[i*NR + j];
+              }
+            }
+          }
+        }
+      }
+
+      if (performReLu) {
+        for (uint32_t iFilter = 0; iFilter < numFilters; ++ iFilter) {
+          for (uint32_t p = p0; p < p0 + pc; ++ p) {
+            if (output[iFilter*P + p] < 0)
+              output[iFilter*P + p] = 0;
+          }
+        }
+      }
+    }
+  });
+}
@@ -0,0 +1,11 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+// Convolution lowered to a fixed-point GEMM: output[F][P] = filters[F][K] x im2col(input)[K][P], with K = C*3*3
+// and P = the output pixels. The im2col matrix is never built: each block of it is packed directly from the input.
+// Bit-exact with Conv2D() + AddBiases() + ReLU().
+void Conv2DGemm(TFXP *input, TFXP * output, TFXP * filters, TFXP * biases,
+      uint32_t numFilters, uint32_t numChannels,
+      uint32_t inputWidth, uint32_t inputHeight, bool performReLu);
+
+#endif
@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+#include "memoryPlanner.h"
+
+static uint32_t AlignUp(uint32_t value, uint32_t alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static bool Overlap(const TTensorLifetime & a, const TTensorLifetime & b)
+{
+  return a.first <= b.last && b.first <= a.last;
+}
+
+uint32_t PlanArena(std::vector<TTensorLifetime> & tensors, uint32_t alignment)
+{
+  std::vector<uint32_t> order(tensors.size());
+  for (uint32_t ii = 0; ii < order.size(); ++ ii)
+    order[ii] = ii;
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return tensors[a].size > tensors[b].size; });
+
+  std::vector<uint32_t> placed;
+  uint32_t arenaSize = 0;
+  for (uint32_t iTensor : order) {
+    TTensorLifetime & tensor = tensors[iTensor];
+
+    // The placed tensors alive at the same time, by offset. The tensor goes into the first gap that fits.
+    std::vector<const TTensorLifetime *> conflicts;
+    for (uint32_t iPlaced : placed) {
+      if (Overlap(tensor, tensors[iPlaced]))
+        conflicts.push_back(&tensors[iPlaced]);
+    }
+    std::sort(conflicts.begin(), conflicts.end(), [](const TTensorLifetime * a, const TTensorLifetime * b) { return a->offset < b->offset; });
+
+    uint32_t offset = 0;
+    for (const TTensorLifetime * other : conflicts) {
+      if (offset + tensor.size <= other->offset)
+        break;
+      offset = std::max(offset, AlignUp(other->offset + other->size, alignment));
+    }
+    tensor.offset = offset;
+    arenaSize = std::max(arenaSize, offset + tensor.size);
+    placed.push_back(iTensor);
+  }
+  return AlignUp(arenaSize, alignment);
+}
+
+uint32_t PeakLiveSize(const std::vector<TTensorLifetime> & tensors)
+{
+  uint32_t peak = 0;
+  for (const TTensorLifetime & tensor : tensors) {
+    // The peak is reached when some tensor is written.
+    uint32_t live = 0;
+    for (const TTensorLifetime & other : tensors) {
+      if (other.first <= tensor.first && tensor.first <= other.last)
+        live += other.size;
+    }
+    peak = std::max(peak, live);
+  }
+  return peak;
+}
@@ -0,0 +1,25 @@
+#ifndef MEMORY_PLANNER_H
+#define MEMORY_PLANNER_H
+
+#include <stdint.h>
+#include <vector>
+
+// Static placement of the activations of a network in a single arena. Each tensor is alive from the step that
+// writes it to the last step that reads it (both included), and two tensors can only share memory if their
+// lifetimes do not overlap. The plan is made once, when the network is loaded.
+
+struct TTensorLifetime {
+  uint32_t size;      // Bytes
+  uint32_t first;     // Step that writes it
+  uint32_t last;      // Last step that reads it
+  uint32_t offset;    // Position in the arena, set by PlanArena()
+};
+
+// Greedy by size: the largest tensors are placed first, each at the lowest aligned offset that does not collide
+// with a placed tensor alive at the same time. Returns the size of the arena, in bytes.
+uint32_t PlanArena(std::vector<TTensorLifetime> & tensors, uint32_t alignment);
+
+// Largest sum of the sizes of the tensors alive at the same step. No arena can be smaller.
+uint32_t PeakLiveSize(const std::vector<TTensorLifetime> & tensors);
+
+#endif
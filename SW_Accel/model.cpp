@@ -3,9 +3,14 @@
 #include <time.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <string.h>
+#include <algorithm>
 
 #include "model.h"
+#include "network.h"
+#include "fxpModel.h"
 #include "cnn.h"
+#include "CThreadPool.hpp"
 
 bool ConvertWeightsToFxP(CConvDriver& convolver, const uint32_t numLayers, float ** floatWeights, TFXP ** fxpWeights)
 {
@@ -14,7 +19,7 @@ bool ConvertWeightsToFxP(CConvDriver& convolver, const uint32_t numLayers, float
 
   for (uint32_t iLayer = 0; iLayer < numLayers; ++ iLayer) {
     pFloat = floatWeights[iLayer];
-    uint32_t layerSize = LayerTypes[iLayer] == CONV ? LayerShapes[iLayer][0] * LayerShapes[iLayer][1] * 3*3 : LayerShapes[iLayer][0] * LayerShapes[iLayer][1];
+    uint32_t layerSize = LayerWeightsCount(iLayer);
     
     if ( (fxpWeights[iLayer] = (TFXP*)convolver.AllocDMACompatible(layerSize * sizeof(TFXP))) == NULL ) {
       printf("Error allocating %" PRIu32 " bytes for FxP weights in layer %u\n", (uint32_t)(layerSize*sizeof(TFXP)), iLayer);
@@ -37,6 +42,9 @@ bool ConvertWeightsToFxP(CConvDriver& convolver, const uint32_t numLayers, float
         }
       }
     }
+
+    if (LayerTypes[iLayer] == CONV)
+      convolver.PrepareFilters(fxpWeights[iLayer], LayerShapes[iLayer][1], LayerShapes[iLayer][0]);
   }
   return true;
 }
@@ -63,7 +71,7 @@ bool LoadFloatWeights(const uint32_t numLayers, float ** weights)
       printf("Error opening file [%s]\n", title);
       return false;
     }
-    uint32_t layerSize = LayerTypes[iLayer] == CONV ? LayerShapes[iLayer][0] * LayerShapes[iLayer][1] * 3*3 : LayerShapes[iLayer][0] * LayerShapes[iLayer][1];
+    uint32_t layerSize = LayerWeightsCount(iLayer);
     if ( (weights[iLayer] = (float*)malloc(layerSize * sizeof(float))) == NULL ) {
       printf("Error allocating %" PRIu32 " bytes to read file [%s]\n", (uint32_t)(layerSize*sizeof(float)), title);
       fclose(input);
@@ -129,15 +137,22 @@ bool LoadFloatBiases(const uint32_t numLayers, float ** biases)
   return true;
 }
 
-bool LoadModelInFxP(CConvDriver& convolver, TFXP ** fxpWeights, TFXP ** fxpBiases)
+bool LoadModelInFxP(CConvDriver& convolver, TNetwork & network, std::vector<TFXP*> & fxpWeights, std::vector<TFXP*> & fxpBiases)
 {
   float * floatWeights[NUM_LAYERS];
   float * floatBiases[NUM_LAYERS];
 
+  // The precompiled container is read without any conversion, and describes its own network.
+  // The float files are the fallback, and can only hold the default network.
+  if (LoadFxPModel(convolver, FXP_MODEL_FILE, network, fxpWeights, fxpBiases))
+    return true;
+  printf("Converting the float model (run fxpModelConverter to create %s)\n", FXP_MODEL_FILE);
+
+  network = DefaultNetwork();
+  fxpWeights.assign(NUM_LAYERS, NULL);
+  fxpBiases.assign(NUM_LAYERS, NULL);
   for (uint32_t ii = 0; ii < NUM_LAYERS; ++ ii) {
-    fxpWeights[ii] = NULL;
     floatWeights[ii] = NULL;
-    fxpBiases[ii] = NULL;
     floatBiases[ii] = NULL;
   }
 
@@ -146,7 +161,7 @@ bool LoadModelInFxP(CConvDriver& convolver, TFXP ** fxpWeights, TFXP ** fxpBiase
     FreeParams(NUM_LAYERS, (void**)floatWeights);
     return false;
   }
-  ConvertWeightsToFxP(convolver, NUM_LAYERS, floatWeights, fxpWeights);
+  ConvertWeightsToFxP(convolver, NUM_LAYERS, floatWeights, fxpWeights.data());
   FreeParams(NUM_LAYERS, (void**)floatWeights);
 
   if (!LoadFloatBiases(NUM_LAYERS, floatBiases)) {
@@ -154,7 +169,7 @@ bool LoadModelInFxP(CConvDriver& convolver, TFXP ** fxpWeights, TFXP ** fxpBiase
     FreeParams(NUM_LAYERS, (void**)floatBiases);
     return false;
   }
-  ConvertBiasesToFxP(convolver, NUM_LAYERS, floatBiases, fxpBiases);
+  ConvertBiasesToFxP(convolver, NUM_LAYERS, floatBiases, fxpBiases.data());
   FreeParams(NUM_LAYERS, (void**)floatBiases);
 
   return true;
@@ -178,117 +193,198 @@ bool LoadImageInFxp(const char * fileName, TFXP * inputImageFxp, uint8_t * input
   }
   fclose(inputImageFile);
 
-  // Convert image from RGB 8-8-8 pixels to fxp, normalized to [0.0-1.0)
+  ConvertImageToFxp(inputImageRGB, inputImageFxp, inputSize);
+  return true;
+}
+
+void ConvertImageToFxp(const uint8_t * inputImageRGB, TFXP * inputImageFxp, uint32_t inputSize)
+{
+  // Convert image from RGB 8-8-8 pixels to fxp, normalized to [0.0-1.0).
+  // There are only 256 possible values, so they are converted once and looked up.
+  static TFXP pixelToFxp[256];
+  static bool tableReady = false;
+  if (!tableReady) {
+    for (uint32_t ii = 0; ii < 256; ++ ii)
+      pixelToFxp[ii] = Float2Fxp((ii/255.0), DECIMALS);
+    tableReady = true;
+  }
+
   for (uint32_t ii = 0; ii < inputSize; ++ ii)
-    inputImageFxp[ii] = Float2Fxp((inputImageRGB[ii]/255.0), DECIMALS);
+    inputImageFxp[ii] = pixelToFxp[inputImageRGB[ii]];
+}
 
-  return true;
+// Largest magnitude of the values, or largest positive value.
+static TFXP MaxFxp(const TFXP * values, uint32_t count, bool positiveOnly)
+{
+  int64_t maxValue = 0;
+  for (uint32_t ii = 0; ii < count; ++ ii) {
+    int64_t value = (positiveOnly || values[ii] >= 0) ? values[ii] : -(int64_t)values[ii];
+    if (value > maxValue)
+      maxValue = value;
+  }
+  return maxValue > INT32_MAX ? INT32_MAX : maxValue;
+}
+
+// value * 2^(toDecimals - fromDecimals), rounding to nearest, saturated to [minValue, maxValue].
+static int64_t RescaleFxp(int64_t value, uint32_t fromDecimals, uint32_t toDecimals, int64_t minValue, int64_t maxValue)
+{
+  if (toDecimals >= fromDecimals)
+    value = value << (toDecimals - fromDecimals);
+  else
+    value = (value + ((int64_t)1 << (fromDecimals - toDecimals - 1))) >> (fromDecimals - toDecimals);
+  return value < minValue ? minValue : (value > maxValue ? maxValue : value);
+}
+
+uint32_t Fxp16Decimals(TFXP maxAbs, uint32_t headroomBits)
+{
+  uint32_t decimals = DECIMALS;
+  while (decimals > 0 && ((int64_t)maxAbs << (headroomBits + decimals)) > ((int64_t)INT16_MAX << DECIMALS))
+    -- decimals;
+  return decimals;
+}
+
+void ConvertFxpToFxp16(const TFXP * input, TFXP16 * output, uint32_t count, uint32_t decimals)
+{
+  for (uint32_t ii = 0; ii < count; ++ ii)
+    output[ii] = RescaleFxp(input[ii], DECIMALS, decimals, INT16_MIN, INT16_MAX);
+}
+
+void ConvertFxp16ToFxp(const TFXP16 * input, TFXP * output, uint32_t count, uint32_t decimals)
+{
+  for (uint32_t ii = 0; ii < count; ++ ii)
+    output[ii] = (TFXP)input[ii] * (1 << (DECIMALS - decimals));
 }
 
-TFXP Inference(CConvDriver& convolver, TFXP * inputImageFxp, TFXP * buffer0, TFXP * buffer1, TFXP ** fxpWeights, TFXP ** fxpBiases, TTimes & times)
+void QuantizeConvFxp16(const TFXP * filters, const TFXP * biases, uint32_t numFilters, uint32_t numChannels,
+  const CConvDriver::TFxp16Quant & quant, TFXP16 * filtersFxp16, TFXP16_BIAS * biasesFxp16)
 {
-  uint32_t iLayer, size;
-  struct timespec start, end;
-
-  // TODO: Call the accelerator Conv_HW() function instead of calling the Conv2D function. Also remove the AddBiases and ReLu calls.
-  iLayer = 0, size = 256;
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  convolver.Conv(inputImageFxp, buffer0, fxpWeights[iLayer], fxpBiases[iLayer], LayerShapes[iLayer][1], LayerShapes[iLayer][0], size, size, true);
-  size -= 2;
-  // AddBiases(buffer0, fxpBiases[iLayer], LayerShapes[iLayer][1], size, size);
-  // ReLU(buffer0, LayerShapes[iLayer][1], size, size);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeConv[iLayer] = CalcTimeDiff(end, start);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  MaxPool(buffer0, buffer1, LayerShapes[iLayer][1], size, size);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeMaxPool[iLayer] = CalcTimeDiff(end, start);
-  ++ iLayer;
-
-  size = 127;
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  convolver.Conv(buffer1, buffer0, fxpWeights[iLayer], fxpBiases[iLayer], LayerShapes[iLayer][1], LayerShapes[iLayer][0], size, size, true);
-  size -= 2;
-  // AddBiases(buffer0, fxpBiases[iLayer], LayerShapes[iLayer][1], size, size);
-  // ReLU(buffer0, LayerShapes[iLayer][1], size, size);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeConv[iLayer] = CalcTimeDiff(end, start);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  MaxPool(buffer0, buffer1, LayerShapes[iLayer][1], size, size);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeMaxPool[iLayer] = CalcTimeDiff(end, start);
-  ++ iLayer;
-
-  size = 62;
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  convolver.Conv(buffer1, buffer0, fxpWeights[iLayer], fxpBiases[iLayer], LayerShapes[iLayer][1], LayerShapes[iLayer][0], size, size, true);
-  size -= 2;
-  // AddBiases(buffer0, fxpBiases[iLayer], LayerShapes[iLayer][1], size, size);
-  // ReLU(buffer0, LayerShapes[iLayer][1], size, size);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeConv[iLayer] = CalcTimeDiff(end, start);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  MaxPool(buffer0, buffer1, LayerShapes[iLayer][1], size, size);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeMaxPool[iLayer] = CalcTimeDiff(end, start);
-  ++ iLayer;
-
-  size = 30;
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  convolver.Conv(buffer1, buffer0, fxpWeights[iLayer], fxpBiases[iLayer], LayerShapes[iLayer][1], LayerShapes[iLayer][0], size, size, true);
-  size -= 2;
-  // AddBiases(buffer0, fxpBiases[iLayer], LayerShapes[iLayer][1], size, size);
-  // ReLU(buffer0, LayerShapes[iLayer][1], size, size);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeConv[iLayer] = CalcTimeDiff(end, start);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  MaxPool(buffer0, buffer1, LayerShapes[iLayer][1], size, size);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeMaxPool[iLayer] = CalcTimeDiff(end, start);
-  ++ iLayer;
-
-  size = 14;
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  convolver.Conv(buffer1, buffer0, fxpWeights[iLayer], fxpBiases[iLayer], LayerShapes[iLayer][1], LayerShapes[iLayer][0], size, size, true);
-  size -= 2;
-  // AddBiases(buffer0, fxpBiases[iLayer], LayerShapes[iLayer][1], size, size);
-  // ReLU(buffer0, LayerShapes[iLayer][1], size, size);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeConv[iLayer] = CalcTimeDiff(end, start);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  MaxPool(buffer0, buffer1, LayerShapes[iLayer][1], size, size);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeMaxPool[iLayer] = CalcTimeDiff(end, start);
-
-  size = 6;
-  // Flatten the output for the next dense layer: [row, col, filter]
-  // From [64, 6, 6] to [2304]
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  Flatten(buffer1, buffer0, LayerShapes[iLayer][1], size, size);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeFlatten = CalcTimeDiff(end, start);
-  ++ iLayer;
-
-  // Output is now 6x6x64 --> 2304. Goes to a fully-connected layer.
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  Dense(buffer0, buffer1, LayerShapes[iLayer][0], LayerShapes[iLayer][1], fxpWeights[iLayer], fxpBiases[iLayer]);
-  ReLU(buffer1, 1, LayerShapes[iLayer][1], 1);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeDense[iLayer] = CalcTimeDiff(end, start);
-  ++ iLayer;
-
-  // Output is now an array of 512 values. Goes to the final fully-connected layer.
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  Dense(buffer1, buffer0, LayerShapes[iLayer][0], LayerShapes[iLayer][1], fxpWeights[iLayer], fxpBiases[iLayer]);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeDense[iLayer] = CalcTimeDiff(end, start);
-
-  clock_gettime(CLOCK_MONOTONIC_RAW, &start);
-  Sigmoid(buffer0, 1);
-  clock_gettime(CLOCK_MONOTONIC_RAW, &end);
-  times.timeSigmoid = CalcTimeDiff(end, start);
-
-  return buffer0[0];
+  ConvertFxpToFxp16(filters, filtersFxp16, numFilters * numChannels * CONV_FILTER_HEIGHT * CONV_FILTER_WIDTH, quant.weightDecimals);
+  for (uint32_t iFilter = 0; iFilter < numFilters; ++ iFilter)
+    biasesFxp16[iFilter] = RescaleFxp(biases[iFilter], DECIMALS, quant.inputDecimals + quant.weightDecimals, INT32_MIN, INT32_MAX);
+}
+
+void Conv2DFxp16(const TFXP16 * input, TFXP16 * output, const TFXP16 * filters, const TFXP16_BIAS * biases,
+  uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight,
+  const CConvDriver::TFxp16Quant & quant, bool performReLu, bool performMaxPool)
+{
+  const uint32_t outputWidth = inputWidth - CONV_FILTER_WIDTH + 1;
+  const uint32_t outputHeight = inputHeight - CONV_FILTER_HEIGHT + 1;
+  const uint32_t shift = quant.inputDecimals + quant.weightDecimals - quant.outputDecimals;
+  const uint32_t filterSize = CONV_FILTER_HEIGHT * CONV_FILTER_WIDTH;
+
+  ThreadPool().ParallelFor(numFilters, [=](uint32_t firstFilter, uint32_t lastFilter) {
+    std::vector<TFXP16> row[2];
+    for (uint32_t iFilter = firstFilter; iFilter < lastFilter; ++ iFilter) {
+      TFXP16 * out = output + iFilter * (performMaxPool ? (outputHeight / 2) * (outputWidth / 2) : outputHeight * outputWidth);
+      for (uint32_t y = 0; y < outputHeight; ++ y) {
+        // With the MaxPool, the rows are pooled in pairs, dropping the last one of odd heights.
+        std::vector<TFXP16> & outRow = row[y & 1];
+        outRow.resize(outputWidth);
+        for (uint32_t x = 0; x < outputWidth; ++ x) {
+          TFXP16_ACC acc = biases[iFilter];
+          for (uint32_t iChannel = 0; iChannel < numChannels; ++ iChannel) {
+            const TFXP16 * f = filters + (iFilter * numChannels + iChannel) * filterSize;
+            const TFXP16 * in = input + (iChannel * inputHeight + y) * inputWidth + x;
+            for (uint32_t cy = 0; cy < CONV_FILTER_HEIGHT; ++ cy) {
+              for (uint32_t cx = 0; cx < CONV_FILTER_WIDTH; ++ cx)
+                acc += (int32_t)f[cy * CONV_FILTER_WIDTH + cx] * in[cy * inputWidth + cx];
+            }
+          }
+          if (shift > 0)
+            acc = (acc + ((TFXP16_ACC)1 << (shift - 1))) >> shift;
+          acc = acc < INT16_MIN ? INT16_MIN : (acc > INT16_MAX ? INT16_MAX : acc);
+          outRow[x] = (performReLu && acc < 0) ? 0 : acc;
+        }
+
+        if (!performMaxPool) {
+          memcpy(out + y * outputWidth, outRow.data(), outputWidth * sizeof(TFXP16));
+        } else if (y & 1) {
+          for (uint32_t x = 0; x + 1 < outputWidth; x += 2)
+            out[(y / 2) * (outputWidth / 2) + x / 2] = std::max(std::max(row[0][x], row[0][x + 1]), std::max(row[1][x], row[1][x + 1]));
+        }
+      }
+    }
+  });
+}
+
+bool QuantizeModelFxp16(CConvDriver & convolver, const TNetwork & network, const std::vector<TFXP*> & weights,
+  const std::vector<TFXP*> & biases, const std::vector<std::string> & calibrationImages)
+{
+  std::vector<TNetShape> shapes;
+  if (!DeriveShapes(network, shapes))
+    return false;
+
+  // The features run up to the FLATTEN (or the first DENSE), as in CNetExecutor.
+  uint32_t numFeatureOps = 0;
+  while (numFeatureOps < network.ops.size() && network.ops[numFeatureOps].type != OP_FLATTEN && network.ops[numFeatureOps].type != OP_DENSE)
+    ++ numFeatureOps;
+
+  // Largest input value, and largest output of every conv layer: only the positive ones when a ReLU follows, as the
+  // negative ones become 0 after saturating.
+  TFXP inputMax = 0;
+  std::vector<TFXP> convMax(network.layers.size(), 0);
+  std::vector<TFXP> current, next;
+  std::vector<uint8_t> inputRGB(network.input.Size());
+  uint32_t numImages = 0;
+  for (const std::string & image : calibrationImages) {
+    current.resize(network.input.Size());
+    if (!LoadImageInFxp(image.c_str(), current.data(), inputRGB.data(), inputRGB.size()))
+      continue;
+    ++ numImages;
+    inputMax = std::max(inputMax, MaxFxp(current.data(), current.size(), false));
+
+    TNetShape shape = network.input;
+    for (uint32_t iOp = 0; iOp < numFeatureOps; ++ iOp) {
+      const TNetOp & op = network.ops[iOp];
+      if (op.type == OP_CONV) {
+        const TNetLayer & layer = network.layers[op.layer];
+        bool relu = iOp + 1 < numFeatureOps && network.ops[iOp + 1].type == OP_RELU;
+        next.resize(shapes[iOp].Size());
+        Conv2DBiasReLU(current.data(), next.data(), weights[op.layer], biases[op.layer], layer.outputSize, layer.inputSize, shape.width, shape.height, false);
+        convMax[op.layer] = std::max(convMax[op.layer], MaxFxp(next.data(), next.size(), relu));
+        current.swap(next);
+      } else if (op.type == OP_RELU) {
+        ReLU(current.data(), shape.channels, shape.width, shape.height);
+      } else if (op.type == OP_MAXPOOL) {
+        next.resize(shapes[iOp].Size());
+        MaxPool(current.data(), next.data(), shape.channels, shape.width, shape.height);
+        current.swap(next);
+      } else {
+        Sigmoid(current.data(), current.size());
+      }
+      shape = shapes[iOp];
+    }
+  }
+  if (numImages == 0) {
+    printf("Error: no calibration image could be read for the 16-bit layers.\n");
+    return false;
+  }
+
+  // The decimals follow the activations: a conv layer reads its input with those of the tensor it comes from (the
+  // ReLU and the MaxPool do not change them).
+  uint32_t decimals = Fxp16Decimals(inputMax, 1);
+  for (uint32_t iOp = 0; iOp < numFeatureOps; ++ iOp) {
+    const TNetOp & op = network.ops[iOp];
+    if (op.type != OP_CONV)
+      continue;
+    const TNetLayer & layer = network.layers[op.layer];
+    CConvDriver::TFxp16Quant quant;
+    quant.inputDecimals = decimals;
+    quant.weightDecimals = Fxp16Decimals(MaxFxp(weights[op.layer], NetLayerWeightsCount(layer), false), 0);
+    // The biases have to fit in 32 bits with the decimals of the products.
+    TFXP biasMax = MaxFxp(biases[op.layer], layer.outputSize, false);
+    while (quant.weightDecimals > 0 && quant.inputDecimals + quant.weightDecimals > DECIMALS &&
+        ((int64_t)biasMax << (quant.inputDecimals + quant.weightDecimals - DECIMALS)) > INT32_MAX)
+      -- quant.weightDecimals;
+    quant.outputDecimals = std::min(Fxp16Decimals(convMax[op.layer], 1), quant.inputDecimals + quant.weightDecimals);
+
+    printf("Conv layer %u in 16 bits: %u decimals for the input, %u for the filters and %u for the output\n", op.layer,
+      quant.inputDecimals, quant.weightDecimals, quant.outputDecimals);
+    if (!convolver.SetFxp16Quant(weights[op.layer], biases[op.layer], layer.outputSize, layer.inputSize, quant))
+      return false;
+    decimals = quant.outputDecimals;
+  }
+  return true;
 }
 
 uint64_t CalcTimeDiff(const struct timespec & time2, const struct timespec & time1)
@@ -1,6 +1,8 @@
 #ifndef MODEL_H
 #define MODEL_H
 
+#include <vector>
+#include <string>
 #include "CConvDriver.hpp"
 
 const uint32_t DECIMALS = 20;
@@ -18,14 +20,28 @@ const TLayerType LayerTypes[NUM_LAYERS] = {
   CONV, CONV, CONV, CONV, CONV, DENSE, DENSE
 };
 
+// Largest number of parameterized layers in a network (network.h).
+const uint32_t MAX_NET_LAYERS = 16;
+
+// Indexed by parameterized layer
 struct TTimes {
-  uint64_t timeConv[NUM_LAYERS];
-  uint64_t timeMaxPool[NUM_LAYERS];
-  uint64_t timeDense[NUM_LAYERS];
+  uint64_t timeConv[MAX_NET_LAYERS];
+  uint64_t timeMaxPool[MAX_NET_LAYERS];
+  uint64_t timeDense[MAX_NET_LAYERS];
   uint64_t timeFlatten;
   uint64_t timeSigmoid;
+  // Counters of the accelerator for the conv layers run on it (CConvDriver::TAccelStats)
+  uint64_t accelCycles[MAX_NET_LAYERS];
+  uint64_t accelMemCycles[MAX_NET_LAYERS];
+  uint64_t accelBytes[MAX_NET_LAYERS];
 };
 
+// Number of weights of a layer: [filter][channel][3][3] for CONV, [output][input] for DENSE.
+inline uint32_t LayerWeightsCount(uint32_t iLayer)
+{
+  return LayerTypes[iLayer] == CONV ? LayerShapes[iLayer][0] * LayerShapes[iLayer][1] * 3*3 : LayerShapes[iLayer][0] * LayerShapes[iLayer][1];
+}
+
 uint64_t CalcTimeDiff(const struct timespec & time2, const struct timespec & time1);
 
 bool LoadFloatWeights(const uint32_t numLayers, float ** weights);
@@ -34,9 +50,12 @@ bool LoadFloatBiases(const uint32_t numLayers, float ** biases);
 bool ConvertBiasesToFxP(CConvDriver& convolver, const uint32_t numLayers, float ** floatBiases, TFXP ** fxpBiases);
 void FreeParams(const uint32_t numLayers, void ** params);
 
-bool LoadModelInFxP(CConvDriver& convolver, TFXP ** fxpWeights, TFXP ** fxpBiases);
+struct TNetwork;
+
+// Loads FXP_MODEL_FILE, with its network. Without it, converts the float files of DefaultNetwork().
+bool LoadModelInFxP(CConvDriver& convolver, TNetwork & network, std::vector<TFXP*> & fxpWeights, std::vector<TFXP*> & fxpBiases);
 bool LoadImageInFxp(const char * fileName, TFXP * inputImageFxp, uint8_t * inputImageRGB, uint32_t inputSize);
-TFXP Inference(CConvDriver& convolver, TFXP* inputImageFxp, TFXP * buffer0, TFXP * buffer1, TFXP ** fxpWeights, TFXP ** fxpBiases, TTimes & times);
+void ConvertImageToFxp(const uint8_t * inputImageRGB, TFXP * inputImageFxp, uint32_t inputSize);
 
 inline TFXP Float2Fxp(float value, uint32_t decimalBits = DECIMALS)
 {
@@ -58,5 +77,34 @@ inline TFXP FXP_Mult(TFXP a, TFXP b, uint32_t decimalBits = DECIMALS)
   return res;
 }
 
+// Values of the 16-bit datapath of the accelerator (VALUE_BITS 16 in HLS/conv.h), with the decimals of each conv
+// layer (CConvDriver::TFxp16Quant). The biases are 32-bit, with the decimals of the products.
+typedef int16_t TFXP16;
+typedef int32_t TFXP16_BIAS;
+typedef int64_t TFXP16_ACC;
+
+// Sample images to measure the range of the activations of the 16-bit conv layers (QuantizeModelFxp16()).
+const char * const FXP16_CALIBRATION_IMAGES[] = {"cat.9495.jpg.rgba.planar", "dog.9499.jpg.rgba.planar"};
+
+// Most decimals (up to DECIMALS) with which values up to maxAbs fit in a TFXP16, with headroomBits spare bits.
+uint32_t Fxp16Decimals(TFXP maxAbs, uint32_t headroomBits);
+// TFXP --> TFXP16 with the given decimals, rounding to nearest and saturating. The way back is exact.
+void ConvertFxpToFxp16(const TFXP * input, TFXP16 * output, uint32_t count, uint32_t decimals);
+void ConvertFxp16ToFxp(const TFXP16 * input, TFXP * output, uint32_t count, uint32_t decimals);
+// The filters (weightDecimals) and biases (inputDecimals + weightDecimals) of a conv layer, saturating.
+void QuantizeConvFxp16(const TFXP * filters, const TFXP * biases, uint32_t numFilters, uint32_t numChannels,
+  const CConvDriver::TFxp16Quant & quant, TFXP16 * filtersFxp16, TFXP16_BIAS * biasesFxp16);
+// Reference of the 16-bit datapath, bit-exact with it: exact products, the sum shifted to outputDecimals rounding to
+// nearest and saturated, then the ReLU and the MaxPool (as MaxPool() in cnn.cpp).
+void Conv2DFxp16(const TFXP16 * input, TFXP16 * output, const TFXP16 * filters, const TFXP16_BIAS * biases,
+  uint32_t numFilters, uint32_t numChannels, uint32_t inputWidth, uint32_t inputHeight,
+  const CConvDriver::TFxp16Quant & quant, bool performReLu, bool performMaxPool);
+
+// Chooses the decimals of every conv layer for the 16-bit datapath and gives them, with the quantized parameters, to
+// the convolver (CConvDriver::SetFxp16Quant()). The filters use the range of their values, and the activations the
+// range measured running the features of the network in TFXP on the calibration images, with one bit of headroom.
+bool QuantizeModelFxp16(CConvDriver & convolver, const TNetwork & network, const std::vector<TFXP*> & weights,
+  const std::vector<TFXP*> & biases, const std::vector<std::string> & calibrationImages);
+
 #endif
 
@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdint.h>
+#include "network.h"
+
+static const char * opNames[NUM_OP_TYPES] = {"Conv", "ReLU", "MaxPool", "Flatten", "Dense", "Sigmoid"};
+
+const char * OpName(uint32_t type)
+{
+  return type < NUM_OP_TYPES ? opNames[type] : "?";
+}
+
+uint32_t NetLayerWeightsCount(const TNetLayer & layer)
+{
+  return layer.type == CONV ? layer.inputSize * layer.outputSize * 3*3 : layer.inputSize * layer.outputSize;
+}
+
+TNetwork DefaultNetwork()
+{
+  TNetwork network;
+
+  network.input = {3, 256, 256};
+  for (uint32_t iLayer = 0; iLayer < NUM_LAYERS; ++ iLayer)
+    network.layers.push_back({(uint32_t)LayerTypes[iLayer], LayerShapes[iLayer][0], LayerShapes[iLayer][1]});
+
+  for (uint32_t iLayer = 0; iLayer < NUM_LAYERS; ++ iLayer) {
+    if (LayerTypes[iLayer] == CONV) {
+      network.ops.push_back({OP_CONV, iLayer});
+      network.ops.push_back({OP_RELU, 0});
+      network.ops.push_back({OP_MAXPOOL, 0});
+    } else {
+      if (iLayer > 0 && LayerTypes[iLayer - 1] == CONV)
+        network.ops.push_back({OP_FLATTEN, 0});
+      network.ops.push_back({OP_DENSE, iLayer});
+      // The last layer goes to the Sigmoid instead.
+      network.ops.push_back({iLayer + 1 < NUM_LAYERS ? (uint32_t)OP_RELU : (uint32_t)OP_SIGMOID, 0});
+    }
+  }
+  return network;
+}
+
+bool DeriveShapes(const TNetwork & network, std::vector<TNetShape> & shapes)
+{
+  TNetShape shape = network.input;
+  bool isVector = false;
+
+  shapes.clear();
+  if (network.layers.size() > MAX_NET_LAYERS) {
+    printf("The network has %u layers, the maximum is %u\n", (uint32_t)network.layers.size(), MAX_NET_LAYERS);
+    return false;
+  }
+  if (network.ops.empty() || shape.Size() == 0) {
+    printf("The network is empty\n");
+    return false;
+  }
+
+  for (uint32_t iOp = 0; iOp < network.ops.size(); ++ iOp) {
+    const TNetOp & op = network.ops[iOp];
+    const TNetLayer * layer = op.layer < network.layers.size() ? &network.layers[op.layer] : NULL;
+    const char * error = NULL;
+
+    switch (op.type) {
+      case OP_CONV:
+        if (layer == NULL || layer->type != CONV)
+          error = "needs a CONV layer";
+        else if (isVector || layer->inputSize != shape.channels || shape.height < 3 || shape.width < 3)
+          error = "does not match its input";
+        else
+          shape = {layer->outputSize, shape.height - 2, shape.width - 2};
+        break;
+      case OP_MAXPOOL:
+        if (isVector || shape.height < 2 || shape.width < 2)
+          error = "does not match its input";
+        else
+          shape = {shape.channels, shape.height / 2, shape.width / 2};
+        break;
+      case OP_FLATTEN:
+        shape = {shape.Size(), 1, 1};
+        isVector = true;
+        break;
+      case OP_DENSE:
+        if (layer == NULL || layer->type != DENSE)
+          error = "needs a DENSE layer";
+        else if (layer->inputSize != shape.Size() || (!isVector && (shape.height != 1 || shape.width != 1)))
+          error = "does not match its input";
+        else
+          shape = {layer->outputSize, 1, 1};
+        isVector = true;
+        break;
+      case OP_RELU:
+      case OP_SIGMOID:
+        break;
+      default:
+        error = "is unknown";
+        break;
+    }
+
+    if (error != NULL) {
+      printf("Operation %u (%s, layer %u) %s (%ux%ux%u)\n", iOp, OpName(op.type), op.layer, error,
+        shape.channels, shape.height, shape.width);
+      return false;
+    }
+    shapes.push_back(shape);
+  }
+  return true;
+}
+
+void PrintNetwork(const TNetwork & network)
+{
+  std::vector<TNetShape> shapes;
+  if (!DeriveShapes(network, shapes))
+    return;
+
+  printf("Input %ux%ux%u\n", network.input.channels, network.input.height, network.input.width);
+  for (uint32_t iOp = 0; iOp < network.ops.size(); ++ iOp) {
+    const TNetOp & op = network.ops[iOp];
+    if (op.type == OP_CONV || op.type == OP_DENSE)
+      printf("%2u %-8s layer %u --> %ux%ux%u\n", iOp, OpName(op.type), op.layer, shapes[iOp].channels, shapes[iOp].height, shapes[iOp].width);
+    else
+      printf("%2u %-8s         --> %ux%ux%u\n", iOp, OpName(op.type), shapes[iOp].channels, shapes[iOp].height, shapes[iOp].width);
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef NETWORK_H
+#define NETWORK_H
+
+#include <stdint.h>
+#include <vector>
+#include "model.h"
+
+// Declarative description of a network: the input tensor, the parameterized layers (the weight and bias sets,
+// described by TLayerType and [input_size, output_size] like LayerShapes) and the sequence of operations.
+// All the activation sizes are derived from it, so a retrained or larger variant only needs a new model file.
+//  The description of the model in model/ is DefaultNetwork(). The FxP container (fxpModel.h) stores its own.
+
+typedef enum {OP_CONV = 0, OP_RELU = 1, OP_MAXPOOL = 2, OP_FLATTEN = 3, OP_DENSE = 4, OP_SIGMOID = 5, NUM_OP_TYPES} TOpType;
+
+struct TNetLayer {
+  uint32_t type;          // TLayerType
+  uint32_t inputSize;     // CONV: channels, DENSE: inputs
+  uint32_t outputSize;    // CONV: filters, DENSE: outputs
+};
+
+struct TNetOp {
+  uint32_t type;          // TOpType
+  uint32_t layer;         // OP_CONV, OP_DENSE: index of the parameterized layer. Unused by the others.
+};
+
+struct TNetShape {
+  uint32_t channels;
+  uint32_t height;
+  uint32_t width;
+  uint32_t Size() const { return channels * height * width; }
+};
+
+struct TNetwork {
+  TNetShape input;
+  std::vector<TNetLayer> layers;
+  std::vector<TNetOp> ops;
+};
+
+const char * OpName(uint32_t type);
+
+// Number of weights of a layer: [filter][channel][3][3] for CONV, [output][input] for DENSE.
+uint32_t NetLayerWeightsCount(const TNetLayer & layer);
+
+// The network of the model in model/, built from LayerTypes and LayerShapes:
+// 5 x (CONV, RELU, MAXPOOL), FLATTEN, DENSE, RELU, DENSE, SIGMOID on a 3x256x256 image.
+TNetwork DefaultNetwork();
+
+// Checks the network and computes the shape after every operation (shapes[i] is the output of ops[i]).
+// The ops after a FLATTEN see a vector (channels = size, height = width = 1). Prints the first problem found.
+bool DeriveShapes(const TNetwork & network, std::vector<TNetShape> & shapes);
+
+void PrintNetwork(const TNetwork & network);
+
+#endif
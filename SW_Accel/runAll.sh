@@ -1,8 +1,14 @@
-rm -f outputDogs.txt
-rm -f outputCats.txt
+rm -f outputDogs.txt outputDogs.log
+rm -f outputCats.txt outputCats.log
 
-for i in images/dog.*; do echo $i; ./cnnSolver $i | grep OUTPUT >> outputDogs.txt ; done
-for i in images/cat.*; do echo $i; ./cnnSolver $i | grep OUTPUT >> outputCats.txt ; done
+# A single cnnSolver run per class: the model is loaded once and the images are streamed through it.
+# Extra arguments (e.g. -b cpu-opt) are passed to cnnSolver.
+ls images/dog.* > dogs.lst
+ls images/cat.* > cats.lst
+./cnnSolver "$@" -l dogs.lst | tee outputDogs.log | grep OUTPUT > outputDogs.txt
+./cnnSolver "$@" -l cats.lst | tee outputCats.log | grep OUTPUT > outputCats.txt
+rm -f dogs.lst cats.lst
+grep "images/s" outputDogs.log outputCats.log
 
 echo -n "Positive dogs: "; grep "DOG" outputDogs.txt | wc -l
 echo -n "Negative dogs: "; grep "CAT" outputDogs.txt | wc -l
@@ -0,0 +1,281 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include "model.h"
+#include "cnn.h"
+#include "winograd.h"
+#include "CThreadPool.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define WINOGRAD_HAVE_AVX2 1
+#else
+#define WINOGRAD_HAVE_AVX2 0
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define WINOGRAD_HAVE_NEON 1
+#else
+#define WINOGRAD_HAVE_NEON 0
+#endif
+
+// F(2x2, 3x3) matrices:
+//   G = [1 0 0; 1/2 1/2 1/2; 1/2 -1/2 1/2; 0 0 1]
+//   B^T = [1 0 -1 0; 0 1 1 0; 0 -1 1 0; 0 1 0 -1]
+//   A^T = [1 1 1 0; 0 1 -1 -1]
+// The filters are transformed with G' = 2G, which has integer coefficients, so U' = G' g G'^T = 4 U exactly.
+// The output transform divides by 4 at the end.
+//
+// The element-wise products M = sum_c U'[c] * V[c] are the expensive part. When U' and V fit in 32 bits (always, for
+// trained weights and activations below +-512), they are done with 32x32->64-bit SIMD multiplications; otherwise
+// with 64-bit scalar ones. Both give the same result: the output only depends on bits 2..33 of M, and those do not
+// depend on whether the products are shifted right logically or arithmetically.
+
+static const TFXP_MULT TFXP_MIN = INT32_MIN;
+static const TFXP_MULT TFXP_MAX = INT32_MAX;
+
+uint32_t WinogradFiltersSize(uint32_t numFilters, uint32_t numChannels)
+{
+  return numFilters * numChannels * 16;
+}
+
+bool WinogradTransformFilters(const TFXP * filters, uint32_t numFilters, uint32_t numChannels, TFXP * transformed)
+{
+  bool fits = true;
+
+  for (uint32_t ii = 0; ii < numFilters * numChannels; ++ ii) {
+    const TFXP * g = filters + ii*9;
+    TFXP * u = transformed + ii*16;
+    TFXP_MULT t[4][3];
+
+    // t = G' g
+    for (uint32_t j = 0; j < 3; ++ j) {
+      TFXP_MULT g0 = g[j], g1 = g[3 + j], g2 = g[6 + j];
+      t[0][j] = 2*g0;
+      t[1][j] = g0 + g1 + g2;
+      t[2][j] = g0 - g1 + g2;
+      t[3][j] = 2*g2;
+    }
+
+    // U' = t G'^T
+    for (uint32_t i = 0; i < 4; ++ i) {
+      TFXP_MULT row[4] = {2*t[i][0], t[i][0] + t[i][1] + t[i][2], t[i][0] - t[i][1] + t[i][2], 2*t[i][2]};
+      for (uint32_t j = 0; j < 4; ++ j) {
+        if (row[j] < TFXP_MIN || row[j] > TFXP_MAX)
+          fits = false;
+        u[i*4 + j] = (TFXP)row[j];
+      }
+    }
+  }
+
+  return fits;
+}
+
+// V = B^T d B for the 4x4 input tile starting at in. Rows or columns past the input (odd output sizes) are zeros.
+static inline void TransformInputTile(const TFXP * in, uint32_t inputWidth, uint32_t rows, uint32_t cols, TFXP_MULT * v)
+{
+  TFXP_MULT d[4][4];
+  for (uint32_t i = 0; i < 4; ++ i) {
+    for (uint32_t j = 0; j < 4; ++ j)
+      d[i][j] = (i < rows && j < cols) ? in[i*inputWidth + j] : 0;
+  }
+
+  // r = B^T d
+  TFXP_MULT r[4][4];
+  for (uint32_t j = 0; j < 4; ++ j) {
+    r[0][j] = d[0][j] - d[2][j];
+    r[1][j] = d[1][j] + d[2][j];
+    r[2][j] = d[2][j] - d[1][j];
+    r[3][j] = d[1][j] - d[3][j];
+  }
+
+  // V = r B
+  for (uint32_t i = 0; i < 4; ++ i) {
+    v[i*4 + 0] = r[i][0] - r[i][2];
+    v[i*4 + 1] = r[i][1] + r[i][2];
+    v[i*4 + 2] = r[i][2] - r[i][1];
+    v[i*4 + 3] = r[i][1] - r[i][3];
+  }
+}
+
+// Y = A^T M A / 4, the 2x2 output tile.
+static inline void TransformOutputTile(const TFXP_MULT * m, TFXP_MULT y[2][2])
+{
+  TFXP_MULT a[2][4];
+  for (uint32_t j = 0; j < 4; ++ j) {
+    a[0][j] = m[j] + m[4 + j] + m[8 + j];
+    a[1][j] = m[4 + j] - m[8 + j] - m[12 + j];
+  }
+
+  for (uint32_t i = 0; i < 2; ++ i) {
+    y[i][0] = (a[i][0] + a[i][1] + a[i][2]) >> 2;
+    y[i][1] = (a[i][1] - a[i][2] - a[i][3]) >> 2;
+  }
+}
+
+// Dot kernels: m[k] = sum_c (u[c][k] * v[c][k]) >> DECIMALS, for the 16 elements of a tile.
+typedef void (*TWinogradDot)(const TFXP * u, const TFXP * v, uint32_t numChannels, TFXP_MULT * m);
+
+static void WinogradDotGeneric(const TFXP * u, const TFXP * v, uint32_t numChannels, TFXP_MULT * m)
+{
+  for (uint32_t k = 0; k < 16; ++ k)
+    m[k] = 0;
+
+  for (uint32_t iChannel = 0; iChannel < numChannels; ++ iChannel) {
+    for (uint32_t k = 0; k < 16; ++ k)
+      m[k] += ((TFXP_MULT)u[iChannel*16 + k] * v[iChannel*16 + k]) >> DECIMALS;
+  }
+}
+
+#if WINOGRAD_HAVE_AVX2
+// _mm256_mul_epi32 multiplies the even 32-bit lanes, so the odd elements are shifted down and multiplied separately.
+__attribute__((target("avx2")))
+static void WinogradDotAVX2(const TFXP * u, const TFXP * v, uint32_t numChannels, TFXP_MULT * m)
+{
+  __m256i accEven[2] = {_mm256_setzero_si256(), _mm256_setzero_si256()};
+  __m256i accOdd[2] = {_mm256_setzero_si256(), _mm256_setzero_si256()};
+
+  for (uint32_t iChannel = 0; iChannel < numChannels; ++ iChannel) {
+    for (uint32_t h = 0; h < 2; ++ h) {
+      __m256i uh = _mm256_loadu_si256((const __m256i *)(u + iChannel*16 + h*8));
+      __m256i vh = _mm256_loadu_si256((const __m256i *)(v + iChannel*16 + h*8));
+      accEven[h] = _mm256_add_epi64(accEven[h], _mm256_srli_epi64(_mm256_mul_epi32(uh, vh), DECIMALS));
+      accOdd[h] = _mm256_add_epi64(accOdd[h], _mm256_srli_epi64(_mm256_mul_epi32(_mm256_srli_epi64(uh, 32), _mm256_srli_epi64(vh, 32)), DECIMALS));
+    }
+  }
+
+  for (uint32_t h = 0; h < 2; ++ h) {
+    TFXP_MULT even[4], odd[4];
+    _mm256_storeu_si256((__m256i *)even, accEven[h]);
+    _mm256_storeu_si256((__m256i *)odd, accOdd[h]);
+    for (uint32_t k = 0; k < 4; ++ k) {
+      m[h*8 + 2*k] = even[k];
+      m[h*8 + 2*k + 1] = odd[k];
+    }
+  }
+}
+#endif
+
+#if WINOGRAD_HAVE_NEON
+static void WinogradDotNEON(const TFXP * u, const TFXP * v, uint32_t numChannels, TFXP_MULT * m)
+{
+  int64x2_t acc[8];
+  for (uint32_t k = 0; k < 8; ++ k)
+    acc[k] = vdupq_n_s64(0);
+
+  for (uint32_t iChannel = 0; iChannel < numChannels; ++ iChannel) {
+    for (uint32_t q = 0; q < 4; ++ q) {
+      int32x4_t uq = vld1q_s32(u + iChannel*16 + q*4);
+      int32x4_t vq = vld1q_s32(v + iChannel*16 + q*4);
+      acc[2*q] = vaddq_s64(acc[2*q], vshrq_n_s64(vmull_s32(vget_low_s32(uq), vget_low_s32(vq)), DECIMALS));
+      acc[2*q + 1] = vaddq_s64(acc[2*q + 1], vshrq_n_s64(vmull_s32(vget_high_s32(uq), vget_high_s32(vq)), DECIMALS));
+    }
+  }
+
+  for (uint32_t k = 0; k < 8; ++ k)
+    vst1q_s64(m + 2*k, acc[k]);
+}
+#endif
+
+static TWinogradDot SelectWinogradDot()
+{
+#if WINOGRAD_HAVE_AVX2
+  if (__builtin_cpu_supports("avx2"))
+    return WinogradDotAVX2;
+#endif
+#if WINOGRAD_HAVE_NEON
+  return WinogradDotNEON;
+#endif
+  return WinogradDotGeneric;
+}
+
+static const TWinogradDot winogradDot = SelectWinogradDot();
+
+// The rows of tiles are split among the threads. For each row of tiles, the input tiles of all the channels are
+// transformed once and then reused by all the filters.
+void Conv2DWinograd(TFXP *input, TFXP * output, const TFXP * transformedFilters, TFXP * biases,
+      uint32_t numFilters, uint32_t numChannels,
+      uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool)
+{
+  const uint32_t outWidth = inputWidth - 2;
+  const uint32_t outHeight = inputHeight - 2;
+  const uint32_t poolWidth = outWidth / 2;
+  const uint32_t poolHeight = outHeight / 2;
+  // When pooling, the incomplete tiles are cropped.
+  const uint32_t tilesX = performMaxPool ? poolWidth : (outWidth + 1) / 2;
+  const uint32_t tilesY = performMaxPool ? poolHeight : (outHeight + 1) / 2;
+
+  ThreadPool().ParallelFor(tilesY, [=](uint32_t firstTileRow, uint32_t lastTileRow) {
+    // Transformed input tiles of one row of tiles: [tx][iChannel][16].
+    std::vector<TFXP_MULT> v64(tilesX * numChannels * 16);
+    std::vector<TFXP> v32(tilesX * numChannels * 16);
+
+    for (uint32_t ty = firstTileRow; ty < lastTileRow; ++ ty) {
+      const uint32_t y0 = 2*ty;
+      const uint32_t rows = (y0 + 4 <= inputHeight) ? 4 : inputHeight - y0;
+      bool fits = true;
+
+      for (uint32_t tx = 0; tx < tilesX; ++ tx) {
+        const uint32_t x0 = 2*tx;
+        const uint32_t cols = (x0 + 4 <= inputWidth) ? 4 : inputWidth - x0;
+        for (uint32_t iChannel = 0; iChannel < numChannels; ++ iChannel) {
+          TFXP_MULT * v = &v64[(tx*numChannels + iChannel)*16];
+          TransformInputTile(input + iChannel*inputWidth*inputHeight + y0*inputWidth + x0, inputWidth, rows, cols, v);
+          for (uint32_t k = 0; k < 16; ++ k) {
+            if (v[k] < TFXP_MIN || v[k] > TFXP_MAX)
+              fits = false;
+            v32[(tx*numChannels + iChannel)*16 + k] = (TFXP)v[k];
+          }
+        }
+      }
+
+      for (uint32_t iFilter = 0; iFilter < numFilters; ++ iFilter) {
+        const TFXP * u = transformedFilters + iFilter*numChannels*16;
+        TFXP * out = performMaxPool ? output + iFilter*poolHeight*poolWidth + ty*poolWidth
+                                    : output + iFilter*outHeight*outWidth + y0*outWidth;
+
+        for (uint32_t tx = 0; tx < tilesX; ++ tx) {
+          TFXP_MULT m[16];
+          if (fits) {
+            winogradDot(u, &v32[tx*numChannels*16], numChannels, m);
+          } else {
+            const TFXP_MULT * v = &v64[tx*numChannels*16];
+            for (uint32_t k = 0; k < 16; ++ k)
+              m[k] = 0;
+            for (uint32_t iChannel = 0; iChannel < numChannels; ++ iChannel) {
+              for (uint32_t k = 0; k < 16; ++ k)
+                m[k] += (u[iChannel*16 + k] * v[iChannel*16 + k]) >> DECIMALS;
+            }
+          }
+
+          TFXP_MULT y[2][2];
+          TransformOutputTile(m, y);
+
+          // ReLU and max commute, so the ReLU is applied to the maximum.
+          if (performMaxPool) {
+            TFXP val = (TFXP)y[0][0] + biases[iFilter];
+            for (uint32_t k = 1; k < 4; ++ k) {
+              TFXP tmp = (TFXP)y[k / 2][k % 2] + biases[iFilter];
+              if (tmp > val)
+                val = tmp;
+            }
+            if (performReLu && val < 0)
+              val = 0;
+            out[tx] = val;
+            continue;
+          }
+
+          for (uint32_t i = 0; i < 2 && y0 + i < outHeight; ++ i) {
+            for (uint32_t j = 0; j < 2 && 2*tx + j < outWidth; ++ j) {
+              TFXP val = (TFXP)y[i][j] + biases[iFilter];
+              if (performReLu && val < 0)
+                val = 0;
+              out[i*outWidth + 2*tx + j] = val;
+            }
+          }
+        }
+      }
+    }
+  });
+}
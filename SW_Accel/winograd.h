@@ -0,0 +1,21 @@
+#ifndef WINOGRAD_H
+#define WINOGRAD_H
+
+// Winograd F(2x2, 3x3) convolution: every 2x2 output tile is computed from a 4x4 input tile with 16 multiplications
+// per channel instead of 36. The filters are transformed once (WinogradTransformFilters) and reused for every image.
+// The filters are kept scaled by 4 so the transform is exact in integers, and the products are accumulated in 64 bits.
+// The only differences with Conv2D() come from rounding the products at a different point: a few LSBs of the FxP format.
+
+// Number of TFXP values of the transformed filters: [numFilters][numChannels][4][4].
+uint32_t WinogradFiltersSize(uint32_t numFilters, uint32_t numChannels);
+// Returns false if some transformed coefficient does not fit in a TFXP (weights beyond +-200), in which case the
+// layer cannot use Conv2DWinograd().
+bool WinogradTransformFilters(const TFXP * filters, uint32_t numFilters, uint32_t numChannels, TFXP * transformed);
+
+// The 2x2 output tiles are exactly the 2x2 MaxPool windows, so with performMaxPool each tile is reduced to its
+// maximum before being written (the incomplete tiles of odd sizes are cropped, as MaxPool() does).
+void Conv2DWinograd(TFXP *input, TFXP * output, const TFXP * transformedFilters, TFXP * biases,
+      uint32_t numFilters, uint32_t numChannels,
+      uint32_t inputWidth, uint32_t inputHeight, bool performReLu, bool performMaxPool = false);
+
+#endif
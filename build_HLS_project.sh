@@ -1 +1,2 @@
 /opt/Xilinx/Vitis_HLS/2022.2/bin/vitis_hls -f HLS.tcl
+/opt/Xilinx/Vitis_HLS/2022.2/bin/vitis_hls -f DenseHLS.tcl